@@ -0,0 +1,29 @@
+
+# EGL_FOUND
+# EGL_INCLUDE_DIR
+# EGL_LIBRARY
+
+include(FindPackageHandleStandardArgs)
+
+FIND_PATH(EGL_INCLUDE_DIR EGL/egl.h
+    $ENV{EGL_HOME}/include
+    $ENV{EGLDIR}/include
+    /usr/include
+    /usr/local/include
+    /opt/local/include
+    DOC "The directory where EGL/egl.h resides.")
+
+FIND_LIBRARY(EGL_LIBRARY
+    NAMES EGL libEGL
+    PATHS
+    $ENV{EGL_HOME}/lib
+    $ENV{EGLDIR}/lib
+    /usr/lib
+    /usr/lib64
+    /usr/local/lib
+    /opt/local/lib
+    DOC "The EGL library.")
+
+find_package_handle_standard_args(EGL REQUIRED_VARS EGL_INCLUDE_DIR EGL_LIBRARY)
+
+mark_as_advanced(EGL_INCLUDE_DIR EGL_LIBRARY)
@@ -0,0 +1,16 @@
+#version 140
+#extension GL_ARB_explicit_attrib_location : require
+
+uniform sampler3D frame0;
+uniform sampler3D frame1;
+uniform float weight;
+uniform int slice;
+
+layout (location = 0) out vec4 fragColor;
+in vec2 v_uv;
+
+void main()
+{
+	ivec3 texel = ivec3(ivec2(gl_FragCoord.xy), slice);
+	fragColor = vec4(mix(texelFetch(frame0, texel, 0).xyz, texelFetch(frame1, texel, 0).xyz, weight), 0.0);
+}
@@ -7,6 +7,10 @@ uniform sampler2D velocities;
 uniform sampler3D forces;
 uniform float elapsed; // time delta
 
+// fixed point textures are normalized, decode: stored * decode.x + decode.y
+uniform vec2 positionDecode;
+uniform vec2 velocityDecode;
+
 layout (location = 0) out vec4 fragColor;
 layout (location = 1) out vec4 fragVelocity;
 
@@ -14,13 +18,19 @@ layout (location = 1) out vec4 fragVelocity;
 
 void main()
 {
-	vec4 vert = texelFetch(vertices,   ivec2(int(gl_FragCoord.x), int(gl_FragCoord.y)), 0);
-	vec4 vel  = texelFetch(velocities, ivec2(int(gl_FragCoord.x), int(gl_FragCoord.y)), 0);
+	ivec2 texel = ivec2(int(gl_FragCoord.x), int(gl_FragCoord.y));
+	uint particle = uint(texel.y * textureSize(vertices, 0).x + texel.x);
+
+	vec4 vert = texelFetch(vertices,   texel, 0);
+	vec4 vel  = texelFetch(velocities, texel, 0);
+
+	vert = vec4(vert.xyz * positionDecode.x + positionDecode.y, 1.0);
+	vel  = vec4(vel.xyz  * velocityDecode.x + velocityDecode.y, 0.0);
 
 	vec4 vertOut;
 	vec4 velOut;
-	moveParticlesInForceField(vert, vel, elapsed, forces, vertOut, velOut);
+	moveParticlesInForceField(vert, vel, particle, elapsed, forces, vertOut, velOut);
 
-	fragColor    = vertOut;
-	fragVelocity = velOut;
+	fragColor    = vec4((vertOut.xyz - positionDecode.y) / positionDecode.x, 1.0);
+	fragVelocity = vec4((velOut.xyz  - velocityDecode.y) / velocityDecode.x, 1.0);
 }
\ No newline at end of file
@@ -4,6 +4,16 @@
 uniform float alpha;
 uniform mat4 viewProjection;
 
+// decode of the particle storage format: stored * decode.x + decode.y
+uniform vec2 positionDecode = vec2(1.0, 0.0);
+uniform vec2 velocityDecode = vec2(1.0, 0.0);
+
+// seconds from the simulated state to the rendered time, positions are moved along the velocity
+uniform float interpolation = 0.0;
+
+// pixels per clip space unit of the point sprites, zero for the other render paths
+uniform float pointScale = 0.0;
+
 layout (location = 0) in vec4 a_vertex;
 layout (location = 1) in vec4 a_velocity;
 
@@ -12,7 +22,13 @@ out vec4 v_color;
 
 void main()
 {
+	vec3 vertex   = a_vertex.xyz   * positionDecode.x + positionDecode.y;
+	vec3 velocity = a_velocity.xyz * velocityDecode.x + velocityDecode.y;
+
 	v_scale = 0.008;
-	v_color = vec4(normalize(a_velocity.xyz) * 0.5 + 0.5, alpha);
-	gl_Position = viewProjection * a_vertex;
+	v_color = vec4(normalize(velocity) * 0.5 + 0.5, alpha);
+	gl_Position = viewProjection * vec4(vertex + velocity * interpolation, 1.0);
+
+	// the size of the quads of points.geom; points outside the clip volume are discarded as a whole
+	gl_PointSize = pointScale * v_scale / gl_Position.w;
 }
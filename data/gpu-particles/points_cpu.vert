@@ -0,0 +1,39 @@
+#version 140
+#extension GL_ARB_explicit_attrib_location : require
+
+uniform float alpha;
+uniform mat4 viewProjection;
+
+// decode of the particle storage format: stored * decode.x + decode.y
+uniform vec2 positionDecode = vec2(1.0, 0.0);
+uniform vec2 velocityDecode = vec2(1.0, 0.0);
+
+// seconds from the simulated state to the rendered time, positions are moved along the velocity
+uniform float interpolation = 0.0;
+
+// pixels per clip space unit of the point sprites, zero for the other render paths
+uniform float pointScale = 0.0;
+
+// structure of arrays layout of the cpu technique
+layout (location = 0) in float a_x;
+layout (location = 1) in float a_y;
+layout (location = 2) in float a_z;
+layout (location = 3) in float a_vx;
+layout (location = 4) in float a_vy;
+layout (location = 5) in float a_vz;
+
+out float v_scale;
+out vec4 v_color;
+
+void main()
+{
+	vec3 vertex   = vec3(a_x, a_y, a_z)    * positionDecode.x + positionDecode.y;
+	vec3 velocity = vec3(a_vx, a_vy, a_vz) * velocityDecode.x + velocityDecode.y;
+
+	v_scale = 0.008;
+	v_color = vec4(normalize(velocity) * 0.5 + 0.5, alpha);
+	gl_Position = viewProjection * vec4(vertex + velocity * interpolation, 1.0);
+
+	// the size of the quads of points.geom; points outside the clip volume are discarded as a whole
+	gl_PointSize = pointScale * v_scale / gl_Position.w;
+}
@@ -7,6 +7,16 @@ uniform sampler2D vertices;
 uniform sampler2D velocities;
 uniform int texWidth;
 
+// decode of the particle storage format: stored * decode.x + decode.y
+uniform vec2 positionDecode = vec2(1.0, 0.0);
+uniform vec2 velocityDecode = vec2(1.0, 0.0);
+
+// seconds from the simulated state to the rendered time, positions are moved along the velocity
+uniform float interpolation = 0.0;
+
+// pixels per clip space unit of the point sprites, zero for the other render paths
+uniform float pointScale = 0.0;
+
 layout (location = 0) in vec4 a_vertex;
 
 out float v_scale;
@@ -16,10 +26,13 @@ void main()
 {
 	int y = gl_VertexID / texWidth;
 	int x = gl_VertexID % texWidth;
-	vec4 vertex   = texelFetch(vertices,   ivec2(x, y), 0);
-	vec4 velocity = texelFetch(velocities, ivec2(x, y), 0);
+	vec3 vertex   = texelFetch(vertices,   ivec2(x, y), 0).xyz * positionDecode.x + positionDecode.y;
+	vec3 velocity = texelFetch(velocities, ivec2(x, y), 0).xyz * velocityDecode.x + velocityDecode.y;
 
 	v_scale = 0.008;
-	v_color = vec4(normalize(velocity.xyz) * 0.5 + 0.5, alpha);
-	gl_Position = viewProjection * vertex;
+	v_color = vec4(normalize(velocity) * 0.5 + 0.5, alpha);
+	gl_Position = viewProjection * vec4(vertex + velocity * interpolation, 1.0);
+
+	// the size of the quads of points.geom; points outside the clip volume are discarded as a whole
+	gl_PointSize = pointScale * v_scale / gl_Position.w;
 }
@@ -0,0 +1,97 @@
+#version 140
+#extension GL_ARB_explicit_attrib_location : require
+
+// Instanced quads, one instance per particle, which are pulled from buffer textures instead of
+// vertex attributes. Draws the quads of points.geom, so points.frag shades them the same way.
+
+// see AbstractParticleTechnique::DrawSource
+#define SOURCE_BUFFERS  0
+#define SOURCE_TEXTURES 1
+#define SOURCE_ARRAYS   2
+
+#define SOURCE DRAW_SOURCE
+
+uniform float alpha;
+uniform mat4 viewProjection;
+uniform float aspect;
+
+// decode of the particle storage format: stored * decode.x + decode.y
+uniform vec2 positionDecode = vec2(1.0, 0.0);
+uniform vec2 velocityDecode = vec2(1.0, 0.0);
+
+// seconds from the simulated state to the rendered time, positions are moved along the velocity
+uniform float interpolation = 0.0;
+
+// indices of the visible particles starting at firstIndex, see ParticleCulling
+uniform bool culled = false;
+uniform int firstIndex = 0;
+uniform usamplerBuffer indices;
+
+#if SOURCE == SOURCE_TEXTURES
+
+// layout of FragmentShaderParticles, see points_fragment.vert
+uniform sampler2D vertices;
+uniform sampler2D velocities;
+uniform int texWidth;
+
+#elif SOURCE == SOURCE_ARRAYS
+
+// x, y, z, vx, vy, vz arrays of capacity components each, see CpuSimdParticles
+uniform samplerBuffer components;
+uniform int capacity;
+
+#else
+
+uniform samplerBuffer vertices;
+uniform samplerBuffer velocities;
+
+#endif
+
+out vec2 g_uv;
+out vec4 g_color;
+
+void fetchParticle(in int i, out vec3 vertex, out vec3 velocity)
+{
+#if SOURCE == SOURCE_TEXTURES
+	ivec2 texel = ivec2(i % texWidth, i / texWidth);
+	vertex   = texelFetch(vertices,   texel, 0).xyz;
+	velocity = texelFetch(velocities, texel, 0).xyz;
+#elif SOURCE == SOURCE_ARRAYS
+	vertex   = vec3(texelFetch(components, i).r, texelFetch(components, capacity + i).r, texelFetch(components, 2 * capacity + i).r);
+	velocity = vec3(texelFetch(components, 3 * capacity + i).r, texelFetch(components, 4 * capacity + i).r, texelFetch(components, 5 * capacity + i).r);
+#else
+	vertex   = texelFetch(vertices,   i).xyz;
+	velocity = texelFetch(velocities, i).xyz;
+#endif
+}
+
+void main()
+{
+	int i = culled ? int(texelFetch(indices, firstIndex + gl_InstanceID).r) : gl_InstanceID;
+
+	vec3 vertex;
+	vec3 velocity;
+	fetchParticle(i, vertex, velocity);
+
+	vertex   = vertex   * positionDecode.x + positionDecode.y;
+	velocity = velocity * velocityDecode.x + velocityDecode.y;
+
+	vec4 p = viewProjection * vec4(vertex + velocity * interpolation, 1.0);
+
+	// frustum culling of points.geom, a degenerate quad outside the clip volume is never rasterized
+	vec2 c = clamp(abs(p.xy) / p.w, 0.0, 1.0);
+	if (any(equal(c, vec2(1.0))))
+	{
+		gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+		return;
+	}
+
+	// the corners of the triangle strip of points.geom
+	vec2 corner = vec2(gl_VertexID < 2 ? 1.0 : -1.0, (gl_VertexID & 1) == 0 ? 1.0 : -1.0);
+
+	float k = 0.008;
+
+	g_uv = -corner;
+	g_color = vec4(normalize(velocity) * 0.5 + 0.5, alpha);
+	gl_Position = p + vec4(corner.x * k, corner.y * aspect * k, 0.0, 0.0);
+}
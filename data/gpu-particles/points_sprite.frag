@@ -0,0 +1,18 @@
+#version 140
+#extension GL_ARB_explicit_attrib_location : require
+
+// Shading of points.frag for point sprites, which span the quads of points.geom.
+
+uniform bool paused = false;
+
+in vec4 v_color;
+
+layout (location = 0) out vec4 fragColor;
+
+void main()
+{
+	vec2 uv = gl_PointCoord * 2.0 - 1.0;
+
+	float d = 1.0 - clamp(length(uv), 0.0, 1.0); // d: distance 
+	fragColor = d * v_color * (paused ? 1.33 : 1.0);
+}
@@ -2,18 +2,52 @@
 #extension GL_ARB_explicit_attrib_location : require
 #extension GL_ARB_shading_language_include : require
 
+#define PARTICLE_FORMAT FORMAT_INDEX
+
+// the 16 bit formats (2 and 3) pack their outputs
+#if PARTICLE_FORMAT >= 2
+#extension GL_ARB_shading_language_packing : require
+#endif
+
+#include </particle-format.inc>
+
 uniform float elapsed; // time delta
 uniform sampler3D forces;
 
+uniform vec2 positionDecode;
+uniform vec2 velocityDecode;
+
 layout (location = 0) in vec4 in_position;
 layout (location = 1) in vec4 in_velocity;
 
+#if PARTICLE_FORMAT == PARTICLE_FORMAT_FLOAT4
 out vec4 out_position;
 out vec4 out_velocity;
+#elif PARTICLE_FORMAT == PARTICLE_FORMAT_FLOAT3
+out vec3 out_position;
+out vec3 out_velocity;
+#else
+flat out uvec2 out_position;
+flat out uvec2 out_velocity;
+#endif
 
 #include </particle-step.inc>
 
 void main()
 {
-	moveParticlesInForceField(in_position, in_velocity, elapsed, forces, out_position, out_velocity);
+	vec4 position = vec4(in_position.xyz * positionDecode.x + positionDecode.y, 1.0);
+	vec4 velocity = vec4(in_velocity.xyz * velocityDecode.x + velocityDecode.y, 0.0);
+
+	moveParticlesInForceField(position, velocity, uint(gl_VertexID), elapsed, forces, position, velocity);
+
+#if PARTICLE_FORMAT == PARTICLE_FORMAT_FLOAT4
+	out_position = position;
+	out_velocity = velocity;
+#elif PARTICLE_FORMAT == PARTICLE_FORMAT_FLOAT3
+	out_position = position.xyz;
+	out_velocity = velocity.xyz;
+#else
+	out_position = encodeParticle(position.xyz, positionDecode);
+	out_velocity = encodeParticle(velocity.xyz, velocityDecode);
+#endif
 }
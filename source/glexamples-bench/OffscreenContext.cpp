@@ -0,0 +1,140 @@
+#include "OffscreenContext.h"
+
+#include <cstring>
+
+#include <EGL/eglext.h>
+
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+
+namespace
+{
+
+bool hasExtension(const char * extensions, const char * extension)
+{
+    return extensions && std::strstr(extensions, extension) != nullptr;
+}
+
+}
+
+
+OffscreenContext::OffscreenContext()
+: m_display(EGL_NO_DISPLAY)
+, m_surface(EGL_NO_SURFACE)
+, m_context(EGL_NO_CONTEXT)
+{
+}
+
+OffscreenContext::~OffscreenContext()
+{
+    destroy();
+}
+
+bool OffscreenContext::create(const int width, const int height)
+{
+    const char * clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+
+    const auto getPlatformDisplay = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+        eglGetProcAddress("eglGetPlatformDisplayEXT"));
+
+    if (getPlatformDisplay && hasExtension(clientExtensions, "EGL_MESA_platform_surfaceless"))
+        m_display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+
+    if (m_display == EGL_NO_DISPLAY)
+        m_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major = 0, minor = 0;
+    if (m_display == EGL_NO_DISPLAY || !eglInitialize(m_display, &major, &minor))
+        return fail("Could not initialize EGL display.");
+
+    if (!eglBindAPI(EGL_OPENGL_API))
+        return fail("EGL display does not support desktop OpenGL.");
+
+    const EGLint configAttributes[] = {
+        EGL_SURFACE_TYPE,    EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE,        8,
+        EGL_GREEN_SIZE,      8,
+        EGL_BLUE_SIZE,       8,
+        EGL_ALPHA_SIZE,      8,
+        EGL_DEPTH_SIZE,      24,
+        EGL_NONE };
+
+    EGLConfig config;
+    EGLint numConfigs = 0;
+    if (!eglChooseConfig(m_display, configAttributes, &config, 1, &numConfigs) || numConfigs < 1)
+        return fail("No EGL config with pbuffer and OpenGL support.");
+
+    const EGLint surfaceAttributes[] = {
+        EGL_WIDTH,  width,
+        EGL_HEIGHT, height,
+        EGL_NONE };
+
+    m_surface = eglCreatePbufferSurface(m_display, config, surfaceAttributes);
+    if (m_surface == EGL_NO_SURFACE)
+        return fail("Could not create EGL pbuffer surface.");
+
+    // request the newest core profile first, compute based techniques need 4.3
+    static const EGLint versions[][2] = { { 4, 6 }, { 4, 5 }, { 4, 3 }, { 3, 3 }, { 3, 2 } };
+
+    for (const auto & version : versions)
+    {
+        const EGLint contextAttributes[] = {
+            EGL_CONTEXT_MAJOR_VERSION_KHR,       version[0],
+            EGL_CONTEXT_MINOR_VERSION_KHR,       version[1],
+            EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+            EGL_NONE };
+
+        m_context = eglCreateContext(m_display, config, EGL_NO_CONTEXT, contextAttributes);
+        if (m_context != EGL_NO_CONTEXT)
+            break;
+    }
+
+    if (m_context == EGL_NO_CONTEXT)
+        return fail("Could not create an OpenGL 3.2+ core profile context.");
+
+    return makeCurrent();
+}
+
+void OffscreenContext::destroy()
+{
+    if (m_display == EGL_NO_DISPLAY)
+        return;
+
+    eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+
+    if (m_context != EGL_NO_CONTEXT)
+        eglDestroyContext(m_display, m_context);
+    if (m_surface != EGL_NO_SURFACE)
+        eglDestroySurface(m_display, m_surface);
+
+    eglTerminate(m_display);
+
+    m_display = EGL_NO_DISPLAY;
+    m_surface = EGL_NO_SURFACE;
+    m_context = EGL_NO_CONTEXT;
+}
+
+bool OffscreenContext::makeCurrent()
+{
+    if (!eglMakeCurrent(m_display, m_surface, m_surface, m_context))
+        return fail("Could not make EGL context current.");
+
+    return true;
+}
+
+const std::string & OffscreenContext::error() const
+{
+    return m_error;
+}
+
+bool OffscreenContext::fail(const std::string & message)
+{
+    m_error = message;
+    destroy();
+
+    return false;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+
+#include <EGL/egl.h>
+
+
+// Headless OpenGL context backed by an EGL pbuffer. Mesa's surfaceless platform is preferred when
+// available, so the context works without a window system or GPU (e.g., llvmpipe on CI nodes).
+class OffscreenContext
+{
+public:
+    OffscreenContext();
+    ~OffscreenContext();
+
+    bool create(int width, int height);
+    void destroy();
+
+    bool makeCurrent();
+
+    const std::string & error() const;
+
+protected:
+    bool fail(const std::string & message);
+
+protected:
+    EGLDisplay m_display;
+    EGLSurface m_surface;
+    EGLContext m_context;
+
+    std::string m_error;
+};
@@ -0,0 +1,345 @@
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cpplocate/cpplocate.h>
+
+#include <iozeug/FilePath.h>
+
+#include <glbinding/Binding.h>
+#include <glbinding/gl/gl.h>
+
+#include <globjects/globjects.h>
+#include <globjects/Query.h>
+
+#include <gloperate/resources/ResourceManager.h>
+#include <gloperate/plugin/PluginManager.h>
+#include <gloperate/plugin/PainterPlugin.h>
+#include <gloperate/painter/Painter.h>
+#include <gloperate/painter/AbstractViewportCapability.h>
+#include <gloperate/painter/AbstractVirtualTimeCapability.h>
+
+#ifdef GLEXAMPLES_BENCH_ASSIMP
+#include <gloperate-assimp/AssimpSceneLoader.h>
+#include <gloperate-assimp/AssimpMeshLoader.h>
+#endif
+
+#include <reflectionzeug/property/AbstractValueProperty.h>
+
+#include <glexamples/glexamples-version.h>
+
+#include "OffscreenContext.h"
+
+
+using namespace gl;
+
+
+namespace
+{
+
+struct Options
+{
+    std::string painter;
+    std::string pluginPath;
+    std::string output;
+
+    int width  = 1280;
+    int height = 720;
+
+    int frames = 500;
+    int warmup = 20;
+
+    float delta = 1.f / 60.f;
+
+    bool json = false;
+
+    std::vector<std::pair<std::string, std::string>> properties;
+};
+
+struct Frame
+{
+    double cpuMs;
+    double gpuMs;
+    double steps;
+};
+
+void printUsage(const char * executable)
+{
+    std::cerr
+        << GLEXAMPLES_PROJECT_NAME << " benchmark " << GLEXAMPLES_VERSION << std::endl << std::endl
+        << "Usage: " << executable << " <painter> [options]" << std::endl << std::endl
+        << "  --frames <n>          measured frames (default 500)" << std::endl
+        << "  --warmup <n>          unmeasured frames rendered first (default 20)" << std::endl
+        << "  --size <w>x<h>        offscreen resolution (default 1280x720)" << std::endl
+        << "  --delta <seconds>     fixed virtual time step per frame (default 1/60)" << std::endl
+        << "  --set <name>=<value>  set a painter property before initialization, repeatable" << std::endl
+        << "  --plugins <path>      additional plugin search path" << std::endl
+        << "  --format csv|json     output format (default csv)" << std::endl
+        << "  --output <file>       write results to file instead of stdout" << std::endl;
+}
+
+bool parseArguments(const int argc, char * argv[], Options & options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string argument = argv[i];
+        const bool hasValue = i + 1 < argc;
+
+        if (argument == "--frames" && hasValue)
+            options.frames = std::atoi(argv[++i]);
+        else if (argument == "--warmup" && hasValue)
+            options.warmup = std::atoi(argv[++i]);
+        else if (argument == "--delta" && hasValue)
+            options.delta = static_cast<float>(std::atof(argv[++i]));
+        else if (argument == "--plugins" && hasValue)
+            options.pluginPath = argv[++i];
+        else if (argument == "--output" && hasValue)
+            options.output = argv[++i];
+        else if (argument == "--format" && hasValue)
+        {
+            const std::string format = argv[++i];
+            if (format != "csv" && format != "json")
+                return false;
+
+            options.json = format == "json";
+        }
+        else if (argument == "--size" && hasValue)
+        {
+            const std::string size = argv[++i];
+            const auto x = size.find('x');
+            if (x == std::string::npos)
+                return false;
+
+            options.width  = std::atoi(size.substr(0, x).c_str());
+            options.height = std::atoi(size.substr(x + 1).c_str());
+        }
+        else if (argument == "--set" && hasValue)
+        {
+            const std::string assignment = argv[++i];
+            const auto equals = assignment.find('=');
+            if (equals == std::string::npos)
+                return false;
+
+            options.properties.emplace_back(assignment.substr(0, equals), assignment.substr(equals + 1));
+        }
+        else if (argument[0] != '-' && options.painter.empty())
+            options.painter = argument;
+        else
+            return false;
+    }
+
+    return !options.painter.empty() && options.frames > 0 && options.warmup >= 0
+        && options.width > 0 && options.height > 0 && options.delta >= 0.f;
+}
+
+double frameSteps(gloperate::Painter & painter, const float delta)
+{
+    // painters that count the simulation steps of their last frame expose them as "frame_steps"
+    if (painter.propertyExists("frame_steps"))
+        return painter.property<int>("frame_steps")->value();
+
+    // painters that substep their simulation expose the substep count as "steps"
+    const int substeps = painter.propertyExists("steps") ? std::max(painter.property<int>("steps")->value(), 1) : 1;
+
+    // painters with a fixed timestep expose its rate as "simulation_hz", 0 steps once per frame
+    const float rate = painter.propertyExists("simulation_hz") ? painter.property<float>("simulation_hz")->value() : 0.f;
+    if (rate <= 0.f)
+        return substeps;
+
+    // and the bound on the steps a single frame catches up as "max_catch_up_steps"
+    double steps = static_cast<double>(rate) * delta;
+    if (painter.propertyExists("max_catch_up_steps"))
+        steps = std::min(steps, static_cast<double>(painter.property<int>("max_catch_up_steps")->value()));
+
+    return substeps * steps;
+}
+
+void writeCsv(std::ostream & stream, const std::vector<Frame> & frames)
+{
+    stream << "frame,cpu_ms,gpu_ms,steps" << std::endl;
+
+    for (std::size_t i = 0; i < frames.size(); ++i)
+        stream << i << "," << frames[i].cpuMs << "," << frames[i].gpuMs << "," << frames[i].steps << std::endl;
+}
+
+void writeJson(std::ostream & stream, const Options & options, const std::vector<Frame> & frames,
+    const double wallSeconds, const double steps, const std::string & renderer)
+{
+    double cpuSum = 0.0, gpuSum = 0.0;
+    for (const auto & frame : frames)
+    {
+        cpuSum += frame.cpuMs;
+        gpuSum += frame.gpuMs;
+    }
+
+    const double count = static_cast<double>(frames.size());
+
+    stream << "{" << std::endl
+        << "  \"painter\": \"" << options.painter << "\"," << std::endl
+        << "  \"renderer\": \"" << renderer << "\"," << std::endl
+        << "  \"width\": " << options.width << "," << std::endl
+        << "  \"height\": " << options.height << "," << std::endl
+        << "  \"delta\": " << options.delta << "," << std::endl
+        << "  \"steps_per_frame\": " << steps << "," << std::endl
+        << "  \"summary\": {" << std::endl
+        << "    \"frames\": " << frames.size() << "," << std::endl
+        << "    \"wall_s\": " << wallSeconds << "," << std::endl
+        << "    \"frames_per_s\": " << count / wallSeconds << "," << std::endl
+        << "    \"steps_per_s\": " << count * steps / wallSeconds << "," << std::endl
+        << "    \"mean_cpu_ms\": " << cpuSum / count << "," << std::endl
+        << "    \"mean_gpu_ms\": " << gpuSum / count << std::endl
+        << "  }," << std::endl
+        << "  \"frames\": [" << std::endl;
+
+    for (std::size_t i = 0; i < frames.size(); ++i)
+        stream << "    { \"cpu_ms\": " << frames[i].cpuMs << ", \"gpu_ms\": " << frames[i].gpuMs
+            << ", \"steps\": " << frames[i].steps << " }"
+            << (i + 1 < frames.size() ? "," : "") << std::endl;
+
+    stream << "  ]" << std::endl << "}" << std::endl;
+}
+
+} // namespace
+
+
+int main(int argc, char * argv[])
+{
+    Options options;
+    if (!parseArguments(argc, argv, options))
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    OffscreenContext context;
+    if (!context.create(options.width, options.height))
+    {
+        std::cerr << context.error() << std::endl;
+        return 1;
+    }
+
+    glbinding::Binding::initialize();
+    globjects::init();
+
+    const std::string renderer = globjects::renderer();
+    std::cerr << "Renderer: " << renderer << std::endl;
+
+    gloperate::ResourceManager resourceManager;
+#ifdef GLEXAMPLES_BENCH_ASSIMP
+    resourceManager.addLoader(new gloperate_assimp::AssimpMeshLoader());
+    resourceManager.addLoader(new gloperate_assimp::AssimpSceneLoader());
+#endif
+
+    const std::string executablePath = cpplocate::getExecutablePath();
+    const std::string executableDir = iozeug::FilePath(executablePath).directoryPath();
+
+    gloperate::PluginManager::init(executablePath);
+    gloperate::PluginManager pluginManager;
+    pluginManager.addSearchPath(executableDir);
+    pluginManager.addSearchPath(executableDir + "/plugins");
+    if (!options.pluginPath.empty())
+        pluginManager.addSearchPath(options.pluginPath);
+    pluginManager.scan("painters");
+
+    const auto plugin = dynamic_cast<gloperate::PainterPlugin *>(pluginManager.plugin(options.painter));
+    if (!plugin)
+    {
+        std::cerr << "Painter plugin '" << options.painter << "' not found." << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<gloperate::Painter> painter(plugin->createPainter(resourceManager));
+
+    for (const auto & property : options.properties)
+    {
+        const auto value = painter->propertyExists(property.first) ? painter->property(property.first)->asValue() : nullptr;
+        if (!value || !value->fromString(property.second))
+        {
+            std::cerr << "Could not set property '" << property.first << "' to '" << property.second << "'." << std::endl;
+            return 1;
+        }
+    }
+
+    const auto viewportCapability = painter->getCapability<gloperate::AbstractViewportCapability>();
+    if (viewportCapability)
+        viewportCapability->setViewport(0, 0, options.width, options.height);
+
+    const auto timeCapability = painter->getCapability<gloperate::AbstractVirtualTimeCapability>();
+    if (!timeCapability)
+        std::cerr << "Painter has no virtual time, frames advance with wall clock time." << std::endl;
+
+    painter->initialize();
+
+    const bool timerQueries = globjects::hasExtension(GLextension::GL_ARB_timer_query);
+
+    for (int i = 0; i < options.warmup; ++i)
+    {
+        if (timeCapability)
+            timeCapability->update(options.delta);
+
+        painter->paint();
+    }
+    glFinish();
+
+    // one query per frame, results are collected after the run so that no frame waits on the gpu
+    std::vector<globjects::ref_ptr<globjects::Query>> queries;
+    std::vector<Frame> frames(options.frames);
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < options.frames; ++i)
+    {
+        if (timeCapability)
+            timeCapability->update(options.delta);
+
+        if (timerQueries)
+        {
+            queries.push_back(new globjects::Query());
+            queries.back()->begin(GL_TIME_ELAPSED);
+        }
+
+        const auto frameStart = std::chrono::steady_clock::now();
+        painter->paint();
+        frames[i].cpuMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count();
+        frames[i].steps = frameSteps(*painter, options.delta);
+
+        if (timerQueries)
+            queries.back()->end(GL_TIME_ELAPSED);
+    }
+
+    glFinish();
+    const double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (int i = 0; i < options.frames; ++i)
+        frames[i].gpuMs = timerQueries ? static_cast<double>(queries[i]->get64(GL_QUERY_RESULT)) * 1.0e-6 : 0.0;
+
+    double steps = 0.0;
+    for (const auto & frame : frames)
+        steps += frame.steps;
+    steps /= static_cast<double>(options.frames);
+
+    std::ofstream file;
+    if (!options.output.empty())
+        file.open(options.output);
+    std::ostream & stream = options.output.empty() ? std::cout : file;
+
+    if (options.json)
+        writeJson(stream, options, frames, wallSeconds, steps, renderer);
+    else
+        writeCsv(stream, frames);
+
+    const double framesPerSecond = static_cast<double>(options.frames) / wallSeconds;
+    std::cerr << options.painter << ": " << framesPerSecond << " frames/s, "
+        << framesPerSecond * steps << " steps/s" << std::endl;
+
+    painter.reset();
+    queries.clear();
+
+    return 0;
+}
@@ -1,6 +1,6 @@
 #include "AbstractParticleTechnique.h"
 
-#include <cassert>
+#include <algorithm>
 
 #include <glm/glm.hpp>
 
@@ -11,40 +11,91 @@
 #include <globjects/Shader.h>
 #include <globjects/Buffer.h>
 #include <globjects/Framebuffer.h>
+#include <globjects/VertexAttributeBinding.h>
 
 #include <globjects/base/File.h>
+#include <globjects/base/StringTemplate.h>
 
 #include <gloperate/primitives/ScreenAlignedQuad.h>
 #include <gloperate/painter/CameraCapability.h>
 
+#include "ParticleCulling.h"
+#include "PhaseTimers.h"
+
 
 using namespace gl;
 using namespace glm;
 using namespace globjects;
 using namespace gloperate;
 
+namespace
+{
+
+// internal format of a buffer texture over positions or velocities stored in a format
+GLenum bufferTextureFormat(const ParticleFormat format)
+{
+    switch (format)
+    {
+    case ParticleFormat::Float3:
+        return GL_RGB32F;
+    case ParticleFormat::Half:
+        return GL_RGBA16F;
+    case ParticleFormat::Fixed16:
+        return GL_RGBA16;
+    default:
+        return GL_RGBA32F;
+    }
+}
+
+GLenum trailTextureFormat(const TrailFormat format)
+{
+    switch (format)
+    {
+    case TrailFormat::Float16:
+        return GL_RGBA16F;
+    case TrailFormat::R11G11B10F:
+        return GL_R11F_G11F_B10F;
+    default:
+        return GL_RGBA32F;
+    }
+}
+
+}
+
 AbstractParticleTechnique::AbstractParticleTechnique(
-    const std::vector<vec4> & positions
-,   const std::vector<vec4> & velocities
+    const SharedParticleState & initialState
 ,   const Texture & forces
 ,   const AbstractCameraCapability & cameraCap
 ,   const ivec2 viewport)
-: m_positions(positions)
-, m_velocities(velocities)
+: m_initialState(initialState)
 , m_forces(forces)
 , m_cameraCap(cameraCap)
-, m_numParticles(static_cast<unsigned>(positions.size()))
+, m_numParticles(initialState->size())
+, m_format(ParticleFormat::Float4)
 , m_paused(false)
 , m_viewport(viewport)
+, m_timers(nullptr)
+, m_interaction{ InteractionMode::None, 0.f, 0.f }
+, m_gravity{ GravityMode::Central, 0.f, 0.f }
+, m_emission{ EmitterMode::Off, 1, 0.f, 1.f, 1.f, 0 }
+, m_ensemble(singleSystem(initialState->size()))
+, m_pooled(false)
+, m_cullingEnabled(true)
+, m_interpolation(0.f)
+, m_renderPath(RenderPath::GeometryShader)
+, m_drawSource(DrawSource::Buffers)
+, m_trailFormat(TrailFormat::Float32)
+, m_trailScale(1.f)
+, m_freezeTrails(false)
+, m_trailsValid(false)
 {
-    assert(positions.size() == velocities.size());
 }
 
 AbstractParticleTechnique::~AbstractParticleTechnique()
 {
 }
 
-void AbstractParticleTechnique::initialize(const std::string & vertexShaderSourceFilePath)
+void AbstractParticleTechnique::initialize(const std::string & vertexShaderSourceFilePath, const DrawSource drawSource)
 {
     m_fbo = new Framebuffer();
 
@@ -66,15 +117,192 @@ void AbstractParticleTechnique::initialize(const std::string & vertexShaderSourc
         Shader::fromFile(GL_FRAGMENT_SHADER, "data/gpu-particles/clear.frag"));
     m_quad = new ScreenAlignedQuad(m_color);
 
+    m_vertexShaderSourceFilePath = vertexShaderSourceFilePath;
+    m_drawSource = drawSource;
+
+    m_instancedPositions = new Texture(GL_TEXTURE_BUFFER);
+    m_instancedVelocities = new Texture(GL_TEXTURE_BUFFER);
+    m_instancedIndices = new Texture(GL_TEXTURE_BUFFER);
+
+    createDrawProgram();
+}
+
+void AbstractParticleTechnique::createDrawProgram()
+{
     m_drawProgram = new Program();
-    m_drawProgram->attach(
-        Shader::fromFile(GL_VERTEX_SHADER, vertexShaderSourceFilePath)
-      , Shader::fromFile(GL_GEOMETRY_SHADER, "data/gpu-particles/points.geom")
-      , Shader::fromFile(GL_FRAGMENT_SHADER, "data/gpu-particles/points.frag"));
 
+    switch (m_renderPath)
+    {
+    case RenderPath::InstancedQuads:
+        {
+            StringTemplate * vertexShaderSource = new StringTemplate(
+                new File("data/gpu-particles/points_instanced.vert"));
+            vertexShaderSource->replace("DRAW_SOURCE", static_cast<int>(m_drawSource));
+            vertexShaderSource->update();
+
+            m_drawProgram->attach(
+                new Shader(GL_VERTEX_SHADER, vertexShaderSource)
+              , Shader::fromFile(GL_FRAGMENT_SHADER, "data/gpu-particles/points.frag"));
+
+            m_drawProgram->setUniform("vertices", 0);
+            m_drawProgram->setUniform("velocities", 1);
+            m_drawProgram->setUniform("components", 0);
+            m_drawProgram->setUniform("indices", 2);
+            m_drawProgram->setUniform("texWidth", static_cast<int>(ParticleState::chunkWidth));
+        }
+        break;
+
+    case RenderPath::PointSprites:
+        m_drawProgram->attach(
+            Shader::fromFile(GL_VERTEX_SHADER, m_vertexShaderSourceFilePath)
+          , Shader::fromFile(GL_FRAGMENT_SHADER, "data/gpu-particles/points_sprite.frag"));
+        break;
+
+    default:
+        m_drawProgram->attach(
+            Shader::fromFile(GL_VERTEX_SHADER, m_vertexShaderSourceFilePath)
+          , Shader::fromFile(GL_GEOMETRY_SHADER, "data/gpu-particles/points.geom")
+          , Shader::fromFile(GL_FRAGMENT_SHADER, "data/gpu-particles/points.frag"));
+    }
+
+    setDecodeUniforms(m_drawProgram);
+    updateAlpha();
+    updateViewportUniforms();
+    m_drawProgram->setUniform("paused", m_paused);
+}
+
+void AbstractParticleTechnique::updateAlpha()
+{
     // try to provide a particle alpha that scales well for 10 as well as for 1000000 particles
     const float alpha = 1.0f - 0.9f * (glm::sqrt(glm::sqrt(static_cast<float>(m_numParticles))) / 30.f);
-    m_drawProgram->setUniform("alpha", alpha);
+    m_drawProgram->setUniform("alpha", glm::max(alpha, 0.02f));
+}
+
+void AbstractParticleTechnique::updateViewportUniforms()
+{
+    m_drawProgram->setUniform("aspect", static_cast<float>(m_viewport.x) / max(static_cast<float>(m_viewport.y), 1.f));
+    // a sprite spans the quad of points.geom, 2 * v_scale / w in normalized device coordinates
+    m_drawProgram->setUniform("pointScale", static_cast<float>(trailSize().x));
+}
+
+ivec2 AbstractParticleTechnique::trailSize() const
+{
+    return max(ivec2(vec2(m_viewport) * m_trailScale + 0.5f), ivec2(1));
+}
+
+void AbstractParticleTechnique::setInstancedParticles(Buffer & positions, Buffer & velocities)
+{
+    m_instancedPositions->texBuffer(bufferTextureFormat(m_format), &positions);
+    m_instancedVelocities->texBuffer(bufferTextureFormat(m_format), &velocities);
+
+    m_instancedPositions->bindActive(GL_TEXTURE0);
+    m_instancedVelocities->bindActive(GL_TEXTURE1);
+}
+
+void AbstractParticleTechnique::setInstancedArrays(Buffer & arrays, const unsigned int capacity)
+{
+    GLenum format = GL_R32F;
+    if (m_format == ParticleFormat::Half)
+        format = GL_R16F;
+    else if (m_format == ParticleFormat::Fixed16)
+        format = GL_R16;
+
+    m_instancedPositions->texBuffer(format, &arrays);
+    m_instancedPositions->bindActive(GL_TEXTURE0);
+
+    m_drawProgram->setUniform("capacity", static_cast<int>(capacity));
+}
+
+void AbstractParticleTechnique::setInstancedIndices(Buffer * indices, const unsigned int firstIndex)
+{
+    m_drawProgram->setUniform("culled", indices != nullptr);
+    m_drawProgram->setUniform("firstIndex", static_cast<int>(firstIndex));
+
+    if (!indices)
+        return;
+
+    m_instancedIndices->texBuffer(GL_R32UI, indices);
+    m_instancedIndices->bindActive(GL_TEXTURE2);
+}
+
+void AbstractParticleTechnique::setAttributeFormat(VertexAttributeBinding * binding) const
+{
+    switch (m_format)
+    {
+    case ParticleFormat::Float3:
+        binding->setFormat(3, GL_FLOAT, GL_FALSE, 0);
+        break;
+    case ParticleFormat::Half:
+        binding->setFormat(3, GL_HALF_FLOAT, GL_FALSE, 0);
+        break;
+    case ParticleFormat::Fixed16:
+        binding->setFormat(3, GL_UNSIGNED_SHORT, GL_TRUE, 0);
+        break;
+    default:
+        binding->setFormat(4, GL_FLOAT, GL_FALSE, 0);
+    }
+}
+
+void AbstractParticleTechnique::setDecodeUniforms(Program * program) const
+{
+    program->setUniform("positionDecode", particleFormatDecode(m_format, fixedPositionRange));
+    program->setUniform("velocityDecode", particleFormatDecode(m_format, fixedVelocityRange));
+}
+
+void AbstractParticleTechnique::setEnsembleUniforms(Program * program, const unsigned int chunk) const
+{
+    program->setUniform("ensembleParticles", m_ensemble.systems > 1 ? m_ensemble.systemParticles : 0u);
+    program->setUniform("forceLayers", m_ensemble.forceLayers);
+    program->setUniform("forceGrid", m_ensemble.forceGrid);
+    program->setUniform("firstParticle", chunk * ParticleState::chunkSize);
+}
+
+void AbstractParticleTechnique::uploadEncoded(Buffer & buffer, const unsigned int offset, const vec4 * values, const unsigned int count, const float range) const
+{
+    const std::size_t size = particleFormatSize(m_format);
+
+    if (m_format == ParticleFormat::Float4)
+    {
+        buffer.setSubData(static_cast<GLintptr>(offset * size), static_cast<GLsizeiptr>(count * size), values);
+        return;
+    }
+
+    std::vector<unsigned char> encoded(count * size);
+    encodeParticles(m_format, values, count, range, encoded.data());
+
+    buffer.setSubData(static_cast<GLintptr>(offset * size), static_cast<GLsizeiptr>(encoded.size()), encoded.data());
+}
+
+void AbstractParticleTechnique::uploadParticles(const unsigned int begin, const unsigned int end)
+{
+    static const unsigned int chunkSize = ParticleState::chunkSize;
+
+    for (unsigned int chunk = begin / chunkSize; chunk * chunkSize < end; ++chunk)
+    {
+        const unsigned int offset = chunk * chunkSize;
+        uploadChunk(chunk, std::max(begin, offset) - offset, std::min(end, offset + chunkSize) - offset);
+    }
+}
+
+void AbstractParticleTechnique::release()
+{
+    m_fbo = nullptr;
+    m_color = nullptr;
+
+    m_drawProgram = nullptr;
+    m_culling.reset();
+
+    m_instancedPositions = nullptr;
+    m_instancedVelocities = nullptr;
+    m_instancedIndices = nullptr;
+
+    m_quad = nullptr;
+    m_clear = nullptr;
+}
+
+bool AbstractParticleTechnique::isInitialized() const
+{
+    return m_fbo.get() != nullptr;
 }
 
 void AbstractParticleTechnique::pause(bool paused)
@@ -83,19 +311,34 @@ void AbstractParticleTechnique::pause(bool paused)
     m_drawProgram->setUniform("paused", paused);
 }
 
+void AbstractParticleTechnique::sort()
+{
+}
+
 void AbstractParticleTechnique::resize()
 {
-    m_drawProgram->setUniform("aspect", static_cast<float>(m_viewport.x) / max(static_cast<float>(m_viewport.y), 1.f));
+    updateViewportUniforms();
+
+    const ivec2 size = trailSize();
+
+    // the upscale of a reduced trail buffer is bilinear, a full resolution one is copied
+    const GLenum filter = size == m_viewport ? GL_NEAREST : GL_LINEAR;
+    m_color->setParameter(GL_TEXTURE_MIN_FILTER, filter);
+    m_color->setParameter(GL_TEXTURE_MAG_FILTER, filter);
 
-    m_color->image2D(0, GL_RGBA32F, m_viewport, 0, GL_RGB, GL_FLOAT, nullptr);
+    m_color->image2D(0, trailTextureFormat(m_trailFormat), size, 0, GL_RGB, GL_FLOAT, nullptr);
 
     m_fbo->bind();
     glClear(GL_COLOR_BUFFER_BIT);
     m_fbo->unbind();
+
+    m_trailsValid = false;
 }
 
 void AbstractParticleTechnique::reset()
 {
+    m_emissionClock.reset();
+
     if (!m_fbo)
         return;
 
@@ -103,12 +346,40 @@ void AbstractParticleTechnique::reset()
     m_fbo->printStatus(true);
     glClear(GL_COLOR_BUFFER_BIT);
     m_fbo->unbind();
+
+    m_trailsValid = false;
 }
 
-void AbstractParticleTechnique::draw(const float elapsed, const mat4 projection)
+void AbstractParticleTechnique::draw(const float elapsed, const mat4 projection, const float interpolation)
 {
+    const mat4 viewProjection = projection * m_cameraCap.view();
+    const bool frozen = m_freezeTrails && m_trailsValid && viewProjection == m_viewProjection && interpolation == m_interpolation;
+
     glDisable(GL_DEPTH_TEST);
 
+    if (!frozen)
+        accumulate(elapsed, viewProjection, interpolation);
+
+    {
+        PhaseTimers::Scope scope(m_timers, TimedPhase::Blit);
+        m_quad->draw();
+    }
+
+    glEnable(GL_DEPTH_TEST);
+}
+
+void AbstractParticleTechnique::accumulate(const float elapsed, const mat4 & viewProjection, const float interpolation)
+{
+    const ivec2 size = trailSize();
+    const bool scaled = size != m_viewport;
+
+    GLint viewport[4];
+    if (scaled)
+    {
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glViewport(0, 0, size.x, size.y);
+    }
+
     m_fbo->bind();
 
     glEnable(GL_BLEND);
@@ -117,6 +388,8 @@ void AbstractParticleTechnique::draw(const float elapsed, const mat4 projection)
         glClear(GL_COLOR_BUFFER_BIT);
     else
     {
+        PhaseTimers::Scope scope(m_timers, TimedPhase::Clear);
+
         glBlendFunc(GL_ZERO, GL_ONE_MINUS_SRC_COLOR);
 
         m_clear->program()->setUniform("elapsed", elapsed);
@@ -125,22 +398,149 @@ void AbstractParticleTechnique::draw(const float elapsed, const mat4 projection)
     glBlendFunc(GL_SRC_ALPHA, GL_ONE);
 
     // draw particles
-    m_drawProgram->setUniform("viewProjection", projection * m_cameraCap.view());
+    m_viewProjection = viewProjection;
+    m_interpolation = interpolation;
+
+    m_drawProgram->setUniform("viewProjection", m_viewProjection);
+    m_drawProgram->setUniform("interpolation", interpolation);
+
+    if (m_renderPath == RenderPath::PointSprites)
+        glEnable(GL_PROGRAM_POINT_SIZE);
+
+    {
+        PhaseTimers::Scope scope(m_timers, TimedPhase::Particles);
+        draw_impl(); // uses m_drawProgram
+    }
 
-    draw_impl(); // uses m_drawProgram
+    if (m_renderPath == RenderPath::PointSprites)
+        glDisable(GL_PROGRAM_POINT_SIZE);
 
     glDisable(GL_BLEND);
 
     m_fbo->unbind();
 
-    m_quad->draw();
+    if (scaled)
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
 
-    glEnable(GL_DEPTH_TEST);
-
-	glFinish();
+    m_trailsValid = true;
 }
 
 void AbstractParticleTechnique::setViewport(ivec2 viewport)
 {
     m_viewport = viewport;
 }
+
+void AbstractParticleTechnique::setTimers(PhaseTimers * timers)
+{
+    m_timers = timers;
+}
+
+void AbstractParticleTechnique::setInteraction(const ParticleInteraction & interaction)
+{
+    m_interaction = interaction;
+}
+
+void AbstractParticleTechnique::setGravity(const ParticleGravity & gravity)
+{
+    m_gravity = gravity;
+}
+
+void AbstractParticleTechnique::setEmission(const ParticleEmission & emission)
+{
+    m_emission = emission;
+}
+
+void AbstractParticleTechnique::setEnsemble(const ParticleEnsemble & ensemble)
+{
+    m_ensemble = ensemble;
+}
+
+void AbstractParticleTechnique::setCulling(const bool enabled)
+{
+    m_cullingEnabled = enabled;
+}
+
+RenderPath AbstractParticleTechnique::renderPath() const
+{
+    return m_renderPath;
+}
+
+void AbstractParticleTechnique::setRenderPath(const RenderPath renderPath)
+{
+    if (renderPath == m_renderPath)
+        return;
+
+    m_renderPath = renderPath;
+
+    if (isInitialized())
+        createDrawProgram();
+}
+
+void AbstractParticleTechnique::setTrailBuffer(const TrailFormat format, const float scale)
+{
+    if (format == m_trailFormat && scale == m_trailScale)
+        return;
+
+    m_trailFormat = format;
+    m_trailScale = scale;
+
+    if (isInitialized())
+        resize();
+}
+
+void AbstractParticleTechnique::setFreezeTrails(const bool freeze)
+{
+    m_freezeTrails = freeze;
+}
+
+unsigned int AbstractParticleTechnique::numParticles() const
+{
+    return m_numParticles;
+}
+
+ParticleFormat AbstractParticleTechnique::format() const
+{
+    return m_format;
+}
+
+void AbstractParticleTechnique::setFormat(const ParticleFormat format)
+{
+    m_format = format;
+}
+
+std::size_t AbstractParticleTechnique::readbackSize() const
+{
+    return 2 * m_initialState->chunkCount() * static_cast<std::size_t>(ParticleState::chunkSize) * particleFormatSize(m_format);
+}
+
+Buffer * AbstractParticleTechnique::pool() const
+{
+    return nullptr;
+}
+
+bool AbstractParticleTechnique::reduceStatistics(const ParticleEnsemble & /*ensemble*/, std::vector<ParticleStatistics::Partial> & /*partials*/)
+{
+    return false;
+}
+
+void AbstractParticleTechnique::setInitialState(const SharedParticleState & initialState)
+{
+    const unsigned int previous = m_numParticles;
+
+    m_initialState = initialState;
+    m_numParticles = initialState->size();
+
+    if (!isInitialized() || previous == m_numParticles)
+        return;
+
+    // existing particles keep their simulated state
+    resizeChunks();
+
+    if (m_numParticles > previous)
+        uploadParticles(previous, m_numParticles);
+
+    updateAlpha();
+
+    // the added or removed particles have to show up in a frozen trail buffer
+    m_trailsValid = false;
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstddef>
+#include <memory>
 #include <vector>
 #include <string>
 
@@ -7,6 +9,16 @@
 
 #include <globjects/base/ref_ptr.h>
 
+#include "BarnesHutTree.h"
+#include "ParticleEmission.h"
+#include "ParticleEnsemble.h"
+#include "ParticleFormat.h"
+#include "ParticleInteraction.h"
+#include "ParticleRenderPath.h"
+#include "ParticleStatistics.h"
+#include "TrailFormat.h"
+#include "ParticleState.h"
+
 
 namespace globjects
 {
@@ -14,6 +26,7 @@ namespace globjects
     class Program;
     class Buffer;
     class Texture;
+    class VertexAttributeBinding;
 }
 
 namespace gloperate
@@ -22,14 +35,16 @@ namespace gloperate
     class ScreenAlignedQuad;
 }
 
+class ParticleCulling;
+class PhaseTimers;
+
 
 
 class AbstractParticleTechnique
 {
 public:
     AbstractParticleTechnique(
-        const std::vector<glm::vec4> & postions
-    ,   const std::vector<glm::vec4> & velocities
+        const SharedParticleState & initialState
     ,   const globjects::Texture & forces
     ,   const gloperate::AbstractCameraCapability & cameraCap
     ,   const glm::ivec2 viewport);
@@ -39,8 +54,18 @@ public:
     virtual void initialize() = 0;
     virtual void reset();
 
-    virtual void draw(float elapsed, const glm::mat4 projection);
+    // frees all GPU resources, the technique may be initialized again afterwards
+    virtual void release();
+    bool isInitialized() const;
+
+    // draws the particles moved along their velocities by interpolation seconds (usually negative),
+    // which places the current state at the render time of a fixed timestep simulation
+    virtual void draw(float elapsed, const glm::mat4 projection, float interpolation);
     virtual void step(float elapsed) = 0;
+    // reorders the particles of each chunk along a morton curve of their positions, which keeps
+    // particles sampling the same region of the force field close in memory; particle indices
+    // are not preserved. Techniques without a sort keep their order.
+    virtual void sort();
 
     void resize();
 
@@ -48,31 +73,155 @@ public:
     
     void setViewport(glm::ivec2 viewport);
 
+    // times the passes of draw, nullptr disables timing
+    void setTimers(PhaseTimers * timers);
+
+    // applied by the following steps, techniques without an interaction stage ignore it
+    void setInteraction(const ParticleInteraction & interaction);
+    // applied by the following steps, techniques without a gravity tree keep the pull to the center
+    void setGravity(const ParticleGravity & gravity);
+    // applied by the following steps; whether the particles are pooled at all is decided by initialize,
+    // techniques without a pool keep all particles alive
+    void setEmission(const ParticleEmission & emission);
+    // applied by the following steps, the particles of each system sample their own force field layer
+    void setEnsemble(const ParticleEnsemble & ensemble);
+    // applied by the following draws, which then only process the particles inside the view frustum;
+    // without compute shader support the gpu techniques leave the culling to the geometry shader
+    void setCulling(bool enabled);
+
+    RenderPath renderPath() const;
+    // recreates the draw program if the path changed
+    void setRenderPath(RenderPath renderPath);
+
+    // the trail buffer has scale times the viewport resolution and is upscaled bilinearly when
+    // presented; a changed format or scale reallocates and clears it
+    void setTrailBuffer(TrailFormat format, float scale);
+    // while frozen and the view is unchanged, draws present the trail buffer as is, skipping the
+    // decay and the particles; for a paused simulation, whose frames would only differ in the decay
+    void setFreezeTrails(bool freeze);
+
+    unsigned int numParticles() const;
+
+    ParticleFormat format() const;
+    // takes effect with the next initialize, techniques fall back to a format they support
+    void setFormat(ParticleFormat format);
+
+    // a changed particle count takes effect immediately, allocating and uploading only the
+    // chunks and particles added; changed particle data takes effect with the next reset
+    void setInitialState(const SharedParticleState & initialState);
+
+    // copies the current particles into buffer without waiting for the GPU, in the layout of
+    // format(): the positions of all chunks, each padded to the chunk size, then the velocities
+    virtual void readback(globjects::Buffer & buffer) = 0;
+    // bytes written by readback
+    std::size_t readbackSize() const;
+    // the pool of techniques whose particles are pooled on the GPU, see particle-pool.inc, nullptr otherwise;
+    // only the live particles of the readback count
+    virtual globjects::Buffer * pool() const;
+
+    // techniques that simulate on the host reduce their particles into one partial per system of
+    // ensemble and return true, the others leave the readback to ParticleStatistics
+    virtual bool reduceStatistics(const ParticleEnsemble & ensemble, std::vector<ParticleStatistics::Partial> & partials);
+
     // Note: this is intentionally not implemented - but fixes MSVC12 C4512 warning
     AbstractParticleTechnique & operator=(const AbstractParticleTechnique & particleTechnique);
 
 protected:
-    void initialize(const std::string & vertexShaderSourceFilePath);
+    // where points_instanced.vert pulls the particles from
+    enum class DrawSource
+    {
+        Buffers  // a position and a velocity buffer in m_format per chunk
+    ,   Textures // a position and a velocity texture per chunk, see FragmentShaderParticles
+    ,   Arrays   // x, y, z, vx, vy, vz arrays of scalars, see CpuSimdParticles
+    };
+
+protected:
+    void initialize(const std::string & vertexShaderSourceFilePath, DrawSource drawSource);
+    // (re)creates m_drawProgram for m_renderPath
+    void createDrawProgram();
     virtual void draw_impl() = 0; // // use m_drawProgram
 
+    // matches the per chunk resources to the chunk count of the initial state
+    virtual void resizeChunks() = 0;
+    // uploads particles [begin, end) of a chunk from the initial state
+    virtual void uploadChunk(unsigned int chunk, unsigned int begin, unsigned int end) = 0;
+
+    // uploads the global particle range [begin, end) chunk by chunk
+    void uploadParticles(unsigned int begin, unsigned int end);
+    void updateAlpha();
+    void updateViewportUniforms();
+    glm::ivec2 trailSize() const;
+    // decays the trails and draws the particles into them
+    void accumulate(float elapsed, const glm::mat4 & viewProjection, float interpolation);
+
+    // the particles fetched by the following instanced quads, bound as buffer textures
+    void setInstancedParticles(globjects::Buffer & positions, globjects::Buffer & velocities);
+    // the particles of the following instanced quads of a DrawSource::Arrays technique, see CpuSimdParticles
+    void setInstancedArrays(globjects::Buffer & arrays, unsigned int capacity);
+    // the visible particles of the following instanced quads starting at firstIndex, nullptr draws all particles
+    void setInstancedIndices(globjects::Buffer * indices, unsigned int firstIndex);
+
+    // vertex attribute format of a position or velocity stored in m_format
+    void setAttributeFormat(globjects::VertexAttributeBinding * binding) const;
+    void setDecodeUniforms(globjects::Program * program) const;
+    // the ensemble uniforms of particle-step.inc for stepping a chunk
+    void setEnsembleUniforms(globjects::Program * program, unsigned int chunk) const;
+    // uploads count values encoded in m_format to the element offset of the buffer
+    void uploadEncoded(globjects::Buffer & buffer, unsigned int offset, const glm::vec4 * values, unsigned int count, float range) const;
+
 
 protected:
-    const std::vector<glm::vec4> m_positions;
-    const std::vector<glm::vec4> m_velocities;
+    // shared with the painter and the other techniques, never copied
+    SharedParticleState m_initialState;
 
     const globjects::Texture & m_forces;
     const gloperate::AbstractCameraCapability & m_cameraCap;
 
-    const unsigned int m_numParticles;
+    unsigned int m_numParticles;
+
+    ParticleFormat m_format;
 
     bool m_paused;
 
     glm::ivec2 m_viewport;
 
+    PhaseTimers * m_timers;
+
+    ParticleInteraction m_interaction;
+    ParticleGravity m_gravity;
+
+    ParticleEmission m_emission;
+    ParticleEnsemble m_ensemble;
+    // set by the initialize of techniques with a pool, the particles then have lifetimes and
+    // the live ones are kept at the front of each chunk
+    bool m_pooled;
+    EmissionClock m_emissionClock;
+
+    bool m_cullingEnabled;
+    // created by the initialize of gpu techniques that support it, released with the technique
+    std::unique_ptr<ParticleCulling> m_culling;
+    // of the current draw, for the culling
+    glm::mat4 m_viewProjection;
+    float m_interpolation;
+
+    RenderPath m_renderPath;
+    DrawSource m_drawSource;
+    std::string m_vertexShaderSourceFilePath;
+    // buffer textures of the instanced quads, see setInstancedParticles and setInstancedIndices
+    globjects::ref_ptr<globjects::Texture> m_instancedPositions;
+    globjects::ref_ptr<globjects::Texture> m_instancedVelocities;
+    globjects::ref_ptr<globjects::Texture> m_instancedIndices;
+
 
     globjects::ref_ptr<globjects::Framebuffer> m_fbo;
     globjects::ref_ptr<globjects::Texture> m_color;
 
+    TrailFormat m_trailFormat;
+    float m_trailScale;
+    bool m_freezeTrails;
+    // m_color holds the trails of the last draw, false after it was cleared
+    bool m_trailsValid;
+
     globjects::ref_ptr<globjects::Program> m_drawProgram;
 
     globjects::ref_ptr<gloperate::ScreenAlignedQuad> m_quad;
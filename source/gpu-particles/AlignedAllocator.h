@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+
+// Allocator for std::vector storage that is consumed by SIMD kernels and buffer uploads.
+// The default alignment of 64 bytes matches a cache line and the widest vector loads used.
+
+template <typename T, std::size_t Alignment = 64>
+class AlignedAllocator
+{
+public:
+    using value_type = T;
+
+    template <typename U>
+    struct rebind
+    {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+public:
+    AlignedAllocator() = default;
+
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment> &)
+    {
+    }
+
+    T * allocate(std::size_t n)
+    {
+        if (n == 0)
+            return nullptr;
+
+        void * p = nullptr;
+#ifdef _MSC_VER
+        p = _aligned_malloc(n * sizeof(T), Alignment);
+#else
+        if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0)
+            p = nullptr;
+#endif
+        if (!p)
+            throw std::bad_alloc();
+
+        return static_cast<T *>(p);
+    }
+
+    void deallocate(T * p, std::size_t)
+    {
+#ifdef _MSC_VER
+        _aligned_free(p);
+#else
+        free(p);
+#endif
+    }
+};
+
+template <typename T, typename U, std::size_t Alignment>
+bool operator==(const AlignedAllocator<T, Alignment> &, const AlignedAllocator<U, Alignment> &)
+{
+    return true;
+}
+
+template <typename T, typename U, std::size_t Alignment>
+bool operator!=(const AlignedAllocator<T, Alignment> &, const AlignedAllocator<U, Alignment> &)
+{
+    return false;
+}
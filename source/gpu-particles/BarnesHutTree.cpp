@@ -0,0 +1,415 @@
+#include "BarnesHutTree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "ParticleOrder.h"
+#include "ParticleState.h"
+#include "WorkStealingPool.h"
+
+
+namespace
+{
+
+static_assert(3 * BarnesHutTree::s_maxDepth == mortonBits, "a level of the tree per bit of each axis of the sort keys");
+
+// the cells of the first two levels, built serially; each of their children is built by one task
+const unsigned int topLevels = 2;
+const unsigned int topCells = 1u << (3 * topLevels);
+
+// octant of a sorted key among the children of a cell at depth
+std::uint32_t childOctant(const std::uint64_t key, const unsigned int depth)
+{
+    return static_cast<std::uint32_t>(key >> (32 + 3 * (BarnesHutTree::s_maxDepth - depth - 1))) & 7;
+}
+
+}
+
+
+const float BarnesHutTree::s_softening = 0.02f;
+
+BarnesHutTree::BarnesHutTree()
+: m_count(0)
+, m_extent(0.f)
+{
+}
+
+BarnesHutTree::~BarnesHutTree()
+{
+}
+
+void BarnesHutTree::build(WorkStealingPool & threadPool, const std::vector<CpuParticleArrays> & chunks, const unsigned int count)
+{
+    m_count = count;
+    m_nodes.clear();
+
+    if (count == 0)
+        return;
+
+    sortParticles(threadPool, chunks, count);
+
+    // each subtree below the top levels is a contiguous range of sorted keys
+    std::uint32_t bounds[topCells + 1];
+    bounds[0] = 0;
+    for (std::uint32_t cell = 0; cell < topCells; ++cell)
+    {
+        const auto end = std::partition_point(m_keys.begin() + bounds[cell], m_keys.end(), [cell](const std::uint64_t key)
+        {
+            return static_cast<std::uint32_t>(key >> (32 + 3 * (s_maxDepth - topLevels))) <= cell;
+        });
+
+        bounds[cell + 1] = static_cast<std::uint32_t>(end - m_keys.begin());
+    }
+
+    m_subtrees.resize(topCells);
+
+    const float subtreeSize = m_extent / static_cast<float>(1u << topLevels);
+
+    threadPool.parallelFor(topCells, 1, [this, &bounds, subtreeSize](std::size_t begin, std::size_t end)
+    {
+        for (std::size_t cell = begin; cell < end; ++cell)
+        {
+            m_subtrees[cell].clear();
+
+            if (bounds[cell + 1] > bounds[cell])
+                buildSubtree(bounds[cell], bounds[cell + 1], topLevels, subtreeSize, m_subtrees[cell]);
+        }
+    });
+
+    // joins the subtrees below the root and its octants in depth first order
+    m_nodes.emplace_back();
+
+    std::vector<std::uint32_t> octants;
+
+    for (std::uint32_t octant = 0; octant < 8; ++octant)
+    {
+        if (bounds[8 * octant + 8] == bounds[8 * octant])
+            continue;
+
+        const auto index = static_cast<std::uint32_t>(m_nodes.size());
+        m_nodes.emplace_back();
+
+        std::vector<std::uint32_t> children;
+
+        for (std::uint32_t cell = 8 * octant; cell < 8 * octant + 8; ++cell)
+        {
+            const auto offset = static_cast<std::uint32_t>(m_nodes.size());
+
+            if (!m_subtrees[cell].empty())
+                children.push_back(offset);
+
+            for (Node node : m_subtrees[cell])
+            {
+                node.next += offset;
+                m_nodes.push_back(node);
+            }
+        }
+
+        joinNode(index, m_extent * 0.5f, children);
+        octants.push_back(index);
+    }
+
+    joinNode(0, m_extent, octants);
+}
+
+void BarnesHutTree::sortParticles(WorkStealingPool & threadPool, const std::vector<CpuParticleArrays> & chunks, const unsigned int count)
+{
+    static const std::size_t chunkSize = ParticleState::chunkSize;
+
+    // bounding box from per task partial bounds
+    const std::size_t boundsTasks = (count + particleGrain - 1) / particleGrain;
+    m_bounds.resize(6 * boundsTasks);
+
+    threadPool.parallelFor(count, particleGrain, [this, &chunks](std::size_t begin, std::size_t end)
+    {
+        const CpuParticleArrays & particles = chunks[begin / chunkSize];
+        const std::size_t offset = begin / chunkSize * chunkSize;
+
+        float bounds[6] = {
+            std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+            std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest() };
+
+        for (std::size_t i = begin - offset; i < end - offset; ++i)
+        {
+            bounds[0] = std::min(bounds[0], particles.px[i]);
+            bounds[1] = std::min(bounds[1], particles.py[i]);
+            bounds[2] = std::min(bounds[2], particles.pz[i]);
+            bounds[3] = std::max(bounds[3], particles.px[i]);
+            bounds[4] = std::max(bounds[4], particles.py[i]);
+            bounds[5] = std::max(bounds[5], particles.pz[i]);
+        }
+
+        std::copy(bounds, bounds + 6, m_bounds.begin() + 6 * (begin / particleGrain));
+    });
+
+    float lower[3] = { m_bounds[0], m_bounds[1], m_bounds[2] };
+    float upper[3] = { m_bounds[3], m_bounds[4], m_bounds[5] };
+
+    for (std::size_t task = 1; task < boundsTasks; ++task)
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            lower[axis] = std::min(lower[axis], m_bounds[6 * task + axis]);
+            upper[axis] = std::max(upper[axis], m_bounds[6 * task + 3 + axis]);
+        }
+    }
+
+    // the cube is slightly enlarged, so that the upper bound still maps into the last cell
+    m_extent = std::max(std::max(upper[0] - lower[0], upper[1] - lower[1]), upper[2] - lower[2]);
+    m_extent = std::max(m_extent * 1.0001f, std::numeric_limits<float>::min());
+
+    const float scale = 1024.f / m_extent;
+
+    m_keys.resize(count);
+    m_scratch.resize(count);
+
+    threadPool.parallelFor(count, particleGrain, [this, &chunks, &lower, scale](std::size_t begin, std::size_t end)
+    {
+        const CpuParticleArrays & particles = chunks[begin / chunkSize];
+        const std::size_t offset = begin / chunkSize * chunkSize;
+
+        const auto cell = [scale](const float value, const float lower)
+        {
+            return std::min(static_cast<std::uint32_t>((value - lower) * scale), 1023u);
+        };
+
+        for (std::size_t p = begin; p < end; ++p)
+        {
+            const std::size_t i = p - offset;
+            const std::uint32_t code = mortonCode(cell(particles.px[i], lower[0]), cell(particles.py[i], lower[1]), cell(particles.pz[i], lower[2]));
+
+            m_keys[p] = (static_cast<std::uint64_t>(code) << 32) | p;
+        }
+    });
+
+    // stable least significant digit first radix sort: per task digit counts, their exclusive scan
+    // in digit major order, then each task scatters its keys to its offsets
+    const std::size_t sortTasks = (count + s_sortGrain - 1) / s_sortGrain;
+    m_histograms.resize(sortTasks * radixBuckets);
+
+    std::uint64_t * source = m_keys.data();
+    std::uint64_t * target = m_scratch.data();
+
+    for (unsigned int shift = 32; shift < 32 + 3 * s_maxDepth; shift += radixBits)
+    {
+        threadPool.parallelFor(count, s_sortGrain, [this, source, shift](std::size_t begin, std::size_t end)
+        {
+            std::uint32_t * histogram = m_histograms.data() + begin / s_sortGrain * radixBuckets;
+            std::fill(histogram, histogram + radixBuckets, 0u);
+
+            for (std::size_t i = begin; i < end; ++i)
+                ++histogram[(source[i] >> shift) & (radixBuckets - 1)];
+        });
+
+        std::uint32_t sum = 0;
+        for (std::size_t digit = 0; digit < radixBuckets; ++digit)
+        {
+            for (std::size_t task = 0; task < sortTasks; ++task)
+            {
+                const std::uint32_t digitCount = m_histograms[task * radixBuckets + digit];
+                m_histograms[task * radixBuckets + digit] = sum;
+                sum += digitCount;
+            }
+        }
+
+        threadPool.parallelFor(count, s_sortGrain, [this, source, target, shift](std::size_t begin, std::size_t end)
+        {
+            std::uint32_t * offsets = m_histograms.data() + begin / s_sortGrain * radixBuckets;
+
+            for (std::size_t i = begin; i < end; ++i)
+                target[offsets[(source[i] >> shift) & (radixBuckets - 1)]++] = source[i];
+        });
+
+        std::swap(source, target);
+    }
+
+    if (source != m_keys.data())
+        m_keys.swap(m_scratch);
+
+    m_x.resize(count);
+    m_y.resize(count);
+    m_z.resize(count);
+
+    threadPool.parallelFor(count, particleGrain, [this, &chunks](std::size_t begin, std::size_t end)
+    {
+        for (std::size_t slot = begin; slot < end; ++slot)
+        {
+            const auto p = static_cast<std::uint32_t>(m_keys[slot]);
+            const CpuParticleArrays & particles = chunks[p / chunkSize];
+
+            m_x[slot] = particles.px[p % chunkSize];
+            m_y[slot] = particles.py[p % chunkSize];
+            m_z[slot] = particles.pz[p % chunkSize];
+        }
+    });
+}
+
+std::uint32_t BarnesHutTree::buildSubtree(const std::uint32_t first, const std::uint32_t last, const unsigned int depth,
+    const float size, std::vector<Node> & nodes) const
+{
+    const auto index = static_cast<std::uint32_t>(nodes.size());
+    nodes.emplace_back();
+
+    Node node = { 0.f, 0.f, 0.f, 0.f, size, first, last - first, 0 };
+
+    if (last - first <= s_leafSize || depth == s_maxDepth)
+    {
+        for (std::uint32_t slot = first; slot < last; ++slot)
+        {
+            node.x += m_x[slot];
+            node.y += m_y[slot];
+            node.z += m_z[slot];
+        }
+
+        node.mass = static_cast<float>(last - first);
+    }
+    else
+    {
+        std::uint32_t begin = first;
+
+        for (std::uint32_t octant = 0; octant < 8 && begin < last; ++octant)
+        {
+            const auto end = static_cast<std::uint32_t>(std::partition_point(m_keys.begin() + begin, m_keys.begin() + last,
+                [depth, octant](const std::uint64_t key) { return childOctant(key, depth) <= octant; }) - m_keys.begin());
+
+            if (end == begin)
+                continue;
+
+            const Node & child = nodes[buildSubtree(begin, end, depth + 1, size * 0.5f, nodes)];
+
+            node.x += child.x * child.mass;
+            node.y += child.y * child.mass;
+            node.z += child.z * child.mass;
+            node.mass += child.mass;
+
+            begin = end;
+        }
+    }
+
+    node.x /= node.mass;
+    node.y /= node.mass;
+    node.z /= node.mass;
+    node.next = static_cast<std::uint32_t>(nodes.size());
+
+    nodes[index] = node;
+    return index;
+}
+
+void BarnesHutTree::joinNode(const std::uint32_t index, const float size, const std::vector<std::uint32_t> & children)
+{
+    Node node = { 0.f, 0.f, 0.f, 0.f, size, m_nodes[children.front()].first, 0, static_cast<std::uint32_t>(m_nodes.size()) };
+
+    for (const std::uint32_t child : children)
+    {
+        node.x += m_nodes[child].x * m_nodes[child].mass;
+        node.y += m_nodes[child].y * m_nodes[child].mass;
+        node.z += m_nodes[child].z * m_nodes[child].mass;
+        node.mass += m_nodes[child].mass;
+        node.count += m_nodes[child].count;
+    }
+
+    node.x /= node.mass;
+    node.y /= node.mass;
+    node.z /= node.mass;
+
+    m_nodes[index] = node;
+}
+
+void BarnesHutTree::apply(WorkStealingPool & threadPool, const std::vector<CpuParticleArrays> & chunks,
+    const ParticleGravity & gravity, const float elapsed) const
+{
+    static const std::size_t chunkSize = ParticleState::chunkSize;
+
+    if (m_nodes.empty())
+        return;
+
+    const float theta2 = gravity.theta * gravity.theta;
+    const float softening2 = s_softening * s_softening;
+    // the node masses are in particle masses
+    const float kick = gravity.strength / static_cast<float>(m_count) * elapsed;
+
+    // the sorted order keeps the nodes visited by consecutive particles in cache
+    threadPool.parallelFor(m_count, particleGrain, [this, &chunks, theta2, softening2, kick](std::size_t begin, std::size_t end)
+    {
+        const auto nodeCount = static_cast<std::uint32_t>(m_nodes.size());
+
+        for (std::size_t slot = begin; slot < end; ++slot)
+        {
+            const float x = m_x[slot];
+            const float y = m_y[slot];
+            const float z = m_z[slot];
+
+            float ax = 0.f, ay = 0.f, az = 0.f;
+
+            std::uint32_t i = 0;
+            while (i < nodeCount)
+            {
+                const Node & node = m_nodes[i];
+
+                const float dx = node.x - x;
+                const float dy = node.y - y;
+                const float dz = node.z - z;
+                const float d2 = dx * dx + dy * dy + dz * dz;
+
+                if (node.size * node.size < theta2 * d2)
+                {
+                    const float inverse = 1.f / std::sqrt(d2 + softening2);
+                    const float f = node.mass * inverse * inverse * inverse;
+
+                    ax += dx * f;
+                    ay += dy * f;
+                    az += dz * f;
+
+                    i = node.next;
+                }
+                else if (node.next == i + 1)
+                {
+                    // leaves too close for the approximation are summed particle by particle
+                    for (std::uint32_t other = node.first; other < node.first + node.count; ++other)
+                    {
+                        if (other == slot)
+                            continue;
+
+                        const float ox = m_x[other] - x;
+                        const float oy = m_y[other] - y;
+                        const float oz = m_z[other] - z;
+
+                        const float inverse = 1.f / std::sqrt(ox * ox + oy * oy + oz * oz + softening2);
+                        const float f = inverse * inverse * inverse;
+
+                        ax += ox * f;
+                        ay += oy * f;
+                        az += oz * f;
+                    }
+
+                    i = node.next;
+                }
+                else
+                    ++i;
+            }
+
+            const auto p = static_cast<std::uint32_t>(m_keys[slot]);
+            const CpuParticleArrays & particles = chunks[p / chunkSize];
+
+            particles.vx[p % chunkSize] += ax * kick;
+            particles.vy[p % chunkSize] += ay * kick;
+            particles.vz[p % chunkSize] += az * kick;
+        }
+    });
+}
+
+void BarnesHutTree::clear()
+{
+    m_count = 0;
+
+    std::vector<std::uint64_t>().swap(m_keys);
+    std::vector<std::uint64_t>().swap(m_scratch);
+    std::vector<std::uint32_t>().swap(m_histograms);
+    std::vector<float>().swap(m_bounds);
+    std::vector<float, AlignedAllocator<float>>().swap(m_x);
+    std::vector<float, AlignedAllocator<float>>().swap(m_y);
+    std::vector<float, AlignedAllocator<float>>().swap(m_z);
+    std::vector<std::vector<Node>>().swap(m_subtrees);
+    std::vector<Node>().swap(m_nodes);
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "AlignedAllocator.h"
+#include "CpuParticleKernels.h"
+
+
+class WorkStealingPool;
+
+
+enum class GravityMode { Central, BarnesHut };
+
+// Gravity of the particles among each other, replaces the pull to the center of the force field step
+struct ParticleGravity
+{
+    GravityMode mode;
+    // opening angle; cells seen under a smaller angle act through their center of mass, 0 sums directly
+    float theta;
+    // gravitational constant times the total mass, which is spread evenly across the particles
+    float strength;
+};
+
+
+// Octree over the particles for Barnes-Hut gravity, rebuilt every step. The particles are sorted
+// by the Morton code of their position within their bounding cube with a parallel radix sort, so
+// each cell of the tree is a range of sorted particles. The cells of the first two levels split
+// the particles into 64 subtrees, which are built in parallel and then joined in depth first
+// order. Every node knows the node after its subtree, so the traversal needs no stack.
+class BarnesHutTree
+{
+public:
+    // particles up to which a cell is not split further
+    static const unsigned int s_leafSize = 16;
+    // 10 bits per axis of the Morton code
+    static const unsigned int s_maxDepth = 10;
+    // particles per task of the parallel radix sort
+    static const std::size_t s_sortGrain = 16384;
+
+    // Plummer softening length, keeps the forces of close encounters finite
+    static const float s_softening;
+
+public:
+    BarnesHutTree();
+    ~BarnesHutTree();
+
+    // chunks holds the structure of arrays of each chunk of ParticleState::chunkSize particles
+    void build(WorkStealingPool & threadPool, const std::vector<CpuParticleArrays> & chunks, unsigned int count);
+    // adds the gravity times elapsed to the velocities of the particles the tree was built from
+    void apply(WorkStealingPool & threadPool, const std::vector<CpuParticleArrays> & chunks,
+        const ParticleGravity & gravity, float elapsed) const;
+
+    void clear();
+
+protected:
+    struct Node
+    {
+        // center of mass and mass, in particle masses
+        float x;
+        float y;
+        float z;
+        float mass;
+
+        // edge length of the cell
+        float size;
+
+        // range of sorted particles within the cell
+        std::uint32_t first;
+        std::uint32_t count;
+
+        // first node behind the subtree, the children follow the node directly; leaves have next == index + 1
+        std::uint32_t next;
+    };
+
+    void sortParticles(WorkStealingPool & threadPool, const std::vector<CpuParticleArrays> & chunks, unsigned int count);
+    // appends the subtree of the sorted particles [first, last) in depth first order, returns its root
+    std::uint32_t buildSubtree(std::uint32_t first, std::uint32_t last, unsigned int depth, float size, std::vector<Node> & nodes) const;
+    // appends a node of the first two levels, whose children are the given nodes
+    void joinNode(std::uint32_t index, float size, const std::vector<std::uint32_t> & children);
+
+protected:
+    unsigned int m_count;
+    float m_extent;
+
+    // Morton code in the upper and particle index in the lower half, sorted
+    std::vector<std::uint64_t> m_keys;
+    std::vector<std::uint64_t> m_scratch;
+    std::vector<std::uint32_t> m_histograms;
+    std::vector<float> m_bounds;
+
+    // positions in sorted order
+    std::vector<float, AlignedAllocator<float>> m_x;
+    std::vector<float, AlignedAllocator<float>> m_y;
+    std::vector<float, AlignedAllocator<float>> m_z;
+
+    std::vector<std::vector<Node>> m_subtrees;
+    std::vector<Node> m_nodes;
+};
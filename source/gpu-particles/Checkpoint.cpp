@@ -0,0 +1,319 @@
+#include "Checkpoint.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <glbinding/gl/gl.h>
+
+#include <globjects/logging.h>
+#include <globjects/Buffer.h>
+#include <globjects/Sync.h>
+
+#include "AbstractParticleTechnique.h"
+#include "ParticleEnsemble.h"
+
+
+using namespace gl;
+using namespace glm;
+using namespace globjects;
+
+namespace
+{
+
+const char magic[4] = { 'G', 'P', 'C', 'K' };
+const std::uint32_t formatVersion = 2;
+
+// byte offsets of the header fields
+const std::size_t countOffset = 12;
+const std::size_t seedOffset = 16;
+const std::size_t typeOffset = 20;
+const std::size_t resolutionOffset = 24;
+const std::size_t speedOffset = 28;
+const std::size_t timeOffset = 32;
+const std::size_t forceTimeOffset = 40;
+const std::size_t forceSizeOffset = 44;
+const std::size_t sectionsOffset = 56;
+const std::size_t ensembleOffset = 80;
+
+// particles decoded per write, keeps the temporary memory of the worker small
+const std::size_t blockSize = 65536;
+
+template <typename T>
+T read(const unsigned char * data, const std::size_t offset)
+{
+    T value;
+    std::memcpy(&value, data + offset, sizeof(T));
+    return value;
+}
+
+template <typename T>
+void store(std::vector<unsigned char> & data, const std::size_t offset, const T value)
+{
+    std::memcpy(data.data() + offset, &value, sizeof(T));
+}
+
+std::size_t alignToPage(const std::size_t offset)
+{
+    return (offset + Checkpoint::s_pageSize - 1) / Checkpoint::s_pageSize * Checkpoint::s_pageSize;
+}
+
+}
+
+
+Checkpoint::Checkpoint()
+: m_info()
+, m_forceFieldSize(0)
+, m_positions(0)
+, m_velocities(0)
+, m_forces(0)
+{
+}
+
+bool Checkpoint::open(const std::string & path)
+{
+    if (!m_file.open(path))
+        return false;
+
+    const unsigned char * data = m_file.data();
+
+    const std::uint32_t version = m_file.size() < s_pageSize ? 0 : read<std::uint32_t>(data, 4);
+
+    if (m_file.size() < s_pageSize || std::memcmp(data, magic, sizeof(magic)) != 0
+        || version < 1 || version > formatVersion || read<std::uint32_t>(data, 8) != s_pageSize)
+    {
+        warning() << path << " is not a particle checkpoint";
+        m_file.close();
+        return false;
+    }
+
+    m_info.count = read<std::uint32_t>(data, countOffset);
+    m_info.seed = read<std::uint32_t>(data, seedOffset);
+    // version 1 predates ensembles
+    m_info.ensembleSize = version < 2 ? 1 : read<std::uint32_t>(data, ensembleOffset);
+    m_info.forceFieldType = static_cast<ForceFieldType>(read<std::uint32_t>(data, typeOffset));
+    m_info.forceFieldResolution = read<std::int32_t>(data, resolutionOffset);
+    m_info.forceFieldSpeed = read<float>(data, speedOffset);
+    m_info.simulationTime = read<double>(data, timeOffset);
+    m_info.forceFieldTime = read<float>(data, forceTimeOffset);
+
+    m_forceFieldSize = ivec3(read<std::int32_t>(data, forceSizeOffset), read<std::int32_t>(data, forceSizeOffset + 4),
+        read<std::int32_t>(data, forceSizeOffset + 8));
+
+    m_positions = static_cast<std::size_t>(read<std::uint64_t>(data, sectionsOffset));
+    m_velocities = static_cast<std::size_t>(read<std::uint64_t>(data, sectionsOffset + 8));
+    m_forces = static_cast<std::size_t>(read<std::uint64_t>(data, sectionsOffset + 16));
+
+    const std::size_t particleBytes = m_info.count * sizeof(vec4);
+    const std::size_t forceBytes = 3 * sizeof(float) * static_cast<std::size_t>(std::max(m_forceFieldSize.x, 0))
+        * std::max(m_forceFieldSize.y, 0) * std::max(m_forceFieldSize.z, 0);
+
+    const bool aligned = m_positions % s_pageSize == 0 && m_velocities % s_pageSize == 0 && m_forces % s_pageSize == 0;
+
+    if (m_info.count == 0 || m_info.ensembleSize == 0 || m_info.ensembleSize > maxEnsembleSize || !aligned
+        || static_cast<unsigned int>(m_info.forceFieldType) > static_cast<unsigned int>(ForceFieldType::Stream)
+        || m_positions + particleBytes > m_file.size() || m_velocities + particleBytes > m_file.size() || m_forces + forceBytes > m_file.size())
+    {
+        warning() << path << " is truncated or has an invalid header";
+        m_file.close();
+        return false;
+    }
+
+    return true;
+}
+
+const CheckpointInfo & Checkpoint::info() const
+{
+    return m_info;
+}
+
+const vec4 * Checkpoint::positions() const
+{
+    return reinterpret_cast<const vec4 *>(m_file.data() + m_positions);
+}
+
+const vec4 * Checkpoint::velocities() const
+{
+    return reinterpret_cast<const vec4 *>(m_file.data() + m_velocities);
+}
+
+CpuForceField Checkpoint::forces() const
+{
+    CpuForceField field;
+    field.forces = reinterpret_cast<const float *>(m_file.data() + m_forces);
+    field.width  = m_forceFieldSize.x;
+    field.height = m_forceFieldSize.y;
+    field.depth  = m_forceFieldSize.z;
+
+    return field;
+}
+
+
+CheckpointWriter::CheckpointWriter()
+: m_state(State::Idle)
+, m_info()
+, m_format(ParticleFormat::Float4)
+, m_readbackSize(0)
+, m_forceFieldSize(0)
+, m_written(false)
+, m_succeeded(false)
+{
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+bool CheckpointWriter::busy() const
+{
+    return m_state != State::Idle;
+}
+
+bool CheckpointWriter::save(const std::string & path, AbstractParticleTechnique & technique, const CheckpointInfo & info, const CpuForceField & forces)
+{
+    if (busy())
+        return false;
+
+    m_path = path;
+    m_info = info;
+    m_format = technique.format();
+    m_readbackSize = technique.readbackSize();
+
+    m_forceFieldSize = ivec3(forces.width, forces.height, forces.depth);
+    m_forces.assign(forces.forces, forces.forces + 3 * static_cast<std::size_t>(forces.width) * forces.height * forces.depth);
+
+    m_buffer = new Buffer();
+    m_buffer->setData(static_cast<GLsizeiptr>(m_readbackSize), nullptr, GL_STREAM_READ);
+
+    technique.readback(*m_buffer);
+    m_fence = Sync::fence(GL_SYNC_GPU_COMMANDS_COMPLETE);
+
+    m_state = State::Copying;
+
+    return true;
+}
+
+void CheckpointWriter::update()
+{
+    if (m_state == State::Copying)
+    {
+        if (m_fence->clientWait(GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED)
+            return;
+
+        m_fence = nullptr;
+
+        // the buffer stays mapped until the worker is done, nothing else uses it meanwhile
+        const auto particles = static_cast<const unsigned char *>(m_buffer->mapRange(0, static_cast<GLsizeiptr>(m_readbackSize), GL_MAP_READ_BIT));
+
+        if (!particles)
+        {
+            warning() << "Could not map the particles of checkpoint \"" << m_path << "\"";
+            m_buffer = nullptr;
+            m_state = State::Idle;
+            return;
+        }
+
+        m_written = false;
+        m_thread = std::thread([this, particles]
+        {
+            m_succeeded = write(particles);
+            m_written = true;
+        });
+
+        m_state = State::Writing;
+    }
+
+    if (m_state == State::Writing && m_written)
+    {
+        m_thread.join();
+
+        m_buffer->unmap();
+        m_buffer = nullptr;
+        std::vector<float>().swap(m_forces);
+
+        if (m_succeeded)
+            debug() << "Saved " << m_info.count << " particles at " << m_info.simulationTime << "s to " << m_path;
+        else
+            warning() << "Could not write checkpoint \"" << m_path << "\"";
+
+        m_state = State::Idle;
+    }
+}
+
+bool CheckpointWriter::write(const unsigned char * particles) const
+{
+    const std::string temporary = m_path + ".tmp";
+
+    std::ofstream stream(temporary, std::ios::binary | std::ios::trunc);
+    if (!stream)
+        return false;
+
+    const std::size_t count = m_info.count;
+    const std::size_t forceBytes = m_forces.size() * sizeof(float);
+
+    const std::size_t positions = Checkpoint::s_pageSize;
+    const std::size_t velocities = alignToPage(positions + count * sizeof(vec4));
+    const std::size_t forces = alignToPage(velocities + count * sizeof(vec4));
+
+    std::vector<unsigned char> header(Checkpoint::s_pageSize, 0);
+    std::memcpy(header.data(), magic, sizeof(magic));
+    store<std::uint32_t>(header, 4, formatVersion);
+    store<std::uint32_t>(header, 8, static_cast<std::uint32_t>(Checkpoint::s_pageSize));
+    store<std::uint32_t>(header, countOffset, m_info.count);
+    store<std::uint32_t>(header, seedOffset, m_info.seed);
+    store<std::uint32_t>(header, typeOffset, static_cast<std::uint32_t>(m_info.forceFieldType));
+    store<std::int32_t>(header, resolutionOffset, m_info.forceFieldResolution);
+    store<float>(header, speedOffset, m_info.forceFieldSpeed);
+    store<double>(header, timeOffset, m_info.simulationTime);
+    store<float>(header, forceTimeOffset, m_info.forceFieldTime);
+    store<std::int32_t>(header, forceSizeOffset, m_forceFieldSize.x);
+    store<std::int32_t>(header, forceSizeOffset + 4, m_forceFieldSize.y);
+    store<std::int32_t>(header, forceSizeOffset + 8, m_forceFieldSize.z);
+    store<std::uint64_t>(header, sectionsOffset, positions);
+    store<std::uint64_t>(header, sectionsOffset + 8, velocities);
+    store<std::uint64_t>(header, sectionsOffset + 16, forces);
+    store<std::uint32_t>(header, ensembleOffset, m_info.ensembleSize);
+
+    stream.write(reinterpret_cast<const char *>(header.data()), static_cast<std::streamsize>(header.size()));
+
+    const std::size_t size = particleFormatSize(m_format);
+    const std::vector<char> padding(Checkpoint::s_pageSize, 0);
+    std::vector<vec4> block(std::min(count, blockSize));
+
+    // the readback holds the positions of all chunks, then their velocities
+    const unsigned char * sections[] = { particles, particles + m_readbackSize / 2 };
+    const float ranges[] = { fixedPositionRange, fixedVelocityRange };
+    const std::size_t begins[] = { positions, velocities };
+    const std::size_t ends[] = { velocities, forces };
+
+    for (int section = 0; section < 2; ++section)
+    {
+        for (std::size_t begin = 0; begin < count; begin += blockSize)
+        {
+            const std::size_t n = std::min(blockSize, count - begin);
+            decodeParticles(m_format, sections[section] + begin * size, n, ranges[section], section == 0 ? 1.f : 0.f, block.data());
+
+            stream.write(reinterpret_cast<const char *>(block.data()), static_cast<std::streamsize>(n * sizeof(vec4)));
+        }
+
+        // the next section starts on a page boundary
+        stream.write(padding.data(), static_cast<std::streamsize>(ends[section] - begins[section] - count * sizeof(vec4)));
+    }
+
+    stream.write(reinterpret_cast<const char *>(m_forces.data()), static_cast<std::streamsize>(forceBytes));
+    stream.close();
+
+    if (!stream)
+        return false;
+
+#if defined(_WIN32)
+    // rename does not replace existing files on Windows
+    std::remove(m_path.c_str());
+#endif
+
+    return std::rename(temporary.c_str(), m_path.c_str()) == 0;
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <globjects/base/ref_ptr.h>
+
+#include "CpuParticleKernels.h"
+#include "ForceField.h"
+#include "MappedFile.h"
+#include "ParticleFormat.h"
+
+
+namespace globjects
+{
+    class Buffer;
+    class Sync;
+}
+
+class AbstractParticleTechnique;
+
+
+// Simulation state besides the particles and forces, restored along with them
+struct CheckpointInfo
+{
+    unsigned int count;
+    unsigned int seed;
+    // systems of the ensemble, see ParticleEnsemble.h
+    unsigned int ensembleSize;
+    double simulationTime;
+
+    ForceFieldType forceFieldType;
+    int forceFieldResolution;
+    float forceFieldSpeed;
+    float forceFieldTime;
+};
+
+// Full simulation state, read from a memory mapped file. Every section starts on a page boundary
+// and is stored in the layout of the initial state, so restoring copies it without any parsing.
+// There is no section for the pool of emitting techniques, see ParticleEmission.h.
+//
+// File layout, little endian:
+//   page 0: char[4] "GPCK", uint32 version (2), uint32 page size (4096), uint32 particle count,
+//     uint32 seed, uint32 force field type, int32 force field resolution, float32 force field speed,
+//     float64 simulation time, float32 force field time, int32 force field width, height, depth,
+//     uint64 offsets of the positions, velocities, and forces, uint32 ensemble size (version 1: 1)
+//   positions: count float32 quadruples with w = 1
+//   velocities: count float32 quadruples with w = 0
+//   forces: width * height * depth RGB float32 triplets with x running fastest, the layers of an
+//     ensemble stacked along z
+class Checkpoint
+{
+public:
+    static const std::size_t s_pageSize = 4096;
+
+public:
+    Checkpoint();
+
+    bool open(const std::string & path);
+
+    const CheckpointInfo & info() const;
+
+    const glm::vec4 * positions() const;
+    const glm::vec4 * velocities() const;
+    CpuForceField forces() const;
+
+protected:
+    MappedFile m_file;
+
+    CheckpointInfo m_info;
+    glm::ivec3 m_forceFieldSize;
+
+    std::size_t m_positions;
+    std::size_t m_velocities;
+    std::size_t m_forces;
+};
+
+// Saves checkpoints without stalling rendering: the technique copies its particles into a buffer
+// on the GPU, which is mapped once its fence signaled and written to disk by a worker thread.
+// Files are written next to the target and renamed when complete, so a crash while saving
+// leaves the previous checkpoint intact.
+class CheckpointWriter
+{
+public:
+    CheckpointWriter();
+    ~CheckpointWriter();
+
+    bool busy() const;
+
+    // enqueues the copies of the current particles, requires a current context; fails while busy
+    bool save(const std::string & path, AbstractParticleTechnique & technique, const CheckpointInfo & info, const CpuForceField & forces);
+
+    // advances a pending save without waiting, call once per frame with a current context
+    void update();
+
+    // Note: this is intentionally not implemented - but fixes MSVC12 C4512 warning
+    CheckpointWriter & operator=(const CheckpointWriter & writer);
+
+protected:
+    enum class State { Idle, Copying, Writing };
+
+    // runs on the worker thread, particles points to the mapped readback
+    bool write(const unsigned char * particles) const;
+
+protected:
+    State m_state;
+
+    std::string m_path;
+    CheckpointInfo m_info;
+
+    // layout of the readback, see AbstractParticleTechnique::readback
+    ParticleFormat m_format;
+    std::size_t m_readbackSize;
+
+    // copied at save time, the field keeps changing while the particles are copied
+    std::vector<float> m_forces;
+    glm::ivec3 m_forceFieldSize;
+
+    globjects::ref_ptr<globjects::Buffer> m_buffer;
+    globjects::ref_ptr<globjects::Sync> m_fence;
+
+    std::thread m_thread;
+    std::atomic<bool> m_written;
+    bool m_succeeded;
+};
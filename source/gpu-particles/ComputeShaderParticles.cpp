@@ -3,11 +3,18 @@
 
 #include <glbinding/gl/gl.h>
 
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <utility>
+
 #include <globjects/base/AbstractStringSource.h>
 
 #include <globjects/globjects.h>
+#include <globjects/logging.h>
 #include <globjects/Buffer.h>
 #include <globjects/Program.h>
+#include <globjects/Query.h>
 #include <globjects/VertexArray.h>
 #include <globjects/Shader.h>
 #include <globjects/Texture.h>
@@ -17,19 +24,47 @@
 
 #include <globjects/base/StringTemplate.h>
 
+#include "ParticleCulling.h"
+#include "ParticlePool.h"
+
 
 using namespace gl;
 using namespace glm;
 using namespace globjects;
 using namespace gloperate;
 
+namespace
+{
+
+// dispatches per timed candidate, after one untimed warm up dispatch
+const int tuningRuns = 4;
+
+const unsigned int minLocalSize = 32;
+const unsigned int particlesPerInvocation[] = { 1, 2, 4 };
+
+// work group size of particle-sort.comp, each group sorts twice as many keys in shared memory
+const unsigned int sortLocalSize = 512;
+const unsigned int sortLocalElements = 2 * sortLocalSize;
+
+// work group size of particle-interaction.comp, each group scans twice as many cells
+const unsigned int interactionLocalSize = 512;
+const unsigned int interactionScanElements = 2 * interactionLocalSize;
+
+}
+
+
+const char * ComputeShaderParticles::s_tuningCachePath = "gpu-particles-tuning.cache";
+
 ComputeShaderParticles::ComputeShaderParticles(
-    const std::vector<vec4> & positions
-,   const std::vector<vec4> & velocities
+    const SharedParticleState & initialState
 ,   const Texture & forces
 ,   const AbstractCameraCapability & cameraCap
 ,   const ivec2 viewport)
-: AbstractParticleTechnique(positions, velocities, forces, cameraCap, viewport)
+: AbstractParticleTechnique(initialState, forces, cameraCap, viewport)
+, m_workGroup{ 1, 1 }
+, m_sortKeysChunks(0)
+, m_gridTableSize(0)
+, m_gridChunks(0)
 {
 }
 
@@ -39,95 +74,818 @@ ComputeShaderParticles::~ComputeShaderParticles()
 
 void ComputeShaderParticles::initialize()
 {
-    static const int max_invocations = getInteger(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS);
-    static const ivec3 max_count = ivec3(
-        getInteger(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 0)
-      , getInteger(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 1)
-      , getInteger(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 2));
+    // the pool changes buffers and shaders, so it is only set up here
+    m_pooled = m_emission.mode != EmitterMode::Off;
 
-    const int groups = static_cast<int>(ceil(static_cast<float>(m_numParticles) / static_cast<float>(max_invocations)));
+    reset();
 
-    ivec3 workGroupSize;
-    workGroupSize.x = max(groups % max_count.x, 1);
-    workGroupSize.y = max(max(groups - workGroupSize.x * max_count.x, 1) % max_count.y, 1);
-    workGroupSize.z = max(max((groups - workGroupSize.x * max_count.x) - workGroupSize.y * max_count.y, 1) % max_count.z, 1);
+    // the tuning only depends on device and format, so it runs once and is looked up afterwards
+    WorkGroupTuningCache cache(s_tuningCachePath);
+    const std::string key = tuningKey();
 
-    m_workGroupSize = workGroupSize;
+    if (!cache.find(key, m_workGroup))
+    {
+        m_workGroup = tune();
 
-    assert(m_workGroupSize.x * m_workGroupSize.y * m_workGroupSize.z * max_invocations >= m_numParticles);
-    assert(m_workGroupSize.x * m_workGroupSize.y * m_workGroupSize.z * max_invocations < m_numParticles + max_invocations);
+        // timings of less than a chunk of particles are dominated by dispatch overhead, keep them out of the cache
+        if (hasExtension(GLextension::GL_ARB_timer_query) && m_numParticles >= ParticleState::chunkSize)
+            cache.store(key, m_workGroup);
+    }
+
+    debug() << "Compute step uses " << m_workGroup.localSize << " invocations per work group and "
+        << m_workGroup.particlesPerInvocation << " particles per invocation";
+
+    m_computeProgram = createComputeProgram(m_workGroup, m_pooled);
+
+    if (ParticleCulling::isSupported())
+        m_culling.reset(new ParticleCulling(ParticleCulling::Source::Buffers, m_format));
+
+    // the step's commands depend on the tuned work group
+    if (m_pooled)
+        resetPool();
+
+    AbstractParticleTechnique::initialize("data/gpu-particles/points.vert", DrawSource::Buffers);
+}
+
+void ComputeShaderParticles::reset()
+{
+    resizeChunks();
+    uploadParticles(0, m_numParticles);
+
+    // before initialize has tuned the step, it resets the pool itself
+    if (m_pooled && m_computeProgram)
+        resetPool();
+
+    AbstractParticleTechnique::reset();
+}
+
+void ComputeShaderParticles::release()
+{
+    m_chunks.clear();
+    m_computeProgram = nullptr;
+
+    for (auto & program : m_sortPrograms)
+        program = nullptr;
+    m_sortKeys = nullptr;
+    m_sortKeysChunks = 0;
+    m_sparePositions = nullptr;
+    m_spareVelocities = nullptr;
+    m_spareLifetimes = nullptr;
+
+    for (auto & program : m_interactionPrograms)
+        program = nullptr;
+    m_gridCells = nullptr;
+    m_gridBlockSums = nullptr;
+    m_gridParticleCells = nullptr;
+    m_gridPositions = nullptr;
+    m_gridTableSize = 0;
+    m_gridChunks = 0;
+
+    for (auto & program : m_poolPrograms)
+        program = nullptr;
+    m_pool = nullptr;
+    m_poolOffsets = nullptr;
+
+    AbstractParticleTechnique::release();
+}
+
+void ComputeShaderParticles::resizeChunks()
+{
+    const auto stride = static_cast<GLint>(particleFormatSize(m_format));
+    const auto size = static_cast<GLsizeiptr>(ParticleState::chunkSize * stride);
+
+    const unsigned int count = m_initialState->chunkCount();
+    const auto previous = static_cast<unsigned int>(m_chunks.size());
+
+    if (m_chunks.size() > count)
+        m_chunks.resize(count);
+
+    while (m_chunks.size() < count)
+    {
+        Chunk chunk;
+
+        chunk.positions = new Buffer();
+        chunk.positions->setData(size, nullptr, GL_STATIC_DRAW);
+        chunk.velocities = new Buffer();
+        chunk.velocities->setData(size, nullptr, GL_STATIC_DRAW);
+
+        if (m_pooled)
+        {
+            chunk.lifetimes = new Buffer();
+            chunk.lifetimes->setData(static_cast<GLsizeiptr>(ParticleState::chunkSize * sizeof(float)), nullptr, GL_STATIC_DRAW);
+        }
+
+        chunk.vao = new VertexArray();
+        chunk.vao->bind();
+
+        auto positionsBinding = chunk.vao->binding(0);
+        positionsBinding->setAttribute(0);
+        positionsBinding->setBuffer(chunk.positions, 0, stride);
+        setAttributeFormat(positionsBinding);
+        chunk.vao->enable(0);
+
+        auto velocitiesBinding = chunk.vao->binding(1);
+        velocitiesBinding->setAttribute(1);
+        velocitiesBinding->setBuffer(chunk.velocities, 0, stride);
+        setAttributeFormat(velocitiesBinding);
+        chunk.vao->enable(1);
+
+        chunk.vao->unbind();
+
+        m_chunks.push_back(chunk);
+    }
+
+    if (m_pooled && (previous != count || !m_pool))
+        resizePool(previous);
+}
+
+void ComputeShaderParticles::resizePool(const unsigned int previousChunks)
+{
+    static const unsigned int chunkSize = ParticleState::chunkSize;
+
+    const auto count = static_cast<unsigned int>(m_chunks.size());
+    const unsigned int stepGroupParticles = m_workGroup.localSize * m_workGroup.particlesPerInvocation;
+
+    ref_ptr<Buffer> pool = new Buffer();
+    pool->setData(std::vector<PoolChunk>(count, poolChunk(0, stepGroupParticles)), GL_DYNAMIC_COPY);
+
+    // particles uploaded to added chunks or to added slots of the last chunk are not alive,
+    // the emitters fill them later on
+    if (m_pool && previousChunks > 0)
+        m_pool->copySubData(pool, 0, 0, static_cast<GLsizeiptr>(std::min(previousChunks, count) * sizeof(PoolChunk)));
+
+    m_pool = pool;
+
+    if (!m_poolOffsets)
+        m_poolOffsets = new Buffer();
+    m_poolOffsets->setData(static_cast<GLsizeiptr>(count * (chunkSize + chunkSize / poolLocalSize) * sizeof(GLuint)), nullptr, GL_DYNAMIC_COPY);
+}
+
+void ComputeShaderParticles::resetPool()
+{
+    const unsigned int stepGroupParticles = m_workGroup.localSize * m_workGroup.particlesPerInvocation;
+
+    std::vector<PoolChunk> pool;
+    for (unsigned int i = 0; i < m_chunks.size(); ++i)
+        pool.push_back(poolChunk(m_initialState->chunkParticles(i), stepGroupParticles));
+
+    m_pool->setSubData(pool);
+}
+
+void ComputeShaderParticles::uploadChunk(const unsigned int chunk, const unsigned int begin, const unsigned int end)
+{
+    const ParticleState::Chunk & source = *m_initialState->chunks[chunk];
+
+    uploadEncoded(*m_chunks[chunk].positions, begin, source.positions.data() + begin, end - begin, fixedPositionRange);
+    uploadEncoded(*m_chunks[chunk].velocities, begin, source.velocities.data() + begin, end - begin, fixedVelocityRange);
+
+    if (!m_pooled)
+        return;
+
+    std::vector<float> lifetimes(end - begin);
+    for (unsigned int i = begin; i < end; ++i)
+        lifetimes[i - begin] = initialLifetime(m_emission, static_cast<std::uint64_t>(chunk) * ParticleState::chunkSize + i);
+
+    m_chunks[chunk].lifetimes->setSubData(static_cast<GLintptr>(begin * sizeof(float)), static_cast<GLsizeiptr>(lifetimes.size() * sizeof(float)), lifetimes.data());
+}
+
+void ComputeShaderParticles::readback(Buffer & buffer)
+{
+    const auto size = static_cast<GLsizeiptr>(ParticleState::chunkSize * particleFormatSize(m_format));
+    const auto velocities = static_cast<GLintptr>(m_chunks.size() * size);
+
+    // the copies read what the last dispatch wrote
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    for (unsigned int i = 0; i < m_chunks.size(); ++i)
+    {
+        m_chunks[i].positions->copySubData(&buffer, 0, i * size, size);
+        m_chunks[i].velocities->copySubData(&buffer, 0, velocities + i * size, size);
+    }
+}
+
+Buffer * ComputeShaderParticles::pool() const
+{
+    return m_pooled ? m_pool.get() : nullptr;
+}
+
+Program * ComputeShaderParticles::createComputeProgram(const WorkGroupConfig & config, const bool pooled) const
+{
+    Program * program = new Program();
 
-    m_computeProgram = new Program();
-    
     StringTemplate * stringTemplate = new StringTemplate(
         new File("data/gpu-particles/particle.comp"));
-    stringTemplate->replace("MAX_INVOCATION", max_invocations);
+    stringTemplate->replace("LOCAL_SIZE", static_cast<int>(config.localSize));
+    stringTemplate->replace("INVOCATION_PARTICLES", static_cast<int>(config.particlesPerInvocation));
+    stringTemplate->replace("FORMAT_INDEX", particleFormatIndex(m_format));
+    stringTemplate->replace("POOL_ENABLED", pooled ? 1 : 0);
     stringTemplate->update();
 
-    m_computeProgram->attach(new Shader(GL_COMPUTE_SHADER, stringTemplate));
+    program->attach(new Shader(GL_COMPUTE_SHADER, stringTemplate));
+    setDecodeUniforms(program);
 
-    m_positionsSSBO = new Buffer();
-    m_velocitiesSSBO = new Buffer();
+    return program;
+}
 
-    reset();
+void ComputeShaderParticles::dispatch(Program & program, const WorkGroupConfig & config, const float elapsed, const bool pooled)
+{
+    const unsigned int particlesPerGroup = config.localSize * config.particlesPerInvocation;
 
-    m_vao = new VertexArray();
-    m_vao->bind();
+    m_forces.bind();
+    program.setUniform("forces", 0);
+    program.setUniform("elapsed", elapsed);
+
+    program.use();
+
+    if (pooled)
+    {
+        m_pool->bindBase(GL_SHADER_STORAGE_BUFFER, 7);
+        m_pool->bind(GL_DISPATCH_INDIRECT_BUFFER);
+    }
 
-    auto positionsBinding = m_vao->binding(0);
-    positionsBinding->setAttribute(0);
-    positionsBinding->setBuffer(m_positionsSSBO, 0, sizeof(vec4));
-    positionsBinding->setFormat(4, GL_FLOAT, GL_FALSE, 0);
-    m_vao->enable(0);
+    for (unsigned int i = 0; i < m_chunks.size(); ++i)
+    {
+        const unsigned int count = m_initialState->chunkParticles(i);
 
-    auto velocitiesBinding = m_vao->binding(1);
-    velocitiesBinding->setAttribute(1);
-    velocitiesBinding->setBuffer(m_velocitiesSSBO, 0, sizeof(vec4));
-    velocitiesBinding->setFormat(4, GL_FLOAT, GL_FALSE, 0);
-    m_vao->enable(1);
+        m_chunks[i].positions->bindBase(GL_SHADER_STORAGE_BUFFER, 0);
+        m_chunks[i].velocities->bindBase(GL_SHADER_STORAGE_BUFFER, 1);
 
-    m_vao->unbind();
+        setEnsembleUniforms(&program, i);
 
+        // only the live particles of the pool are stepped, their count never leaves the gpu
+        if (pooled)
+        {
+            m_chunks[i].lifetimes->bindBase(GL_SHADER_STORAGE_BUFFER, 6);
 
-    AbstractParticleTechnique::initialize("data/gpu-particles/points.vert");
+            program.setUniform("chunk", i);
+            glDispatchComputeIndirect(poolCommand(i, offsetof(PoolChunk, stepGroups)));
+            continue;
+        }
+
+        // the last chunk is partially used, invocations beyond count return early
+        program.setUniform("count", count);
+        program.dispatchCompute((count + particlesPerGroup - 1) / particlesPerGroup, 1, 1);
+    }
+
+    // without a glFinish per frame, the next substep and the draw have to be ordered after the writes explicitly
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+    
+    program.release();
+
+    m_forces.unbind();
+
+    Buffer::unbind(GL_SHADER_STORAGE_BUFFER, 0);
+    Buffer::unbind(GL_SHADER_STORAGE_BUFFER, 1);
+
+    if (pooled)
+    {
+        Buffer::unbind(GL_SHADER_STORAGE_BUFFER, 6);
+        Buffer::unbind(GL_SHADER_STORAGE_BUFFER, 7);
+        Buffer::unbind(GL_DISPATCH_INDIRECT_BUFFER);
+    }
 }
 
-void ComputeShaderParticles::reset()
+WorkGroupConfig ComputeShaderParticles::tune()
 {
-    m_positionsSSBO->setData(m_positions, GL_STATIC_DRAW);
-    m_velocitiesSSBO->setData(m_velocities, GL_STATIC_DRAW);
+    const auto maxInvocations = static_cast<unsigned int>(getInteger(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS));
 
-    AbstractParticleTechnique::reset();
+    WorkGroupConfig best{ maxInvocations, 1 };
+
+    if (!hasExtension(GLextension::GL_ARB_timer_query))
+    {
+        warning() << "Timer queries not supported, compute work group size is not tuned.";
+        return best;
+    }
+
+    std::vector<unsigned int> localSizes;
+    for (unsigned int size = minLocalSize; size <= maxInvocations; size *= 2)
+        localSizes.push_back(size);
+    if (localSizes.empty() || localSizes.back() != maxInvocations)
+        localSizes.push_back(maxInvocations);
+
+    GLuint64 bestTime = std::numeric_limits<GLuint64>::max();
+
+    // timestamps, unlike an elapsed time query, do not collide with one the host may have open around the frame
+    ref_ptr<Query> start = new Query();
+    ref_ptr<Query> end = new Query();
+
+    for (const unsigned int localSize : localSizes)
+    {
+        for (const unsigned int particles : particlesPerInvocation)
+        {
+            const WorkGroupConfig config{ localSize, particles };
+            ref_ptr<Program> program = createComputeProgram(config, false);
+
+            // an elapsed time of zero leaves the particles in place, the tuning run does not disturb the simulation
+            dispatch(*program, config, 0.f, false);
+
+            start->counter(GL_TIMESTAMP);
+            for (int run = 0; run < tuningRuns; ++run)
+                dispatch(*program, config, 0.f, false);
+            end->counter(GL_TIMESTAMP);
+
+            const GLuint64 time = end->waitAndGet64(GL_QUERY_RESULT) - start->waitAndGet64(GL_QUERY_RESULT);
+
+            if (time < bestTime)
+            {
+                bestTime = time;
+                best = config;
+            }
+        }
+    }
+
+    debug() << "Tuned compute work group: " << best.localSize << " x " << best.particlesPerInvocation
+        << " at " << static_cast<double>(bestTime) * 1.0e-6 / tuningRuns << " ms per step";
+
+    return best;
+}
+
+std::string ComputeShaderParticles::tuningKey() const
+{
+    std::string key = renderer() + " / " + version() + " / format " + std::to_string(particleFormatIndex(m_format));
+
+    // keys are stored one per line, terminated by a tab
+    std::replace(key.begin(), key.end(), '\t', ' ');
+    std::replace(key.begin(), key.end(), '\n', ' ');
+
+    return key;
 }
 
 void ComputeShaderParticles::step(const float elapsed)
 {
-    m_positionsSSBO->bindBase(GL_SHADER_STORAGE_BUFFER, 0);
-    m_velocitiesSSBO->bindBase(GL_SHADER_STORAGE_BUFFER, 1);
+    if (m_interaction.mode != InteractionMode::None)
+        interact(elapsed);
 
-    m_forces.bind();
-    m_computeProgram->setUniform("forces", 0);
-    m_computeProgram->setUniform("elapsed", elapsed);
+    dispatch(*m_computeProgram, m_workGroup, elapsed, m_pooled);
 
-    m_computeProgram->use();
-    
-    m_computeProgram->dispatchCompute(m_workGroupSize);
-    
-    m_computeProgram->release();
+    if (m_pooled)
+    {
+        const std::uint64_t sequence = m_emissionClock.sequence();
+        compact(m_emissionClock.advance(m_emission, elapsed), sequence);
+    }
+}
 
-    m_forces.unbind();
+void ComputeShaderParticles::compact(const unsigned int emitCount, const std::uint64_t sequence)
+{
+    static const unsigned int chunkSize = ParticleState::chunkSize;
+
+    const auto chunkCount = static_cast<unsigned int>(m_chunks.size());
+
+    if (!m_poolPrograms[0])
+    {
+        for (unsigned int i = 0; i < m_poolPrograms.size(); ++i)
+            m_poolPrograms[i] = createPoolProgram(static_cast<PoolStage>(i));
+
+        createSpareBuffers();
+    }
+
+    for (auto & program : m_poolPrograms)
+        program->setUniform("blocksBegin", chunkCount * chunkSize);
+
+    Program & scan = *m_poolPrograms[static_cast<int>(PoolStage::Scan)];
+    Program & sums = *m_poolPrograms[static_cast<int>(PoolStage::Sums)];
+    Program & compaction = *m_poolPrograms[static_cast<int>(PoolStage::Compact)];
+
+    m_pool->bindBase(GL_SHADER_STORAGE_BUFFER, 7);
+    m_pool->bind(GL_DISPATCH_INDIRECT_BUFFER);
+    m_poolOffsets->bindBase(GL_SHADER_STORAGE_BUFFER, 2);
+
+    // the lifetimes were written by the step
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    // offsets of the survivors within their blocks and the survivors of each block
+    scan.use();
+    for (unsigned int i = 0; i < chunkCount; ++i)
+    {
+        m_chunks[i].lifetimes->bindBase(GL_SHADER_STORAGE_BUFFER, 6);
+
+        scan.setUniform("chunk", i);
+        scan.setUniform("capacity", m_initialState->chunkParticles(i));
+        glDispatchComputeIndirect(poolCommand(i, offsetof(PoolChunk, particleGroups)));
+    }
+
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    // block offsets, emitted particles per chunk and the commands of the next step
+    sums.setUniform("chunkCount", chunkCount);
+    sums.setUniform("particleCount", m_numParticles);
+    sums.setUniform("emitCount", emitCount);
+    sums.setUniform("stepGroupParticles", m_workGroup.localSize * m_workGroup.particlesPerInvocation);
+    sums.dispatchCompute(1, 1, 1);
+
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+
+    compaction.setUniform("emitters", std::max(m_emission.emitters, 1u));
+    compaction.setUniform("seed", m_emission.seed);
+    compaction.setUniform("sequenceBase", uvec2(static_cast<unsigned int>(sequence), static_cast<unsigned int>(sequence >> 32)));
+    compaction.setUniform("lifetime", m_emission.lifetime);
+
+    compaction.use();
+    for (unsigned int i = 0; i < chunkCount; ++i)
+    {
+        Chunk & chunk = m_chunks[i];
+
+        // also orders the writes to the spare buffers after the previous chunk's reads
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        chunk.positions->bindBase(GL_SHADER_STORAGE_BUFFER, 0);
+        chunk.velocities->bindBase(GL_SHADER_STORAGE_BUFFER, 1);
+        chunk.lifetimes->bindBase(GL_SHADER_STORAGE_BUFFER, 6);
+        m_sparePositions->bindBase(GL_SHADER_STORAGE_BUFFER, 3);
+        m_spareVelocities->bindBase(GL_SHADER_STORAGE_BUFFER, 4);
+        m_spareLifetimes->bindBase(GL_SHADER_STORAGE_BUFFER, 5);
+
+        compaction.setUniform("chunk", i);
+        glDispatchComputeIndirect(poolCommand(i, offsetof(PoolChunk, compactGroups)));
+
+        swapSpareBuffers(i);
+    }
+
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+
+    compaction.release();
+
+    for (GLuint index = 0; index < 8; ++index)
+        Buffer::unbind(GL_SHADER_STORAGE_BUFFER, index);
+    Buffer::unbind(GL_DISPATCH_INDIRECT_BUFFER);
+}
+
+Program * ComputeShaderParticles::createPoolProgram(const PoolStage stage) const
+{
+    Program * program = new Program();
+
+    StringTemplate * stringTemplate = new StringTemplate(
+        new File("data/gpu-particles/particle-pool.comp"));
+    stringTemplate->replace("POOL_STAGE", static_cast<int>(stage));
+    stringTemplate->replace("FORMAT_INDEX", particleFormatIndex(m_format));
+    stringTemplate->update();
+
+    program->attach(new Shader(GL_COMPUTE_SHADER, stringTemplate));
+
+    const unsigned int chunkSize = ParticleState::chunkSize;
+    program->setUniform("chunkSize", chunkSize);
+
+    if (stage == PoolStage::Compact)
+        setDecodeUniforms(program);
+
+    return program;
+}
+
+void ComputeShaderParticles::interact(const float elapsed)
+{
+    static const unsigned int chunkSize = ParticleState::chunkSize;
+
+    const auto chunkCount = static_cast<unsigned int>(m_chunks.size());
+    const unsigned int tableSize = interactionTableSize(m_numParticles);
+    const unsigned int blockCount = tableSize / interactionScanElements;
+
+    if (!m_interactionPrograms[0])
+    {
+        for (unsigned int i = 0; i < m_interactionPrograms.size(); ++i)
+            m_interactionPrograms[i] = createInteractionProgram(static_cast<InteractionStage>(i));
+
+        m_gridCells = new Buffer();
+        m_gridBlockSums = new Buffer();
+        m_gridParticleCells = new Buffer();
+        m_gridPositions = new Buffer();
+    }
+
+    if (m_gridTableSize != tableSize)
+    {
+        m_gridCells->setData(static_cast<GLsizeiptr>(tableSize * sizeof(GLuint)), nullptr, GL_DYNAMIC_COPY);
+        // the scan stores the particle count behind the block sums
+        m_gridBlockSums->setData(static_cast<GLsizeiptr>((blockCount + 1) * sizeof(GLuint)), nullptr, GL_DYNAMIC_COPY);
+        m_gridTableSize = tableSize;
+    }
+
+    if (m_gridChunks != chunkCount)
+    {
+        m_gridParticleCells->setData(static_cast<GLsizeiptr>(chunkCount * chunkSize * sizeof(uvec2)), nullptr, GL_DYNAMIC_COPY);
+        m_gridPositions->setData(static_cast<GLsizeiptr>(chunkCount * chunkSize * sizeof(vec4)), nullptr, GL_DYNAMIC_COPY);
+        m_gridChunks = chunkCount;
+    }
+
+    for (auto & program : m_interactionPrograms)
+    {
+        program->setUniform("radius", m_interaction.radius);
+        program->setUniform("tableMask", tableSize - 1);
+    }
+
+    Program & count = *m_interactionPrograms[static_cast<int>(InteractionStage::Count)];
+    Program & scanCells = *m_interactionPrograms[static_cast<int>(InteractionStage::ScanCells)];
+    Program & scanSums = *m_interactionPrograms[static_cast<int>(InteractionStage::ScanSums)];
+    Program & scatter = *m_interactionPrograms[static_cast<int>(InteractionStage::Scatter)];
+    Program & interaction = *m_interactionPrograms[static_cast<int>(InteractionStage::Interact)];
+
+    const GLuint zero = 0;
+    m_gridCells->clearData(GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+
+    m_gridCells->bindBase(GL_SHADER_STORAGE_BUFFER, 2);
+    m_gridBlockSums->bindBase(GL_SHADER_STORAGE_BUFFER, 3);
+    m_gridParticleCells->bindBase(GL_SHADER_STORAGE_BUFFER, 4);
+    m_gridPositions->bindBase(GL_SHADER_STORAGE_BUFFER, 5);
+
+    if (m_pooled)
+    {
+        m_pool->bindBase(GL_SHADER_STORAGE_BUFFER, 7);
+        m_pool->bind(GL_DISPATCH_INDIRECT_BUFFER);
+    }
+
+    // runs a per particle stage on each chunk
+    const auto dispatchChunks = [this](Program & program)
+    {
+        program.use();
+
+        for (unsigned int i = 0; i < m_chunks.size(); ++i)
+        {
+            const unsigned int particles = m_initialState->chunkParticles(i);
+
+            m_chunks[i].positions->bindBase(GL_SHADER_STORAGE_BUFFER, 0);
+            m_chunks[i].velocities->bindBase(GL_SHADER_STORAGE_BUFFER, 1);
+
+            program.setUniform("chunk", i);
+
+            if (m_pooled)
+            {
+                glDispatchComputeIndirect(poolCommand(i, offsetof(PoolChunk, particleGroups)));
+                continue;
+            }
+
+            program.setUniform("count", particles);
+            program.dispatchCompute((particles + interactionLocalSize - 1) / interactionLocalSize, 1, 1);
+        }
+
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    };
+
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    dispatchChunks(count);
+
+    // exclusive scan of the counts into cell starts, per block of cells and over the block sums
+    scanCells.use();
+    scanCells.dispatchCompute(blockCount, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    scanSums.use();
+    scanSums.setUniform("blockCount", blockCount);
+    scanSums.dispatchCompute(1, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    dispatchChunks(scatter);
+
+    interaction.setUniform("mode", static_cast<int>(m_interaction.mode));
+    interaction.setUniform("strength", m_interaction.strength);
+    interaction.setUniform("elapsed", elapsed);
+    dispatchChunks(interaction);
+
+    interaction.release();
+
+    for (GLuint index = 0; index < 8; ++index)
+        Buffer::unbind(GL_SHADER_STORAGE_BUFFER, index);
+    Buffer::unbind(GL_DISPATCH_INDIRECT_BUFFER);
+}
+
+Program * ComputeShaderParticles::createInteractionProgram(const InteractionStage stage) const
+{
+    Program * program = new Program();
+
+    StringTemplate * stringTemplate = new StringTemplate(
+        new File("data/gpu-particles/particle-interaction.comp"));
+    stringTemplate->replace("INTERACTION_STAGE", static_cast<int>(stage));
+    stringTemplate->replace("FORMAT_INDEX", particleFormatIndex(m_format));
+    stringTemplate->replace("POOL_ENABLED", m_pooled ? 1 : 0);
+    stringTemplate->update();
+
+    program->attach(new Shader(GL_COMPUTE_SHADER, stringTemplate));
+
+    const unsigned int chunkSize = ParticleState::chunkSize;
+    program->setUniform("chunkSize", chunkSize);
+    setDecodeUniforms(program);
+
+    return program;
+}
+
+void ComputeShaderParticles::sort()
+{
+    static const unsigned int chunkSize = ParticleState::chunkSize;
+    static_assert(chunkSize % sortLocalElements == 0, "work groups must not span chunks");
+
+    const auto chunkCount = static_cast<unsigned int>(m_chunks.size());
+
+    if (!m_sortPrograms[0])
+    {
+        for (unsigned int i = 0; i < m_sortPrograms.size(); ++i)
+            m_sortPrograms[i] = createSortProgram(static_cast<SortStage>(i));
+
+        createSpareBuffers();
+        m_sortKeys = new Buffer();
+    }
+
+    if (m_sortKeysChunks != chunkCount)
+    {
+        m_sortKeys->setData(static_cast<GLsizeiptr>(chunkCount * chunkSize * sizeof(uvec2)), nullptr, GL_DYNAMIC_COPY);
+        m_sortKeysChunks = chunkCount;
+    }
+
+    Program & keys = *m_sortPrograms[static_cast<int>(SortStage::Keys)];
+    Program & localSort = *m_sortPrograms[static_cast<int>(SortStage::LocalSort)];
+    Program & globalMerge = *m_sortPrograms[static_cast<int>(SortStage::GlobalMerge)];
+    Program & permute = *m_sortPrograms[static_cast<int>(SortStage::Permute)];
+
+    m_sortKeys->bindBase(GL_SHADER_STORAGE_BUFFER, 2);
+
+    if (m_pooled)
+    {
+        m_pool->bindBase(GL_SHADER_STORAGE_BUFFER, 7);
+        m_pool->bind(GL_DISPATCH_INDIRECT_BUFFER);
+    }
+
+    // keys of the whole chunk, unused entries of the last chunk sort behind its particles
+    keys.use();
+    for (unsigned int i = 0; i < chunkCount; ++i)
+    {
+        m_chunks[i].positions->bindBase(GL_SHADER_STORAGE_BUFFER, 0);
+
+        keys.setUniform("chunk", i);
+        keys.setUniform("count", m_initialState->chunkParticles(i));
+        keys.dispatchCompute(chunkSize / sortLocalSize, 1, 1);
+    }
+
+    // bitonic sort of all chunks at once, strides within a work group's keys run in shared memory
+    const unsigned int groups = chunkSize / sortLocalElements;
+
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    localSort.use();
+    localSort.setUniform("blockSize", 0u);
+    localSort.dispatchCompute(groups, chunkCount, 1);
+
+    for (unsigned int blockSize = 2 * sortLocalElements; blockSize <= chunkSize; blockSize *= 2)
+    {
+        globalMerge.use();
+        globalMerge.setUniform("blockSize", blockSize);
+
+        for (unsigned int stride = blockSize / 2; stride >= sortLocalElements; stride /= 2)
+        {
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+            globalMerge.setUniform("stride", stride);
+            globalMerge.dispatchCompute(groups, chunkCount, 1);
+        }
+
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        localSort.use();
+        localSort.setUniform("blockSize", blockSize);
+        localSort.dispatchCompute(groups, chunkCount, 1);
+    }
+
+    // gathers each chunk into the spare buffers, which then take the place of the chunk's buffers
+    permute.use();
+
+    for (unsigned int i = 0; i < chunkCount; ++i)
+    {
+        Chunk & chunk = m_chunks[i];
+        const unsigned int count = m_initialState->chunkParticles(i);
+
+        // also orders the writes to the spare buffers after the previous chunk's reads
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        chunk.positions->bindBase(GL_SHADER_STORAGE_BUFFER, 0);
+        chunk.velocities->bindBase(GL_SHADER_STORAGE_BUFFER, 1);
+        m_sparePositions->bindBase(GL_SHADER_STORAGE_BUFFER, 3);
+        m_spareVelocities->bindBase(GL_SHADER_STORAGE_BUFFER, 4);
+
+        permute.setUniform("chunk", i);
+
+        if (m_pooled)
+        {
+            chunk.lifetimes->bindBase(GL_SHADER_STORAGE_BUFFER, 6);
+            m_spareLifetimes->bindBase(GL_SHADER_STORAGE_BUFFER, 5);
+
+            glDispatchComputeIndirect(poolCommand(i, offsetof(PoolChunk, particleGroups)));
+        }
+        else
+        {
+            permute.setUniform("count", count);
+            permute.dispatchCompute((count + sortLocalSize - 1) / sortLocalSize, 1, 1);
+        }
+
+        swapSpareBuffers(i);
+    }
+
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+
+    permute.release();
+
+    for (GLuint index = 0; index < 8; ++index)
+        Buffer::unbind(GL_SHADER_STORAGE_BUFFER, index);
+    Buffer::unbind(GL_DISPATCH_INDIRECT_BUFFER);
+}
+
+void ComputeShaderParticles::createSpareBuffers()
+{
+    static const unsigned int chunkSize = ParticleState::chunkSize;
+
+    const auto stride = static_cast<GLsizeiptr>(particleFormatSize(m_format));
+
+    if (!m_sparePositions)
+    {
+        m_sparePositions = new Buffer();
+        m_sparePositions->setData(chunkSize * stride, nullptr, GL_DYNAMIC_COPY);
+        m_spareVelocities = new Buffer();
+        m_spareVelocities->setData(chunkSize * stride, nullptr, GL_DYNAMIC_COPY);
+    }
+
+    if (m_pooled && !m_spareLifetimes)
+    {
+        m_spareLifetimes = new Buffer();
+        m_spareLifetimes->setData(static_cast<GLsizeiptr>(chunkSize * sizeof(float)), nullptr, GL_DYNAMIC_COPY);
+    }
+}
+
+void ComputeShaderParticles::swapSpareBuffers(const unsigned int index)
+{
+    const auto stride = static_cast<GLint>(particleFormatSize(m_format));
+
+    Chunk & chunk = m_chunks[index];
+
+    std::swap(chunk.positions, m_sparePositions);
+    std::swap(chunk.velocities, m_spareVelocities);
 
-    m_positionsSSBO->unbind(GL_SHADER_STORAGE_BUFFER, 0);
-    m_velocitiesSSBO->unbind(GL_SHADER_STORAGE_BUFFER, 1);
+    if (m_pooled)
+        std::swap(chunk.lifetimes, m_spareLifetimes);
+
+    chunk.vao->binding(0)->setBuffer(chunk.positions, 0, stride);
+    chunk.vao->binding(1)->setBuffer(chunk.velocities, 0, stride);
+}
+
+Program * ComputeShaderParticles::createSortProgram(const SortStage stage) const
+{
+    Program * program = new Program();
+
+    StringTemplate * stringTemplate = new StringTemplate(
+        new File("data/gpu-particles/particle-sort.comp"));
+    stringTemplate->replace("SORT_STAGE", static_cast<int>(stage));
+    stringTemplate->replace("FORMAT_INDEX", particleFormatIndex(m_format));
+    stringTemplate->replace("POOL_ENABLED", m_pooled ? 1 : 0);
+    stringTemplate->update();
+
+    program->attach(new Shader(GL_COMPUTE_SHADER, stringTemplate));
+    const unsigned int chunkSize = ParticleState::chunkSize;
+    program->setUniform("chunkSize", chunkSize);
+
+    if (stage == SortStage::Keys)
+        setDecodeUniforms(program);
+
+    return program;
 }
 
 void ComputeShaderParticles::draw_impl()
 {
+    const bool culled = m_culling && m_cullingEnabled;
+    const bool instanced = m_renderPath == RenderPath::InstancedQuads;
+
+    if (culled)
+    {
+        m_culling->begin(static_cast<unsigned int>(m_chunks.size()), m_viewProjection, m_interpolation, m_pooled ? m_pool.get() : nullptr);
+        for (unsigned int i = 0; i < m_chunks.size(); ++i)
+            m_culling->cull(i, m_initialState->chunkParticles(i), *m_chunks[i].positions, *m_chunks[i].velocities);
+        m_culling->end();
+    }
+    else if (instanced)
+        // the steps only order their writes before vertex attribute fetches
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
     m_drawProgram->use();
 
-    m_vao->bind();
-    m_vao->drawArrays(GL_POINTS, 0, m_numParticles);
-    m_vao->unbind();
+    if (m_pooled && !culled)
+        m_pool->bind(GL_DRAW_INDIRECT_BUFFER);
+
+    for (unsigned int i = 0; i < m_chunks.size(); ++i)
+    {
+        m_chunks[i].vao->bind();
+
+        if (instanced)
+        {
+            setInstancedParticles(*m_chunks[i].positions, *m_chunks[i].velocities);
+            setInstancedIndices(culled ? m_culling->indices() : nullptr, i * ParticleState::chunkSize);
+        }
+
+        if (culled && instanced)
+            m_culling->drawInstanced(*m_chunks[i].vao, i);
+        else if (culled)
+            m_culling->draw(*m_chunks[i].vao, i);
+        else if (m_pooled && instanced)
+            m_chunks[i].vao->drawArraysIndirect(GL_TRIANGLE_STRIP, reinterpret_cast<const void *>(poolCommand(i, offsetof(PoolChunk, quads))));
+        else if (m_pooled)
+            m_chunks[i].vao->drawArraysIndirect(GL_POINTS, reinterpret_cast<const void *>(poolCommand(i, offsetof(PoolChunk, draw))));
+        else if (instanced)
+            m_chunks[i].vao->drawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, m_initialState->chunkParticles(i));
+        else
+            m_chunks[i].vao->drawArrays(GL_POINTS, 0, m_initialState->chunkParticles(i));
+    }
+    VertexArray::unbind();
+
+    if (m_pooled && !culled)
+        Buffer::unbind(GL_DRAW_INDIRECT_BUFFER);
 
     m_drawProgram->release();
 }
@@ -1,8 +1,14 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
 #include <globjects/base/ref_ptr.h>
 
 #include "AbstractParticleTechnique.h"
+#include "WorkGroupTuning.h"
 
 
 namespace globjects
@@ -14,10 +20,13 @@ namespace globjects
 
 class ComputeShaderParticles : public AbstractParticleTechnique
 {
+public:
+    // tuned work group configurations, relative to the working directory like the shader sources
+    static const char * s_tuningCachePath;
+
 public:
     ComputeShaderParticles(
-        const std::vector<glm::vec4> & positions
-    ,   const std::vector<glm::vec4> & velocities
+        const SharedParticleState & initialState
     ,   const globjects::Texture & forces
     ,   const gloperate::AbstractCameraCapability & cameraCap
     ,   const glm::ivec2 viewport);
@@ -26,19 +35,92 @@ public:
 
     virtual void initialize() override;
     virtual void reset() override;
+    virtual void release() override;
 
     virtual void step(float elapsed) override;
+    virtual void sort() override;
+
+    virtual void readback(globjects::Buffer & buffer) override;
+    virtual globjects::Buffer * pool() const override;
     
 protected:
     virtual void draw_impl() override;
 
+    virtual void resizeChunks() override;
+    virtual void uploadChunk(unsigned int chunk, unsigned int begin, unsigned int end) override;
+
+    // the tuning always uses programs without the pool, they take their particle counts from the initial state
+    globjects::Program * createComputeProgram(const WorkGroupConfig & config, bool pooled) const;
+    void dispatch(globjects::Program & program, const WorkGroupConfig & config, float elapsed, bool pooled);
+
+    // times candidate configurations on the current particles and returns the fastest
+    WorkGroupConfig tune();
+    std::string tuningKey() const;
+
+    // stages of particle-sort.comp
+    enum class SortStage { Keys, LocalSort, GlobalMerge, Permute };
+    globjects::Program * createSortProgram(SortStage stage) const;
+
+    // stages of particle-interaction.comp
+    enum class InteractionStage { Count, ScanCells, ScanSums, Scatter, Interact };
+    globjects::Program * createInteractionProgram(InteractionStage stage) const;
+    // bins the particles into the hash grid and adds the interaction to their velocities
+    void interact(float elapsed);
+
+    // stages of particle-pool.comp
+    enum class PoolStage { Scan, Sums, Compact };
+    globjects::Program * createPoolProgram(PoolStage stage) const;
+    // moves the surviving particles of each chunk to its front and emits into the free slots,
+    // numbering the emitted particles from sequence on
+    void compact(unsigned int emitCount, std::uint64_t sequence);
+    // matches the pool to the chunks, added chunks start out free
+    void resizePool(unsigned int previousChunks);
+    // marks all particles of the initial state alive
+    void resetPool();
+
+    // the sort and the compaction write a chunk into the spare buffers and swap them with the chunk's
+    void createSpareBuffers();
+    void swapSpareBuffers(unsigned int chunk);
+
 protected:
-    globjects::ref_ptr<globjects::Buffer> m_positionsSSBO;
-    globjects::ref_ptr<globjects::Buffer> m_velocitiesSSBO;
+    struct Chunk
+    {
+        globjects::ref_ptr<globjects::Buffer> positions;
+        globjects::ref_ptr<globjects::Buffer> velocities;
+        // remaining seconds of each particle, only allocated for the pool
+        globjects::ref_ptr<globjects::Buffer> lifetimes;
+
+        globjects::ref_ptr<globjects::VertexArray> vao;
+    };
+
+    std::vector<Chunk> m_chunks;
 
     globjects::ref_ptr<globjects::Program> m_computeProgram;
 
-    globjects::ref_ptr<globjects::VertexArray> m_vao;
+    WorkGroupConfig m_workGroup;
+
+    // created with the first sort
+    std::array<globjects::ref_ptr<globjects::Program>, 4> m_sortPrograms;
+    // morton code and index of each particle, chunk after chunk
+    globjects::ref_ptr<globjects::Buffer> m_sortKeys;
+    unsigned int m_sortKeysChunks;
+
+    globjects::ref_ptr<globjects::Buffer> m_sparePositions;
+    globjects::ref_ptr<globjects::Buffer> m_spareVelocities;
+    globjects::ref_ptr<globjects::Buffer> m_spareLifetimes;
+
+    // created with the first interaction, see CpuInteractionGrid for the algorithm
+    std::array<globjects::ref_ptr<globjects::Program>, 5> m_interactionPrograms;
+    globjects::ref_ptr<globjects::Buffer> m_gridCells;
+    globjects::ref_ptr<globjects::Buffer> m_gridBlockSums;
+    globjects::ref_ptr<globjects::Buffer> m_gridParticleCells;
+    globjects::ref_ptr<globjects::Buffer> m_gridPositions;
+    unsigned int m_gridTableSize;
+    unsigned int m_gridChunks;
 
-    glm::uvec3 m_workGroupSize;
+    // created with the first compaction, see particle-pool.inc for the state of each chunk
+    std::array<globjects::ref_ptr<globjects::Program>, 3> m_poolPrograms;
+    globjects::ref_ptr<globjects::Buffer> m_pool;
+    // offset of each surviving particle within its block and of each block within its chunk
+    globjects::ref_ptr<globjects::Buffer> m_poolOffsets;
 };
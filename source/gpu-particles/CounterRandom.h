@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+
+// Philox4x32-10 counter-based random number generator (Salmon et al., "Parallel Random Numbers:
+// As Easy as 1, 2, 3"). Each block of four numbers is a pure function of key and counter, so any
+// element of a random sequence can be computed on any thread without shared state, and parallel
+// fills are bit-identical regardless of thread count or chunking.
+class Philox4x32
+{
+public:
+    struct Block
+    {
+        std::uint32_t x[4];
+    };
+
+public:
+    explicit Philox4x32(const std::uint64_t seed)
+    : m_key{ static_cast<std::uint32_t>(seed), static_cast<std::uint32_t>(seed >> 32) }
+    {
+    }
+
+    Block operator()(std::uint32_t c0, std::uint32_t c1, std::uint32_t c2, std::uint32_t c3) const
+    {
+        std::uint32_t k0 = m_key[0];
+        std::uint32_t k1 = m_key[1];
+
+        for (int round = 0; round < 10; ++round)
+        {
+            const std::uint64_t p0 = static_cast<std::uint64_t>(0xD2511F53u) * c0;
+            const std::uint64_t p1 = static_cast<std::uint64_t>(0xCD9E8D57u) * c2;
+
+            const std::uint32_t hi0 = static_cast<std::uint32_t>(p0 >> 32);
+            const std::uint32_t hi1 = static_cast<std::uint32_t>(p1 >> 32);
+
+            c0 = hi1 ^ c1 ^ k0;
+            c1 = static_cast<std::uint32_t>(p1);
+            c2 = hi0 ^ c3 ^ k1;
+            c3 = static_cast<std::uint32_t>(p0);
+
+            k0 += 0x9E3779B9u;
+            k1 += 0xBB67AE85u;
+        }
+
+        return Block{ { c0, c1, c2, c3 } };
+    }
+
+    // counter for element index of an independent stream, e.g., one per initialized quantity
+    Block operator()(const std::uint64_t index, const std::uint32_t stream) const
+    {
+        return (*this)(static_cast<std::uint32_t>(index), static_cast<std::uint32_t>(index >> 32), stream, 0u);
+    }
+
+    // uniform float in [0, 1) from the upper 24 bits
+    static float uniform(const std::uint32_t x)
+    {
+        return static_cast<float>(x >> 8) * (1.f / 16777216.f);
+    }
+
+    // uniformly distributed point on a sphere, counterpart of glm::sphericalRand
+    glm::vec3 sphericalRand(const std::uint64_t index, const std::uint32_t stream, const float radius) const
+    {
+        const Block block = (*this)(index, stream);
+
+        const float z = 2.f * uniform(block.x[0]) - 1.f;
+        const float phi = 6.28318530718f * uniform(block.x[1]);
+        const float r = std::sqrt(glm::max(1.f - z * z, 0.f));
+
+        return glm::vec3(r * std::cos(phi), r * std::sin(phi), z) * radius;
+    }
+
+protected:
+    std::uint32_t m_key[2];
+};
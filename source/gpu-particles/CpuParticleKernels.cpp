@@ -0,0 +1,545 @@
+#include "CpuParticleKernels.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CPU_KERNEL_X86
+#endif
+
+#ifdef CPU_KERNEL_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang only emit SSE/AVX instructions for functions that opt into the instruction set,
+// which keeps the rest of the library runnable on any CPU of the target architecture.
+#if defined(__GNUC__) || defined(__clang__)
+#define CPU_KERNEL_TARGET(isa) __attribute__((target(isa)))
+#else
+#define CPU_KERNEL_TARGET(isa)
+#endif
+
+
+namespace
+{
+
+// keep in sync with data/gpu-particles/particle-step.inc
+const float gravity = 1.0f;
+const float friction = 0.2f;
+
+
+// Texel space coordinate of the force lookup at texture coordinate p * 0.2 + 0.5,
+// resolved the way GL_LINEAR filtering with GL_CLAMP_TO_EDGE wrapping does.
+inline void texelRange(const float p, const int size, int & i0, int & i1, float & t)
+{
+    float s = (p * 0.2f + 0.5f) * static_cast<float>(size) - 0.5f;
+    s = s > 0.f ? s : 0.f;
+    s = s < static_cast<float>(size - 1) ? s : static_cast<float>(size - 1);
+
+    i0 = static_cast<int>(s);
+    i1 = i0 + 1 < size ? i0 + 1 : size - 1;
+    t  = s - static_cast<float>(i0);
+}
+
+inline float lerp(const float a, const float b, const float t)
+{
+    return a + (b - a) * t;
+}
+
+inline void sampleForce(const CpuForceField & field, const float px, const float py, const float pz,
+    float & fx, float & fy, float & fz)
+{
+    int x0, x1, y0, y1, z0, z1;
+    float tx, ty, tz;
+
+    texelRange(px, field.width,  x0, x1, tx);
+    texelRange(py, field.height, y0, y1, ty);
+    texelRange(pz, field.depth,  z0, z1, tz);
+
+    const int w  = field.width;
+    const int wh = field.width * field.height;
+
+    const int i000 = 3 * (z0 * wh + y0 * w + x0), i100 = 3 * (z0 * wh + y0 * w + x1);
+    const int i010 = 3 * (z0 * wh + y1 * w + x0), i110 = 3 * (z0 * wh + y1 * w + x1);
+    const int i001 = 3 * (z1 * wh + y0 * w + x0), i101 = 3 * (z1 * wh + y0 * w + x1);
+    const int i011 = 3 * (z1 * wh + y1 * w + x0), i111 = 3 * (z1 * wh + y1 * w + x1);
+
+    float f[3];
+    for (int c = 0; c < 3; ++c)
+    {
+        const float * d = field.forces + c;
+
+        const float c00 = lerp(d[i000], d[i100], tx);
+        const float c10 = lerp(d[i010], d[i110], tx);
+        const float c01 = lerp(d[i001], d[i101], tx);
+        const float c11 = lerp(d[i011], d[i111], tx);
+
+        f[c] = lerp(lerp(c00, c10, ty), lerp(c01, c11, ty), tz);
+    }
+
+    fx = f[0];
+    fy = f[1];
+    fz = f[2];
+}
+
+inline void stepParticle(float & p, float & v, const float force, const float t, const float centralGravity)
+{
+    const float g = -p * (p < 0.f ? -p : p); // sign(-p) * (p * p), gravity to center
+    const float f = (g * (gravity * centralGravity) + force) - (v * friction);
+
+    p = p + (v * t) + (0.5f * f * t * t);
+    v = v + (f * t);
+}
+
+void stepScalar(const CpuParticleArrays & particles, const std::size_t begin, const std::size_t end,
+    const CpuForceField & field, const float elapsed, const float centralGravity)
+{
+    for (std::size_t i = begin; i < end; ++i)
+    {
+        float fx, fy, fz;
+        sampleForce(field, particles.px[i], particles.py[i], particles.pz[i], fx, fy, fz);
+
+        stepParticle(particles.px[i], particles.vx[i], fx, elapsed, centralGravity);
+        stepParticle(particles.py[i], particles.vy[i], fy, elapsed, centralGravity);
+        stepParticle(particles.pz[i], particles.vz[i], fz, elapsed, centralGravity);
+    }
+}
+
+// the indices are written unconditionally and only kept by advancing count, which avoids a branch per particle
+std::size_t cullScalar(const CpuParticleArrays & particles, const std::size_t begin, const std::size_t end,
+    const float * m, const float interpolation, const std::uint32_t base, std::uint32_t * indices)
+{
+    std::size_t count = 0;
+
+    for (std::size_t i = begin; i < end; ++i)
+    {
+        const float x = particles.px[i] + particles.vx[i] * interpolation;
+        const float y = particles.py[i] + particles.vy[i] * interpolation;
+        const float z = particles.pz[i] + particles.vz[i] * interpolation;
+
+        const float cx = m[0] * x + m[4] * y + m[8]  * z + m[12];
+        const float cy = m[1] * x + m[5] * y + m[9]  * z + m[13];
+        const float cw = m[3] * x + m[7] * y + m[11] * z + m[15];
+
+        const bool visible = cw > 0.f && (cx < 0.f ? -cx : cx) < cw && (cy < 0.f ? -cy : cy) < cw;
+
+        indices[count] = base + static_cast<std::uint32_t>(i);
+        count += visible ? 1 : 0;
+    }
+
+    return count;
+}
+
+
+#ifdef CPU_KERNEL_X86
+
+// The vector samplers compute the linear texel index in float, which is exact for fields up to 256^3.
+
+CPU_KERNEL_TARGET("sse2")
+inline __m128 texelCoordSSE2(const __m128 p, const int size)
+{
+    const __m128 s = _mm_sub_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(p, _mm_set1_ps(0.2f)), _mm_set1_ps(0.5f)),
+        _mm_set1_ps(static_cast<float>(size))), _mm_set1_ps(0.5f));
+
+    // _mm_max_ps returns its second operand for NaN input
+    return _mm_min_ps(_mm_max_ps(s, _mm_setzero_ps()), _mm_set1_ps(static_cast<float>(size - 1)));
+}
+
+CPU_KERNEL_TARGET("sse2")
+inline __m128 lerpSSE2(const __m128 a, const __m128 b, const __m128 t)
+{
+    return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), t));
+}
+
+CPU_KERNEL_TARGET("sse2")
+inline void sampleForcesSSE2(const CpuForceField & field, const __m128 px, const __m128 py, const __m128 pz,
+    __m128 & fx, __m128 & fy, __m128 & fz)
+{
+    const __m128 sx = texelCoordSSE2(px, field.width);
+    const __m128 sy = texelCoordSSE2(py, field.height);
+    const __m128 sz = texelCoordSSE2(pz, field.depth);
+
+    // coordinates are non-negative, so truncation equals floor
+    const __m128 x0 = _mm_cvtepi32_ps(_mm_cvttps_epi32(sx));
+    const __m128 y0 = _mm_cvtepi32_ps(_mm_cvttps_epi32(sy));
+    const __m128 z0 = _mm_cvtepi32_ps(_mm_cvttps_epi32(sz));
+
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 w  = _mm_set1_ps(static_cast<float>(field.width));
+    const __m128 wh = _mm_set1_ps(static_cast<float>(field.width * field.height));
+
+    const __m128 dx = _mm_sub_ps(_mm_min_ps(_mm_add_ps(x0, one), _mm_set1_ps(static_cast<float>(field.width  - 1))), x0);
+    const __m128 dy = _mm_sub_ps(_mm_min_ps(_mm_add_ps(y0, one), _mm_set1_ps(static_cast<float>(field.height - 1))), y0);
+    const __m128 dz = _mm_sub_ps(_mm_min_ps(_mm_add_ps(z0, one), _mm_set1_ps(static_cast<float>(field.depth  - 1))), z0);
+
+    const __m128i base = _mm_cvttps_epi32(_mm_add_ps(_mm_add_ps(_mm_mul_ps(z0, wh), _mm_mul_ps(y0, w)), x0));
+    const __m128i ox = _mm_cvttps_epi32(dx);
+    const __m128i oy = _mm_cvttps_epi32(_mm_mul_ps(dy, w));
+    const __m128i oz = _mm_cvttps_epi32(_mm_mul_ps(dz, wh));
+
+    __m128i corners[8];
+    corners[0] = base;
+    corners[1] = _mm_add_epi32(base, ox);
+    corners[2] = _mm_add_epi32(base, oy);
+    corners[3] = _mm_add_epi32(corners[1], oy);
+    corners[4] = _mm_add_epi32(base, oz);
+    corners[5] = _mm_add_epi32(corners[1], oz);
+    corners[6] = _mm_add_epi32(corners[2], oz);
+    corners[7] = _mm_add_epi32(corners[3], oz);
+
+    // SSE2 has no gather, so the 8 corners of all 4 lanes are fetched through an index table
+    alignas(16) int indices[8][4];
+    for (int i = 0; i < 8; ++i)
+        _mm_store_si128(reinterpret_cast<__m128i *>(indices[i]),
+            _mm_add_epi32(_mm_add_epi32(corners[i], corners[i]), corners[i]));
+
+    const __m128 tx = _mm_sub_ps(sx, x0);
+    const __m128 ty = _mm_sub_ps(sy, y0);
+    const __m128 tz = _mm_sub_ps(sz, z0);
+
+    __m128 f[3];
+    for (int c = 0; c < 3; ++c)
+    {
+        const float * d = field.forces + c;
+
+        __m128 v[8];
+        for (int i = 0; i < 8; ++i)
+            v[i] = _mm_setr_ps(d[indices[i][0]], d[indices[i][1]], d[indices[i][2]], d[indices[i][3]]);
+
+        const __m128 c00 = lerpSSE2(v[0], v[1], tx);
+        const __m128 c10 = lerpSSE2(v[2], v[3], tx);
+        const __m128 c01 = lerpSSE2(v[4], v[5], tx);
+        const __m128 c11 = lerpSSE2(v[6], v[7], tx);
+
+        f[c] = lerpSSE2(lerpSSE2(c00, c10, ty), lerpSSE2(c01, c11, ty), tz);
+    }
+
+    fx = f[0];
+    fy = f[1];
+    fz = f[2];
+}
+
+CPU_KERNEL_TARGET("sse2")
+inline void stepComponentSSE2(float * p, float * v, const __m128 force, const __m128 t, const __m128 halfTT, const __m128 pull)
+{
+    const __m128 pv = _mm_loadu_ps(p);
+    const __m128 vv = _mm_loadu_ps(v);
+
+    const __m128 signMask = _mm_set1_ps(-0.f);
+    const __m128 g = _mm_xor_ps(_mm_mul_ps(pv, _mm_andnot_ps(signMask, pv)), signMask);
+    const __m128 f = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(g, pull), force), _mm_mul_ps(vv, _mm_set1_ps(friction)));
+
+    _mm_storeu_ps(p, _mm_add_ps(_mm_add_ps(pv, _mm_mul_ps(vv, t)), _mm_mul_ps(f, halfTT)));
+    _mm_storeu_ps(v, _mm_add_ps(vv, _mm_mul_ps(f, t)));
+}
+
+CPU_KERNEL_TARGET("sse2")
+void stepSSE2(const CpuParticleArrays & particles, const std::size_t begin, const std::size_t end,
+    const CpuForceField & field, const float elapsed, const float centralGravity)
+{
+    const __m128 t = _mm_set1_ps(elapsed);
+    const __m128 halfTT = _mm_set1_ps(0.5f * elapsed * elapsed);
+    const __m128 pull = _mm_set1_ps(gravity * centralGravity);
+
+    std::size_t i = begin;
+    for (; i + 4 <= end; i += 4)
+    {
+        __m128 fx, fy, fz;
+        sampleForcesSSE2(field, _mm_loadu_ps(particles.px + i), _mm_loadu_ps(particles.py + i), _mm_loadu_ps(particles.pz + i),
+            fx, fy, fz);
+
+        stepComponentSSE2(particles.px + i, particles.vx + i, fx, t, halfTT, pull);
+        stepComponentSSE2(particles.py + i, particles.vy + i, fy, t, halfTT, pull);
+        stepComponentSSE2(particles.pz + i, particles.vz + i, fz, t, halfTT, pull);
+    }
+
+    stepScalar(particles, i, end, field, elapsed, centralGravity);
+}
+
+// row r of the column major matrix m times (x, y, z, 1)
+CPU_KERNEL_TARGET("sse2")
+inline __m128 clipCoordSSE2(const float * m, const int r, const __m128 x, const __m128 y, const __m128 z)
+{
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[r]), x), _mm_mul_ps(_mm_set1_ps(m[4 + r]), y)),
+        _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[8 + r]), z), _mm_set1_ps(m[12 + r])));
+}
+
+CPU_KERNEL_TARGET("sse2")
+std::size_t cullSSE2(const CpuParticleArrays & particles, const std::size_t begin, const std::size_t end,
+    const float * m, const float interpolation, const std::uint32_t base, std::uint32_t * indices)
+{
+    const __m128 t = _mm_set1_ps(interpolation);
+    const __m128 signMask = _mm_set1_ps(-0.f);
+
+    std::size_t count = 0;
+
+    std::size_t i = begin;
+    for (; i + 4 <= end; i += 4)
+    {
+        const __m128 x = _mm_add_ps(_mm_loadu_ps(particles.px + i), _mm_mul_ps(_mm_loadu_ps(particles.vx + i), t));
+        const __m128 y = _mm_add_ps(_mm_loadu_ps(particles.py + i), _mm_mul_ps(_mm_loadu_ps(particles.vy + i), t));
+        const __m128 z = _mm_add_ps(_mm_loadu_ps(particles.pz + i), _mm_mul_ps(_mm_loadu_ps(particles.vz + i), t));
+
+        const __m128 cx = _mm_andnot_ps(signMask, clipCoordSSE2(m, 0, x, y, z));
+        const __m128 cy = _mm_andnot_ps(signMask, clipCoordSSE2(m, 1, x, y, z));
+        const __m128 cw = clipCoordSSE2(m, 3, x, y, z);
+
+        const __m128 visible = _mm_and_ps(_mm_cmpgt_ps(cw, _mm_setzero_ps()),
+            _mm_and_ps(_mm_cmplt_ps(cx, cw), _mm_cmplt_ps(cy, cw)));
+        const int mask = _mm_movemask_ps(visible);
+
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            indices[count] = base + static_cast<std::uint32_t>(i + lane);
+            count += (mask >> lane) & 1;
+        }
+    }
+
+    return count + cullScalar(particles, i, end, m, interpolation, base, indices + count);
+}
+
+
+CPU_KERNEL_TARGET("avx2,fma")
+inline __m256 texelCoordAVX2(const __m256 p, const int size)
+{
+    const __m256 s = _mm256_fmsub_ps(_mm256_fmadd_ps(p, _mm256_set1_ps(0.2f), _mm256_set1_ps(0.5f)),
+        _mm256_set1_ps(static_cast<float>(size)), _mm256_set1_ps(0.5f));
+
+    // _mm256_max_ps returns its second operand for NaN input
+    return _mm256_min_ps(_mm256_max_ps(s, _mm256_setzero_ps()), _mm256_set1_ps(static_cast<float>(size - 1)));
+}
+
+CPU_KERNEL_TARGET("avx2,fma")
+inline __m256 lerpAVX2(const __m256 a, const __m256 b, const __m256 t)
+{
+    return _mm256_fmadd_ps(_mm256_sub_ps(b, a), t, a);
+}
+
+CPU_KERNEL_TARGET("avx2,fma")
+inline void sampleForcesAVX2(const CpuForceField & field, const __m256 px, const __m256 py, const __m256 pz,
+    __m256 & fx, __m256 & fy, __m256 & fz)
+{
+    const __m256 sx = texelCoordAVX2(px, field.width);
+    const __m256 sy = texelCoordAVX2(py, field.height);
+    const __m256 sz = texelCoordAVX2(pz, field.depth);
+
+    const __m256 x0 = _mm256_floor_ps(sx);
+    const __m256 y0 = _mm256_floor_ps(sy);
+    const __m256 z0 = _mm256_floor_ps(sz);
+
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256 w  = _mm256_set1_ps(static_cast<float>(field.width));
+    const __m256 wh = _mm256_set1_ps(static_cast<float>(field.width * field.height));
+
+    const __m256 dx = _mm256_sub_ps(_mm256_min_ps(_mm256_add_ps(x0, one), _mm256_set1_ps(static_cast<float>(field.width  - 1))), x0);
+    const __m256 dy = _mm256_sub_ps(_mm256_min_ps(_mm256_add_ps(y0, one), _mm256_set1_ps(static_cast<float>(field.height - 1))), y0);
+    const __m256 dz = _mm256_sub_ps(_mm256_min_ps(_mm256_add_ps(z0, one), _mm256_set1_ps(static_cast<float>(field.depth  - 1))), z0);
+
+    const __m256i three = _mm256_set1_epi32(3);
+
+    const __m256i base = _mm256_mullo_epi32(_mm256_cvttps_epi32(_mm256_fmadd_ps(z0, wh, _mm256_fmadd_ps(y0, w, x0))), three);
+    const __m256i ox = _mm256_mullo_epi32(_mm256_cvttps_epi32(dx), three);
+    const __m256i oy = _mm256_mullo_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(dy, w)), three);
+    const __m256i oz = _mm256_mullo_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(dz, wh)), three);
+
+    __m256i corners[8];
+    corners[0] = base;
+    corners[1] = _mm256_add_epi32(base, ox);
+    corners[2] = _mm256_add_epi32(base, oy);
+    corners[3] = _mm256_add_epi32(corners[1], oy);
+    corners[4] = _mm256_add_epi32(base, oz);
+    corners[5] = _mm256_add_epi32(corners[1], oz);
+    corners[6] = _mm256_add_epi32(corners[2], oz);
+    corners[7] = _mm256_add_epi32(corners[3], oz);
+
+    const __m256 tx = _mm256_sub_ps(sx, x0);
+    const __m256 ty = _mm256_sub_ps(sy, y0);
+    const __m256 tz = _mm256_sub_ps(sz, z0);
+
+    __m256 f[3];
+    for (int c = 0; c < 3; ++c)
+    {
+        const float * d = field.forces + c;
+
+        __m256 v[8];
+        for (int i = 0; i < 8; ++i)
+            v[i] = _mm256_i32gather_ps(d, corners[i], 4);
+
+        const __m256 c00 = lerpAVX2(v[0], v[1], tx);
+        const __m256 c10 = lerpAVX2(v[2], v[3], tx);
+        const __m256 c01 = lerpAVX2(v[4], v[5], tx);
+        const __m256 c11 = lerpAVX2(v[6], v[7], tx);
+
+        f[c] = lerpAVX2(lerpAVX2(c00, c10, ty), lerpAVX2(c01, c11, ty), tz);
+    }
+
+    fx = f[0];
+    fy = f[1];
+    fz = f[2];
+}
+
+CPU_KERNEL_TARGET("avx2,fma")
+inline void stepComponentAVX2(float * p, float * v, const __m256 force, const __m256 t, const __m256 halfTT, const __m256 pull)
+{
+    const __m256 pv = _mm256_loadu_ps(p);
+    const __m256 vv = _mm256_loadu_ps(v);
+
+    const __m256 signMask = _mm256_set1_ps(-0.f);
+    const __m256 g = _mm256_xor_ps(_mm256_mul_ps(pv, _mm256_andnot_ps(signMask, pv)), signMask);
+    const __m256 f = _mm256_fnmadd_ps(vv, _mm256_set1_ps(friction), _mm256_fmadd_ps(g, pull, force));
+
+    _mm256_storeu_ps(p, _mm256_fmadd_ps(f, halfTT, _mm256_fmadd_ps(vv, t, pv)));
+    _mm256_storeu_ps(v, _mm256_fmadd_ps(f, t, vv));
+}
+
+CPU_KERNEL_TARGET("avx2,fma")
+void stepAVX2(const CpuParticleArrays & particles, const std::size_t begin, const std::size_t end,
+    const CpuForceField & field, const float elapsed, const float centralGravity)
+{
+    const __m256 t = _mm256_set1_ps(elapsed);
+    const __m256 halfTT = _mm256_set1_ps(0.5f * elapsed * elapsed);
+    const __m256 pull = _mm256_set1_ps(gravity * centralGravity);
+
+    std::size_t i = begin;
+    for (; i + 8 <= end; i += 8)
+    {
+        __m256 fx, fy, fz;
+        sampleForcesAVX2(field, _mm256_loadu_ps(particles.px + i), _mm256_loadu_ps(particles.py + i), _mm256_loadu_ps(particles.pz + i),
+            fx, fy, fz);
+
+        stepComponentAVX2(particles.px + i, particles.vx + i, fx, t, halfTT, pull);
+        stepComponentAVX2(particles.py + i, particles.vy + i, fy, t, halfTT, pull);
+        stepComponentAVX2(particles.pz + i, particles.vz + i, fz, t, halfTT, pull);
+    }
+
+    stepScalar(particles, i, end, field, elapsed, centralGravity);
+}
+
+CPU_KERNEL_TARGET("avx2,fma")
+inline __m256 clipCoordAVX2(const float * m, const int r, const __m256 x, const __m256 y, const __m256 z)
+{
+    return _mm256_fmadd_ps(_mm256_set1_ps(m[r]), x, _mm256_fmadd_ps(_mm256_set1_ps(m[4 + r]), y,
+        _mm256_fmadd_ps(_mm256_set1_ps(m[8 + r]), z, _mm256_set1_ps(m[12 + r]))));
+}
+
+CPU_KERNEL_TARGET("avx2,fma")
+std::size_t cullAVX2(const CpuParticleArrays & particles, const std::size_t begin, const std::size_t end,
+    const float * m, const float interpolation, const std::uint32_t base, std::uint32_t * indices)
+{
+    const __m256 t = _mm256_set1_ps(interpolation);
+    const __m256 signMask = _mm256_set1_ps(-0.f);
+
+    std::size_t count = 0;
+
+    std::size_t i = begin;
+    for (; i + 8 <= end; i += 8)
+    {
+        const __m256 x = _mm256_fmadd_ps(_mm256_loadu_ps(particles.vx + i), t, _mm256_loadu_ps(particles.px + i));
+        const __m256 y = _mm256_fmadd_ps(_mm256_loadu_ps(particles.vy + i), t, _mm256_loadu_ps(particles.py + i));
+        const __m256 z = _mm256_fmadd_ps(_mm256_loadu_ps(particles.vz + i), t, _mm256_loadu_ps(particles.pz + i));
+
+        const __m256 cx = _mm256_andnot_ps(signMask, clipCoordAVX2(m, 0, x, y, z));
+        const __m256 cy = _mm256_andnot_ps(signMask, clipCoordAVX2(m, 1, x, y, z));
+        const __m256 cw = clipCoordAVX2(m, 3, x, y, z);
+
+        const __m256 visible = _mm256_and_ps(_mm256_cmp_ps(cw, _mm256_setzero_ps(), _CMP_GT_OQ),
+            _mm256_and_ps(_mm256_cmp_ps(cx, cw, _CMP_LT_OQ), _mm256_cmp_ps(cy, cw, _CMP_LT_OQ)));
+        const int mask = _mm256_movemask_ps(visible);
+
+        for (int lane = 0; lane < 8; ++lane)
+        {
+            indices[count] = base + static_cast<std::uint32_t>(i + lane);
+            count += (mask >> lane) & 1;
+        }
+    }
+
+    return count + cullScalar(particles, i, end, m, interpolation, base, indices + count);
+}
+
+#endif
+
+} // namespace
+
+
+CpuSimdLevel detectCpuSimdLevel()
+{
+#if defined(CPU_KERNEL_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+
+    __cpuid(info, 1);
+    const bool sse2    = (info[3] & (1 << 26)) != 0;
+    const bool fma     = (info[2] & (1 << 12)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx     = (info[2] & (1 << 28)) != 0;
+
+    bool avx2 = false;
+    if (maxLeaf >= 7 && osxsave && avx && fma && (_xgetbv(0) & 0x6) == 0x6)
+    {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+    }
+
+    if (avx2)
+        return CpuSimdLevel::AVX2;
+    if (sse2)
+        return CpuSimdLevel::SSE2;
+#elif defined(CPU_KERNEL_X86)
+    __builtin_cpu_init();
+
+    // checks OS support for the extended register state as well
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return CpuSimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return CpuSimdLevel::SSE2;
+#endif
+
+    return CpuSimdLevel::Scalar;
+}
+
+const char * cpuSimdLevelName(const CpuSimdLevel level)
+{
+    switch (level)
+    {
+    case CpuSimdLevel::AVX2:
+        return "AVX2";
+    case CpuSimdLevel::SSE2:
+        return "SSE2";
+    case CpuSimdLevel::Scalar:
+    default:
+        return "Scalar";
+    }
+}
+
+CpuStepKernel cpuStepKernel(const CpuSimdLevel level)
+{
+    switch (level)
+    {
+#ifdef CPU_KERNEL_X86
+    case CpuSimdLevel::AVX2:
+        return &stepAVX2;
+    case CpuSimdLevel::SSE2:
+        return &stepSSE2;
+#endif
+    case CpuSimdLevel::Scalar:
+    default:
+        return &stepScalar;
+    }
+}
+
+CpuCullKernel cpuCullKernel(const CpuSimdLevel level)
+{
+    switch (level)
+    {
+#ifdef CPU_KERNEL_X86
+    case CpuSimdLevel::AVX2:
+        return &cullAVX2;
+    case CpuSimdLevel::SSE2:
+        return &cullSSE2;
+#endif
+    case CpuSimdLevel::Scalar:
+    default:
+        return &cullScalar;
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+
+// Structure-of-arrays view on the particle state stepped by the CPU kernels.
+struct CpuParticleArrays
+{
+    float * px;
+    float * py;
+    float * pz;
+    float * vx;
+    float * vy;
+    float * vz;
+};
+
+// CPU copy of the 3D force field texture; RGB triplets with x running fastest.
+struct CpuForceField
+{
+    const float * forces;
+
+    int width;
+    int height;
+    int depth;
+};
+
+
+enum class CpuSimdLevel { Scalar, SSE2, AVX2 };
+
+// Advances particles [begin, end) by elapsed seconds, see moveParticlesInForceField in particle-step.inc;
+// centralGravity scales the pull to the center, 1 matches the shaders
+using CpuStepKernel = void (*)(const CpuParticleArrays & particles, std::size_t begin, std::size_t end,
+    const CpuForceField & forces, float elapsed, float centralGravity);
+
+// Writes base + i for each particle i of [begin, end) inside the view frustum to indices, which has room
+// for end - begin values, and returns their count; positions are moved along the velocity by interpolation
+// seconds and viewProjection is column major. Matches particle-cull.comp.
+using CpuCullKernel = std::size_t (*)(const CpuParticleArrays & particles, std::size_t begin, std::size_t end,
+    const float * viewProjection, float interpolation, std::uint32_t base, std::uint32_t * indices);
+
+
+CpuSimdLevel detectCpuSimdLevel();
+const char * cpuSimdLevelName(CpuSimdLevel level);
+
+CpuStepKernel cpuStepKernel(CpuSimdLevel level);
+CpuCullKernel cpuCullKernel(CpuSimdLevel level);
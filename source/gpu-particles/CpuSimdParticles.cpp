@@ -0,0 +1,704 @@
+#include "CpuSimdParticles.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <glbinding/gl/gl.h>
+
+#include <globjects/logging.h>
+#include <globjects/Buffer.h>
+#include <globjects/Sync.h>
+#include <globjects/VertexArray.h>
+#include <globjects/Texture.h>
+#include <globjects/VertexAttributeBinding.h>
+
+#include "ForceField.h"
+#include "FramePipeline.h"
+#include "ParticleEmission.h"
+#include "ParticleOrder.h"
+#include "WorkStealingPool.h"
+
+
+using namespace gl;
+using namespace glm;
+using namespace globjects;
+using namespace gloperate;
+
+namespace
+{
+
+// 10 bits per axis across the domain of the force field, matches particle-sort.comp
+std::uint32_t fieldMortonCode(const float x, const float y, const float z)
+{
+    const auto cell = [](const float value)
+    {
+        return static_cast<std::uint32_t>(clamp(value * 0.2f + 0.5f, 0.f, 1.f) * 1023.f);
+    };
+
+    return mortonCode(cell(x), cell(y), cell(z));
+}
+
+// least significant digit first radix sort by the morton codes in the upper 32 bits; the passes
+// alternate between both arrays, after the odd number of passes the result is in target
+void radixSort(std::uint64_t * keys, std::uint64_t * target, const std::size_t count)
+{
+    static_assert((mortonBits / radixBits) % 2 == 1, "the result has to end up in target");
+
+    std::uint64_t * source = keys;
+    std::uint64_t * destination = target;
+
+    for (unsigned int shift = 32; shift < 32 + mortonBits; shift += radixBits)
+    {
+        std::array<std::size_t, radixBuckets> offsets;
+        offsets.fill(0);
+
+        for (std::size_t i = 0; i < count; ++i)
+            ++offsets[(source[i] >> shift) & (radixBuckets - 1)];
+
+        std::size_t sum = 0;
+        for (auto & offset : offsets)
+        {
+            const std::size_t bucket = offset;
+            offset = sum;
+            sum += bucket;
+        }
+
+        for (std::size_t i = 0; i < count; ++i)
+            destination[offsets[(source[i] >> shift) & (radixBuckets - 1)]++] = source[i];
+
+        std::swap(source, destination);
+    }
+}
+
+}
+
+CpuSimdParticles::CpuSimdParticles(
+    WorkStealingPool & threadPool
+,   const ForceField & forceField
+,   const SharedParticleState & initialState
+,   const AbstractCameraCapability & cameraCap
+,   const ivec2 viewport)
+: AbstractParticleTechnique(initialState, forceField.texture(), cameraCap, viewport)
+, m_threadPool(threadPool)
+, m_stepKernel(nullptr)
+, m_cullKernel(nullptr)
+, m_liveCount(0)
+, m_forceField(forceField)
+, m_uploadPending(false)
+, m_capacity(0)
+, m_uploadIndex(0)
+{
+}
+
+CpuSimdParticles::~CpuSimdParticles()
+{
+}
+
+void CpuSimdParticles::initialize()
+{
+    const CpuSimdLevel simdLevel = detectCpuSimdLevel();
+    m_stepKernel = cpuStepKernel(simdLevel);
+    m_cullKernel = cpuCullKernel(simdLevel);
+
+    // the simulation always runs on float arrays, the per component layout covers both float formats
+    if (m_format == ParticleFormat::Float4)
+        m_format = ParticleFormat::Float3;
+
+    debug() << "CPU particle step uses " << cpuSimdLevelName(simdLevel) << " kernel";
+
+    for (auto & buffer : m_particleBuffers)
+        buffer = new Buffer();
+    m_indexBuffer = new Buffer();
+
+    // buffers are bound per upload
+    m_vao = new VertexArray();
+    m_vao->bind();
+
+    for (int i = 0; i < 6; ++i)
+    {
+        auto binding = m_vao->binding(i);
+        binding->setAttribute(i);
+
+        if (m_format == ParticleFormat::Half)
+            binding->setFormat(1, GL_HALF_FLOAT, GL_FALSE, 0);
+        else if (m_format == ParticleFormat::Fixed16)
+            binding->setFormat(1, GL_UNSIGNED_SHORT, GL_TRUE, 0);
+        else
+            binding->setFormat(1, GL_FLOAT, GL_FALSE, 0);
+
+        m_vao->enable(i);
+    }
+
+    m_vao->unbind();
+
+    m_pooled = m_emission.mode != EmitterMode::Off;
+
+    reset();
+
+    AbstractParticleTechnique::initialize("data/gpu-particles/points_cpu.vert", DrawSource::Arrays);
+}
+
+void CpuSimdParticles::reset()
+{
+    resizeChunks();
+    uploadParticles(0, m_numParticles);
+
+    m_liveCount = m_numParticles;
+
+    AbstractParticleTechnique::reset();
+}
+
+void CpuSimdParticles::release()
+{
+    for (auto & buffer : m_particleBuffers)
+        buffer = nullptr;
+    for (auto & fence : m_drawFences)
+        fence = nullptr;
+
+    m_capacity = 0;
+    m_vao = nullptr;
+    m_indexBuffer = nullptr;
+    std::vector<std::uint16_t>().swap(m_encoded);
+
+    // the host side simulation state is as large as the buffers, free it as well
+    m_chunks.clear();
+    m_sortedChunks.clear();
+    m_interactionGrid.clear();
+    m_gravityTree.clear();
+    std::vector<std::uint64_t>().swap(m_sortKeys);
+    std::vector<std::uint64_t>().swap(m_sortScratch);
+    std::vector<std::size_t>().swap(m_taskOffsets);
+    std::vector<std::uint32_t>().swap(m_cullScratch);
+    std::vector<std::uint32_t>().swap(m_visibleIndices);
+    std::vector<ParticleStatistics::Partial>().swap(m_taskPartials);
+
+    AbstractParticleTechnique::release();
+}
+
+void CpuSimdParticles::resizeChunks()
+{
+    const unsigned int count = m_initialState->chunkCount();
+
+    // chunks are allocated individually, so growing keeps existing chunks in place
+    m_chunks.resize(count);
+    for (auto & chunk : m_chunks)
+        chunk.resize(chunkArrays() * ParticleState::chunkSize);
+
+    const unsigned int capacity = count * ParticleState::chunkSize;
+
+    if (capacity == m_capacity)
+        return;
+
+    // everything is uploaded per frame anyway, so reallocating the streamed buffers loses nothing
+    for (auto & buffer : m_particleBuffers)
+        buffer->setData(static_cast<GLsizeiptr>(6 * capacity * componentSize()), nullptr, GL_STREAM_DRAW);
+
+    if (componentSize() != sizeof(float))
+        m_encoded.resize(6 * static_cast<std::size_t>(capacity));
+
+    m_capacity = capacity;
+    m_uploadPending = true;
+}
+
+void CpuSimdParticles::uploadChunk(const unsigned int chunk, const unsigned int begin, const unsigned int end)
+{
+    const CpuParticleArrays particles = particleArrays(chunk);
+    const auto & positions  = m_initialState->chunks[chunk]->positions;
+    const auto & velocities = m_initialState->chunks[chunk]->velocities;
+
+    for (unsigned int i = begin; i < end; ++i)
+    {
+        particles.px[i] = positions[i].x;
+        particles.py[i] = positions[i].y;
+        particles.pz[i] = positions[i].z;
+        particles.vx[i] = velocities[i].x;
+        particles.vy[i] = velocities[i].y;
+        particles.vz[i] = velocities[i].z;
+    }
+
+    if (m_pooled)
+    {
+        float * lifetimes = m_chunks[chunk].data() + 6 * ParticleState::chunkSize;
+        for (unsigned int i = begin; i < end; ++i)
+            lifetimes[i] = initialLifetime(m_emission, static_cast<std::uint64_t>(chunk) * ParticleState::chunkSize + i);
+    }
+
+    m_uploadPending = true;
+}
+
+CpuParticleArrays CpuSimdParticles::particleArrays(const unsigned int chunk)
+{
+    static const unsigned int stride = ParticleState::chunkSize;
+
+    float * data = m_chunks[chunk].data();
+
+    CpuParticleArrays particles;
+    particles.px = data + 0 * stride;
+    particles.py = data + 1 * stride;
+    particles.pz = data + 2 * stride;
+    particles.vx = data + 3 * stride;
+    particles.vy = data + 4 * stride;
+    particles.vz = data + 5 * stride;
+
+    return particles;
+}
+
+unsigned int CpuSimdParticles::activeParticles() const
+{
+    // shrinking the pool drops the particles beyond it, growing adds free slots
+    return m_pooled ? std::min(m_liveCount, m_numParticles) : m_numParticles;
+}
+
+std::size_t CpuSimdParticles::chunkArrays() const
+{
+    return m_pooled ? 7 : 6;
+}
+
+void CpuSimdParticles::step(const float elapsed)
+{
+    // the force field layer of each system of the ensemble
+    std::vector<CpuForceField> forces;
+    for (unsigned int system = 0; system < m_ensemble.systems; ++system)
+        forces.push_back(m_ensemble.systems > 1 ? m_forceField.cpuLayer(static_cast<int>(system)) : m_forceField.cpuField());
+
+    const CpuStepKernel stepKernel = m_stepKernel;
+    const unsigned int active = activeParticles();
+    const bool pooled = m_pooled;
+
+    std::vector<CpuParticleArrays> chunks;
+    for (unsigned int chunk = 0; chunk < m_chunks.size(); ++chunk)
+        chunks.push_back(particleArrays(chunk));
+
+    if (m_interaction.mode != InteractionMode::None)
+    {
+        m_interactionGrid.build(m_threadPool, chunks, active, m_interaction.radius);
+        m_interactionGrid.apply(m_threadPool, chunks, active, m_interaction, elapsed);
+    }
+
+    // the tree gravity replaces the pull to the center of the step kernel
+    const bool barnesHut = m_gravity.mode == GravityMode::BarnesHut;
+    if (barnesHut)
+    {
+        m_gravityTree.build(m_threadPool, chunks, active);
+        m_gravityTree.apply(m_threadPool, chunks, m_gravity, elapsed);
+    }
+
+    const float centralGravity = barnesHut ? 0.f : 1.f;
+
+    // one substep across all threads, parallelFor returns once every task is done
+    m_threadPool.parallelFor(active, particleGrain, [this, &forces, stepKernel, elapsed, centralGravity, pooled, active](std::size_t begin, std::size_t end)
+    {
+        const unsigned int chunk = static_cast<unsigned int>(begin / ParticleState::chunkSize);
+        const std::size_t offset = chunk * static_cast<std::size_t>(ParticleState::chunkSize);
+        const CpuParticleArrays particles = particleArrays(chunk);
+
+        if (m_ensemble.systems <= 1)
+            stepKernel(particles, begin - offset, end - offset, forces.front(), elapsed, centralGravity);
+
+        // tasks spanning systems step each system's part with its own field
+        for (std::size_t first = begin; m_ensemble.systems > 1 && first < end;)
+        {
+            const unsigned int system = ensembleSystem(m_ensemble, static_cast<unsigned int>(first));
+            const std::size_t last = std::min(end, static_cast<std::size_t>(ensembleBegin(m_ensemble, system + 1, active)));
+
+            stepKernel(particles, first - offset, last - offset, forces[system], elapsed, centralGravity);
+            first = last;
+        }
+
+        if (!pooled)
+            return;
+
+        float * lifetimes = m_chunks[chunk].data() + 6 * ParticleState::chunkSize;
+        for (std::size_t i = begin - offset; i < end - offset; ++i)
+            lifetimes[i] -= elapsed;
+    });
+
+    if (pooled)
+    {
+        const std::uint64_t sequence = m_emissionClock.sequence();
+        compact(m_emissionClock.advance(m_emission, elapsed), sequence);
+    }
+
+    m_uploadPending = true;
+}
+
+void CpuSimdParticles::compact(const unsigned int emitCount, const std::uint64_t sequence)
+{
+    static const std::size_t chunkSize = ParticleState::chunkSize;
+
+    const unsigned int live = activeParticles();
+    const std::size_t arrays = chunkArrays();
+
+    m_taskOffsets.assign((live + particleGrain - 1) / particleGrain + 1, 0);
+
+    m_threadPool.parallelFor(live, particleGrain, [this](std::size_t begin, std::size_t end)
+    {
+        const std::size_t offset = begin / chunkSize * chunkSize;
+        const float * lifetimes = m_chunks[begin / chunkSize].data() + 6 * chunkSize;
+
+        std::size_t survivors = 0;
+        for (std::size_t p = begin; p < end; ++p)
+            survivors += lifetimes[p - offset] > 0.f ? 1 : 0;
+
+        m_taskOffsets[begin / particleGrain] = survivors;
+    });
+
+    std::size_t survivors = 0;
+    for (auto & offset : m_taskOffsets)
+    {
+        const std::size_t task = offset;
+        offset = survivors;
+        survivors += task;
+    }
+
+    // the survivors of a task are contiguous, but may continue in the next chunk
+    if (survivors < live)
+    {
+        m_sortedChunks.resize(m_chunks.size());
+        for (auto & chunk : m_sortedChunks)
+            chunk.resize(arrays * chunkSize);
+
+        m_threadPool.parallelFor(live, particleGrain, [this, arrays](std::size_t begin, std::size_t end)
+        {
+            const std::size_t offset = begin / chunkSize * chunkSize;
+            const float * source = m_chunks[begin / chunkSize].data();
+
+            std::size_t target = m_taskOffsets[begin / particleGrain];
+
+            for (std::size_t p = begin; p < end; ++p)
+            {
+                const std::size_t i = p - offset;
+                if (source[6 * chunkSize + i] <= 0.f)
+                    continue;
+
+                float * data = m_sortedChunks[target / chunkSize].data();
+                for (std::size_t array = 0; array < arrays; ++array)
+                    data[array * chunkSize + target % chunkSize] = source[array * chunkSize + i];
+
+                ++target;
+            }
+        });
+
+        for (std::size_t chunk = 0; chunk < m_chunks.size(); ++chunk)
+            m_chunks[chunk].swap(m_sortedChunks[chunk]);
+    }
+
+    // emitted particles that find no free slot are dropped
+    const std::size_t emitted = std::min<std::size_t>(emitCount, m_numParticles - survivors);
+    const ParticleEmission emission = m_emission;
+
+    m_threadPool.parallelFor(emitted, particleGrain, [this, &emission, survivors, sequence](std::size_t begin, std::size_t end)
+    {
+        for (std::size_t k = begin; k < end; ++k)
+        {
+            const std::size_t p = survivors + k;
+            float * data = m_chunks[p / chunkSize].data();
+            const std::size_t i = p % chunkSize;
+
+            vec3 position;
+            vec3 velocity;
+            emitParticle(emission, sequence + k, position, velocity);
+
+            data[i] = position.x;
+            data[chunkSize + i] = position.y;
+            data[2 * chunkSize + i] = position.z;
+            data[3 * chunkSize + i] = velocity.x;
+            data[4 * chunkSize + i] = velocity.y;
+            data[5 * chunkSize + i] = velocity.z;
+            data[6 * chunkSize + i] = emission.lifetime;
+        }
+    });
+
+    m_liveCount = static_cast<unsigned int>(survivors + emitted);
+}
+
+void CpuSimdParticles::sort()
+{
+    static const std::size_t chunkSize = ParticleState::chunkSize;
+
+    const unsigned int active = activeParticles();
+    const std::size_t arrays = chunkArrays();
+
+    m_sortKeys.resize(m_chunks.size() * chunkSize);
+    m_sortScratch.resize(m_sortKeys.size());
+
+    m_sortedChunks.resize(m_chunks.size());
+    for (auto & chunk : m_sortedChunks)
+        chunk.resize(arrays * chunkSize);
+
+    m_threadPool.parallelFor(active, particleGrain, [this](std::size_t begin, std::size_t end)
+    {
+        const std::size_t offset = begin / chunkSize * chunkSize;
+        const float * data = m_chunks[begin / chunkSize].data();
+
+        for (std::size_t p = begin; p < end; ++p)
+        {
+            const std::size_t i = p - offset;
+            const std::uint32_t code = fieldMortonCode(data[i], data[chunkSize + i], data[2 * chunkSize + i]);
+
+            m_sortKeys[p] = (static_cast<std::uint64_t>(code) << 32) | i;
+        }
+    });
+
+    // the chunks are sorted independently of each other, one task per chunk
+    m_threadPool.parallelFor(active, chunkSize, [this](std::size_t begin, std::size_t end)
+    {
+        radixSort(m_sortKeys.data() + begin, m_sortScratch.data() + begin, end - begin);
+    });
+
+    m_threadPool.parallelFor(active, particleGrain, [this, arrays](std::size_t begin, std::size_t end)
+    {
+        const unsigned int chunk = static_cast<unsigned int>(begin / chunkSize);
+        const std::size_t offset = chunk * chunkSize;
+
+        const float * source = m_chunks[chunk].data();
+        float * target = m_sortedChunks[chunk].data();
+
+        for (std::size_t i = 0; i < arrays * chunkSize; i += chunkSize)
+        {
+            for (std::size_t p = begin; p < end; ++p)
+                target[i + p - offset] = source[i + static_cast<std::uint32_t>(m_sortScratch[p])];
+        }
+    });
+
+    // swapping keeps both sets of arrays allocated for the next sort
+    for (std::size_t chunk = 0; chunk < m_chunks.size(); ++chunk)
+        m_chunks[chunk].swap(m_sortedChunks[chunk]);
+
+    m_uploadPending = true;
+}
+
+void CpuSimdParticles::readback(Buffer & buffer)
+{
+    // the state is on the host already, it is only brought into the layout of the gpu techniques
+    static const std::size_t chunkSize = ParticleState::chunkSize;
+
+    const ParticleFormat format = m_format;
+    const std::size_t size = particleFormatSize(format);
+    const std::size_t velocities = m_chunks.size() * chunkSize;
+
+    std::vector<unsigned char> staging(readbackSize());
+
+    m_threadPool.parallelFor(m_numParticles, particleGrain, [this, format, size, velocities, &staging](std::size_t begin, std::size_t end)
+    {
+        const unsigned int chunk = static_cast<unsigned int>(begin / chunkSize);
+        const std::size_t offset = chunk * chunkSize;
+        const float * data = m_chunks[chunk].data();
+
+        for (std::size_t p = begin; p < end; ++p)
+        {
+            const std::size_t i = p - offset;
+            const vec4 position(data[i], data[chunkSize + i], data[2 * chunkSize + i], 1.f);
+            const vec4 velocity(data[3 * chunkSize + i], data[4 * chunkSize + i], data[5 * chunkSize + i], 0.f);
+
+            encodeParticles(format, &position, 1, fixedPositionRange, staging.data() + p * size);
+            encodeParticles(format, &velocity, 1, fixedVelocityRange, staging.data() + (velocities + p) * size);
+        }
+    });
+
+    buffer.setSubData(0, static_cast<GLsizeiptr>(staging.size()), staging.data());
+}
+
+bool CpuSimdParticles::reduceStatistics(const ParticleEnsemble & ensemble, std::vector<ParticleStatistics::Partial> & partials)
+{
+    static const std::size_t chunkSize = ParticleState::chunkSize;
+
+    const unsigned int active = activeParticles();
+    const std::size_t tasks = (active + particleGrain - 1) / particleGrain;
+
+    // a task reduces into a partial per system it touches, which are merged in task order, so the
+    // result does not depend on the scheduling
+    m_taskOffsets.assign(tasks + 1, 0);
+    for (std::size_t task = 0; task < tasks; ++task)
+    {
+        const std::size_t begin = task * particleGrain;
+        const std::size_t end = std::min<std::size_t>(begin + particleGrain, active);
+        const unsigned int first = ensembleSystem(ensemble, static_cast<unsigned int>(begin));
+        const unsigned int last = ensembleSystem(ensemble, static_cast<unsigned int>(end - 1));
+
+        m_taskOffsets[task + 1] = m_taskOffsets[task] + last - first + 1;
+    }
+
+    m_taskPartials.assign(m_taskOffsets.back(), ParticleStatistics::Partial());
+
+    m_threadPool.parallelFor(active, particleGrain, [this, &ensemble, active](std::size_t begin, std::size_t end)
+    {
+        const std::size_t offset = begin / chunkSize * chunkSize;
+        const float * data = m_chunks[begin / chunkSize].data();
+        const unsigned int first = ensembleSystem(ensemble, static_cast<unsigned int>(begin));
+
+        ParticleStatistics::Partial * partials = m_taskPartials.data() + m_taskOffsets[begin / particleGrain];
+
+        for (std::size_t p = begin; p < end;)
+        {
+            const unsigned int system = ensembleSystem(ensemble, static_cast<unsigned int>(p));
+            const std::size_t last = std::min(end, static_cast<std::size_t>(ensembleBegin(ensemble, system + 1, active)));
+
+            ParticleStatistics::Partial & partial = partials[system - first];
+            for (; p < last; ++p)
+            {
+                const std::size_t i = p - offset;
+                partial.add(vec3(data[i], data[chunkSize + i], data[2 * chunkSize + i]),
+                    vec3(data[3 * chunkSize + i], data[4 * chunkSize + i], data[5 * chunkSize + i]));
+            }
+        }
+    });
+
+    partials.assign(ensemble.systems, ParticleStatistics::Partial());
+
+    for (std::size_t task = 0; task < tasks; ++task)
+    {
+        const unsigned int first = ensembleSystem(ensemble, static_cast<unsigned int>(task * particleGrain));
+        for (std::size_t i = m_taskOffsets[task]; i < m_taskOffsets[task + 1]; ++i)
+            partials[first + i - m_taskOffsets[task]].merge(m_taskPartials[i]);
+    }
+
+    return true;
+}
+
+void CpuSimdParticles::upload()
+{
+    m_uploadIndex = (m_uploadIndex + 1) % s_uploadBufferCount;
+
+    // the buffer was last drawn from s_uploadBufferCount frames ago, usually its fence is long signaled
+    FramePipeline::wait(m_drawFences[m_uploadIndex]);
+    m_drawFences[m_uploadIndex] = nullptr;
+
+    Buffer * buffer = m_particleBuffers[m_uploadIndex];
+    const std::size_t size = componentSize();
+
+    if (size == sizeof(float))
+    {
+        const unsigned int active = activeParticles();
+
+        for (unsigned int chunk = 0; chunk < m_chunks.size(); ++chunk)
+        {
+            const unsigned int first = chunk * ParticleState::chunkSize;
+            if (first >= active)
+                break;
+
+            const auto chunkSize = static_cast<GLsizeiptr>(std::min(m_initialState->chunkParticles(chunk), active - first) * sizeof(float));
+
+            for (unsigned int i = 0; i < 6; ++i)
+            {
+                const std::size_t offset = i * static_cast<std::size_t>(m_capacity) + chunk * ParticleState::chunkSize;
+                buffer->setSubData(static_cast<GLintptr>(offset * sizeof(float)), chunkSize, m_chunks[chunk].data() + i * ParticleState::chunkSize);
+            }
+        }
+    }
+    else
+    {
+        encode();
+        buffer->setSubData(0, static_cast<GLsizeiptr>(m_encoded.size() * sizeof(std::uint16_t)), m_encoded.data());
+    }
+
+    for (int i = 0; i < 6; ++i)
+        m_vao->binding(i)->setBuffer(buffer, static_cast<GLint>(i * m_capacity * size), static_cast<GLint>(size));
+
+    m_uploadPending = false;
+}
+
+void CpuSimdParticles::encode()
+{
+    const ParticleFormat format = m_format;
+    const std::size_t capacity = m_capacity;
+
+    // quantizing costs about as much as a step, so it is spread across the pool as well
+    m_threadPool.parallelFor(activeParticles(), particleGrain, [this, format, capacity](std::size_t begin, std::size_t end)
+    {
+        const unsigned int chunk = static_cast<unsigned int>(begin / ParticleState::chunkSize);
+        const std::size_t offset = chunk * static_cast<std::size_t>(ParticleState::chunkSize);
+        const float * data = m_chunks[chunk].data();
+
+        for (unsigned int i = 0; i < 6; ++i)
+        {
+            const float range = i < 3 ? fixedPositionRange : fixedVelocityRange;
+            const float * source = data + i * ParticleState::chunkSize;
+            std::uint16_t * target = m_encoded.data() + i * capacity;
+
+            for (std::size_t p = begin; p < end; ++p)
+                target[p] = encodeComponent(format, source[p - offset], range);
+        }
+    });
+}
+
+std::size_t CpuSimdParticles::componentSize() const
+{
+    return m_format == ParticleFormat::Half || m_format == ParticleFormat::Fixed16 ? sizeof(std::uint16_t) : sizeof(float);
+}
+
+unsigned int CpuSimdParticles::cull()
+{
+    static const std::size_t chunkSize = ParticleState::chunkSize;
+
+    const unsigned int active = activeParticles();
+    const CpuCullKernel cullKernel = m_cullKernel;
+    const mat4 viewProjection = m_viewProjection;
+    const float interpolation = m_interpolation;
+
+    m_cullScratch.resize(active);
+    m_taskOffsets.assign((active + particleGrain - 1) / particleGrain + 1, 0);
+
+    m_threadPool.parallelFor(active, particleGrain, [this, cullKernel, &viewProjection, interpolation](std::size_t begin, std::size_t end)
+    {
+        const unsigned int chunk = static_cast<unsigned int>(begin / chunkSize);
+        const std::size_t offset = chunk * chunkSize;
+
+        m_taskOffsets[begin / particleGrain] = cullKernel(particleArrays(chunk), begin - offset, end - offset,
+            &viewProjection[0][0], interpolation, static_cast<std::uint32_t>(offset), m_cullScratch.data() + begin);
+    });
+
+    std::size_t visible = 0;
+    for (auto & offset : m_taskOffsets)
+    {
+        const std::size_t task = offset;
+        offset = visible;
+        visible += task;
+    }
+
+    m_visibleIndices.resize(visible);
+
+    m_threadPool.parallelFor(active, particleGrain, [this](std::size_t begin, std::size_t)
+    {
+        const std::size_t task = begin / particleGrain;
+        std::copy(m_cullScratch.begin() + begin, m_cullScratch.begin() + begin + (m_taskOffsets[task + 1] - m_taskOffsets[task]),
+            m_visibleIndices.begin() + m_taskOffsets[task]);
+    });
+
+    // orphaned per draw, the previous indices may still be in use
+    m_indexBuffer->setData(m_visibleIndices, GL_STREAM_DRAW);
+
+    return static_cast<unsigned int>(visible);
+}
+
+void CpuSimdParticles::draw_impl()
+{
+    if (m_uploadPending)
+        upload();
+
+    // the particles are uploaded whole, the culling only adds the indices of the visible ones
+    const unsigned int visible = m_cullingEnabled ? cull() : 0;
+
+    m_drawProgram->use();
+
+    m_vao->bind();
+    if (m_renderPath == RenderPath::InstancedQuads)
+    {
+        setInstancedArrays(*m_particleBuffers[m_uploadIndex], m_capacity);
+        setInstancedIndices(m_cullingEnabled ? m_indexBuffer.get() : nullptr, 0);
+
+        m_vao->drawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, static_cast<GLsizei>(m_cullingEnabled ? visible : activeParticles()));
+    }
+    else if (m_cullingEnabled)
+    {
+        m_vao->bindElementBuffer(m_indexBuffer);
+        m_vao->drawElements(GL_POINTS, static_cast<GLsizei>(visible), GL_UNSIGNED_INT, nullptr);
+    }
+    else
+        m_vao->drawArrays(GL_POINTS, 0, activeParticles());
+    m_vao->unbind();
+
+    m_drawProgram->release();
+
+    m_drawFences[m_uploadIndex] = Sync::fence(GL_SYNC_GPU_COMMANDS_COMPLETE);
+}
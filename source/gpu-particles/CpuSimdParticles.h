@@ -0,0 +1,118 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <globjects/base/ref_ptr.h>
+
+#include "AbstractParticleTechnique.h"
+#include "AlignedAllocator.h"
+#include "CpuParticleKernels.h"
+#include "ParticleInteraction.h"
+
+
+namespace globjects
+{
+    class Buffer;
+    class Sync;
+    class VertexArray;
+}
+
+class ForceField;
+class WorkStealingPool;
+
+class CpuSimdParticles : public AbstractParticleTechnique
+{
+public:
+    // upload buffers cycled per frame, so that uploading never overwrites a buffer the gpu still draws from
+    static const unsigned int s_uploadBufferCount = 3;
+
+public:
+    CpuSimdParticles(
+        WorkStealingPool & threadPool
+    ,   const ForceField & forceField
+    ,   const SharedParticleState & initialState
+    ,   const gloperate::AbstractCameraCapability & cameraCap
+    ,   const glm::ivec2 viewport);
+
+    virtual ~CpuSimdParticles();
+
+    virtual void initialize() override;
+    virtual void reset() override;
+    virtual void release() override;
+
+    virtual void step(float elapsed) override;
+    virtual void sort() override;
+
+    virtual void readback(globjects::Buffer & buffer) override;
+    virtual bool reduceStatistics(const ParticleEnsemble & ensemble, std::vector<ParticleStatistics::Partial> & partials) override;
+
+protected:
+    virtual void draw_impl() override;
+
+    virtual void resizeChunks() override;
+    virtual void uploadChunk(unsigned int chunk, unsigned int begin, unsigned int end) override;
+
+    void upload();
+    void encode();
+
+    // removes the dead particles, keeping the order of the survivors, and emits into the freed slots
+    void compact(unsigned int emitCount, std::uint64_t sequence);
+    // uploads the indices of the particles inside the view frustum, returns their count
+    unsigned int cull();
+
+    // particles in use: all of them, or the live particles at the front of the pool
+    unsigned int activeParticles() const;
+    // six arrays per chunk, a seventh of remaining lifetimes for the pool
+    std::size_t chunkArrays() const;
+
+    // bytes per uploaded component: floats, or halfs/fixed point for the 16 bit formats
+    std::size_t componentSize() const;
+    CpuParticleArrays particleArrays(unsigned int chunk);
+
+protected:
+    WorkStealingPool & m_threadPool;
+
+    CpuStepKernel m_stepKernel;
+    CpuCullKernel m_cullKernel;
+
+    // one structure of arrays per chunk: x, y, z, vx, vy, vz and lifetimes of chunk size floats each
+    std::vector<std::vector<float, AlignedAllocator<float>>> m_chunks;
+    // live particles at the front of the pool, counted across chunks
+    unsigned int m_liveCount;
+
+    // sampled through the CPU mirror of the field instead of reading the texture back
+    const ForceField & m_forceField;
+
+    bool m_uploadPending;
+
+    // the buffers hold the six arrays of all chunks back to back, each for m_capacity particles
+    std::array<globjects::ref_ptr<globjects::Buffer>, s_uploadBufferCount> m_particleBuffers;
+    unsigned int m_capacity;
+    std::array<globjects::ref_ptr<globjects::Sync>, s_uploadBufferCount> m_drawFences;
+    unsigned int m_uploadIndex;
+
+    CpuInteractionGrid m_interactionGrid;
+    BarnesHutTree m_gravityTree;
+
+    // morton code in the upper and index within the chunk in the lower half, sorted into the scratch
+    std::vector<std::uint64_t> m_sortKeys;
+    std::vector<std::uint64_t> m_sortScratch;
+    // the sort and the compaction gather the chunks into these and swap them
+    std::vector<std::vector<float, AlignedAllocator<float>>> m_sortedChunks;
+    // survivors or visible particles per task of the compaction and the culling, scanned into the first target of each task
+    std::vector<std::size_t> m_taskOffsets;
+    // visible particles of each culling task at the task's first particle, then compacted
+    std::vector<std::uint32_t> m_cullScratch;
+    std::vector<std::uint32_t> m_visibleIndices;
+    // the partials of the systems each task of the statistics touches, starting at its offset in m_taskOffsets
+    std::vector<ParticleStatistics::Partial> m_taskPartials;
+    globjects::ref_ptr<globjects::Buffer> m_indexBuffer;
+
+    // staging memory in the buffer layout, only used by the 16 bit formats
+    std::vector<std::uint16_t> m_encoded;
+
+    globjects::ref_ptr<globjects::VertexArray> m_vao;
+};
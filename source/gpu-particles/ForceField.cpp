@@ -0,0 +1,654 @@
+#include "ForceField.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+
+#include <glm/gtc/constants.hpp>
+
+#include <glbinding/gl/gl.h>
+
+#include <globjects/globjects.h>
+#include <globjects/logging.h>
+#include <globjects/Texture.h>
+
+#include "CounterRandom.h"
+#include "ForceFieldStream.h"
+#include "WorkStealingPool.h"
+
+
+using namespace gl;
+using namespace glm;
+using namespace globjects;
+
+namespace
+{
+
+// independent random streams of the counter-based generator, GpuParticles uses stream 0
+const std::uint32_t forceStream = 1;
+const std::uint32_t curlNoiseStream = 2;
+const std::uint32_t vortexStream = 3;
+
+// 8 random fourier modes per component of the vector potential
+const int modeCount = 24;
+const float minFrequency = glm::pi<float>();
+const float maxFrequency = 3.f * glm::pi<float>();
+
+const int vortexCount = 6;
+const float vortexCore = 0.25f;
+const float vortexOrbit = 0.25f;
+
+// the field fades out towards the corners of the domain, like the original random field
+inline float falloff(const float x, const float y, const float z)
+{
+    return std::max(1.f - std::sqrt(x * x + y * y + z * z) / std::sqrt(3.f), 0.f);
+}
+
+}
+
+
+ForceField::ForceField(WorkStealingPool & threadPool)
+: m_threadPool(threadPool)
+, m_type(ForceFieldType::Random)
+, m_resolution(32)
+, m_seed(0)
+, m_layers(1)
+, m_speed(0.f)
+, m_bricksPerFrame(64)
+, m_time(0.f)
+, m_reallocate(true)
+, m_size(0)
+, m_bricks(0)
+, m_layerCount(0)
+, m_layerGrid(1)
+, m_dirtyCount(0)
+, m_cursor(0)
+{
+}
+
+ForceField::~ForceField()
+{
+}
+
+ForceFieldType ForceField::type() const
+{
+    return m_type;
+}
+
+void ForceField::setType(const ForceFieldType type)
+{
+    if (type == m_type)
+        return;
+
+    m_type = type;
+    m_reallocate = true;
+}
+
+int ForceField::resolution() const
+{
+    return m_resolution;
+}
+
+void ForceField::setResolution(const int resolution)
+{
+    const int clamped = clamp(resolution, s_minResolution, s_maxResolution);
+    if (clamped == m_resolution)
+        return;
+
+    m_resolution = clamped;
+    m_reallocate = true;
+}
+
+unsigned int ForceField::seed() const
+{
+    return m_seed;
+}
+
+void ForceField::setSeed(const unsigned int seed)
+{
+    if (seed == m_seed)
+        return;
+
+    m_seed = seed;
+    m_reallocate = true;
+}
+
+int ForceField::layers() const
+{
+    return m_type == ForceFieldType::Stream ? 1 : m_layers;
+}
+
+void ForceField::setLayers(const int layers)
+{
+    const int clamped = std::max(layers, 1);
+    if (clamped == m_layers)
+        return;
+
+    m_layers = clamped;
+    m_reallocate = true;
+}
+
+ivec3 ForceField::layerGrid() const
+{
+    return m_layerGrid;
+}
+
+const std::string & ForceField::file() const
+{
+    return m_file;
+}
+
+void ForceField::setFile(const std::string & file)
+{
+    if (file == m_file)
+        return;
+
+    m_file = file;
+    m_reallocate = m_reallocate || m_type == ForceFieldType::Stream;
+}
+
+float ForceField::speed() const
+{
+    return m_speed;
+}
+
+void ForceField::setSpeed(const float speed)
+{
+    m_speed = std::max(speed, 0.f);
+}
+
+int ForceField::bricksPerFrame() const
+{
+    return m_bricksPerFrame;
+}
+
+void ForceField::setBricksPerFrame(const int bricksPerFrame)
+{
+    m_bricksPerFrame = std::max(bricksPerFrame, 1);
+}
+
+int ForceField::dirtyBricks() const
+{
+    return m_dirtyCount;
+}
+
+float ForceField::time() const
+{
+    return m_time;
+}
+
+void ForceField::restore(const float time, const CpuForceField & field)
+{
+    m_time = time;
+
+    if (m_reallocate)
+        allocate();
+
+    // streams are seeked by the time alone
+    if (m_stream || ivec3(field.width, field.height, field.depth) != ivec3(m_size.x, m_size.y, m_size.z * m_layerCount))
+        return;
+
+    std::copy(field.forces, field.forces + m_data.size(), m_data.begin());
+
+    std::fill(m_dirty.begin(), m_dirty.end(), 0);
+    m_dirtyCount = 0;
+
+    uploadLayers();
+}
+
+Texture & ForceField::texture()
+{
+    return *m_texture;
+}
+
+const Texture & ForceField::texture() const
+{
+    return *m_texture;
+}
+
+CpuForceField ForceField::cpuField() const
+{
+    CpuForceField field;
+    field.forces = m_data.data();
+    field.width  = m_size.x;
+    field.height = m_size.y;
+    field.depth  = m_size.z * m_layerCount;
+
+    if (m_stream)
+    {
+        // a single zero force until the first frame is resident
+        static const float none[3] = { 0.f, 0.f, 0.f };
+
+        field.forces = m_stream->frame() ? m_stream->frame() : none;
+        if (!m_stream->frame())
+            field.width = field.height = field.depth = 1;
+    }
+
+    return field;
+}
+
+CpuForceField ForceField::cpuLayer(const int layer) const
+{
+    CpuForceField field = cpuField();
+    if (m_stream)
+        return field;
+
+    field.forces += 3 * static_cast<std::size_t>(clamp(layer, 0, m_layerCount - 1)) * m_size.x * m_size.y * m_size.z;
+    field.depth = m_size.z;
+
+    return field;
+}
+
+void ForceField::update(const float delta)
+{
+    if (!m_texture)
+        m_texture = Texture::createDefault(GL_TEXTURE_3D);
+
+    if (m_reallocate)
+        allocate();
+
+    if (m_stream)
+    {
+        m_time += delta * m_speed;
+        m_stream->update(m_time, *m_texture);
+        return;
+    }
+
+    if (m_speed > 0.f && m_type != ForceFieldType::Random)
+    {
+        m_time += delta * m_speed;
+
+        // start the next sweep once the previous one is done, every brick samples the time it is generated at
+        if (m_dirtyCount == 0)
+        {
+            std::fill(m_dirty.begin(), m_dirty.end(), 1);
+            m_dirtyCount = static_cast<int>(m_dirty.size());
+        }
+    }
+
+    if (m_dirtyCount == 0)
+        return;
+
+    prepare();
+
+    std::vector<Brick> bricks;
+    const int brickCount = static_cast<int>(m_dirty.size());
+
+    for (int i = 0; i < brickCount && static_cast<int>(bricks.size()) < m_bricksPerFrame; ++i)
+    {
+        const int index = (m_cursor + i) % brickCount;
+        if (!m_dirty[index])
+            continue;
+
+        bricks.push_back(brick(index));
+        m_dirty[index] = 0;
+    }
+
+    m_cursor = (m_cursor + static_cast<int>(bricks.size())) % brickCount;
+    m_dirtyCount -= static_cast<int>(bricks.size());
+
+    // bricks write disjoint texels of the mirror, one brick per task
+    m_threadPool.parallelFor(bricks.size(), 1, [this, &bricks](std::size_t begin, std::size_t end)
+    {
+        for (std::size_t i = begin; i < end; ++i)
+            generate(bricks[i]);
+    });
+
+    // bricks are uploaded straight from the mirror, the unpack state selects their rows and slices
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, m_size.x);
+    glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, m_size.y);
+
+    for (const auto & brick : bricks)
+        upload(brick);
+
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+}
+
+void ForceField::allocate()
+{
+    m_reallocate = false;
+    m_stream = nullptr;
+
+    if (m_type == ForceFieldType::Stream)
+    {
+        std::unique_ptr<ForceFieldStream> stream(new ForceFieldStream());
+
+        if (stream->open(m_file))
+        {
+            m_size = stream->size();
+            m_bricks = ivec3(0);
+            m_layerCount = 1;
+            m_layerGrid = ivec3(1);
+            std::vector<float>().swap(m_data);
+            m_dirty.clear();
+            m_dirtyCount = 0;
+
+            // cleared by the stream, which renders its frames into the texture
+            m_texture->image3D(0, GL_RGBA16F, m_size, 0, GL_RGB, GL_FLOAT, nullptr);
+            m_stream = std::move(stream);
+            return;
+        }
+
+        warning() << "Could not open force field sequence \"" << m_file << "\", using an empty field.";
+    }
+
+    int resolution = m_type == ForceFieldType::Random ? s_randomResolution : m_type == ForceFieldType::Stream ? 1 : m_resolution;
+    const int layers = m_type == ForceFieldType::Stream ? 1 : m_layers;
+
+    // the layers are tiled along x first, then y and z; all layers together hold at most the
+    // texels of a single field of the maximum resolution
+    const int maxSize = getInteger(GL_MAX_3D_TEXTURE_SIZE);
+    const std::size_t maxTexels = static_cast<std::size_t>(s_maxResolution) * s_maxResolution * s_maxResolution;
+    ivec3 grid(1);
+
+    for (;;)
+    {
+        const int perAxis = std::max(maxSize / resolution, 1);
+        grid.x = std::min(layers, perAxis);
+        grid.y = std::min((layers + grid.x - 1) / grid.x, perAxis);
+        grid.z = (layers + grid.x * grid.y - 1) / (grid.x * grid.y);
+
+        const std::size_t texels = static_cast<std::size_t>(layers) * resolution * resolution * resolution;
+        if ((grid.z <= perAxis && texels <= maxTexels) || resolution <= s_minResolution)
+            break;
+
+        resolution = std::max(resolution / 2, s_minResolution);
+    }
+
+    if (resolution != m_resolution && m_type != ForceFieldType::Random && m_type != ForceFieldType::Stream)
+        warning() << "Reduced the resolution of " << layers << " force field layers to " << resolution << ".";
+
+    const ivec3 size(resolution);
+
+    if (size != m_size || layers != m_layerCount || grid != m_layerGrid || m_data.empty())
+    {
+        m_size = size;
+        m_bricks = (size + s_brickSize - 1) / s_brickSize;
+        m_layerCount = layers;
+        m_layerGrid = grid;
+
+        // zero until the bricks are generated, allocating a 256^3 field must not wait for its generation
+        m_data.assign(3 * static_cast<std::size_t>(size.x) * size.y * size.z * layers, 0.f);
+
+        // half floats halve memory and sampling bandwidth, the forces need no more precision;
+        // RGBA since streamed fields are rendered into the texture
+        m_texture->image3D(0, GL_RGBA16F, size * grid, 0, GL_RGB, GL_FLOAT, nullptr);
+        uploadLayers();
+    }
+
+    m_dirty.assign(static_cast<std::size_t>(m_bricks.x) * m_bricks.y * m_bricks.z * layers, 1);
+    m_dirtyCount = static_cast<int>(m_dirty.size());
+    m_cursor = 0;
+
+    // the sources of the procedural fields only depend on the seed
+
+    m_modes.resize(layers);
+    m_vortices.resize(layers);
+
+    for (int layer = 0; layer < layers; ++layer)
+    {
+        const Philox4x32 random(m_seed + static_cast<unsigned int>(layer));
+
+        allocateModes(random, m_modes[layer]);
+        allocateVortices(random, m_vortices[layer]);
+    }
+}
+
+void ForceField::allocateModes(const Philox4x32 & random, Modes & modes) const
+{
+    for (auto array : { &modes.gx, &modes.gy, &modes.gz, &modes.kx, &modes.ky, &modes.kz,
+        &modes.phase, &modes.omega, &modes.current, &modes.stepSin, &modes.stepCos })
+        array->resize(modeCount);
+
+    // a random vector potential as sum of sine waves, each mode contributes a * (k x e_c) * cos(k.q + phase)
+    // to its curl, which is divergence free and therefore neither collapses nor disperses the particles
+    const float amplitude = 0.5f / std::sqrt(0.5f * modeCount);
+
+    for (int i = 0; i < modeCount; ++i)
+    {
+        const Philox4x32::Block block = random(static_cast<std::uint64_t>(i), curlNoiseStream);
+        const float frequency = mix(minFrequency, maxFrequency, Philox4x32::uniform(block.x[0]));
+        const vec3 k = random.sphericalRand(static_cast<std::uint64_t>(modeCount + i), curlNoiseStream, frequency);
+
+        vec3 component(0.f);
+        component[i % 3] = 1.f;
+        const vec3 g = cross(k, component) * (amplitude / frequency);
+
+        modes.gx[i] = g.x;
+        modes.gy[i] = g.y;
+        modes.gz[i] = g.z;
+        modes.kx[i] = k.x;
+        modes.ky[i] = k.y;
+        modes.kz[i] = k.z;
+        modes.phase[i] = glm::two_pi<float>() * Philox4x32::uniform(block.x[1]);
+        modes.omega[i] = mix(0.5f, 1.5f, Philox4x32::uniform(block.x[2]));
+
+        const float step = k.x * 2.f / static_cast<float>(m_size.x);
+        modes.stepSin[i] = std::sin(step);
+        modes.stepCos[i] = std::cos(step);
+    }
+}
+
+void ForceField::allocateVortices(const Philox4x32 & random, Vortices & vortices) const
+{
+    for (auto array : { &vortices.cx, &vortices.cy, &vortices.cz, &vortices.dx, &vortices.dy, &vortices.dz,
+        &vortices.strength, &vortices.orbit, &vortices.omega, &vortices.phase })
+        array->resize(vortexCount);
+
+    for (int i = 0; i < vortexCount; ++i)
+    {
+        const Philox4x32::Block block = random(static_cast<std::uint64_t>(i), vortexStream);
+        const vec3 center = random.sphericalRand(static_cast<std::uint64_t>(vortexCount + i), vortexStream,
+            0.5f * Philox4x32::uniform(block.x[0]));
+        const vec3 direction = random.sphericalRand(static_cast<std::uint64_t>(2 * vortexCount + i), vortexStream, 1.f);
+
+        vortices.cx[i] = center.x;
+        vortices.cy[i] = center.y;
+        vortices.cz[i] = center.z;
+        vortices.dx[i] = direction.x;
+        vortices.dy[i] = direction.y;
+        vortices.dz[i] = direction.z;
+        vortices.strength[i] = (block.x[1] & 1u ? 1.f : -1.f) * mix(0.3f, 0.7f, Philox4x32::uniform(block.x[2]));
+        vortices.orbit[i] = vortexOrbit;
+        vortices.omega[i] = mix(0.5f, 1.5f, Philox4x32::uniform(block.x[3]));
+        vortices.phase[i] = glm::two_pi<float>() * Philox4x32::uniform(random(static_cast<std::uint64_t>(3 * vortexCount + i), vortexStream).x[0]);
+    }
+}
+
+void ForceField::prepare()
+{
+    for (auto & modes : m_modes)
+        for (int i = 0; i < modeCount; ++i)
+            modes.current[i] = modes.phase[i] + modes.omega[i] * m_time;
+}
+
+ForceField::Brick ForceField::brick(const int index) const
+{
+    const int layerBricks = m_bricks.x * m_bricks.y * m_bricks.z;
+    const int i = index % layerBricks;
+    const ivec3 coordinate(i % m_bricks.x, (i / m_bricks.x) % m_bricks.y, i / (m_bricks.x * m_bricks.y));
+
+    Brick brick;
+    brick.layer = index / layerBricks;
+    brick.offset = coordinate * s_brickSize;
+    brick.size = min(ivec3(s_brickSize), m_size - brick.offset);
+
+    return brick;
+}
+
+void ForceField::generate(const Brick & brick)
+{
+    switch (m_type)
+    {
+    case ForceFieldType::CurlNoise:
+        generateCurlNoise(brick);
+        break;
+    case ForceFieldType::Vortices:
+        generateVortices(brick);
+        break;
+    case ForceFieldType::Stream:
+        // only generated if the sequence could not be opened
+        std::fill(m_data.begin(), m_data.end(), 0.f);
+        break;
+    default:
+        generateRandom(brick);
+    }
+}
+
+std::size_t ForceField::texel(const Brick & brick, const int x, const int y, const int z) const
+{
+    return ((static_cast<std::size_t>(brick.layer) * m_size.z + z) * m_size.y + y) * m_size.x + x;
+}
+
+void ForceField::generateRandom(const Brick & brick)
+{
+    const Philox4x32 random(m_seed + static_cast<unsigned int>(brick.layer));
+
+    for (int z = brick.offset.z; z < brick.offset.z + brick.size.z; ++z)
+    for (int y = brick.offset.y; y < brick.offset.y + brick.size.y; ++y)
+    for (int x = brick.offset.x; x < brick.offset.x + brick.size.x; ++x)
+    {
+        const int i = z * m_size.x * m_size.y + y * m_size.x + x;
+        const vec3 f = random.sphericalRand(static_cast<std::uint64_t>(i), forceStream, 1.f)
+            * (1.f - length(vec3(x, y, z)) / std::sqrt(3.f));
+
+        const std::size_t t = texel(brick, x, y, z);
+        m_data[3 * t + 0] = f.x;
+        m_data[3 * t + 1] = f.y;
+        m_data[3 * t + 2] = f.z;
+    }
+}
+
+void ForceField::generateCurlNoise(const Brick & brick)
+{
+    const Modes & modes = m_modes[brick.layer];
+    const float scale = 2.f / static_cast<float>(m_size.x);
+
+    float s[modeCount];
+    float c[modeCount];
+
+    for (int z = brick.offset.z; z < brick.offset.z + brick.size.z; ++z)
+    for (int y = brick.offset.y; y < brick.offset.y + brick.size.y; ++y)
+    {
+        const float qx0 = (static_cast<float>(brick.offset.x) + 0.5f) * scale - 1.f;
+        const float qy  = (static_cast<float>(y) + 0.5f) * scale - 1.f;
+        const float qz  = (static_cast<float>(z) + 0.5f) * scale - 1.f;
+
+        // the phases advance by a constant angle per texel along the row, so sine and cosine are
+        // evaluated once per row and then rotated; the mode loops vectorize over the arrays
+        for (int m = 0; m < modeCount; ++m)
+        {
+            const float theta = modes.kx[m] * qx0 + modes.ky[m] * qy + modes.kz[m] * qz + modes.current[m];
+            s[m] = std::sin(theta);
+            c[m] = std::cos(theta);
+        }
+
+        float * out = m_data.data() + 3 * texel(brick, brick.offset.x, y, z);
+
+        for (int x = 0; x < brick.size.x; ++x)
+        {
+            float fx = 0.f, fy = 0.f, fz = 0.f;
+
+            for (int m = 0; m < modeCount; ++m)
+            {
+                fx += modes.gx[m] * c[m];
+                fy += modes.gy[m] * c[m];
+                fz += modes.gz[m] * c[m];
+            }
+
+            for (int m = 0; m < modeCount; ++m)
+            {
+                const float sm = s[m];
+                s[m] = sm * modes.stepCos[m] + c[m] * modes.stepSin[m];
+                c[m] = c[m] * modes.stepCos[m] - sm * modes.stepSin[m];
+            }
+
+            const float f = falloff(qx0 + static_cast<float>(x) * scale, qy, qz);
+
+            out[3 * x + 0] = fx * f;
+            out[3 * x + 1] = fy * f;
+            out[3 * x + 2] = fz * f;
+        }
+    }
+}
+
+void ForceField::generateVortices(const Brick & brick)
+{
+    const Vortices & vortices = m_vortices[brick.layer];
+    const float scale = 2.f / static_cast<float>(m_size.x);
+
+    // the vortex lines orbit their base center around the y axis
+    float cx[vortexCount];
+    float cz[vortexCount];
+
+    for (int v = 0; v < vortexCount; ++v)
+    {
+        const float angle = vortices.phase[v] + vortices.omega[v] * m_time;
+        cx[v] = vortices.cx[v] + vortices.orbit[v] * std::cos(angle);
+        cz[v] = vortices.cz[v] + vortices.orbit[v] * std::sin(angle);
+    }
+
+    for (int z = brick.offset.z; z < brick.offset.z + brick.size.z; ++z)
+    for (int y = brick.offset.y; y < brick.offset.y + brick.size.y; ++y)
+    {
+        const float qy = (static_cast<float>(y) + 0.5f) * scale - 1.f;
+        const float qz = (static_cast<float>(z) + 0.5f) * scale - 1.f;
+
+        float * out = m_data.data() + 3 * texel(brick, brick.offset.x, y, z);
+
+        for (int x = 0; x < brick.size.x; ++x)
+        {
+            const float qx = (static_cast<float>(brick.offset.x + x) + 0.5f) * scale - 1.f;
+
+            float fx = 0.f, fy = 0.f, fz = 0.f;
+
+            // swirl around each line, strength * (d x r) / (|r|^2 + core^2) with r perpendicular to the line
+            for (int v = 0; v < vortexCount; ++v)
+            {
+                const float rx = qx - cx[v];
+                const float ry = qy - vortices.cy[v];
+                const float rz = qz - cz[v];
+
+                const float along = rx * vortices.dx[v] + ry * vortices.dy[v] + rz * vortices.dz[v];
+                const float px = rx - along * vortices.dx[v];
+                const float py = ry - along * vortices.dy[v];
+                const float pz = rz - along * vortices.dz[v];
+
+                const float weight = vortices.strength[v] / (px * px + py * py + pz * pz + vortexCore * vortexCore);
+
+                fx += weight * (vortices.dy[v] * pz - vortices.dz[v] * py);
+                fy += weight * (vortices.dz[v] * px - vortices.dx[v] * pz);
+                fz += weight * (vortices.dx[v] * py - vortices.dy[v] * px);
+            }
+
+            const float f = falloff(qx, qy, qz);
+
+            out[3 * x + 0] = fx * f;
+            out[3 * x + 1] = fy * f;
+            out[3 * x + 2] = fz * f;
+        }
+    }
+}
+
+ivec3 ForceField::layerOffset(const int layer) const
+{
+    const ivec3 slot(layer % m_layerGrid.x, (layer / m_layerGrid.x) % m_layerGrid.y, layer / (m_layerGrid.x * m_layerGrid.y));
+    return slot * m_size;
+}
+
+void ForceField::upload(const Brick & brick)
+{
+    const float * data = m_data.data() + 3 * texel(brick, brick.offset.x, brick.offset.y, brick.offset.z);
+
+    m_texture->subImage3D(0, layerOffset(brick.layer) + brick.offset, brick.size, GL_RGB, GL_FLOAT, data);
+}
+
+void ForceField::uploadLayers()
+{
+    const std::size_t layerSize = 3 * static_cast<std::size_t>(m_size.x) * m_size.y * m_size.z;
+
+    for (int layer = 0; layer < m_layerCount; ++layer)
+        m_texture->subImage3D(0, layerOffset(layer), m_size, GL_RGB, GL_FLOAT, m_data.data() + layer * layerSize);
+}
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <globjects/base/ref_ptr.h>
+
+#include "CpuParticleKernels.h"
+
+
+namespace globjects
+{
+    class Texture;
+}
+
+class ForceFieldStream;
+class Philox4x32;
+class WorkStealingPool;
+
+
+enum class ForceFieldType { Random, CurlNoise, Vortices, Stream };
+
+// Procedural 3D force field, sampled by the particles at texture coordinate position * 0.2 + 0.5.
+// The field is generated on the CPU in bricks of s_brickSize^3 texels, in parallel, and kept in a
+// CPU mirror that the CPU technique samples directly. Changes only mark bricks dirty; update
+// regenerates and uploads at most bricksPerFrame of them, so even a full 256^3 rebuild is spread
+// over several frames. Animated fields are refreshed by continuous sweeps over all bricks.
+// Stream fields play back a sequence of frames from file instead, see ForceFieldStream.
+//
+// An ensemble, see ParticleEnsemble.h, samples several independent fields of consecutive seeds.
+// There are no 3D texture arrays, so these layers are tiled into a single 3D texture, and the CPU
+// mirror stores them one after the other.
+class ForceField
+{
+public:
+    static const int s_brickSize = 16;
+
+    static const int s_minResolution = 8;
+    static const int s_maxResolution = 256;
+
+    // resolution of the random field, which matches the original 5x5x5 field
+    static const int s_randomResolution = 5;
+
+public:
+    explicit ForceField(WorkStealingPool & threadPool);
+    ~ForceField();
+
+    ForceFieldType type() const;
+    void setType(ForceFieldType type);
+
+    // texels per axis of the procedural fields
+    int resolution() const;
+    void setResolution(int resolution);
+
+    unsigned int seed() const;
+    void setSeed(unsigned int seed);
+
+    // independent fields, layer l is generated from seed + l; streams always have a single layer
+    // the layout of the texture follows with the next update
+    int layers() const;
+    void setLayers(int layers);
+    // layers of the texture per axis, layer l is tiled at (l % x, l / x % y, l / (x * y)) times the layer size
+    glm::ivec3 layerGrid() const;
+
+    // sequence played back by stream fields
+    const std::string & file() const;
+    void setFile(const std::string & file);
+
+    // animation time scale, 0 keeps the field static
+    float speed() const;
+    void setSpeed(float speed);
+
+    int bricksPerFrame() const;
+    void setBricksPerFrame(int bricksPerFrame);
+
+    // bricks waiting to be regenerated
+    int dirtyBricks() const;
+
+    // animation time, advanced by update with delta * speed
+    float time() const;
+
+    // continues from a saved state instead of regenerating: seeks to time and, if it matches the
+    // current type and resolution, takes over the saved field; requires a current context
+    void restore(float time, const CpuForceField & field);
+
+    // reallocates the texture if required and regenerates dirty bricks within the budget,
+    // requires a current context
+    void update(float delta);
+
+    globjects::Texture & texture();
+    const globjects::Texture & texture() const;
+
+    // RGB triplets with x running fastest, always matching the texture contents; the layers
+    // follow each other along z
+    CpuForceField cpuField() const;
+    // the part of the mirror holding a single layer
+    CpuForceField cpuLayer(int layer) const;
+
+protected:
+    struct Brick
+    {
+        int layer;
+        glm::ivec3 offset;
+        glm::ivec3 size;
+    };
+
+    struct Modes;
+    struct Vortices;
+
+    void allocate();
+    // the sources of a single layer
+    void allocateModes(const Philox4x32 & random, Modes & modes) const;
+    void allocateVortices(const Philox4x32 & random, Vortices & vortices) const;
+    void prepare();
+
+    Brick brick(int index) const;
+    void generate(const Brick & brick);
+    void generateRandom(const Brick & brick);
+    void generateCurlNoise(const Brick & brick);
+    void generateVortices(const Brick & brick);
+
+    // index of a texel of the layer of brick within the mirror
+    std::size_t texel(const Brick & brick, int x, int y, int z) const;
+    // texel offset of a layer within the texture
+    glm::ivec3 layerOffset(int layer) const;
+    void upload(const Brick & brick);
+    // uploads all layers of the mirror
+    void uploadLayers();
+
+protected:
+    WorkStealingPool & m_threadPool;
+
+    ForceFieldType m_type;
+    int m_resolution;
+    unsigned int m_seed;
+    int m_layers;
+    float m_speed;
+    int m_bricksPerFrame;
+    std::string m_file;
+
+    float m_time;
+    bool m_reallocate;
+
+    // size of a layer, the texture has m_layerGrid times this
+    glm::ivec3 m_size;
+    glm::ivec3 m_bricks;
+    int m_layerCount;
+    glm::ivec3 m_layerGrid;
+    std::vector<float> m_data;
+
+    std::vector<char> m_dirty;
+    int m_dirtyCount;
+    int m_cursor;
+
+    // structure of arrays of the curl noise modes, phases include the current time
+    struct Modes
+    {
+        std::vector<float> gx, gy, gz;
+        std::vector<float> kx, ky, kz;
+        std::vector<float> phase;
+        std::vector<float> omega;
+        std::vector<float> current;
+        // rotation of each mode's phase per texel step along x
+        std::vector<float> stepSin, stepCos;
+    };
+    // per layer
+    std::vector<Modes> m_modes;
+
+    // structure of arrays of the vortex lines, centers include the current time
+    struct Vortices
+    {
+        std::vector<float> cx, cy, cz;
+        std::vector<float> dx, dy, dz;
+        std::vector<float> strength;
+        std::vector<float> orbit;
+        std::vector<float> omega;
+        std::vector<float> phase;
+    };
+    std::vector<Vortices> m_vortices;
+
+    std::unique_ptr<ForceFieldStream> m_stream;
+
+    globjects::ref_ptr<globjects::Texture> m_texture;
+};
@@ -0,0 +1,380 @@
+#include "ForceFieldStream.h"
+
+#include <cmath>
+#include <cstring>
+
+#include <glbinding/gl/gl.h>
+
+#include <globjects/globjects.h>
+#include <globjects/logging.h>
+#include <globjects/Buffer.h>
+#include <globjects/Framebuffer.h>
+#include <globjects/Program.h>
+#include <globjects/Shader.h>
+#include <globjects/Sync.h>
+#include <globjects/Texture.h>
+
+#include <gloperate/primitives/ScreenAlignedQuad.h>
+
+
+using namespace gl;
+using namespace glm;
+using namespace globjects;
+using namespace gloperate;
+
+namespace
+{
+
+const char magic[4] = { 'G', 'P', 'F', 'F' };
+const std::uint32_t formatVersion = 1;
+
+template <typename T>
+T read(const unsigned char * data, const std::size_t offset)
+{
+    T value;
+    std::memcpy(&value, data + offset, sizeof(T));
+    return value;
+}
+
+}
+
+
+ForceFieldStream::ForceFieldStream()
+: m_size(0)
+, m_frameCount(0)
+, m_framesPerSecond(0.f)
+, m_frameBytes(0)
+, m_initialized(false)
+, m_persistent(false)
+, m_residentFrames{ { -1, -1 } }
+, m_blendedFrames{ -1, -1 }
+, m_blendedWeight(0.f)
+, m_frame(nullptr)
+, m_quit(false)
+{
+    for (auto & slot : m_slots)
+    {
+        slot.state = SlotState::Free;
+        slot.frame = -1;
+        slot.memory = nullptr;
+    }
+}
+
+ForceFieldStream::~ForceFieldStream()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_condition.notify_all();
+
+    if (m_prefetchThread.joinable())
+        m_prefetchThread.join();
+
+    if (m_persistent)
+        m_stagingBuffer->unmap();
+}
+
+bool ForceFieldStream::open(const std::string & path)
+{
+    if (!m_file.open(path))
+        return false;
+
+    const unsigned char * data = m_file.data();
+
+    if (m_file.size() < s_headerSize || std::memcmp(data, magic, sizeof(magic)) != 0
+        || read<std::uint32_t>(data, 4) != formatVersion)
+    {
+        warning() << path << " is not a force field sequence";
+        m_file.close();
+        return false;
+    }
+
+    m_size = ivec3(read<std::int32_t>(data, 8), read<std::int32_t>(data, 12), read<std::int32_t>(data, 16));
+    m_frameCount = read<std::uint32_t>(data, 20);
+    m_framesPerSecond = read<float>(data, 24);
+    m_frameBytes = 3 * sizeof(float) * static_cast<std::size_t>(m_size.x) * m_size.y * m_size.z;
+
+    if (m_size.x <= 0 || m_size.y <= 0 || m_size.z <= 0 || m_frameCount == 0 || !(m_framesPerSecond > 0.f)
+        || m_file.size() < s_headerSize + m_frameCount * m_frameBytes)
+    {
+        warning() << path << " is truncated or has an invalid header";
+        m_file.close();
+        return false;
+    }
+
+    debug() << "Streaming " << m_frameCount << " force field frames of " << m_size.x << "x" << m_size.y << "x" << m_size.z
+        << " at " << m_framesPerSecond << " frames per second";
+
+    return true;
+}
+
+ivec3 ForceFieldStream::size() const
+{
+    return m_size;
+}
+
+unsigned int ForceFieldStream::frameCount() const
+{
+    return m_frameCount;
+}
+
+const float * ForceFieldStream::frame() const
+{
+    return m_frame;
+}
+
+void ForceFieldStream::initialize(Texture & target)
+{
+    m_initialized = true;
+
+    // coherent persistent mapping lets the prefetch thread write while the GPU reads other slots
+    m_persistent = hasExtension(GLextension::GL_ARB_buffer_storage);
+
+    if (m_persistent)
+    {
+        const auto size = static_cast<GLsizeiptr>(s_slotCount * m_frameBytes);
+
+        m_stagingBuffer = new Buffer();
+        m_stagingBuffer->setStorage(size, nullptr, GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+
+        auto memory = static_cast<unsigned char *>(m_stagingBuffer->mapRange(0, size,
+            GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT));
+
+        for (unsigned int i = 0; i < s_slotCount; ++i)
+            m_slots[i].memory = memory + i * m_frameBytes;
+    }
+    else
+    {
+        warning() << "Persistent buffer mapping not supported, force field frames are staged in host memory.";
+
+        m_stagingMemory.resize(s_slotCount * m_frameBytes);
+
+        for (unsigned int i = 0; i < s_slotCount; ++i)
+            m_slots[i].memory = m_stagingMemory.data() + i * m_frameBytes;
+    }
+
+    for (auto & frame : m_frames)
+    {
+        frame = Texture::createDefault(GL_TEXTURE_3D);
+        frame->image3D(0, GL_RGB32F, m_size, 0, GL_RGB, GL_FLOAT, nullptr);
+    }
+
+    m_fbo = new Framebuffer();
+
+    m_blend = new ScreenAlignedQuad(
+        Shader::fromFile(GL_FRAGMENT_SHADER, "data/gpu-particles/force-blend.frag"));
+    m_blend->program()->setUniform("frame0", 0);
+    m_blend->program()->setUniform("frame1", 1);
+
+    // the target stays zero until the first frame arrives
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glViewport(0, 0, m_size.x, m_size.y);
+
+    m_fbo->bind();
+    for (int z = 0; z < m_size.z; ++z)
+    {
+        m_fbo->attachTextureLayer(GL_COLOR_ATTACHMENT0, &target, 0, z);
+        glClear(GL_COLOR_BUFFER_BIT);
+    }
+    m_fbo->unbind();
+
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+    m_prefetchThread = std::thread(&ForceFieldStream::prefetchLoop, this);
+}
+
+void ForceFieldStream::prefetchLoop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (true)
+    {
+        int slot = -1;
+
+        m_condition.wait(lock, [this, &slot]
+        {
+            if (m_quit)
+                return true;
+
+            slot = findSlot(-1);
+            return slot >= 0 && !m_requests.empty();
+        });
+
+        if (m_quit)
+            return;
+
+        const int frame = m_requests.front();
+        m_requests.pop_front();
+
+        m_slots[slot].state = SlotState::Loading;
+        m_slots[slot].frame = frame;
+
+        lock.unlock();
+
+        // page faults of the mapping, i.e., the actual disk reads, happen here instead of on the render thread
+        std::memcpy(m_slots[slot].memory, m_file.data() + s_headerSize + frame * m_frameBytes, m_frameBytes);
+
+        lock.lock();
+
+        m_slots[slot].state = SlotState::Staged;
+    }
+}
+
+int ForceFieldStream::findSlot(const int frame) const
+{
+    for (unsigned int i = 0; i < s_slotCount; ++i)
+    {
+        // frame -1 asks for a free slot
+        if (frame < 0 ? m_slots[i].state == SlotState::Free : m_slots[i].state != SlotState::Free && m_slots[i].frame == frame)
+            return static_cast<int>(i);
+    }
+
+    return -1;
+}
+
+bool ForceFieldStream::isResident(const int frame) const
+{
+    return m_residentFrames[0] == frame || m_residentFrames[1] == frame;
+}
+
+void ForceFieldStream::update(const float time, Texture & target)
+{
+    if (!m_initialized)
+        initialize(target);
+
+    const float count = static_cast<float>(m_frameCount);
+
+    float position = std::fmod(time * m_framesPerSecond, count);
+    if (position < 0.f)
+        position += count;
+
+    const int current = static_cast<int>(position) % static_cast<int>(m_frameCount);
+    const int next = (current + 1) % static_cast<int>(m_frameCount);
+    const int wanted[] = { current, next, (next + 1) % static_cast<int>(m_frameCount) };
+
+    std::vector<int> uploads;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        for (auto & slot : m_slots)
+        {
+            // the GPU finished reading the slot, it may be overwritten
+            if (slot.state == SlotState::Uploading && (!slot.fence
+                || slot.fence->clientWait(GL_SYNC_FLUSH_COMMANDS_BIT, 0) != GL_TIMEOUT_EXPIRED))
+            {
+                slot.state = SlotState::Free;
+                slot.fence = nullptr;
+            }
+
+            // the sequence was seeked past this frame
+            if (slot.state == SlotState::Staged && slot.frame != wanted[0] && slot.frame != wanted[1] && slot.frame != wanted[2])
+                slot.state = SlotState::Free;
+        }
+
+        for (int i = 0; i < 2; ++i)
+        {
+            const int slot = findSlot(wanted[i]);
+            if (!isResident(wanted[i]) && slot >= 0 && m_slots[slot].state == SlotState::Staged)
+            {
+                m_slots[slot].state = SlotState::Uploading;
+                uploads.push_back(slot);
+            }
+        }
+
+        // requests are renewed every frame, so stale ones never pile up
+        m_requests.clear();
+        for (const int frame : wanted)
+        {
+            if (!isResident(frame) && findSlot(frame) < 0)
+                m_requests.push_back(frame);
+        }
+    }
+    m_condition.notify_one();
+
+    // slots in Uploading state are left alone by the prefetch thread
+    for (const int slot : uploads)
+    {
+        const int frame = m_slots[slot].frame;
+
+        // replace the texture that holds neither of the two frames needed now
+        const int texture = m_residentFrames[0] == current || m_residentFrames[0] == next ? 1 : 0;
+        upload(slot, texture);
+        m_residentFrames[texture] = frame;
+    }
+
+    if (isResident(current))
+    {
+        const int first = m_residentFrames[0] == current ? 0 : 1;
+
+        // hold the current frame until the next one is resident instead of waiting for it
+        const bool hold = !isResident(next);
+        const float weight = hold ? 0.f : position - std::floor(position);
+        blend(target, first, hold ? first : 1 - first, weight);
+
+        const int nearest = weight < 0.5f ? current : next;
+        m_frame = reinterpret_cast<const float *>(m_file.data() + s_headerSize + nearest * m_frameBytes);
+    }
+}
+
+void ForceFieldStream::upload(const int slot, const int texture)
+{
+    if (m_persistent)
+    {
+        m_stagingBuffer->bind(GL_PIXEL_UNPACK_BUFFER);
+        m_frames[texture]->subImage3D(0, ivec3(0), m_size, GL_RGB, GL_FLOAT,
+            reinterpret_cast<const GLvoid *>(slot * m_frameBytes));
+        Buffer::unbind(GL_PIXEL_UNPACK_BUFFER);
+
+        m_slots[slot].fence = Sync::fence(GL_SYNC_GPU_COMMANDS_COMPLETE);
+    }
+    else
+    {
+        // client memory is copied before the call returns, the slot is free again right away
+        m_frames[texture]->subImage3D(0, ivec3(0), m_size, GL_RGB, GL_FLOAT, m_slots[slot].memory);
+    }
+}
+
+void ForceFieldStream::blend(Texture & target, const int first, const int second, const float weight)
+{
+    const int frames[] = { m_residentFrames[first], m_residentFrames[second] };
+
+    // a paused simulation or a held frame needs no new blend
+    if (frames[0] == m_blendedFrames[0] && frames[1] == m_blendedFrames[1] && weight == m_blendedWeight)
+        return;
+
+    m_blendedFrames[0] = frames[0];
+    m_blendedFrames[1] = frames[1];
+    m_blendedWeight = weight;
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glViewport(0, 0, m_size.x, m_size.y);
+
+    // blending runs within the painter's frame, whose depth test state is restored afterwards
+    const GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+    glDisable(GL_DEPTH_TEST);
+
+    m_frames[first]->bindActive(GL_TEXTURE0);
+    m_frames[second]->bindActive(GL_TEXTURE1);
+    m_blend->program()->setUniform("weight", weight);
+
+    // one layer of the 3D target per pass
+    m_fbo->bind();
+    for (int z = 0; z < m_size.z; ++z)
+    {
+        m_fbo->attachTextureLayer(GL_COLOR_ATTACHMENT0, &target, 0, z);
+        m_blend->program()->setUniform("slice", z);
+        m_blend->draw();
+    }
+    m_fbo->unbind();
+
+    m_frames[second]->unbindActive(GL_TEXTURE1);
+    m_frames[first]->unbindActive(GL_TEXTURE0);
+
+    if (depthTest == GL_TRUE)
+        glEnable(GL_DEPTH_TEST);
+
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <globjects/base/ref_ptr.h>
+
+#include "MappedFile.h"
+
+
+namespace globjects
+{
+    class Buffer;
+    class Framebuffer;
+    class Sync;
+    class Texture;
+}
+
+namespace gloperate
+{
+    class ScreenAlignedQuad;
+}
+
+
+// Plays back a sequence of force field frames from a memory mapped file, e.g., exported from
+// offline simulations. A prefetch thread copies upcoming frames from the mapping into slots of a
+// persistently mapped pixel unpack buffer, which pulls them from disk off the render thread.
+// update uploads staged frames into two resident textures and blends them into the target.
+//
+// File layout, little endian:
+//   char[4] "GPFF", uint32 version (1), int32 width, height, depth, uint32 frame count,
+//   float32 frames per second, uint32 reserved (0),
+//   followed by the frames, each width * height * depth RGB float32 triplets with x running fastest.
+class ForceFieldStream
+{
+public:
+    static const unsigned int s_slotCount = 3;
+    static const std::size_t s_headerSize = 32;
+
+public:
+    ForceFieldStream();
+    ~ForceFieldStream();
+
+    bool open(const std::string & path);
+
+    glm::ivec3 size() const;
+    unsigned int frameCount() const;
+
+    // seeks to time (wrapping around the sequence) and blends the resident frames into the
+    // RGBA target texture of size(); never waits for frames that are not staged yet
+    void update(float time, globjects::Texture & target);
+
+    // frame nearest to the time of the last update, read from the mapping, nullptr before the first
+    const float * frame() const;
+
+    // Note: this is intentionally not implemented - but fixes MSVC12 C4512 warning
+    ForceFieldStream & operator=(const ForceFieldStream & stream);
+
+protected:
+    enum class SlotState { Free, Loading, Staged, Uploading };
+
+    struct Slot
+    {
+        SlotState state;
+        int frame;
+        unsigned char * memory;
+
+        // signaled once the GPU has read the slot, only used with persistent mapping
+        globjects::ref_ptr<globjects::Sync> fence;
+    };
+
+    void initialize(globjects::Texture & target);
+    void prefetchLoop();
+
+    bool isResident(int frame) const;
+    // slot holding the frame, -1 if none, requires m_mutex
+    int findSlot(int frame) const;
+    void upload(int slot, int texture);
+    // blends the resident frames in textures first and second into the target
+    void blend(globjects::Texture & target, int first, int second, float weight);
+
+protected:
+    MappedFile m_file;
+
+    glm::ivec3 m_size;
+    unsigned int m_frameCount;
+    float m_framesPerSecond;
+    std::size_t m_frameBytes;
+
+    bool m_initialized;
+    bool m_persistent;
+
+    // persistently mapped, or host memory as fallback without ARB_buffer_storage
+    globjects::ref_ptr<globjects::Buffer> m_stagingBuffer;
+    std::vector<unsigned char> m_stagingMemory;
+    std::array<Slot, s_slotCount> m_slots;
+
+    std::array<globjects::ref_ptr<globjects::Texture>, 2> m_frames;
+    std::array<int, 2> m_residentFrames;
+
+    globjects::ref_ptr<globjects::Framebuffer> m_fbo;
+    globjects::ref_ptr<gloperate::ScreenAlignedQuad> m_blend;
+    int m_blendedFrames[2];
+    float m_blendedWeight;
+
+    const float * m_frame;
+
+    std::thread m_prefetchThread;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::deque<int> m_requests;
+    bool m_quit;
+};
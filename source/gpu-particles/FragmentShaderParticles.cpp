@@ -3,6 +3,7 @@
 
 #include <glbinding/gl/gl.h>
 
+#include <globjects/Buffer.h>
 #include <globjects/Program.h>
 #include <globjects/Shader.h>
 #include <globjects/VertexArray.h>
@@ -13,6 +14,8 @@
 
 #include <gloperate/primitives/ScreenAlignedQuad.h>
 
+#include "ParticleCulling.h"
+
 
 using namespace gl;
 using namespace glm;
@@ -21,14 +24,11 @@ using namespace gloperate;
 
 
 FragmentShaderParticles::FragmentShaderParticles(
-    const std::vector<vec4> & positions
-,   const std::vector<vec4> & velocities
+    const SharedParticleState & initialState
 ,   const Texture & forces
 ,   const AbstractCameraCapability & cameraCap
 ,   const ivec2 viewport)
-: AbstractParticleTechnique(positions, velocities, forces, cameraCap, viewport)
-, m_positionsFilled(m_positions)
-, m_velocitiesFilled(m_velocities)
+: AbstractParticleTechnique(initialState, forces, cameraCap, viewport)
 {
 }
 
@@ -38,104 +38,257 @@ FragmentShaderParticles::~FragmentShaderParticles()
 
 void FragmentShaderParticles::initialize()
 {
-    // use 2d texture for pseudo compute invocations
+    // use one 2d texture per chunk for pseudo compute invocations
 
-    const int size = static_cast<int>(m_positions.size());
+    // three channel float textures are not renderable
+    if (m_format == ParticleFormat::Float3)
+        m_format = ParticleFormat::Float4;
 
-    m_workGroupSize.x = static_cast<int>(std::sqrt(static_cast<float>(size)));
-    m_workGroupSize.y = m_workGroupSize.x;
+    m_vao = new VertexArray();
 
-    const int remain = size - (m_workGroupSize.x * m_workGroupSize.y);
-    m_workGroupSize.y += remain / m_workGroupSize.x + (remain % m_workGroupSize.x == 0 ? 0 : 1);
+    m_updateQuad = new ScreenAlignedQuad(
+        Shader::fromFile(GL_FRAGMENT_SHADER, "data/gpu-particles/particle.frag"));
+    m_updateQuad->program()->setUniform("vertices",   0);
+    m_updateQuad->program()->setUniform("velocities", 1);
+    m_updateQuad->program()->setUniform("forces",     2);
+    setDecodeUniforms(m_updateQuad->program());
+
+    if (ParticleCulling::isSupported())
+        m_culling.reset(new ParticleCulling(ParticleCulling::Source::Textures, m_format));
+
+    reset();
+
+    AbstractParticleTechnique::initialize("data/gpu-particles/points_fragment.vert", DrawSource::Textures);
+}
 
-    // inject some null data to fill texture
+void FragmentShaderParticles::reset()
+{
+    resizeChunks();
+    uploadParticles(0, m_numParticles);
+
+    AbstractParticleTechnique::reset();
+}
+
+void FragmentShaderParticles::release()
+{
+    m_chunks.clear();
+
+    m_updateQuad = nullptr;
+    m_vao = nullptr;
+
+    AbstractParticleTechnique::release();
+}
 
-    const int nullsize = m_workGroupSize.x * m_workGroupSize.y - size;
+namespace
+{
 
-    m_positionsFilled.resize(m_workGroupSize.x * m_workGroupSize.y);
-    m_velocitiesFilled.resize(m_workGroupSize.x * m_workGroupSize.y);
+GLenum internalFormat(const ParticleFormat format)
+{
+    switch (format)
+    {
+    case ParticleFormat::Half:
+        return GL_RGBA16F;
+    case ParticleFormat::Fixed16:
+        return GL_RGBA16;
+    default:
+        return GL_RGBA32F;
+    }
+}
 
-    for (int i = 0; i < nullsize; ++i)
+GLenum pixelType(const ParticleFormat format)
+{
+    switch (format)
     {
-        m_positionsFilled[size + i] = glm::vec4(0.f, 0.f, 0.f, 0.f);
-        m_velocitiesFilled[size + i] = glm::vec4(0.f, 0.f, 0.f, 0.f);
+    case ParticleFormat::Half:
+        return GL_HALF_FLOAT;
+    case ParticleFormat::Fixed16:
+        return GL_UNSIGNED_SHORT;
+    default:
+        return GL_FLOAT;
     }
+}
 
-    m_positionsTex = new Texture(GL_TEXTURE_2D);
-    m_positionsTex->setParameter(GL_TEXTURE_MIN_FILTER, static_cast<GLint>(GL_NEAREST));
-    m_positionsTex->setParameter(GL_TEXTURE_MAG_FILTER, static_cast<GLint>(GL_NEAREST));
-    m_positionsTex->setParameter(GL_TEXTURE_WRAP_S, static_cast<GLint>(GL_CLAMP_TO_EDGE));
-    m_positionsTex->setParameter(GL_TEXTURE_WRAP_T, static_cast<GLint>(GL_CLAMP_TO_EDGE));
-    m_positionsTex->setParameter(GL_TEXTURE_WRAP_R, static_cast<GLint>(GL_CLAMP_TO_EDGE));
+Texture * createParticleTexture(const ParticleFormat format)
+{
+    static const ivec2 size(ParticleState::chunkWidth, ParticleState::chunkSize / ParticleState::chunkWidth);
 
-    m_velocitiesTex = new Texture(GL_TEXTURE_2D);
-    m_velocitiesTex->setParameter(GL_TEXTURE_MIN_FILTER, static_cast<GLint>(GL_NEAREST));
-    m_velocitiesTex->setParameter(GL_TEXTURE_MAG_FILTER, static_cast<GLint>(GL_NEAREST));
-    m_velocitiesTex->setParameter(GL_TEXTURE_WRAP_S, static_cast<GLint>(GL_CLAMP_TO_EDGE));
-    m_velocitiesTex->setParameter(GL_TEXTURE_WRAP_T, static_cast<GLint>(GL_CLAMP_TO_EDGE));
-    m_velocitiesTex->setParameter(GL_TEXTURE_WRAP_R, static_cast<GLint>(GL_CLAMP_TO_EDGE));
+    Texture * texture = new Texture(GL_TEXTURE_2D);
+    texture->setParameter(GL_TEXTURE_MIN_FILTER, static_cast<GLint>(GL_NEAREST));
+    texture->setParameter(GL_TEXTURE_MAG_FILTER, static_cast<GLint>(GL_NEAREST));
+    texture->setParameter(GL_TEXTURE_WRAP_S, static_cast<GLint>(GL_CLAMP_TO_EDGE));
+    texture->setParameter(GL_TEXTURE_WRAP_T, static_cast<GLint>(GL_CLAMP_TO_EDGE));
+    texture->setParameter(GL_TEXTURE_WRAP_R, static_cast<GLint>(GL_CLAMP_TO_EDGE));
+    texture->image2D(0, internalFormat(format), size, 0, GL_RGBA, pixelType(format), nullptr);
 
-    reset();
+    return texture;
+}
 
-    m_vao = new VertexArray();
+void uploadTexels(Texture & texture, const ParticleFormat format, const vec4 * values, unsigned int begin, const unsigned int end, const float range)
+{
+    // row-wise in at most three parts: a partial first row, full rows, and a partial last row
 
-    m_updateFbo = new Framebuffer();
-    m_updateFbo->bind();
-    m_updateFbo->attachTexture(GL_COLOR_ATTACHMENT0, m_positionsTex);
-    m_updateFbo->attachTexture(GL_COLOR_ATTACHMENT1, m_velocitiesTex);
-    m_updateFbo->setDrawBuffers({ GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 });
-    m_updateFbo->unbind();
+    static const unsigned int width = ParticleState::chunkWidth;
 
-    m_updateQuad = new ScreenAlignedQuad(
-        Shader::fromFile(GL_FRAGMENT_SHADER, "data/gpu-particles/particle.frag"), m_positionsTex);
-    m_updateQuad->program()->setUniform("vertices",   0);
-    m_updateQuad->program()->setUniform("velocities", 1);
-    m_updateQuad->program()->setUniform("forces",     2);
+    const std::size_t texelSize = particleFormatSize(format);
+
+    // float4 is uploaded straight from the shared state, the others are encoded first
+    const unsigned int first = begin;
+    const unsigned char * data = reinterpret_cast<const unsigned char *>(values + first);
+
+    std::vector<unsigned char> encoded;
+    if (format != ParticleFormat::Float4)
+    {
+        encoded.resize((end - first) * texelSize);
+        encodeParticles(format, values + first, end - first, range, encoded.data());
+
+        data = encoded.data();
+    }
 
+    while (begin < end)
+    {
+        const unsigned int x = begin % width;
+        const unsigned int y = begin / width;
+
+        unsigned int count = end - begin < width - x ? end - begin : width - x;
+        ivec2 size(count, 1);
+
+        if (x == 0 && end - begin >= width)
+        {
+            size = ivec2(width, (end - begin) / width);
+            count = size.x * size.y;
+        }
 
-    AbstractParticleTechnique::initialize("data/gpu-particles/points_fragment.vert");
+        texture.subImage2D(0, ivec2(x, y), size, GL_RGBA, pixelType(format), data + (begin - first) * texelSize);
+        begin += count;
+    }
 }
 
-void FragmentShaderParticles::reset()
+}
+
+void FragmentShaderParticles::resizeChunks()
 {
-    m_positionsTex->image2D(0, GL_RGBA32F, m_workGroupSize, 0, GL_RGBA, GL_FLOAT, m_positionsFilled.data());
-    m_velocitiesTex->image2D(0, GL_RGBA32F, m_workGroupSize, 0, GL_RGBA, GL_FLOAT, m_velocitiesFilled.data());
+    const unsigned int count = m_initialState->chunkCount();
 
-    AbstractParticleTechnique::reset();
+    if (m_chunks.size() > count)
+        m_chunks.resize(count);
+
+    while (m_chunks.size() < count)
+    {
+        Chunk chunk;
+
+        chunk.positions = createParticleTexture(m_format);
+        chunk.velocities = createParticleTexture(m_format);
+
+        chunk.updateFbo = new Framebuffer();
+        chunk.updateFbo->bind();
+        chunk.updateFbo->attachTexture(GL_COLOR_ATTACHMENT0, chunk.positions);
+        chunk.updateFbo->attachTexture(GL_COLOR_ATTACHMENT1, chunk.velocities);
+        chunk.updateFbo->setDrawBuffers({ GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 });
+        chunk.updateFbo->unbind();
+
+        m_chunks.push_back(chunk);
+    }
+}
+
+void FragmentShaderParticles::uploadChunk(const unsigned int chunk, const unsigned int begin, const unsigned int end)
+{
+    const ParticleState::Chunk & source = *m_initialState->chunks[chunk];
+
+    uploadTexels(*m_chunks[chunk].positions, m_format, source.positions.data(), begin, end, fixedPositionRange);
+    uploadTexels(*m_chunks[chunk].velocities, m_format, source.velocities.data(), begin, end, fixedVelocityRange);
+}
+
+void FragmentShaderParticles::readback(Buffer & buffer)
+{
+    const std::size_t size = ParticleState::chunkSize * particleFormatSize(m_format);
+    const std::size_t velocities = m_chunks.size() * size;
+
+    // with a pixel pack buffer bound, the texture reads only enqueue a copy into it
+    buffer.bind(GL_PIXEL_PACK_BUFFER);
+
+    for (unsigned int i = 0; i < m_chunks.size(); ++i)
+    {
+        m_chunks[i].positions->bind();
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, pixelType(m_format), reinterpret_cast<GLvoid *>(i * size));
+
+        m_chunks[i].velocities->bind();
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, pixelType(m_format), reinterpret_cast<GLvoid *>(velocities + i * size));
+    }
+
+    Buffer::unbind(GL_PIXEL_PACK_BUFFER);
 }
 
 void FragmentShaderParticles::step(const float elapsed)
 {
     // Use positions and velocities textures for both input and output at the same time
 
-    m_updateFbo->bind();
+    static const int width = static_cast<int>(ParticleState::chunkWidth);
 
-    m_positionsTex->bindActive(GL_TEXTURE0);
-    m_velocitiesTex->bindActive(GL_TEXTURE1);
     m_forces.bindActive(GL_TEXTURE2);
 
     m_updateQuad->program()->setUniform("elapsed", elapsed);
 
-    glViewport(0, 0, m_workGroupSize.x, m_workGroupSize.y);
-    m_updateQuad->draw();
+    for (unsigned int i = 0; i < m_chunks.size(); ++i)
+    {
+        // only rasterize the rows in use
+        const int rows = static_cast<int>((m_initialState->chunkParticles(i) + width - 1) / width);
+
+        m_chunks[i].updateFbo->bind();
+
+        m_chunks[i].positions->bindActive(GL_TEXTURE0);
+        m_chunks[i].velocities->bindActive(GL_TEXTURE1);
+
+        setEnsembleUniforms(m_updateQuad->program(), i);
+
+        glViewport(0, 0, width, rows);
+        m_updateQuad->draw();
+    }
+
     glViewport(0, 0, m_viewport.x, m_viewport.y);
 
-    m_updateFbo->unbind();
+    Framebuffer::unbind();
 }
 
 void FragmentShaderParticles::draw_impl()
 {
-    m_positionsTex->bindActive(GL_TEXTURE0);
+    const bool culled = m_culling && m_cullingEnabled;
+    const bool instanced = m_renderPath == RenderPath::InstancedQuads;
+
+    if (culled)
+    {
+        m_culling->begin(static_cast<unsigned int>(m_chunks.size()), m_viewProjection, m_interpolation);
+        for (unsigned int i = 0; i < m_chunks.size(); ++i)
+            m_culling->cull(i, m_initialState->chunkParticles(i), *m_chunks[i].positions, *m_chunks[i].velocities);
+        m_culling->end();
+    }
+
     m_drawProgram->setUniform("vertices", 0);
-    m_velocitiesTex->bindActive(GL_TEXTURE1);
     m_drawProgram->setUniform("velocities", 1);
-    m_drawProgram->setUniform("texWidth", m_workGroupSize.x);
+    m_drawProgram->setUniform("texWidth", static_cast<int>(ParticleState::chunkWidth));
     m_drawProgram->use();
 
     m_vao->bind();
-    m_vao->drawArrays(GL_POINTS, 0, m_numParticles);
+
+    for (unsigned int i = 0; i < m_chunks.size(); ++i)
+    {
+        m_chunks[i].positions->bindActive(GL_TEXTURE0);
+        m_chunks[i].velocities->bindActive(GL_TEXTURE1);
+
+        if (instanced)
+            setInstancedIndices(culled ? m_culling->indices() : nullptr, i * ParticleState::chunkSize);
+
+        // the vertex shader fetches the particle of gl_VertexID, which is the culled index
+        if (culled && instanced)
+            m_culling->drawInstanced(*m_vao, i);
+        else if (culled)
+            m_culling->draw(*m_vao, i);
+        else if (instanced)
+            m_vao->drawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, m_initialState->chunkParticles(i));
+        else
+            m_vao->drawArrays(GL_POINTS, 0, m_initialState->chunkParticles(i));
+    }
+
     m_vao->unbind();
 
-    m_positionsTex->unbind();
     m_drawProgram->release();
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <vector>
+
 #include <globjects/base/ref_ptr.h>
 
 #include "AbstractParticleTechnique.h"
@@ -16,8 +18,7 @@ class FragmentShaderParticles : public AbstractParticleTechnique
 {
 public:
     FragmentShaderParticles(
-        const std::vector<glm::vec4> & positions
-    ,   const std::vector<glm::vec4> & velocities
+        const SharedParticleState & initialState
     ,   const globjects::Texture & forces
     ,   const gloperate::AbstractCameraCapability & cameraCap
     ,   const glm::ivec2 viewport);
@@ -26,23 +27,30 @@ public:
 
     virtual void initialize() override;
     virtual void reset() override;
+    virtual void release() override;
 
     virtual void step(float elapsed) override;
 
+    virtual void readback(globjects::Buffer & buffer) override;
+
 protected:
     virtual void draw_impl() override;
 
+    virtual void resizeChunks() override;
+    virtual void uploadChunk(unsigned int chunk, unsigned int begin, unsigned int end) override;
+
 protected:
-    std::vector<glm::vec4> m_positionsFilled;
-    std::vector<glm::vec4> m_velocitiesFilled;
+    struct Chunk
+    {
+        globjects::ref_ptr<globjects::Texture> positions;
+        globjects::ref_ptr<globjects::Texture> velocities;
 
-    globjects::ref_ptr<globjects::Texture> m_positionsTex;
-    globjects::ref_ptr<globjects::Texture> m_velocitiesTex;
+        globjects::ref_ptr<globjects::Framebuffer> updateFbo;
+    };
+
+    std::vector<Chunk> m_chunks;
 
-    globjects::ref_ptr<globjects::Framebuffer> m_updateFbo;
     globjects::ref_ptr<gloperate::ScreenAlignedQuad> m_updateQuad;
 
     globjects::ref_ptr<globjects::VertexArray> m_vao;
-
-    glm::ivec2 m_workGroupSize;
 };
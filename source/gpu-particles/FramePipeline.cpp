@@ -0,0 +1,105 @@
+#include "FramePipeline.h"
+
+#include <algorithm>
+
+#include <glbinding/gl/enum.h>
+#include <glbinding/gl/bitfield.h>
+
+#include <globjects/Sync.h>
+
+
+using namespace gl;
+using namespace globjects;
+
+namespace
+{
+
+// weight of the latest frame in the running averages
+const float smoothing = 0.05f;
+
+// wait in slices of 100ms, a lost context or driver reset must not hang the frame forever
+const GLuint64 waitTimeout = 100000000;
+const int maxWaitSlices = 50;
+
+}
+
+
+double FramePipeline::wait(Sync * fence)
+{
+    if (!fence)
+        return 0.0;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < maxWaitSlices; ++i)
+    {
+        const GLenum result = fence->clientWait(GL_SYNC_FLUSH_COMMANDS_BIT, waitTimeout);
+
+        if (result != GL_TIMEOUT_EXPIRED)
+            break;
+    }
+
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+FramePipeline::FramePipeline(const unsigned int maxFramesInFlight)
+: m_maxFramesInFlight(std::max(maxFramesInFlight, 1u))
+, m_started(false)
+, m_overlap(1.f)
+, m_waitTime(0.f)
+{
+}
+
+FramePipeline::~FramePipeline()
+{
+}
+
+unsigned int FramePipeline::maxFramesInFlight() const
+{
+    return m_maxFramesInFlight;
+}
+
+void FramePipeline::setMaxFramesInFlight(const unsigned int maxFramesInFlight)
+{
+    m_maxFramesInFlight = std::max(maxFramesInFlight, 1u);
+}
+
+void FramePipeline::beginFrame()
+{
+    double waited = 0.0;
+
+    while (m_fences.size() >= m_maxFramesInFlight)
+    {
+        waited += wait(m_fences.front());
+        m_fences.pop_front();
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+
+    if (m_started)
+    {
+        const double interval = std::chrono::duration<double, std::milli>(now - m_frameStart).count();
+        const float overlap = interval > 0.0 ? static_cast<float>(1.0 - std::min(waited / interval, 1.0)) : 1.f;
+
+        m_overlap  += (overlap - m_overlap) * smoothing;
+        m_waitTime += (static_cast<float>(waited) - m_waitTime) * smoothing;
+    }
+
+    m_started = true;
+    m_frameStart = now;
+}
+
+void FramePipeline::endFrame()
+{
+    m_fences.push_back(Sync::fence(GL_SYNC_GPU_COMMANDS_COMPLETE));
+}
+
+float FramePipeline::overlap() const
+{
+    return m_overlap;
+}
+
+float FramePipeline::waitTime() const
+{
+    return m_waitTime;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+
+#include <globjects/base/ref_ptr.h>
+
+
+namespace globjects
+{
+    class Sync;
+}
+
+
+// Paces frames with fence sync objects instead of glFinish: the CPU may run up to
+// maxFramesInFlight frames ahead of the GPU before beginFrame blocks on the oldest fence.
+class FramePipeline
+{
+public:
+    // blocks until the fence is signaled and returns the time spent waiting in milliseconds
+    static double wait(globjects::Sync * fence);
+
+public:
+    explicit FramePipeline(unsigned int maxFramesInFlight = 2);
+    ~FramePipeline();
+
+    unsigned int maxFramesInFlight() const;
+    void setMaxFramesInFlight(unsigned int maxFramesInFlight);
+
+    void beginFrame();
+    void endFrame();
+
+    // smoothed fraction of the frame interval the CPU spent working instead of waiting on the GPU
+    float overlap() const;
+    // smoothed time per frame spent waiting on the GPU in milliseconds
+    float waitTime() const;
+
+protected:
+    unsigned int m_maxFramesInFlight;
+
+    std::deque<globjects::ref_ptr<globjects::Sync>> m_fences;
+
+    bool m_started;
+    std::chrono::steady_clock::time_point m_frameStart;
+
+    float m_overlap;
+    float m_waitTime;
+};
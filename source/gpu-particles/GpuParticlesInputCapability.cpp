@@ -4,6 +4,8 @@
 
 GpuParticlesInputCapability::GpuParticlesInputCapability()
 :   m_paused(false)
+,   m_saveRequested(false)
+,   m_restoreRequested(false)
 {
 }
 
@@ -16,6 +18,20 @@ bool GpuParticlesInputCapability::paused() const
     return m_paused;
 }
 
+bool GpuParticlesInputCapability::saveRequested()
+{
+    const bool requested = m_saveRequested;
+    m_saveRequested = false;
+    return requested;
+}
+
+bool GpuParticlesInputCapability::restoreRequested()
+{
+    const bool requested = m_restoreRequested;
+    m_restoreRequested = false;
+    return requested;
+}
+
 void GpuParticlesInputCapability::onMouseMove(int /*x*/, int /*y*/)
 {
 }
@@ -42,6 +58,14 @@ void GpuParticlesInputCapability::onKeyDown(gloperate::Key key)
     {
         m_paused = !m_paused;
     }
+    else if (key == gloperate::Key::KeyF5)
+    {
+        m_saveRequested = true;
+    }
+    else if (key == gloperate::Key::KeyF9)
+    {
+        m_restoreRequested = true;
+    }
 }
 
 void GpuParticlesInputCapability::onKeyUp(gloperate::Key /*key*/)
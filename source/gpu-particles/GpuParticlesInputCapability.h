@@ -15,6 +15,10 @@ public:
 
     bool paused() const;
 
+    // one-shot requests of the checkpoint keys, cleared when queried
+    bool saveRequested();
+    bool restoreRequested();
+
 
     // Virtual functions from AbstractInputCapability
     virtual void onMouseMove(int x, int y) override;
@@ -28,6 +32,8 @@ public:
 
 protected:
     bool m_paused;
+    bool m_saveRequested;
+    bool m_restoreRequested;
 
 };
 
@@ -0,0 +1,126 @@
+#include "MappedFile.h"
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+MappedFile::MappedFile()
+: m_data(nullptr)
+, m_size(0)
+#if defined(_WIN32)
+, m_file(INVALID_HANDLE_VALUE)
+, m_mapping(nullptr)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const std::string & path)
+{
+    close();
+
+#if defined(_WIN32)
+    m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+    {
+        close();
+        return false;
+    }
+
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!m_mapping)
+    {
+        close();
+        return false;
+    }
+
+    m_data = static_cast<const unsigned char *>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+    m_size = static_cast<std::size_t>(size.QuadPart);
+#else
+    const int file = ::open(path.c_str(), O_RDONLY);
+    if (file < 0)
+        return false;
+
+    struct stat status;
+    if (fstat(file, &status) != 0 || status.st_size == 0)
+    {
+        ::close(file);
+        return false;
+    }
+
+    void * data = mmap(nullptr, static_cast<std::size_t>(status.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+
+    // the mapping keeps the file referenced
+    ::close(file);
+
+    if (data == MAP_FAILED)
+        return false;
+
+    // frames are streamed front to back, let the kernel read ahead
+    madvise(data, static_cast<std::size_t>(status.st_size), MADV_SEQUENTIAL);
+
+    m_data = static_cast<const unsigned char *>(data);
+    m_size = static_cast<std::size_t>(status.st_size);
+#endif
+
+    if (!m_data)
+    {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void MappedFile::close()
+{
+#if defined(_WIN32)
+    if (m_data)
+        UnmapViewOfFile(m_data);
+    if (m_mapping)
+        CloseHandle(m_mapping);
+    if (m_file != INVALID_HANDLE_VALUE)
+        CloseHandle(m_file);
+
+    m_mapping = nullptr;
+    m_file = INVALID_HANDLE_VALUE;
+#else
+    if (m_data)
+        munmap(const_cast<unsigned char *>(m_data), m_size);
+#endif
+
+    m_data = nullptr;
+    m_size = 0;
+}
+
+bool MappedFile::isOpen() const
+{
+    return m_data != nullptr;
+}
+
+const unsigned char * MappedFile::data() const
+{
+    return m_data;
+}
+
+std::size_t MappedFile::size() const
+{
+    return m_size;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+
+// Read-only memory mapping of a whole file. Pages are read from disk on first access, so
+// touching a range on a background thread prefetches it for any later reader.
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    bool open(const std::string & path);
+    void close();
+
+    bool isOpen() const;
+
+    const unsigned char * data() const;
+    std::size_t size() const;
+
+    // Note: this is intentionally not implemented, a mapping has a single owner
+    MappedFile(const MappedFile & file);
+    MappedFile & operator=(const MappedFile & file);
+
+protected:
+    const unsigned char * m_data;
+    std::size_t m_size;
+
+#if defined(_WIN32)
+    void * m_file;
+    void * m_mapping;
+#endif
+};
@@ -0,0 +1,195 @@
+#include "ParticleCulling.h"
+
+#include <cstddef>
+
+#include <glbinding/gl/gl.h>
+#include <glbinding/gl/extension.h>
+
+#include <globjects/globjects.h>
+#include <globjects/Buffer.h>
+#include <globjects/Program.h>
+#include <globjects/Shader.h>
+#include <globjects/Texture.h>
+#include <globjects/VertexArray.h>
+
+#include <globjects/base/File.h>
+#include <globjects/base/StringTemplate.h>
+
+#include "ParticlePool.h"
+#include "ParticleState.h"
+
+
+using namespace gl;
+using namespace glm;
+using namespace globjects;
+
+namespace
+{
+
+// work group size of particle-cull.comp, matches the indirect dispatches over a pool
+const unsigned int cullLocalSize = poolLocalSize;
+
+}
+
+
+ParticleCulling::ParticleCulling(const Source source, const ParticleFormat format)
+: m_source(source)
+, m_format(format)
+, m_program(nullptr)
+, m_pool(nullptr)
+{
+}
+
+ParticleCulling::~ParticleCulling()
+{
+}
+
+bool ParticleCulling::isSupported()
+{
+    return hasExtension(GLextension::GL_ARB_compute_shader) && hasExtension(GLextension::GL_ARB_draw_indirect);
+}
+
+void ParticleCulling::begin(const unsigned int chunkCount, const mat4 & viewProjection, const float interpolation, Buffer * pool)
+{
+    static const unsigned int chunkSize = ParticleState::chunkSize;
+
+    if (m_clearedCommands.size() != chunkCount)
+    {
+        m_clearedCommands.resize(chunkCount);
+        for (unsigned int i = 0; i < chunkCount; ++i)
+            m_clearedCommands[i] = { 0, 1, i * chunkSize, 0, 0, 4, 0, 0, 0 };
+
+        if (!m_indices)
+        {
+            m_indices = new Buffer();
+            m_commands = new Buffer();
+        }
+
+        m_indices->setData(static_cast<GLsizeiptr>(chunkCount * chunkSize * sizeof(GLuint)), nullptr, GL_DYNAMIC_COPY);
+        m_commands->setData(m_clearedCommands, GL_DYNAMIC_COPY);
+    }
+    else
+        m_commands->setSubData(m_clearedCommands);
+
+    const int variant = pool ? 1 : 0;
+    if (!m_programs[variant])
+        m_programs[variant] = createProgram(pool != nullptr);
+
+    m_program = m_programs[variant];
+    m_pool = pool;
+
+    m_program->setUniform("viewProjection", viewProjection);
+    m_program->setUniform("interpolation", interpolation);
+
+    // the compute technique wrote its particles in shader storage
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    m_indices->bindBase(GL_SHADER_STORAGE_BUFFER, 2);
+    m_commands->bindBase(GL_SHADER_STORAGE_BUFFER, 3);
+
+    if (m_pool)
+    {
+        m_pool->bindBase(GL_SHADER_STORAGE_BUFFER, 7);
+        m_pool->bind(GL_DISPATCH_INDIRECT_BUFFER);
+    }
+
+    m_program->use();
+}
+
+void ParticleCulling::cull(const unsigned int chunk, const unsigned int count, Buffer & positions, Buffer & velocities)
+{
+    positions.bindBase(GL_SHADER_STORAGE_BUFFER, 0);
+    velocities.bindBase(GL_SHADER_STORAGE_BUFFER, 1);
+
+    dispatch(chunk, count);
+}
+
+void ParticleCulling::cull(const unsigned int chunk, const unsigned int count, Texture & positions, Texture & velocities)
+{
+    positions.bindActive(GL_TEXTURE0);
+    velocities.bindActive(GL_TEXTURE1);
+
+    dispatch(chunk, count);
+}
+
+void ParticleCulling::dispatch(const unsigned int chunk, const unsigned int count)
+{
+    m_program->setUniform("chunk", chunk);
+
+    if (m_pool)
+    {
+        glDispatchComputeIndirect(poolCommand(chunk, offsetof(PoolChunk, particleGroups)));
+        return;
+    }
+
+    if (count == 0)
+        return;
+
+    m_program->setUniform("count", count);
+    m_program->dispatchCompute((count + cullLocalSize - 1) / cullLocalSize, 1, 1);
+}
+
+void ParticleCulling::end()
+{
+    m_program->release();
+
+    for (GLuint index = 0; index < 4; ++index)
+        Buffer::unbind(GL_SHADER_STORAGE_BUFFER, index);
+
+    if (m_pool)
+    {
+        Buffer::unbind(GL_SHADER_STORAGE_BUFFER, 7);
+        Buffer::unbind(GL_DISPATCH_INDIRECT_BUFFER);
+    }
+
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_ELEMENT_ARRAY_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+}
+
+void ParticleCulling::draw(VertexArray & vao, const unsigned int chunk) const
+{
+    vao.bindElementBuffer(m_indices);
+
+    m_commands->bind(GL_DRAW_INDIRECT_BUFFER);
+    vao.drawElementsIndirect(GL_POINTS, GL_UNSIGNED_INT, reinterpret_cast<const void *>(chunk * sizeof(DrawCommand)));
+    Buffer::unbind(GL_DRAW_INDIRECT_BUFFER);
+}
+
+void ParticleCulling::drawInstanced(VertexArray & vao, const unsigned int chunk) const
+{
+    m_commands->bind(GL_DRAW_INDIRECT_BUFFER);
+    vao.drawArraysIndirect(GL_TRIANGLE_STRIP, reinterpret_cast<const void *>(chunk * sizeof(DrawCommand) + offsetof(DrawCommand, quadVertices)));
+    Buffer::unbind(GL_DRAW_INDIRECT_BUFFER);
+}
+
+Buffer * ParticleCulling::indices() const
+{
+    return m_indices;
+}
+
+Program * ParticleCulling::createProgram(const bool pooled) const
+{
+    Program * program = new Program();
+
+    StringTemplate * stringTemplate = new StringTemplate(
+        new File("data/gpu-particles/particle-cull.comp"));
+    stringTemplate->replace("FORMAT_INDEX", particleFormatIndex(m_format));
+    stringTemplate->replace("POOL_ENABLED", pooled ? 1 : 0);
+    stringTemplate->replace("CULL_SOURCE", static_cast<int>(m_source));
+    stringTemplate->update();
+
+    program->attach(new Shader(GL_COMPUTE_SHADER, stringTemplate));
+
+    const unsigned int chunkSize = ParticleState::chunkSize;
+    program->setUniform("chunkSize", chunkSize);
+    program->setUniform("positionDecode", particleFormatDecode(m_format, fixedPositionRange));
+    program->setUniform("velocityDecode", particleFormatDecode(m_format, fixedVelocityRange));
+
+    if (m_source == Source::Textures)
+    {
+        program->setUniform("positions", 0);
+        program->setUniform("velocities", 1);
+        program->setUniform("texWidth", static_cast<int>(ParticleState::chunkWidth));
+    }
+
+    return program;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <globjects/base/ref_ptr.h>
+
+#include "ParticleFormat.h"
+
+
+namespace globjects
+{
+    class Buffer;
+    class Program;
+    class Texture;
+    class VertexArray;
+}
+
+
+// Frustum culling of the gpu techniques ahead of their draws. A compute pass writes the indices of
+// the visible particles of each chunk into a compacted buffer and counts them in an indirect
+// command per chunk, so the vertex and geometry stages only run for visible particles.
+class ParticleCulling
+{
+public:
+    // where the pass reads the particles from, see particle-cull.comp
+    enum class Source { Buffers, Textures };
+
+    // the commands of a chunk: a DrawElementsIndirectCommand over its indices, followed by a
+    // DrawArraysIndirectCommand of an instanced quad per index
+    struct DrawCommand
+    {
+        unsigned int count;
+        unsigned int instanceCount;
+        unsigned int firstIndex;
+        int baseVertex;
+        unsigned int baseInstance;
+
+        unsigned int quadVertices;
+        unsigned int quads;
+        unsigned int quadFirst;
+        unsigned int quadBaseInstance;
+    };
+
+public:
+    ParticleCulling(Source source, ParticleFormat format);
+    ~ParticleCulling();
+
+    // compute shaders and indirect draws
+    static bool isSupported();
+
+    // starts culling chunkCount chunks; with a pool, see particle-pool.inc, only its live particles are culled
+    void begin(unsigned int chunkCount, const glm::mat4 & viewProjection, float interpolation, globjects::Buffer * pool = nullptr);
+    void cull(unsigned int chunk, unsigned int count, globjects::Buffer & positions, globjects::Buffer & velocities);
+    void cull(unsigned int chunk, unsigned int count, globjects::Texture & positions, globjects::Texture & velocities);
+    // orders the following draws after the culling
+    void end();
+
+    // draws the visible particles of a chunk with a vertex array that fetches them by their index within the chunk
+    void draw(globjects::VertexArray & vao, unsigned int chunk) const;
+    // draws a triangle strip quad per visible particle of a chunk, the vertex shader fetches the
+    // particle of an instance from indices() at chunk * ParticleState::chunkSize + gl_InstanceID
+    void drawInstanced(globjects::VertexArray & vao, unsigned int chunk) const;
+
+    globjects::Buffer * indices() const;
+
+protected:
+    globjects::Program * createProgram(bool pooled) const;
+    void dispatch(unsigned int chunk, unsigned int count);
+
+protected:
+    const Source m_source;
+    const ParticleFormat m_format;
+
+    // without and with pool, created on first use
+    std::array<globjects::ref_ptr<globjects::Program>, 2> m_programs;
+    globjects::Program * m_program;
+    globjects::Buffer * m_pool;
+
+    // chunk size indices per chunk
+    globjects::ref_ptr<globjects::Buffer> m_indices;
+    globjects::ref_ptr<globjects::Buffer> m_commands;
+    // the cleared commands, uploaded by begin
+    std::vector<DrawCommand> m_clearedCommands;
+};
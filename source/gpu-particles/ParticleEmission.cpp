@@ -0,0 +1,98 @@
+#include "ParticleEmission.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "CounterRandom.h"
+
+
+using namespace glm;
+
+
+namespace
+{
+
+// independent random streams of the counter-based generator, see GpuParticles and ForceField for streams 0 to 3
+const std::uint32_t emissionStream = 4;
+const std::uint32_t lifetimeStream = 5;
+
+// bounds the particles owed after a long step, more than any pool holds
+const float maxEmission = 1073741824.f;
+
+}
+
+
+void emitParticle(const ParticleEmission & emission, const std::uint64_t sequence, vec3 & position, vec3 & velocity)
+{
+    const Philox4x32 random(emission.seed);
+    const Philox4x32::Block block = random(sequence, emissionStream);
+
+    const unsigned int emitters = std::max(emission.emitters, 1u);
+    const float angle = 6.28318530718f * static_cast<float>(static_cast<std::uint32_t>(sequence) % emitters) / static_cast<float>(emitters);
+    const vec3 emitter = emitters > 1 ? vec3(std::cos(angle), 0.f, std::sin(angle)) * emitterRingRadius : vec3(0.f);
+
+    const float z = 2.f * Philox4x32::uniform(block.x[0]) - 1.f;
+    const float phi = 6.28318530718f * Philox4x32::uniform(block.x[1]);
+    const float r = std::sqrt(max(1.f - z * z, 0.f));
+    const vec3 direction(r * std::cos(phi), r * std::sin(phi), z);
+
+    position = emitter + direction * emitterRadius;
+    velocity = direction * (emissionSpeed * (0.5f + Philox4x32::uniform(block.x[2])));
+}
+
+float initialLifetime(const ParticleEmission & emission, const std::uint64_t index)
+{
+    const Philox4x32 random(emission.seed);
+    return emission.lifetime * Philox4x32::uniform(random(index, lifetimeStream).x[0]);
+}
+
+
+EmissionClock::EmissionClock()
+: m_owed(0.f)
+, m_sequence(0)
+{
+}
+
+unsigned int EmissionClock::advance(const ParticleEmission & emission, const float elapsed)
+{
+    float count = 0.f;
+
+    switch (emission.mode)
+    {
+    case EmitterMode::Continuous:
+        m_owed = std::min(m_owed + emission.rate * elapsed, maxEmission);
+        count = std::floor(m_owed);
+        m_owed -= count;
+        break;
+
+    case EmitterMode::Bursts:
+        // intervals missed by a long step are released in one burst
+        m_owed += elapsed;
+        if (emission.burstInterval > 0.f && m_owed >= emission.burstInterval)
+        {
+            const float bursts = std::floor(m_owed / emission.burstInterval);
+            m_owed -= bursts * emission.burstInterval;
+            count = std::min(std::floor(bursts * emission.burstInterval * emission.rate), maxEmission);
+        }
+        break;
+
+    default:
+        m_owed = 0.f;
+    }
+
+    const auto emitted = static_cast<unsigned int>(count);
+    m_sequence += emitted;
+
+    return emitted;
+}
+
+void EmissionClock::reset()
+{
+    m_owed = 0.f;
+    m_sequence = 0;
+}
+
+std::uint64_t EmissionClock::sequence() const
+{
+    return m_sequence;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+
+enum class EmitterMode { Off, Continuous, Bursts };
+
+// Emitters releasing particles with a limited lifetime into a pool of num_particles slots. Dead
+// particles free their slots, emitted particles only take free slots, so a burst never grows the
+// memory beyond the pool. Keep in sync with emitParticle in data/gpu-particles/particle-pool.comp.
+struct ParticleEmission
+{
+    EmitterMode mode;
+    // a single emitter sits at the center, several are spread on a ring around it
+    unsigned int emitters;
+    // particles per second; bursts release the particles of a whole interval at once
+    float rate;
+    float burstInterval;
+    // seconds from emission to death
+    float lifetime;
+    // key of the random numbers, emitted particles only depend on seed and sequence number
+    unsigned int seed;
+};
+
+// emitted particles start on a small sphere around their emitter and move away from it
+const float emitterRadius = 0.05f;
+const float emitterRingRadius = 1.f;
+const float emissionSpeed = 0.5f;
+
+// position and velocity of the emitted particle with the given sequence number
+void emitParticle(const ParticleEmission & emission, std::uint64_t sequence, glm::vec3 & position, glm::vec3 & velocity);
+
+// remaining lifetime of a particle of the initial state, spread across the lifetime so that
+// the initial particles die out gradually when the emitters take over
+float initialLifetime(const ParticleEmission & emission, std::uint64_t index);
+
+
+// Tells how many particles the emitters release per step, shared by all pooling techniques.
+class EmissionClock
+{
+public:
+    EmissionClock();
+
+    // particles to emit for a step of elapsed seconds
+    unsigned int advance(const ParticleEmission & emission, float elapsed);
+    void reset();
+
+    // sequence number of the next emitted particle; particles that found no free slot use theirs up as well
+    std::uint64_t sequence() const;
+
+protected:
+    // fractional particles owed by a continuous emitter, seconds since the last burst otherwise
+    float m_owed;
+    std::uint64_t m_sequence;
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+
+// Independent particle systems simulated together, e.g., for parameter sweeps. The systems hold
+// consecutive ranges of systemParticles particles, the last one the remainder as well, so the
+// ensemble index of a particle follows from its index and the techniques step all systems with the
+// dispatches of a single one. System s starts from the initial state of seed + s and samples the
+// force field layer of seed + s, see ForceField::setLayers. Systems never interact, so the painter
+// runs ensembles without sorting, emission, interactions and tree gravity, which would mix them.
+struct ParticleEnsemble
+{
+    unsigned int systems;
+    unsigned int systemParticles;
+
+    // layers of the force field and their tiling within its texture, see ForceField::layerGrid
+    unsigned int forceLayers;
+    glm::ivec3 forceGrid;
+};
+
+// bound of the ensemble_size property, checkpoints of larger ensembles are rejected
+const unsigned int maxEnsembleSize = 1024;
+
+// a single system without layers, the regular simulation
+inline ParticleEnsemble singleSystem(const unsigned int count)
+{
+    return { 1, count, 1, glm::ivec3(1) };
+}
+
+inline unsigned int ensembleSystem(const ParticleEnsemble & ensemble, const unsigned int particle)
+{
+    return std::min(particle / std::max(ensemble.systemParticles, 1u), ensemble.systems - 1);
+}
+
+// first particle of system, systems is the end of the last one
+inline unsigned int ensembleBegin(const ParticleEnsemble & ensemble, const unsigned int system, const unsigned int count)
+{
+    return system < ensemble.systems ? system * ensemble.systemParticles : count;
+}
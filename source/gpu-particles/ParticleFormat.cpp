@@ -0,0 +1,121 @@
+#include "ParticleFormat.h"
+
+#include <cstring>
+
+#include <glm/gtc/packing.hpp>
+
+
+using namespace glm;
+
+
+int particleFormatIndex(const ParticleFormat format)
+{
+    return static_cast<int>(format);
+}
+
+std::size_t particleFormatSize(const ParticleFormat format)
+{
+    switch (format)
+    {
+    case ParticleFormat::Float3:
+        return 3 * sizeof(float);
+    case ParticleFormat::Half:
+    case ParticleFormat::Fixed16:
+        return 4 * sizeof(std::uint16_t);
+    default:
+        return 4 * sizeof(float);
+    }
+}
+
+vec2 particleFormatDecode(const ParticleFormat format, const float range)
+{
+    // normalized [0, 1] to [-range, range]
+    if (format == ParticleFormat::Fixed16)
+        return vec2(2.f * range, -range);
+
+    return vec2(1.f, 0.f);
+}
+
+std::uint16_t encodeComponent(const ParticleFormat format, const float value, const float range)
+{
+    if (format == ParticleFormat::Half)
+        return packHalf1x16(value);
+
+    // packUnorm1x16 clamps to [0, 1]
+    return packUnorm1x16(value / (2.f * range) + 0.5f);
+}
+
+void encodeParticles(const ParticleFormat format, const vec4 * values, const std::size_t count, const float range, void * encoded)
+{
+    switch (format)
+    {
+    case ParticleFormat::Float4:
+        std::memcpy(encoded, values, count * sizeof(vec4));
+        break;
+
+    case ParticleFormat::Float3:
+    {
+        float * out = static_cast<float *>(encoded);
+        for (std::size_t i = 0; i < count; ++i, out += 3)
+        {
+            out[0] = values[i].x;
+            out[1] = values[i].y;
+            out[2] = values[i].z;
+        }
+        break;
+    }
+
+    case ParticleFormat::Half:
+    case ParticleFormat::Fixed16:
+    {
+        std::uint16_t * out = static_cast<std::uint16_t *>(encoded);
+        for (std::size_t i = 0; i < count; ++i, out += 4)
+        {
+            out[0] = encodeComponent(format, values[i].x, range);
+            out[1] = encodeComponent(format, values[i].y, range);
+            out[2] = encodeComponent(format, values[i].z, range);
+            out[3] = 0;
+        }
+        break;
+    }
+    }
+}
+
+void decodeParticles(const ParticleFormat format, const void * encoded, const std::size_t count, const float range, const float w, vec4 * values)
+{
+    switch (format)
+    {
+    case ParticleFormat::Float4:
+    {
+        const vec4 * in = static_cast<const vec4 *>(encoded);
+        for (std::size_t i = 0; i < count; ++i)
+            values[i] = vec4(in[i].x, in[i].y, in[i].z, w);
+        break;
+    }
+
+    case ParticleFormat::Float3:
+    {
+        const float * in = static_cast<const float *>(encoded);
+        for (std::size_t i = 0; i < count; ++i, in += 3)
+            values[i] = vec4(in[0], in[1], in[2], w);
+        break;
+    }
+
+    case ParticleFormat::Half:
+    case ParticleFormat::Fixed16:
+    {
+        const vec2 decode = particleFormatDecode(format, range);
+        const std::uint16_t * in = static_cast<const std::uint16_t *>(encoded);
+
+        for (std::size_t i = 0; i < count; ++i, in += 4)
+        {
+            if (format == ParticleFormat::Half)
+                values[i] = vec4(unpackHalf1x16(in[0]), unpackHalf1x16(in[1]), unpackHalf1x16(in[2]), w);
+            else
+                values[i] = vec4(unpackUnorm1x16(in[0]) * decode.x + decode.y, unpackUnorm1x16(in[1]) * decode.x + decode.y,
+                    unpackUnorm1x16(in[2]) * decode.x + decode.y, w);
+        }
+        break;
+    }
+    }
+}
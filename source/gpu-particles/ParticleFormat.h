@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+
+// Storage format of particle positions and velocities on the GPU. The step is bandwidth bound,
+// so smaller formats trade precision for throughput. Every format stores the xyz components only,
+// padded to 8 bytes for the 16 bit formats; the float4 layout keeps w for compatibility.
+enum class ParticleFormat { Float4, Float3, Half, Fixed16 };
+
+// Fixed point values are normalized to these ranges around the origin; values beyond are clamped.
+// The particles are attracted to the center and rarely leave a radius of about 2.
+const float fixedPositionRange = 4.f;
+const float fixedVelocityRange = 8.f;
+
+
+// value used for PARTICLE_FORMAT in shaders, see particle-format.inc
+int particleFormatIndex(ParticleFormat format);
+
+// bytes of one stored position or velocity
+std::size_t particleFormatSize(ParticleFormat format);
+
+// scale and offset that decode a stored value (normalized for fixed point) as stored * x + y
+glm::vec2 particleFormatDecode(ParticleFormat format, float range);
+
+// encodes the xyz components of count values into the memory layout of the format
+void encodeParticles(ParticleFormat format, const glm::vec4 * values, std::size_t count, float range, void * encoded);
+
+// decodes count values stored in the format back to xyz, w is set to the given value
+void decodeParticles(ParticleFormat format, const void * encoded, std::size_t count, float range, float w, glm::vec4 * values);
+
+// encodes a single component into the 16 bit half or fixed point representation
+std::uint16_t encodeComponent(ParticleFormat format, float value, float range);
@@ -0,0 +1,259 @@
+#include "ParticleInteraction.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "ParticleOrder.h"
+#include "ParticleState.h"
+#include "WorkStealingPool.h"
+
+
+namespace
+{
+
+const unsigned int minTableSize = 1u << 10;
+const unsigned int maxTableSize = 1u << 20;
+
+// bounds the cell coordinates of far away particles to the range of int
+const float cellLimit = 1048576.f;
+
+int cellCoordinate(const float value, const float radius)
+{
+    float c = std::floor(value / radius);
+
+    // NaN fails both comparisons and ends up in the first cell
+    c = c > -cellLimit ? c : -cellLimit;
+    c = c < cellLimit ? c : cellLimit;
+
+    return static_cast<int>(c);
+}
+
+std::uint32_t cellHash(const int x, const int y, const int z)
+{
+    return (static_cast<std::uint32_t>(x) * 73856093u)
+        ^ (static_cast<std::uint32_t>(y) * 19349663u)
+        ^ (static_cast<std::uint32_t>(z) * 83492791u);
+}
+
+// weight of the force between two particles at distance q * radius, positive pushes them apart
+float interactionWeight(const InteractionMode mode, const float q)
+{
+    return mode == InteractionMode::Repulsion ? (1.f - q) * (1.f - q) : (1.f - q) * (1.f - 2.f * q);
+}
+
+}
+
+
+unsigned int interactionTableSize(const unsigned int count)
+{
+    unsigned int size = minTableSize;
+    while (size < count && size < maxTableSize)
+        size *= 2;
+
+    return size;
+}
+
+
+CpuInteractionGrid::CpuInteractionGrid()
+: m_radius(1.f)
+, m_tableMask(0)
+, m_countsSize(0)
+{
+}
+
+CpuInteractionGrid::~CpuInteractionGrid()
+{
+}
+
+void CpuInteractionGrid::build(WorkStealingPool & threadPool, const std::vector<CpuParticleArrays> & chunks,
+    const unsigned int count, const float radius)
+{
+    static const std::size_t chunkSize = ParticleState::chunkSize;
+
+    const std::size_t tableSize = interactionTableSize(count);
+
+    m_radius = radius;
+    m_tableMask = static_cast<std::uint32_t>(tableSize - 1);
+
+    if (m_countsSize != tableSize)
+    {
+        m_counts.reset(new std::atomic<std::uint32_t>[tableSize]);
+        m_countsSize = tableSize;
+    }
+
+    m_cells.resize(count);
+    m_starts.resize(tableSize + 1);
+    m_blockSums.resize((tableSize + s_scanGrain - 1) / s_scanGrain);
+    m_particles.resize(count);
+    m_x.resize(count);
+    m_y.resize(count);
+    m_z.resize(count);
+
+    threadPool.parallelFor(tableSize, s_scanGrain, [this](std::size_t begin, std::size_t end)
+    {
+        for (std::size_t cell = begin; cell < end; ++cell)
+            m_counts[cell].store(0, std::memory_order_relaxed);
+    });
+
+    threadPool.parallelFor(count, particleGrain, [this, &chunks, radius](std::size_t begin, std::size_t end)
+    {
+        const CpuParticleArrays & particles = chunks[begin / chunkSize];
+        const std::size_t offset = begin / chunkSize * chunkSize;
+
+        for (std::size_t p = begin; p < end; ++p)
+        {
+            const std::size_t i = p - offset;
+            const std::uint32_t cell = cellHash(cellCoordinate(particles.px[i], radius),
+                cellCoordinate(particles.py[i], radius), cellCoordinate(particles.pz[i], radius)) & m_tableMask;
+
+            m_cells[p] = cell;
+            m_counts[cell].fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+
+    // exclusive scan of the counts: block sums, a serial scan over the few blocks, then the blocks
+    threadPool.parallelFor(tableSize, s_scanGrain, [this](std::size_t begin, std::size_t end)
+    {
+        std::uint32_t sum = 0;
+        for (std::size_t cell = begin; cell < end; ++cell)
+            sum += m_counts[cell].load(std::memory_order_relaxed);
+
+        m_blockSums[begin / s_scanGrain] = sum;
+    });
+
+    std::uint32_t total = 0;
+    for (auto & sum : m_blockSums)
+    {
+        const std::uint32_t block = sum;
+        sum = total;
+        total += block;
+    }
+
+    threadPool.parallelFor(tableSize, s_scanGrain, [this](std::size_t begin, std::size_t end)
+    {
+        std::uint32_t start = m_blockSums[begin / s_scanGrain];
+
+        for (std::size_t cell = begin; cell < end; ++cell)
+        {
+            const std::uint32_t cellCount = m_counts[cell].load(std::memory_order_relaxed);
+
+            // the counts turn into the cursors of the scatter
+            m_starts[cell] = start;
+            m_counts[cell].store(start, std::memory_order_relaxed);
+            start += cellCount;
+        }
+    });
+
+    m_starts[tableSize] = count;
+
+    threadPool.parallelFor(count, particleGrain, [this](std::size_t begin, std::size_t end)
+    {
+        for (std::size_t p = begin; p < end; ++p)
+            m_particles[m_counts[m_cells[p]].fetch_add(1, std::memory_order_relaxed)] = static_cast<std::uint32_t>(p);
+    });
+
+    // the scatter order depends on the thread timing, sorting each cell keeps the sums deterministic
+    threadPool.parallelFor(tableSize, s_scanGrain, [this, &chunks](std::size_t begin, std::size_t end)
+    {
+        for (std::size_t cell = begin; cell < end; ++cell)
+        {
+            const std::uint32_t first = m_starts[cell];
+            const std::uint32_t last = m_starts[cell + 1];
+
+            std::sort(m_particles.begin() + first, m_particles.begin() + last);
+
+            for (std::uint32_t slot = first; slot < last; ++slot)
+            {
+                const std::uint32_t p = m_particles[slot];
+                const CpuParticleArrays & particles = chunks[p / chunkSize];
+                const std::size_t i = p % chunkSize;
+
+                m_x[slot] = particles.px[i];
+                m_y[slot] = particles.py[i];
+                m_z[slot] = particles.pz[i];
+            }
+        }
+    });
+}
+
+void CpuInteractionGrid::apply(WorkStealingPool & threadPool, const std::vector<CpuParticleArrays> & chunks,
+    const unsigned int count, const ParticleInteraction & interaction, const float elapsed) const
+{
+    static const std::size_t chunkSize = ParticleState::chunkSize;
+
+    const float radius = m_radius;
+    const float radius2 = radius * radius;
+
+    threadPool.parallelFor(count, particleGrain, [this, &chunks, &interaction, radius, radius2, elapsed](std::size_t begin, std::size_t end)
+    {
+        const CpuParticleArrays & particles = chunks[begin / chunkSize];
+        const std::size_t offset = begin / chunkSize * chunkSize;
+
+        for (std::size_t p = begin; p < end; ++p)
+        {
+            const std::size_t i = p - offset;
+
+            const float x = particles.px[i];
+            const float y = particles.py[i];
+            const float z = particles.pz[i];
+
+            const int cx = cellCoordinate(x, radius);
+            const int cy = cellCoordinate(y, radius);
+            const int cz = cellCoordinate(z, radius);
+
+            float ax = 0.f, ay = 0.f, az = 0.f;
+
+            // neighbouring cells may share a hash, each is visited once
+            std::uint32_t visited[27];
+            int visitedCount = 0;
+
+            for (int dz = -1; dz <= 1; ++dz)
+            for (int dy = -1; dy <= 1; ++dy)
+            for (int dx = -1; dx <= 1; ++dx)
+            {
+                const std::uint32_t cell = cellHash(cx + dx, cy + dy, cz + dz) & m_tableMask;
+
+                if (std::find(visited, visited + visitedCount, cell) != visited + visitedCount)
+                    continue;
+                visited[visitedCount++] = cell;
+
+                for (std::uint32_t slot = m_starts[cell]; slot < m_starts[cell + 1]; ++slot)
+                {
+                    const float rx = x - m_x[slot];
+                    const float ry = y - m_y[slot];
+                    const float rz = z - m_z[slot];
+                    const float r2 = rx * rx + ry * ry + rz * rz;
+
+                    // skips particles out of reach, e.g., of colliding cells, and the particle itself
+                    if (r2 >= radius2 || r2 == 0.f)
+                        continue;
+
+                    const float r = std::sqrt(r2);
+                    const float scale = interaction.strength * interactionWeight(interaction.mode, r / radius) / r;
+
+                    ax += rx * scale;
+                    ay += ry * scale;
+                    az += rz * scale;
+                }
+            }
+
+            particles.vx[i] += ax * elapsed;
+            particles.vy[i] += ay * elapsed;
+            particles.vz[i] += az * elapsed;
+        }
+    });
+}
+
+void CpuInteractionGrid::clear()
+{
+    m_counts.reset();
+    m_countsSize = 0;
+
+    std::vector<std::uint32_t>().swap(m_cells);
+    std::vector<std::uint32_t>().swap(m_starts);
+    std::vector<std::uint32_t>().swap(m_blockSums);
+    std::vector<std::uint32_t>().swap(m_particles);
+    std::vector<float, AlignedAllocator<float>>().swap(m_x);
+    std::vector<float, AlignedAllocator<float>>().swap(m_y);
+    std::vector<float, AlignedAllocator<float>>().swap(m_z);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "AlignedAllocator.h"
+#include "CpuParticleKernels.h"
+
+
+class WorkStealingPool;
+
+
+enum class InteractionMode { None, Repulsion, Cohesion };
+
+// Short range forces between particles closer than radius, applied as a velocity change before
+// each force field step. Repulsion pushes particles apart, cohesion pulls them together beyond
+// half the radius and apart within it, so clusters keep a rest distance instead of collapsing.
+struct ParticleInteraction
+{
+    InteractionMode mode;
+    float radius;
+    float strength;
+};
+
+// cells of the interaction hash grid for count particles, a power of two within [2^10, 2^20]
+unsigned int interactionTableSize(unsigned int count);
+
+
+// Uniform hash grid with cells of the interaction radius, rebuilt every step by a parallel counting
+// sort: particles are counted per cell, the counts are scanned into cell ranges and the positions
+// are scattered into them. Each particle then only visits the 27 cells around it, keep in sync
+// with data/gpu-particles/particle-interaction.comp.
+class CpuInteractionGrid
+{
+public:
+    // cells of the table that are scanned per task
+    static const unsigned int s_scanGrain = 16384;
+
+public:
+    CpuInteractionGrid();
+    ~CpuInteractionGrid();
+
+    // chunks holds the structure of arrays of each chunk of ParticleState::chunkSize particles
+    void build(WorkStealingPool & threadPool, const std::vector<CpuParticleArrays> & chunks, unsigned int count, float radius);
+    // adds the interaction accelerations times elapsed to the velocities of the particles binned by build
+    void apply(WorkStealingPool & threadPool, const std::vector<CpuParticleArrays> & chunks, unsigned int count,
+        const ParticleInteraction & interaction, float elapsed) const;
+
+    void clear();
+
+protected:
+    float m_radius;
+    std::uint32_t m_tableMask;
+
+    // cell of each particle
+    std::vector<std::uint32_t> m_cells;
+    std::unique_ptr<std::atomic<std::uint32_t>[]> m_counts;
+    std::size_t m_countsSize;
+    // first slot of each cell, followed by the particle count
+    std::vector<std::uint32_t> m_starts;
+    std::vector<std::uint32_t> m_blockSums;
+
+    // particle index and position per slot, ordered by cell
+    std::vector<std::uint32_t> m_particles;
+    std::vector<float, AlignedAllocator<float>> m_x;
+    std::vector<float, AlignedAllocator<float>> m_y;
+    std::vector<float, AlignedAllocator<float>> m_z;
+};
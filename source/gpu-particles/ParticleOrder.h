@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "ParticleState.h"
+
+
+// particles per parallel task of the CPU passes, a multiple of 16 that keeps a task's six arrays
+// within L2 cache and divides the chunk size, so that no task spans two chunks
+const std::size_t particleGrain = 4096;
+
+static_assert(ParticleState::chunkSize % particleGrain == 0, "tasks must not span chunks");
+
+// 10 bits per axis, sorted by radix passes of 10 bits over the upper half of 64 bit keys
+const unsigned int mortonBits = 30;
+const unsigned int radixBits = 10;
+const std::size_t radixBuckets = std::size_t(1) << radixBits;
+
+// inserts two zero bits between each of the lower 10 bits
+inline std::uint32_t spreadBits(std::uint32_t v)
+{
+    v &= 0x000003ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// morton code of the 10 bit cell coordinates, x in the lowest bit
+inline std::uint32_t mortonCode(const std::uint32_t x, const std::uint32_t y, const std::uint32_t z)
+{
+    return spreadBits(x) | (spreadBits(y) << 1) | (spreadBits(z) << 2);
+}
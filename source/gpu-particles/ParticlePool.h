@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+
+#include <glm/glm.hpp>
+
+#include <glbinding/gl/types.h>
+
+
+// work group size of particle-pool.comp, also the particles per group of PoolChunk::particleGroups
+const unsigned int poolLocalSize = 512;
+
+// state of a chunk of the pool of the compute technique, mirrors particle-pool.inc
+struct PoolChunk
+{
+    glm::uvec4 stepGroups;
+    glm::uvec4 particleGroups;
+    glm::uvec4 compactGroups;
+    glm::uvec4 draw;
+    glm::uvec4 quads;
+    glm::uvec4 counts;
+};
+
+inline PoolChunk poolChunk(const unsigned int live, const unsigned int stepGroupParticles)
+{
+    const unsigned int groups = (live + poolLocalSize - 1) / poolLocalSize;
+
+    PoolChunk chunk;
+    chunk.stepGroups = glm::uvec4((live + stepGroupParticles - 1) / stepGroupParticles, 1, 1, 0);
+    chunk.particleGroups = glm::uvec4(groups, 1, 1, 0);
+    chunk.compactGroups = glm::uvec4(groups, 1, 1, 0);
+    chunk.draw = glm::uvec4(live, 1, 0, 0);
+    chunk.quads = glm::uvec4(4, live, 0, 0);
+    chunk.counts = glm::uvec4(live, live, live, 0);
+
+    return chunk;
+}
+
+// byte offset of a command of a chunk within the pool, for the indirect dispatches and draws
+inline gl::GLintptr poolCommand(const unsigned int chunk, const std::size_t command)
+{
+    return static_cast<gl::GLintptr>(chunk * sizeof(PoolChunk) + command);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+
+// How the particles are turned into their quads, all paths draw the same image. Which one is
+// fastest depends on the GPU: geometry shaders are slow on some, point sprites are limited to the
+// maximum point size of the implementation.
+enum class RenderPath
+{
+    GeometryShader // a point per particle, expanded by points.geom
+,   InstancedQuads // a triangle strip instance per particle, pulled from buffer textures by points_instanced.vert
+,   PointSprites   // a point per particle, sized by the vertex shader
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "AlignedAllocator.h"
+
+
+// Initial particle state, created by the painter and shared read-only by all techniques.
+// Techniques upload straight from these arrays instead of keeping copies of their own.
+//
+// Particles are stored in fixed size chunks. Chunks are immutable and always completely filled,
+// so a state for a different particle count shares all existing chunks and only adds or drops
+// chunks at the end; the count limits how many particles of the last chunk are in use.
+struct ParticleState
+{
+    using Array = std::vector<glm::vec4, AlignedAllocator<glm::vec4>>;
+
+    // 256 x 256 particles, one texture of the fragment shader technique
+    static const unsigned int chunkSize = 65536;
+    static const unsigned int chunkWidth = 256;
+
+    struct Chunk
+    {
+        Array positions;
+        Array velocities;
+    };
+
+    static unsigned int chunksFor(const unsigned int count)
+    {
+        return (count + chunkSize - 1) / chunkSize;
+    }
+
+    std::vector<std::shared_ptr<const Chunk>> chunks;
+    unsigned int count;
+
+    unsigned int size() const
+    {
+        return count;
+    }
+
+    unsigned int chunkCount() const
+    {
+        return static_cast<unsigned int>(chunks.size());
+    }
+
+    // number of particles in use within the given chunk
+    unsigned int chunkParticles(const unsigned int chunk) const
+    {
+        const unsigned int begin = chunk * chunkSize;
+        return count - begin < chunkSize ? count - begin : chunkSize;
+    }
+};
+
+using SharedParticleState = std::shared_ptr<const ParticleState>;
@@ -0,0 +1,377 @@
+#include "ParticleStatistics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <glbinding/gl/gl.h>
+#include <glbinding/gl/extension.h>
+
+#include <globjects/globjects.h>
+#include <globjects/logging.h>
+#include <globjects/Buffer.h>
+#include <globjects/Program.h>
+#include <globjects/Shader.h>
+#include <globjects/Sync.h>
+
+#include <globjects/base/File.h>
+#include <globjects/base/StringTemplate.h>
+
+#include "AbstractParticleTechnique.h"
+#include "ParticleState.h"
+
+
+using namespace gl;
+using namespace glm;
+using namespace globjects;
+
+namespace
+{
+
+// see particle-statistics.comp
+const int blocksStage = 0;
+const int systemsStage = 1;
+
+static_assert(sizeof(ParticleStatistics::Partial) == 4 * sizeof(vec4) + ParticleStatistics::s_histogramBins * sizeof(unsigned int),
+    "the partials are read from std430 buffers");
+
+}
+
+
+ParticleStatistics::Partial::Partial()
+: position(0.f)
+, moments(0.f)
+, minimum(std::numeric_limits<float>::max())
+, maximum(-std::numeric_limits<float>::max())
+{
+    speedHistogram.fill(0);
+}
+
+void ParticleStatistics::Partial::merge(const Partial & partial)
+{
+    position += partial.position;
+    moments += partial.moments;
+    minimum = glm::min(minimum, partial.minimum);
+    maximum = glm::max(maximum, partial.maximum);
+
+    for (unsigned int i = 0; i < s_histogramBins; ++i)
+        speedHistogram[i] += partial.speedHistogram[i];
+}
+
+
+ParticleStatistics::ParticleStatistics()
+: m_format(ParticleFormat::Float4)
+, m_particlesCapacity(0)
+, m_partialsCapacity(0)
+, m_total(summarize(Partial()))
+, m_time(0.0)
+{
+    for (auto & slot : m_slots)
+    {
+        slot.time = 0.0;
+        slot.ensemble = singleSystem(0);
+    }
+}
+
+ParticleStatistics::~ParticleStatistics()
+{
+}
+
+bool ParticleStatistics::isSupported()
+{
+    return hasExtension(GLextension::GL_ARB_compute_shader);
+}
+
+const std::string & ParticleStatistics::file() const
+{
+    return m_file;
+}
+
+void ParticleStatistics::setFile(const std::string & file)
+{
+    if (file == m_file)
+        return;
+
+    m_file = file;
+
+    // reopened by the next write
+    if (m_stream.is_open())
+        m_stream.close();
+}
+
+bool ParticleStatistics::evaluate(AbstractParticleTechnique & technique, const ParticleEnsemble & ensemble, const double simulationTime)
+{
+    if (technique.reduceStatistics(ensemble, m_hostPartials))
+    {
+        collect(m_hostPartials.data(), ensemble, simulationTime);
+        return true;
+    }
+
+    if (!isSupported())
+        return false;
+
+    int index = -1;
+    for (unsigned int i = 0; i < s_slotCount && index < 0; ++i)
+        if (!m_slots[i].fence)
+            index = static_cast<int>(i);
+
+    // the gpu lags behind, the next evaluation is not far
+    if (index < 0)
+        return true;
+
+    const ParticleFormat format = technique.format();
+    if (format != m_format)
+    {
+        m_format = format;
+        m_blocksPrograms.fill(nullptr);
+    }
+
+    Buffer * pool = technique.pool();
+    Program * blocksProgram = m_blocksPrograms[pool ? 1 : 0];
+
+    if (!blocksProgram)
+        m_blocksPrograms[pool ? 1 : 0] = blocksProgram = createProgram(blocksStage, format, pool != nullptr);
+
+    if (!m_systemsProgram)
+        m_systemsProgram = createProgram(systemsStage, format, false);
+
+    const unsigned int count = technique.numParticles();
+    const std::size_t size = technique.readbackSize();
+
+    if (!m_particles)
+    {
+        m_particles = new Buffer();
+        m_partials = new Buffer();
+    }
+
+    if (m_particlesCapacity < size)
+    {
+        m_particles->setData(static_cast<GLsizeiptr>(size), nullptr, GL_STREAM_COPY);
+        m_particlesCapacity = size;
+    }
+
+    // the last system also holds the remainder, its blocks bound those of all
+    const unsigned int largest = count - ensembleBegin(ensemble, ensemble.systems - 1, count);
+    const unsigned int blocks = std::max((largest + s_blockParticles - 1) / s_blockParticles, 1u);
+    const std::size_t partials = static_cast<std::size_t>(blocks) * ensemble.systems * sizeof(Partial);
+
+    if (m_partialsCapacity < partials)
+    {
+        m_partials->setData(static_cast<GLsizeiptr>(partials), nullptr, GL_STREAM_COPY);
+        m_partialsCapacity = partials;
+    }
+
+    Slot & slot = m_slots[index];
+    const std::size_t results = ensemble.systems * sizeof(Partial);
+
+    if (!slot.results || static_cast<std::size_t>(slot.results->getParameter(GL_BUFFER_SIZE)) < results)
+    {
+        slot.results = new Buffer();
+        slot.results->setData(static_cast<GLsizeiptr>(results), nullptr, GL_STREAM_READ);
+    }
+
+    technique.readback(*m_particles);
+
+    // positions, then velocities, both padded to whole chunks
+    const auto half = static_cast<GLsizeiptr>(size / 2);
+    m_particles->bindRange(GL_SHADER_STORAGE_BUFFER, 0, 0, half);
+    m_particles->bindRange(GL_SHADER_STORAGE_BUFFER, 1, half, half);
+    m_partials->bindBase(GL_SHADER_STORAGE_BUFFER, 2);
+    slot.results->bindBase(GL_SHADER_STORAGE_BUFFER, 3);
+
+    if (pool)
+        pool->bindBase(GL_SHADER_STORAGE_BUFFER, 7);
+
+    // the readback of the compute technique is written by shaders as well
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    blocksProgram->setUniform("count", count);
+    blocksProgram->setUniform("systems", ensemble.systems);
+    blocksProgram->setUniform("systemParticles", ensemble.systemParticles);
+    blocksProgram->setUniform("blocksPerSystem", blocks);
+    blocksProgram->dispatchCompute(blocks, ensemble.systems, 1);
+
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    m_systemsProgram->setUniform("blocksPerSystem", blocks);
+    m_systemsProgram->dispatchCompute(ensemble.systems, 1, 1);
+    m_systemsProgram->release();
+
+    // the results are mapped once the fence signaled
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    for (GLuint binding = 0; binding < 4; ++binding)
+        Buffer::unbind(GL_SHADER_STORAGE_BUFFER, binding);
+
+    if (pool)
+        Buffer::unbind(GL_SHADER_STORAGE_BUFFER, 7);
+
+    slot.fence = Sync::fence(GL_SYNC_GPU_COMMANDS_COMPLETE);
+    slot.time = simulationTime;
+    slot.ensemble = ensemble;
+
+    m_pending.push_back(index);
+
+    return true;
+}
+
+void ParticleStatistics::update()
+{
+    // fences signal in submission order, so the first unsignaled one ends the search
+    while (!m_pending.empty())
+    {
+        Slot & slot = m_slots[m_pending.front()];
+
+        if (slot.fence->clientWait(GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED)
+            break;
+
+        m_pending.pop_front();
+        slot.fence = nullptr;
+
+        const auto partials = static_cast<const Partial *>(slot.results->mapRange(0,
+            static_cast<GLsizeiptr>(slot.ensemble.systems * sizeof(Partial)), GL_MAP_READ_BIT));
+
+        if (!partials)
+            continue;
+
+        collect(partials, slot.ensemble, slot.time);
+        slot.results->unmap();
+    }
+}
+
+void ParticleStatistics::release()
+{
+    for (auto & slot : m_slots)
+    {
+        slot.results = nullptr;
+        slot.fence = nullptr;
+    }
+
+    m_pending.clear();
+
+    m_blocksPrograms.fill(nullptr);
+    m_systemsProgram = nullptr;
+    m_particles = nullptr;
+    m_partials = nullptr;
+    m_particlesCapacity = 0;
+    m_partialsCapacity = 0;
+
+    std::vector<Partial>().swap(m_hostPartials);
+}
+
+const std::vector<ParticleStatistics::System> & ParticleStatistics::systems() const
+{
+    return m_systems;
+}
+
+const ParticleStatistics::System & ParticleStatistics::total() const
+{
+    return m_total;
+}
+
+double ParticleStatistics::time() const
+{
+    return m_time;
+}
+
+Program * ParticleStatistics::createProgram(const int stage, const ParticleFormat format, const bool pooled) const
+{
+    Program * program = new Program();
+
+    StringTemplate * stringTemplate = new StringTemplate(
+        new File("data/gpu-particles/particle-statistics.comp"));
+    stringTemplate->replace("FORMAT_INDEX", particleFormatIndex(format));
+    stringTemplate->replace("POOL_ENABLED", pooled ? 1 : 0);
+    stringTemplate->replace("STATISTICS_STAGE", stage);
+    stringTemplate->update();
+
+    program->attach(new Shader(GL_COMPUTE_SHADER, stringTemplate));
+
+    if (stage == blocksStage)
+    {
+        program->setUniform("positionDecode", particleFormatDecode(format, fixedPositionRange));
+        program->setUniform("velocityDecode", particleFormatDecode(format, fixedVelocityRange));
+        program->setUniform("speedRange", fixedVelocityRange);
+    }
+
+    if (pooled)
+        program->setUniform("chunkSize", static_cast<unsigned int>(ParticleState::chunkSize));
+
+    return program;
+}
+
+void ParticleStatistics::collect(const Partial * partials, const ParticleEnsemble & ensemble, const double time)
+{
+    Partial total;
+
+    m_systems.resize(ensemble.systems);
+    for (unsigned int i = 0; i < ensemble.systems; ++i)
+    {
+        m_systems[i] = summarize(partials[i]);
+        total.merge(partials[i]);
+    }
+
+    m_total = summarize(total);
+    m_time = time;
+
+    write();
+}
+
+ParticleStatistics::System ParticleStatistics::summarize(const Partial & partial)
+{
+    System system;
+
+    // the histogram counts exactly, unlike the float sums of the positions
+    system.particles = 0;
+    for (const unsigned int particles : partial.speedHistogram)
+        system.particles += particles;
+
+    const float n = static_cast<float>(std::max(system.particles, 1u));
+    const bool empty = system.particles == 0;
+
+    system.centroid = vec3(partial.position) / n;
+    // rms distance to the centroid
+    system.spread = std::sqrt(std::max(partial.position.w / n - dot(system.centroid, system.centroid), 0.f));
+    system.meanSpeed = partial.moments.x / n;
+    system.maxSpeed = empty ? 0.f : partial.maximum.w;
+    system.kineticEnergy = 0.5f * partial.moments.y;
+    system.minimum = empty ? vec3(0.f) : vec3(partial.minimum);
+    system.maximum = empty ? vec3(0.f) : vec3(partial.maximum);
+    system.speedHistogram = partial.speedHistogram;
+
+    return system;
+}
+
+void ParticleStatistics::write()
+{
+    if (m_file.empty())
+        return;
+
+    if (!m_stream.is_open())
+    {
+        m_stream.open(m_file, std::ios::out | std::ios::trunc);
+
+        if (!m_stream)
+        {
+            warning() << "Could not write statistics to \"" << m_file << "\".";
+            m_file.clear();
+            return;
+        }
+
+        m_stream << "time,system,particles,centroid_x,centroid_y,centroid_z,spread,mean_speed,max_speed,kinetic_energy,"
+            "min_x,min_y,min_z,max_x,max_y,max_z\n";
+    }
+
+    for (unsigned int i = 0; i < m_systems.size(); ++i)
+    {
+        const System & system = m_systems[i];
+
+        m_stream << m_time << ',' << i << ',' << system.particles << ','
+            << system.centroid.x << ',' << system.centroid.y << ',' << system.centroid.z << ','
+            << system.spread << ',' << system.meanSpeed << ',' << system.maxSpeed << ',' << system.kineticEnergy << ','
+            << system.minimum.x << ',' << system.minimum.y << ',' << system.minimum.z << ','
+            << system.maximum.x << ',' << system.maximum.y << ',' << system.maximum.z << '\n';
+    }
+
+    m_stream.flush();
+}
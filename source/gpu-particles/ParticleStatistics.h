@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <globjects/base/ref_ptr.h>
+
+#include "ParticleEnsemble.h"
+#include "ParticleFormat.h"
+
+
+namespace globjects
+{
+    class Buffer;
+    class Program;
+    class Sync;
+}
+
+class AbstractParticleTechnique;
+
+
+// Summary statistics of each system of an ensemble, see ParticleEnsemble.h, and of all particles.
+// Techniques that simulate on the host reduce their particles into partials themselves, one per
+// task. For the others, the particles are copied into a scratch buffer, which a compute pass
+// reduces block by block and then per system; the few bytes of partials land in a ring of buffers
+// and are collected once their fence signaled, a frame or two later, so evaluating never waits for
+// the GPU. Collected results are appended to a CSV file, one row per system:
+//   time,system,particles,centroid_x,centroid_y,centroid_z,spread,mean_speed,max_speed,kinetic_energy,
+//   min_x,min_y,min_z,max_x,max_y,max_z
+class ParticleStatistics
+{
+public:
+    static const unsigned int s_slotCount = 3;
+
+    // particles per work group of the first pass, matches particle-statistics.comp
+    static const unsigned int s_blockParticles = 1024;
+
+    // bins of equal width over speeds up to fixedVelocityRange, the last also counts faster particles
+    static const unsigned int s_histogramBins = 16;
+
+    using Histogram = std::array<unsigned int, s_histogramBins>;
+
+    // sums and bounds of a range of particles, mirrors the Partial of particle-statistics.comp
+    struct Partial
+    {
+        // sum of the positions and of their squared distances to the origin
+        glm::vec4 position;
+        // sums of the speeds and squared speeds, unused
+        glm::vec4 moments;
+        // bounds of the positions and speeds
+        glm::vec4 minimum;
+        glm::vec4 maximum;
+        // adds up to the particle count
+        Histogram speedHistogram;
+
+        // of no particles
+        Partial();
+
+        void add(const glm::vec3 & p, const glm::vec3 & v)
+        {
+            const float speed = glm::length(v);
+            const glm::vec4 bounds(p, speed);
+
+            position += glm::vec4(p, glm::dot(p, p));
+            moments += glm::vec4(speed, speed * speed, 0.f, 0.f);
+            minimum = glm::min(minimum, bounds);
+            maximum = glm::max(maximum, bounds);
+
+            ++speedHistogram[std::min(static_cast<unsigned int>(speed * (s_histogramBins / fixedVelocityRange)), s_histogramBins - 1)];
+        }
+
+        void merge(const Partial & partial);
+    };
+
+    struct System
+    {
+        unsigned int particles;
+        glm::vec3 centroid;
+        // root mean square distance to the centroid
+        float spread;
+        float meanSpeed;
+        float maxSpeed;
+        // of unit masses
+        float kineticEnergy;
+        // bounding box of the positions, empty systems have zero bounds
+        glm::vec3 minimum;
+        glm::vec3 maximum;
+        Histogram speedHistogram;
+    };
+
+public:
+    ParticleStatistics();
+    ~ParticleStatistics();
+
+    // compute shaders, which reduce the readback of the techniques that simulate on the GPU
+    static bool isSupported();
+
+    // the CSV file, (re)written from the next collected results on; empty writes none
+    const std::string & file() const;
+    void setFile(const std::string & file);
+
+    // evaluates the current particles of technique on the host or enqueues their evaluation on the
+    // GPU, requires a current context; dropped if all slots are in flight. Returns false if the
+    // technique simulates on the GPU and compute shaders are not supported.
+    bool evaluate(AbstractParticleTechnique & technique, const ParticleEnsemble & ensemble, double simulationTime);
+
+    // collects finished evaluations without waiting, call once per frame
+    void update();
+
+    // frees all GPU resources and drops the evaluations in flight, requires a current context
+    void release();
+
+    // the latest collected results per system and of all particles, and the simulation time they
+    // were evaluated at
+    const std::vector<System> & systems() const;
+    const System & total() const;
+    double time() const;
+
+    // Note: this is intentionally not implemented - but fixes MSVC12 C4512 warning
+    ParticleStatistics & operator=(const ParticleStatistics & statistics);
+
+protected:
+    struct Slot
+    {
+        double time;
+        ParticleEnsemble ensemble;
+
+        globjects::ref_ptr<globjects::Buffer> results;
+        globjects::ref_ptr<globjects::Sync> fence;
+    };
+
+    globjects::Program * createProgram(int stage, ParticleFormat format, bool pooled) const;
+
+    // replaces the results by those of the partials of each system
+    void collect(const Partial * partials, const ParticleEnsemble & ensemble, double time);
+    static System summarize(const Partial & partial);
+    void write();
+
+protected:
+    std::string m_file;
+    std::ofstream m_stream;
+
+    ParticleFormat m_format;
+    // the blocks stage depends on the format of the readback, without and with pool
+    std::array<globjects::ref_ptr<globjects::Program>, 2> m_blocksPrograms;
+    globjects::ref_ptr<globjects::Program> m_systemsProgram;
+
+    globjects::ref_ptr<globjects::Buffer> m_particles;
+    std::size_t m_particlesCapacity;
+    globjects::ref_ptr<globjects::Buffer> m_partials;
+    std::size_t m_partialsCapacity;
+
+    std::array<Slot, s_slotCount> m_slots;
+    // slots in flight, in evaluation order
+    std::deque<int> m_pending;
+
+    // the partials of each system reduced on the host
+    std::vector<Partial> m_hostPartials;
+
+    std::vector<System> m_systems;
+    System m_total;
+    double m_time;
+};
@@ -0,0 +1,184 @@
+#include "PhaseTimers.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <glbinding/gl/gl.h>
+#include <glbinding/gl/extension.h>
+
+#include <globjects/globjects.h>
+#include <globjects/Query.h>
+
+
+using namespace gl;
+using namespace globjects;
+
+namespace
+{
+
+unsigned int index(const TimedPhase phase)
+{
+    return static_cast<unsigned int>(phase);
+}
+
+}
+
+
+PhaseTimers::Scope::Scope(PhaseTimers * timers, const TimedPhase phase)
+: m_timers(timers)
+, m_phase(phase)
+{
+    if (m_timers)
+        m_timers->begin(m_phase);
+}
+
+PhaseTimers::Scope::~Scope()
+{
+    if (m_timers)
+        m_timers->end(m_phase);
+}
+
+
+PhaseTimers::PhaseTimers()
+: m_gpuTiming(false)
+, m_frame(0)
+{
+    for (auto & frame : m_frames)
+        frame.runs.fill(0);
+
+    m_cpuTime.fill(0.0);
+    m_cpuRan.fill(false);
+}
+
+PhaseTimers::~PhaseTimers()
+{
+}
+
+const char * PhaseTimers::name(const TimedPhase phase)
+{
+    static const char * names[s_phaseCount] = { "step", "draw", "clear", "particles", "blit" };
+    return names[index(phase)];
+}
+
+void PhaseTimers::beginFrame()
+{
+    // the context is only current from here on
+    m_gpuTiming = hasExtension(GLextension::GL_ARB_timer_query);
+
+    m_frame = (m_frame + 1) % s_frameLatency;
+    Frame & frame = m_frames[m_frame];
+
+    std::array<double, s_phaseCount> times;
+    std::array<bool, s_phaseCount> complete;
+
+    for (unsigned int phase = 0; phase < s_phaseCount; ++phase)
+    {
+        times[phase] = 0.0;
+        complete[phase] = frame.runs[phase] > 0;
+
+        for (unsigned int run = 0; run < frame.runs[phase] && complete[phase]; ++run)
+        {
+            const Query * start = frame.queries[phase][2 * run];
+            const Query * end = frame.queries[phase][2 * run + 1];
+
+            // a result that is still pending is dropped instead of waited for, the end completes last
+            complete[phase] = end->resultAvailable();
+            if (complete[phase])
+                times[phase] += static_cast<double>(end->get64(GL_QUERY_RESULT) - start->get64(GL_QUERY_RESULT)) * 1.0e-6;
+        }
+    }
+
+    for (unsigned int phase = 0; phase < s_phaseCount; ++phase)
+    {
+        if (complete[phase])
+            addSample(m_gpuSamples[phase], static_cast<float>(times[phase]));
+    }
+
+    frame.runs.fill(0);
+}
+
+void PhaseTimers::endFrame()
+{
+    for (unsigned int phase = 0; phase < s_phaseCount; ++phase)
+    {
+        if (m_cpuRan[phase])
+            addSample(m_cpuSamples[phase], static_cast<float>(m_cpuTime[phase]));
+
+        m_cpuTime[phase] = 0.0;
+        m_cpuRan[phase] = false;
+    }
+}
+
+void PhaseTimers::begin(const TimedPhase phase)
+{
+    const unsigned int i = index(phase);
+
+    if (m_gpuTiming)
+    {
+        Frame & frame = m_frames[m_frame];
+
+        while (frame.queries[i].size() <= 2 * frame.runs[i] + 1)
+            frame.queries[i].push_back(new Query());
+
+        frame.queries[i][2 * frame.runs[i]]->counter(GL_TIMESTAMP);
+    }
+
+    m_cpuStart[i] = std::chrono::high_resolution_clock::now();
+}
+
+void PhaseTimers::end(const TimedPhase phase)
+{
+    const unsigned int i = index(phase);
+
+    m_cpuTime[i] += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - m_cpuStart[i]).count();
+    m_cpuRan[i] = true;
+
+    if (m_gpuTiming)
+    {
+        Frame & frame = m_frames[m_frame];
+
+        frame.queries[i][2 * frame.runs[i] + 1]->counter(GL_TIMESTAMP);
+        ++frame.runs[i];
+    }
+}
+
+PhaseTimers::Statistics PhaseTimers::cpu(const TimedPhase phase) const
+{
+    return statistics(m_cpuSamples[index(phase)]);
+}
+
+PhaseTimers::Statistics PhaseTimers::gpu(const TimedPhase phase) const
+{
+    return statistics(m_gpuSamples[index(phase)]);
+}
+
+void PhaseTimers::addSample(std::deque<float> & samples, const float sample)
+{
+    samples.push_back(sample);
+
+    if (samples.size() > s_windowSize)
+        samples.pop_front();
+}
+
+PhaseTimers::Statistics PhaseTimers::statistics(const std::deque<float> & samples)
+{
+    Statistics result = { 0.f, 0.f, 0.f };
+
+    if (samples.empty())
+        return result;
+
+    std::vector<float> sorted(samples.begin(), samples.end());
+    std::sort(sorted.begin(), sorted.end());
+
+    float sum = 0.f;
+    for (const float sample : sorted)
+        sum += sample;
+
+    const auto p99 = static_cast<std::size_t>(std::ceil(0.99 * static_cast<double>(sorted.size()))) - 1;
+
+    result.min = sorted.front();
+    result.average = sum / static_cast<float>(sorted.size());
+    result.p99 = sorted[p99];
+
+    return result;
+}
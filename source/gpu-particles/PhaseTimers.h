@@ -0,0 +1,98 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <deque>
+#include <vector>
+
+#include <globjects/base/ref_ptr.h>
+
+
+namespace globjects
+{
+    class Query;
+}
+
+
+enum class TimedPhase { Step, Draw, Clear, Particles, Blit };
+
+// CPU and GPU times of the phases of a frame, with rolling statistics over the last frames.
+// GPU times are measured with pairs of GL_TIMESTAMP queries, which are read back s_frameLatency
+// frames later, when the frame pipeline guarantees their completion, so reading them never stalls.
+// Unlike GL_TIME_ELAPSED queries, timestamps nest, with each other and with an elapsed time query
+// the host may hold open around the whole frame, e.g., glexamples-bench.
+class PhaseTimers
+{
+public:
+    static const unsigned int s_phaseCount = 5;
+
+    // matches the maximum of max_frames_in_flight
+    static const unsigned int s_frameLatency = 4;
+
+    // frames the statistics are computed over
+    static const unsigned int s_windowSize = 120;
+
+    struct Statistics
+    {
+        float min;
+        float average;
+        float p99;
+    };
+
+    // times a phase for the lifetime of the scope, does nothing without timers
+    class Scope
+    {
+    public:
+        Scope(PhaseTimers * timers, TimedPhase phase);
+        ~Scope();
+
+        // Note: this is intentionally not implemented - but fixes MSVC12 C4512 warning
+        Scope & operator=(const Scope & scope);
+
+    protected:
+        PhaseTimers * m_timers;
+        const TimedPhase m_phase;
+    };
+
+public:
+    PhaseTimers();
+    ~PhaseTimers();
+
+    static const char * name(TimedPhase phase);
+
+    // collects the GPU times of the frame issued s_frameLatency frames ago, requires a current context
+    void beginFrame();
+    void endFrame();
+
+    // a phase may run several times per frame, e.g., the step, its times are summed up
+    void begin(TimedPhase phase);
+    void end(TimedPhase phase);
+
+    // in milliseconds, zero before the first sample
+    Statistics cpu(TimedPhase phase) const;
+    Statistics gpu(TimedPhase phase) const;
+
+protected:
+    struct Frame
+    {
+        // per phase, a start and an end timestamp per run within the frame
+        std::array<std::vector<globjects::ref_ptr<globjects::Query>>, s_phaseCount> queries;
+        std::array<unsigned int, s_phaseCount> runs;
+    };
+
+    static Statistics statistics(const std::deque<float> & samples);
+    static void addSample(std::deque<float> & samples, float sample);
+
+protected:
+    bool m_gpuTiming;
+
+    std::array<Frame, s_frameLatency> m_frames;
+    unsigned int m_frame;
+
+    std::array<std::chrono::high_resolution_clock::time_point, s_phaseCount> m_cpuStart;
+    std::array<double, s_phaseCount> m_cpuTime;
+    std::array<bool, s_phaseCount> m_cpuRan;
+
+    std::array<std::deque<float>, s_phaseCount> m_cpuSamples;
+    std::array<std::deque<float>, s_phaseCount> m_gpuSamples;
+};
@@ -0,0 +1,11 @@
+#pragma once
+
+
+// Format of the trail buffer the particles accumulate in. The trails decay by a full screen blend
+// every frame, which reads and writes the whole buffer, so it is bound by its bandwidth.
+enum class TrailFormat
+{
+    Float32      // GL_RGBA32F, 16 bytes per pixel
+,   Float16      // GL_RGBA16F, 8 bytes per pixel
+,   R11G11B10F   // GL_R11F_G11F_B10F, 4 bytes per pixel, no alpha and 5 to 6 bit mantissas
+};
@@ -0,0 +1,497 @@
+#include "TrajectoryRecorder.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <glm/glm.hpp>
+
+#include <glbinding/gl/gl.h>
+
+#include <globjects/globjects.h>
+#include <globjects/logging.h>
+#include <globjects/Buffer.h>
+#include <globjects/Sync.h>
+
+#include "AbstractParticleTechnique.h"
+#include "FramePipeline.h"
+#include "ParticleState.h"
+
+
+using namespace gl;
+using namespace glm;
+using namespace globjects;
+
+namespace
+{
+
+const char magic[4] = { 'G', 'P', 'T', 'R' };
+const std::uint32_t formatVersion = 1;
+
+const std::uint32_t deltaFlag = 1;
+const std::uint32_t compressedFlag = 2;
+
+const std::size_t headerSize = 16;
+const std::size_t recordSize = 32;
+
+template <typename T>
+void store(unsigned char * data, const std::size_t offset, const T value)
+{
+    std::memcpy(data + offset, &value, sizeof(T));
+}
+
+// byte planes of the words, run-length coded; false if that does not save anything
+bool compress(const std::vector<std::uint32_t> & words, std::vector<unsigned char> & shuffled, std::vector<unsigned char> & compressed)
+{
+    const std::size_t size = words.size() * sizeof(std::uint32_t);
+
+    // the high bytes of the deltas of similar values are mostly zero, grouping them forms long runs
+    shuffled.resize(size);
+    for (std::size_t plane = 0; plane < sizeof(std::uint32_t); ++plane)
+    {
+        unsigned char * out = shuffled.data() + plane * words.size();
+        for (std::size_t i = 0; i < words.size(); ++i)
+            out[i] = static_cast<unsigned char>(words[i] >> (8 * plane));
+    }
+
+    compressed.clear();
+
+    std::size_t i = 0;
+    while (i < size && compressed.size() < size)
+    {
+        std::size_t j = i;
+
+        if (shuffled[i] == 0)
+        {
+            while (j < size && j - i < 128 && shuffled[j] == 0)
+                ++j;
+
+            compressed.push_back(static_cast<unsigned char>(127 + (j - i)));
+        }
+        else
+        {
+            // single zeros are cheaper as literals than as runs
+            while (j < size && j - i < 128 && !(shuffled[j] == 0 && j + 1 < size && shuffled[j + 1] == 0))
+                ++j;
+
+            compressed.push_back(static_cast<unsigned char>(j - i - 1));
+            compressed.insert(compressed.end(), shuffled.begin() + i, shuffled.begin() + j);
+        }
+
+        i = j;
+    }
+
+    return compressed.size() < size;
+}
+
+}
+
+
+TrajectoryRecorder::TrajectoryRecorder()
+: m_recording(false)
+, m_persistent(false)
+, m_interval(1)
+, m_delta(true)
+, m_compress(false)
+, m_steps(0)
+, m_captures(0)
+, m_droppedChunks(0)
+, m_bytesWritten(0)
+, m_measuredBytes(0)
+, m_bandwidth(0.f)
+, m_failed(false)
+, m_quit(false)
+{
+    for (auto & slot : m_slots)
+    {
+        slot.state = SlotState::Free;
+        slot.capture = 0;
+        slot.time = 0.0;
+        slot.count = 0;
+        slot.format = ParticleFormat::Float4;
+        slot.size = 0;
+        slot.capacity = 0;
+        slot.memory = nullptr;
+    }
+}
+
+TrajectoryRecorder::~TrajectoryRecorder()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_condition.notify_all();
+
+    if (m_writerThread.joinable())
+        m_writerThread.join();
+}
+
+bool TrajectoryRecorder::isRecording() const
+{
+    return m_recording;
+}
+
+unsigned int TrajectoryRecorder::droppedChunks() const
+{
+    return m_droppedChunks;
+}
+
+float TrajectoryRecorder::bandwidth() const
+{
+    return m_bandwidth;
+}
+
+bool TrajectoryRecorder::start(const std::string & path, const unsigned int interval, const bool delta, const bool compress)
+{
+    if (m_recording)
+        stop();
+
+    m_stream.open(path, std::ios::binary | std::ios::trunc);
+    if (!m_stream)
+    {
+        warning() << "Could not open trajectory file \"" << path << "\"";
+        return false;
+    }
+
+    m_interval = std::max(interval, 1u);
+
+    unsigned char header[headerSize] = { };
+    std::memcpy(header, magic, sizeof(magic));
+    store<std::uint32_t>(header, 4, formatVersion);
+    store<std::uint32_t>(header, 8, m_interval);
+    m_stream.write(reinterpret_cast<const char *>(header), headerSize);
+
+    // readbacks land in memory the writer reads directly, otherwise each buffer is mapped per capture
+    m_persistent = hasExtension(GLextension::GL_ARB_buffer_storage);
+
+    m_delta = delta;
+    m_compress = compress;
+
+    m_steps = 0;
+    m_captures = 0;
+    m_droppedChunks = 0;
+
+    m_bytesWritten = headerSize;
+    m_measuredBytes = headerSize;
+    m_measureStart = std::chrono::steady_clock::now();
+    m_bandwidth = 0.f;
+
+    m_references.clear();
+    m_failed = false;
+    m_quit = false;
+
+    m_writerThread = std::thread(&TrajectoryRecorder::writerLoop, this);
+    m_recording = true;
+
+    debug() << "Recording trajectories every " << m_interval << " steps to " << path;
+
+    return true;
+}
+
+void TrajectoryRecorder::stop()
+{
+    if (!m_recording)
+        return;
+
+    // the copies in flight take at most a few frames, waiting for them completes the stream
+    for (const int index : m_copying)
+        FramePipeline::wait(m_slots[index].fence);
+
+    collect();
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_condition.notify_all();
+
+    // the writer drains its queue before it quits
+    m_writerThread.join();
+
+    for (auto & slot : m_slots)
+    {
+        if (slot.memory)
+            slot.buffer->unmap();
+
+        slot.state = SlotState::Free;
+        slot.buffer = nullptr;
+        slot.fence = nullptr;
+        slot.capacity = 0;
+        slot.memory = nullptr;
+    }
+
+    m_stream.close();
+    m_recording = false;
+
+    debug() << "Recorded " << m_captures << " captures, dropped " << m_droppedChunks << " chunks";
+}
+
+void TrajectoryRecorder::step(AbstractParticleTechnique & technique, const double simulationTime)
+{
+    if (!m_recording || ++m_steps % m_interval != 0)
+        return;
+
+    capture(technique, simulationTime);
+}
+
+void TrajectoryRecorder::capture(AbstractParticleTechnique & technique, const double simulationTime)
+{
+    int index = -1;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        for (unsigned int i = 0; i < s_slotCount && index < 0; ++i)
+            if (m_slots[i].state == SlotState::Free)
+                index = static_cast<int>(i);
+    }
+
+    // the writer or the GPU lags behind, the simulation must not wait for either
+    if (index < 0)
+    {
+        m_droppedChunks += ParticleState::chunksFor(technique.numParticles());
+        return;
+    }
+
+    // free slots are only touched by this thread
+    Slot & slot = m_slots[index];
+    const std::size_t size = technique.readbackSize();
+
+    if (slot.capacity < size)
+        allocate(slot, size);
+
+    technique.readback(*slot.buffer);
+
+    if (m_persistent)
+        glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+
+    slot.fence = Sync::fence(GL_SYNC_GPU_COMMANDS_COMPLETE);
+
+    slot.capture = m_captures++;
+    slot.time = simulationTime;
+    slot.count = technique.numParticles();
+    slot.format = technique.format();
+    slot.size = size;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        slot.state = SlotState::Copying;
+    }
+
+    m_copying.push_back(index);
+}
+
+void TrajectoryRecorder::allocate(Slot & slot, const std::size_t size)
+{
+    if (slot.buffer && m_persistent)
+        slot.buffer->unmap();
+
+    slot.buffer = new Buffer();
+
+    if (m_persistent)
+    {
+        // dynamic storage since the cpu technique's readback writes with glBufferSubData
+        slot.buffer->setStorage(static_cast<GLsizeiptr>(size), nullptr,
+            GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT | GL_DYNAMIC_STORAGE_BIT);
+        slot.memory = static_cast<const unsigned char *>(slot.buffer->mapRange(0, static_cast<GLsizeiptr>(size),
+            GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT));
+    }
+    else
+    {
+        slot.buffer->setData(static_cast<GLsizeiptr>(size), nullptr, GL_STREAM_READ);
+        slot.memory = nullptr;
+    }
+
+    slot.capacity = size;
+}
+
+void TrajectoryRecorder::update()
+{
+    if (!m_recording)
+        return;
+
+    if (m_failed)
+    {
+        warning() << "Could not write the trajectory, recording stopped.";
+        stop();
+        return;
+    }
+
+    collect();
+
+    const auto now = std::chrono::steady_clock::now();
+    const float seconds = std::chrono::duration<float>(now - m_measureStart).count();
+
+    if (seconds >= 1.f)
+    {
+        const std::uint64_t bytes = m_bytesWritten;
+
+        m_bandwidth = static_cast<float>(bytes - m_measuredBytes) / seconds * 1.0e-6f;
+        m_measuredBytes = bytes;
+        m_measureStart = now;
+    }
+}
+
+void TrajectoryRecorder::collect()
+{
+    bool queued = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // fences signal in submission order, so the first unsignaled one ends the search
+        while (!m_copying.empty())
+        {
+            const int index = m_copying.front();
+            Slot & slot = m_slots[index];
+
+            if (slot.fence->clientWait(GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED)
+                break;
+
+            m_copying.pop_front();
+            slot.fence = nullptr;
+
+            if (!m_persistent)
+                slot.memory = static_cast<const unsigned char *>(slot.buffer->mapRange(0, static_cast<GLsizeiptr>(slot.size), GL_MAP_READ_BIT));
+
+            if (!slot.memory)
+            {
+                m_droppedChunks += ParticleState::chunksFor(slot.count);
+                slot.state = SlotState::Free;
+                continue;
+            }
+
+            slot.state = SlotState::Queued;
+            m_queue.push_back(index);
+            queued = true;
+        }
+
+        for (auto & slot : m_slots)
+        {
+            if (slot.state != SlotState::Written)
+                continue;
+
+            if (!m_persistent)
+            {
+                slot.buffer->unmap();
+                slot.memory = nullptr;
+            }
+
+            slot.state = SlotState::Free;
+        }
+    }
+
+    if (queued)
+        m_condition.notify_one();
+}
+
+void TrajectoryRecorder::writerLoop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (true)
+    {
+        m_condition.wait(lock, [this] { return m_quit || !m_queue.empty(); });
+
+        if (m_queue.empty())
+            return;
+
+        const int index = m_queue.front();
+        m_queue.pop_front();
+
+        lock.unlock();
+
+        // queued slots are left alone by the render thread
+        write(m_slots[index]);
+
+        lock.lock();
+
+        m_slots[index].state = SlotState::Written;
+    }
+}
+
+void TrajectoryRecorder::write(const Slot & slot)
+{
+    static const unsigned int chunkSize = ParticleState::chunkSize;
+
+    if (m_failed)
+        return;
+
+    const std::size_t stride = particleFormatSize(slot.format);
+    const unsigned char * velocities = slot.memory + slot.size / 2;
+
+    std::vector<vec4> decoded(std::min(slot.count, chunkSize));
+    std::vector<std::uint32_t> words;
+    std::vector<unsigned char> shuffled;
+
+    for (unsigned int chunk = 0; chunk * chunkSize < slot.count; ++chunk)
+    {
+        const unsigned int first = chunk * chunkSize;
+        const unsigned int count = std::min(chunkSize, slot.count - first);
+
+        // xyz only, positions then velocities
+        words.resize(6 * static_cast<std::size_t>(count));
+
+        decodeParticles(slot.format, slot.memory + first * stride, count, fixedPositionRange, 1.f, decoded.data());
+        for (unsigned int i = 0; i < count; ++i)
+            std::memcpy(&words[3 * i], &decoded[i], 3 * sizeof(float));
+
+        decodeParticles(slot.format, velocities + first * stride, count, fixedVelocityRange, 0.f, decoded.data());
+        for (unsigned int i = 0; i < count; ++i)
+            std::memcpy(&words[3 * (count + i)], &decoded[i], 3 * sizeof(float));
+
+        std::uint32_t flags = 0;
+
+        if (m_delta && encode(words, chunk, slot.capture))
+            flags |= deltaFlag;
+
+        const unsigned char * payload = reinterpret_cast<const unsigned char *>(words.data());
+        std::size_t bytes = words.size() * sizeof(std::uint32_t);
+
+        if (m_compress && compress(words, shuffled, m_compressed))
+        {
+            flags |= compressedFlag;
+            payload = m_compressed.data();
+            bytes = m_compressed.size();
+        }
+
+        unsigned char record[recordSize] = { };
+        store<std::uint32_t>(record, 0, slot.capture);
+        store<std::uint32_t>(record, 4, first);
+        store<std::uint32_t>(record, 8, count);
+        store<std::uint32_t>(record, 12, flags);
+        store<double>(record, 16, slot.time);
+        store<std::uint32_t>(record, 24, static_cast<std::uint32_t>(bytes));
+
+        m_stream.write(reinterpret_cast<const char *>(record), recordSize);
+        m_stream.write(reinterpret_cast<const char *>(payload), static_cast<std::streamsize>(bytes));
+
+        m_bytesWritten += recordSize + bytes;
+    }
+
+    if (!m_stream)
+        m_failed = true;
+}
+
+bool TrajectoryRecorder::encode(std::vector<std::uint32_t> & words, const unsigned int chunk, const unsigned int capture)
+{
+    if (m_references.size() <= chunk)
+        m_references.resize(chunk + 1);
+
+    std::vector<std::uint32_t> & reference = m_references[chunk];
+
+    // keyframes allow seeking, a changed particle count restarts the chain as well
+    if (capture % s_keyframeInterval == 0 || reference.size() != words.size())
+    {
+        reference = words;
+        return false;
+    }
+
+    // the bits of slowly moving particles mostly agree, their XOR is mostly zero
+    for (std::size_t i = 0; i < words.size(); ++i)
+    {
+        const std::uint32_t word = words[i];
+        words[i] = word ^ reference[i];
+        reference[i] = word;
+    }
+
+    return true;
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <globjects/base/ref_ptr.h>
+
+#include "ParticleFormat.h"
+
+
+namespace globjects
+{
+    class Buffer;
+    class Sync;
+}
+
+class AbstractParticleTechnique;
+
+
+// Records the particles every few simulation steps without ever waiting for the GPU. Captures are
+// copied by the technique into a ring of persistently mapped buffers; once a capture's fence
+// signaled, a writer thread encodes it straight from the mapping. If all buffers are in flight,
+// the capture is dropped and its chunks are counted instead of stalling the simulation.
+//
+// Stream layout, little endian:
+//   char[4] "GPTR", uint32 version (1), uint32 capture interval in steps, uint32 reserved (0),
+//   followed by one record per chunk of a capture:
+//     uint32 capture, uint32 first particle, uint32 particle count, uint32 flags,
+//     float64 simulation time, uint32 payload bytes, uint32 reserved (0),
+//     payload: count xyz float32 positions, then count xyz float32 velocities.
+//   With flag 1 (delta), each 32 bit word is XORed with the same word of the chunk's previous
+//   capture; every s_keyframeInterval captures are stored without. With flag 2 (compressed), the
+//   words are split into four byte planes, which are run-length coded: a control byte c >= 128
+//   stands for c - 127 zero bytes, otherwise c + 1 literal bytes follow.
+class TrajectoryRecorder
+{
+public:
+    static const unsigned int s_slotCount = 4;
+    static const unsigned int s_keyframeInterval = 60;
+
+public:
+    TrajectoryRecorder();
+    ~TrajectoryRecorder();
+
+    bool isRecording() const;
+
+    // opens the stream and starts the writer, requires a current context
+    bool start(const std::string & path, unsigned int interval, bool delta, bool compress);
+    // writes the captures in flight and closes the stream, requires a current context
+    void stop();
+
+    // counts a simulation step and captures the technique every interval steps
+    void step(AbstractParticleTechnique & technique, double simulationTime);
+
+    // hands finished copies to the writer and recycles written buffers, call once per frame
+    void update();
+
+    // chunks of captures dropped because no buffer was free
+    unsigned int droppedChunks() const;
+    // megabytes per second written to the stream, averaged over about a second
+    float bandwidth() const;
+
+    // Note: this is intentionally not implemented - but fixes MSVC12 C4512 warning
+    TrajectoryRecorder & operator=(const TrajectoryRecorder & recorder);
+
+protected:
+    enum class SlotState { Free, Copying, Queued, Written };
+
+    struct Slot
+    {
+        SlotState state;
+
+        unsigned int capture;
+        double time;
+        unsigned int count;
+        ParticleFormat format;
+        std::size_t size;
+
+        globjects::ref_ptr<globjects::Buffer> buffer;
+        globjects::ref_ptr<globjects::Sync> fence;
+        std::size_t capacity;
+        const unsigned char * memory;
+    };
+
+    void capture(AbstractParticleTechnique & technique, double simulationTime);
+    void allocate(Slot & slot, std::size_t size);
+    // queues the captures whose copies are done and frees written slots
+    void collect();
+    void writerLoop();
+    // runs on the writer thread
+    void write(const Slot & slot);
+    // delta encodes the words of a chunk against its previous capture, false for keyframes
+    bool encode(std::vector<std::uint32_t> & words, unsigned int chunk, unsigned int capture);
+
+protected:
+    bool m_recording;
+    bool m_persistent;
+
+    unsigned int m_interval;
+    bool m_delta;
+    bool m_compress;
+
+    unsigned int m_steps;
+    unsigned int m_captures;
+
+    std::array<Slot, s_slotCount> m_slots;
+    // slots being copied, in capture order
+    std::deque<int> m_copying;
+
+    unsigned int m_droppedChunks;
+
+    std::atomic<std::uint64_t> m_bytesWritten;
+    std::uint64_t m_measuredBytes;
+    std::chrono::steady_clock::time_point m_measureStart;
+    float m_bandwidth;
+
+    // only accessed by the writer thread while recording
+    std::ofstream m_stream;
+    std::vector<std::vector<std::uint32_t>> m_references;
+    std::vector<unsigned char> m_compressed;
+    std::atomic<bool> m_failed;
+
+    std::thread m_writerThread;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::deque<int> m_queue;
+    bool m_quit;
+};
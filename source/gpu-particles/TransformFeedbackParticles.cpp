@@ -3,6 +3,7 @@
 
 #include <glbinding/gl/gl.h>
 
+#include <globjects/globjects.h>
 #include <globjects/Shader.h>
 #include <globjects/VertexAttributeBinding.h>
 #include <globjects/TransformFeedback.h>
@@ -11,7 +12,12 @@
 #include <globjects/Buffer.h>
 #include <globjects/Texture.h>
 
+#include <globjects/logging.h>
+
 #include <globjects/base/File.h>
+#include <globjects/base/StringTemplate.h>
+
+#include "ParticleCulling.h"
 
 
 using namespace gl;
@@ -20,12 +26,11 @@ using namespace globjects;
 using namespace gloperate;
 
 TransformFeedbackParticles::TransformFeedbackParticles(
-    const std::vector<vec4> & positions
-,   const std::vector<vec4> & velocities
+    const SharedParticleState & initialState
 ,   const Texture & forces
 ,   const AbstractCameraCapability & cameraCap
 ,   const glm::ivec2 viewport)
-: AbstractParticleTechnique(positions, velocities, forces, cameraCap, viewport)
+: AbstractParticleTechnique(initialState, forces, cameraCap, viewport)
 {
 }
 
@@ -35,60 +40,125 @@ TransformFeedbackParticles::~TransformFeedbackParticles()
 
 void TransformFeedbackParticles::initialize()
 {
-    m_sourcePositions  = new Buffer();
-    m_sourceVelocities = new Buffer();
-    m_targetPositions  = new Buffer();
-    m_targetVelocities = new Buffer();
-
-    reset();
+    // the 16 bit formats pack the captured values in the shader
+    if ((m_format == ParticleFormat::Half || m_format == ParticleFormat::Fixed16)
+        && !hasExtension(GLextension::GL_ARB_shading_language_packing))
+    {
+        warning() << "Transform feedback based implementation falls back to float4 particles, packing not supported.";
+        m_format = ParticleFormat::Float4;
+    }
+
+    StringTemplate * stringTemplate = new StringTemplate(
+        new File("data/gpu-particles/transformfeedback.vert"));
+    stringTemplate->replace("FORMAT_INDEX", particleFormatIndex(m_format));
+    stringTemplate->update();
 
     m_transformFeedbackProgram = new Program();
-    m_transformFeedbackProgram->attach(Shader::fromFile(GL_VERTEX_SHADER, "data/gpu-particles/transformfeedback.vert"));
+    m_transformFeedbackProgram->attach(new Shader(GL_VERTEX_SHADER, stringTemplate));
 
     m_transformFeedbackProgram->link();
+    setDecodeUniforms(m_transformFeedbackProgram);
 
-    m_transformFeedback = new TransformFeedback();
-    m_transformFeedback->setVaryings(m_transformFeedbackProgram, { "out_position", "out_velocity" }, GL_SEPARATE_ATTRIBS);
+    // the varyings are program state, any transform feedback object can declare them
+    ref_ptr<TransformFeedback> transformFeedback = new TransformFeedback();
+    transformFeedback->setVaryings(m_transformFeedbackProgram, { "out_position", "out_velocity" }, GL_SEPARATE_ATTRIBS);
 
     m_vao = new VertexArray();
     m_vao->bind();
 
     auto positionsBinding = m_vao->binding(0);
     positionsBinding->setAttribute(0);
-    positionsBinding->setFormat(4, GL_FLOAT);
+    setAttributeFormat(positionsBinding);
     m_vao->enable(0);
 
     auto velocitiesBinding = m_vao->binding(1);
     velocitiesBinding->setAttribute(1);
-    velocitiesBinding->setFormat(4, GL_FLOAT);
+    setAttributeFormat(velocitiesBinding);
     m_vao->enable(1);
 
     m_vao->unbind();
 
+    if (ParticleCulling::isSupported())
+        m_culling.reset(new ParticleCulling(ParticleCulling::Source::Buffers, m_format));
+
+    reset();
 
-    AbstractParticleTechnique::initialize("data/gpu-particles/points.vert");
+    AbstractParticleTechnique::initialize("data/gpu-particles/points.vert", DrawSource::Buffers);
 }
 
 void TransformFeedbackParticles::reset()
 {
-    m_sourcePositions->setData(m_positions, GL_DYNAMIC_DRAW);
-    m_targetPositions->setData(static_cast<GLsizei>(m_numParticles * sizeof(vec4)), nullptr, GL_DYNAMIC_DRAW);
-
-    m_sourceVelocities->setData(m_velocities, GL_DYNAMIC_DRAW);
-    m_targetVelocities->setData(static_cast<GLsizei>(m_numParticles * sizeof(vec4)), nullptr, GL_DYNAMIC_DRAW);
+    resizeChunks();
+    uploadParticles(0, m_numParticles);
 
     AbstractParticleTechnique::reset();
 }
 
-void TransformFeedbackParticles::step(const float elapsed)
+void TransformFeedbackParticles::release()
 {
-    m_vao->bind();
+    m_chunks.clear();
+
+    m_transformFeedbackProgram = nullptr;
+    m_vao = nullptr;
+
+    AbstractParticleTechnique::release();
+}
+
+void TransformFeedbackParticles::resizeChunks()
+{
+    const auto size = static_cast<GLsizeiptr>(ParticleState::chunkSize * particleFormatSize(m_format));
+
+    const unsigned int count = m_initialState->chunkCount();
+
+    if (m_chunks.size() > count)
+        m_chunks.resize(count);
+
+    while (m_chunks.size() < count)
+    {
+        Chunk chunk;
+
+        chunk.transformFeedback = new TransformFeedback();
+
+        chunk.sourcePositions  = new Buffer();
+        chunk.sourceVelocities = new Buffer();
+        chunk.targetPositions  = new Buffer();
+        chunk.targetVelocities = new Buffer();
+
+        chunk.sourcePositions->setData(size, nullptr, GL_DYNAMIC_DRAW);
+        chunk.sourceVelocities->setData(size, nullptr, GL_DYNAMIC_DRAW);
+        chunk.targetPositions->setData(size, nullptr, GL_DYNAMIC_DRAW);
+        chunk.targetVelocities->setData(size, nullptr, GL_DYNAMIC_DRAW);
+
+        m_chunks.push_back(chunk);
+    }
+}
+
+void TransformFeedbackParticles::uploadChunk(const unsigned int chunk, const unsigned int begin, const unsigned int end)
+{
+    const ParticleState::Chunk & source = *m_initialState->chunks[chunk];
 
-    m_vao->binding(0)->setBuffer(m_sourcePositions,  0, sizeof(vec4));
-    m_vao->binding(1)->setBuffer(m_sourceVelocities, 0, sizeof(vec4));
+    uploadEncoded(*m_chunks[chunk].sourcePositions, begin, source.positions.data() + begin, end - begin, fixedPositionRange);
+    uploadEncoded(*m_chunks[chunk].sourceVelocities, begin, source.velocities.data() + begin, end - begin, fixedVelocityRange);
+}
 
-    m_targetPositions->bindBase (GL_TRANSFORM_FEEDBACK_BUFFER, 0);
-    m_targetVelocities->bindBase(GL_TRANSFORM_FEEDBACK_BUFFER, 1);
+void TransformFeedbackParticles::readback(Buffer & buffer)
+{
+    const auto size = static_cast<GLsizeiptr>(ParticleState::chunkSize * particleFormatSize(m_format));
+    const auto velocities = static_cast<GLintptr>(m_chunks.size() * size);
+
+    // the sources hold the result of the last step
+    for (unsigned int i = 0; i < m_chunks.size(); ++i)
+    {
+        m_chunks[i].sourcePositions->copySubData(&buffer, 0, i * size, size);
+        m_chunks[i].sourceVelocities->copySubData(&buffer, 0, velocities + i * size, size);
+    }
+}
+
+void TransformFeedbackParticles::step(const float elapsed)
+{
+    const auto stride = static_cast<GLint>(particleFormatSize(m_format));
+
+    m_vao->bind();
 
     m_forces.bind();
     m_transformFeedbackProgram->setUniform("forces", 0);
@@ -97,11 +167,30 @@ void TransformFeedbackParticles::step(const float elapsed)
     glEnable(GL_RASTERIZER_DISCARD);
 
     m_transformFeedbackProgram->use();
-    m_transformFeedback->bind();
-    m_transformFeedback->begin(GL_POINTS);
-    m_vao->drawArrays(GL_POINTS, 0, m_numParticles);
-    m_transformFeedback->end();
-    m_transformFeedback->unbind();
+
+    for (unsigned int i = 0; i < m_chunks.size(); ++i)
+    {
+        Chunk & chunk = m_chunks[i];
+
+        m_vao->binding(0)->setBuffer(chunk.sourcePositions, 0, stride);
+        m_vao->binding(1)->setBuffer(chunk.sourceVelocities, 0, stride);
+
+        setEnsembleUniforms(m_transformFeedbackProgram, i);
+
+        // indexed transform feedback bindings belong to the bound transform feedback object
+        chunk.transformFeedback->bind();
+        chunk.targetPositions->bindBase (GL_TRANSFORM_FEEDBACK_BUFFER, 0);
+        chunk.targetVelocities->bindBase(GL_TRANSFORM_FEEDBACK_BUFFER, 1);
+
+        chunk.transformFeedback->begin(GL_POINTS);
+        m_vao->drawArrays(GL_POINTS, 0, m_initialState->chunkParticles(i));
+        chunk.transformFeedback->end();
+        chunk.transformFeedback->unbind();
+
+        std::swap(chunk.sourcePositions, chunk.targetPositions);
+        std::swap(chunk.sourceVelocities, chunk.targetVelocities);
+    }
+
     m_transformFeedbackProgram->release();
 
     glDisable(GL_RASTERIZER_DISCARD);
@@ -109,21 +198,49 @@ void TransformFeedbackParticles::step(const float elapsed)
     m_vao->unbind();
 
     m_forces.unbind();
-
-    std::swap(m_sourcePositions, m_targetPositions);
-    std::swap(m_sourceVelocities, m_targetVelocities);
 }
 
 void TransformFeedbackParticles::draw_impl()
 {
-    m_vao->binding(0)->setBuffer(m_sourcePositions, 0, sizeof(vec4));
-    m_vao->binding(1)->setBuffer(m_sourceVelocities, 0, sizeof(vec4));
+    const auto stride = static_cast<GLint>(particleFormatSize(m_format));
+    const bool culled = m_culling && m_cullingEnabled;
+    const bool instanced = m_renderPath == RenderPath::InstancedQuads;
+
+    if (culled)
+    {
+        m_culling->begin(static_cast<unsigned int>(m_chunks.size()), m_viewProjection, m_interpolation);
+        for (unsigned int i = 0; i < m_chunks.size(); ++i)
+            m_culling->cull(i, m_initialState->chunkParticles(i), *m_chunks[i].sourcePositions, *m_chunks[i].sourceVelocities);
+        m_culling->end();
+    }
 
     m_drawProgram->use();
 
     m_vao->bind();
-    //m_vao->drawArrays(GL_POINTS, 0, m_numParticles); // don't use this, it is erroneous
-    m_transformFeedback->draw(GL_POINTS);
+
+    // glDrawTransformFeedback would draw the count captured by the last step, which is stale
+    // after resets and resizes and undefined for chunks that were not stepped yet
+    for (unsigned int i = 0; i < m_chunks.size(); ++i)
+    {
+        m_vao->binding(0)->setBuffer(m_chunks[i].sourcePositions, 0, stride);
+        m_vao->binding(1)->setBuffer(m_chunks[i].sourceVelocities, 0, stride);
+
+        if (instanced)
+        {
+            setInstancedParticles(*m_chunks[i].sourcePositions, *m_chunks[i].sourceVelocities);
+            setInstancedIndices(culled ? m_culling->indices() : nullptr, i * ParticleState::chunkSize);
+        }
+
+        if (culled && instanced)
+            m_culling->drawInstanced(*m_vao, i);
+        else if (culled)
+            m_culling->draw(*m_vao, i);
+        else if (instanced)
+            m_vao->drawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, m_initialState->chunkParticles(i));
+        else
+            m_vao->drawArrays(GL_POINTS, 0, m_initialState->chunkParticles(i));
+    }
+
     m_vao->unbind();
 
     m_drawProgram->release();
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <vector>
+
 #include <globjects/base/ref_ptr.h>
 
 #include "AbstractParticleTechnique.h"
@@ -17,8 +19,7 @@ class TransformFeedbackParticles : public AbstractParticleTechnique
 {
 public:
     TransformFeedbackParticles(
-        const std::vector<glm::vec4> & positions
-    ,   const std::vector<glm::vec4> & velocities
+        const SharedParticleState & initialState
     ,   const globjects::Texture & forces
     ,   const gloperate::AbstractCameraCapability & cameraCap
     ,   const glm::ivec2 viewport);
@@ -26,20 +27,32 @@ public:
 
     virtual void initialize() override;
     virtual void reset() override;
+    virtual void release() override;
 
     virtual void step(float elapsed) override;
 
+    virtual void readback(globjects::Buffer & buffer) override;
+
 protected:
     virtual void draw_impl() override;
 
+    virtual void resizeChunks() override;
+    virtual void uploadChunk(unsigned int chunk, unsigned int begin, unsigned int end) override;
+
 protected:
-    globjects::ref_ptr<globjects::TransformFeedback> m_transformFeedback;
-    globjects::ref_ptr<globjects::Program> m_transformFeedbackProgram;
+    struct Chunk
+    {
+        globjects::ref_ptr<globjects::TransformFeedback> transformFeedback;
 
-    globjects::ref_ptr<globjects::Buffer> m_sourcePositions;
-    globjects::ref_ptr<globjects::Buffer> m_sourceVelocities;
-    globjects::ref_ptr<globjects::Buffer> m_targetPositions;
-    globjects::ref_ptr<globjects::Buffer> m_targetVelocities;
+        globjects::ref_ptr<globjects::Buffer> sourcePositions;
+        globjects::ref_ptr<globjects::Buffer> sourceVelocities;
+        globjects::ref_ptr<globjects::Buffer> targetPositions;
+        globjects::ref_ptr<globjects::Buffer> targetVelocities;
+    };
+
+    std::vector<Chunk> m_chunks;
+
+    globjects::ref_ptr<globjects::Program> m_transformFeedbackProgram;
 
     globjects::ref_ptr<globjects::VertexArray> m_vao;
 };
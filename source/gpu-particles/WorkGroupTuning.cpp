@@ -0,0 +1,67 @@
+#include "WorkGroupTuning.h"
+
+#include <fstream>
+#include <sstream>
+
+#include <globjects/logging.h>
+
+
+using namespace globjects;
+
+WorkGroupTuningCache::WorkGroupTuningCache(const std::string & path)
+: m_path(path)
+{
+    load();
+}
+
+WorkGroupTuningCache::~WorkGroupTuningCache()
+{
+}
+
+bool WorkGroupTuningCache::find(const std::string & key, WorkGroupConfig & config) const
+{
+    const auto entry = m_entries.find(key);
+    if (entry == m_entries.end())
+        return false;
+
+    config = entry->second;
+    return true;
+}
+
+void WorkGroupTuningCache::store(const std::string & key, const WorkGroupConfig & config)
+{
+    m_entries[key] = config;
+
+    if (!save())
+        warning() << "Could not write work group tuning cache " << m_path;
+}
+
+void WorkGroupTuningCache::load()
+{
+    std::ifstream file(m_path);
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        const auto tab = line.rfind('\t');
+        if (tab == std::string::npos)
+            continue;
+
+        WorkGroupConfig config;
+        std::istringstream values(line.substr(tab + 1));
+
+        // skip malformed entries, they are replaced by the next tuning run
+        if (values >> config.localSize >> config.particlesPerInvocation && config.localSize > 0 && config.particlesPerInvocation > 0)
+            m_entries[line.substr(0, tab)] = config;
+    }
+}
+
+bool WorkGroupTuningCache::save() const
+{
+    std::ofstream file(m_path, std::ios::trunc);
+
+    for (const auto & entry : m_entries)
+        file << entry.first << '\t' << entry.second.localSize << ' ' << entry.second.particlesPerInvocation << '\n';
+
+    return static_cast<bool>(file);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <map>
+#include <string>
+
+
+// Work group shape of the compute step: invocations per group and particles per invocation,
+// see LOCAL_SIZE and PARTICLES_PER_INVOCATION in particle.comp.
+struct WorkGroupConfig
+{
+    unsigned int localSize;
+    unsigned int particlesPerInvocation;
+};
+
+// Persists tuned work group configurations per key (device and particle format) as text lines
+// "<key>\t<local size> <particles per invocation>". Unreadable files are treated as empty.
+class WorkGroupTuningCache
+{
+public:
+    explicit WorkGroupTuningCache(const std::string & path);
+    ~WorkGroupTuningCache();
+
+    bool find(const std::string & key, WorkGroupConfig & config) const;
+
+    // adds or replaces the entry and rewrites the file
+    void store(const std::string & key, const WorkGroupConfig & config);
+
+protected:
+    void load();
+    bool save() const;
+
+protected:
+    std::string m_path;
+    std::map<std::string, WorkGroupConfig> m_entries;
+};
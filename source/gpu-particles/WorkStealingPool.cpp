@@ -0,0 +1,236 @@
+#include "WorkStealingPool.h"
+
+#include <algorithm>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+
+unsigned int WorkStealingPool::hardwareThreads()
+{
+    const unsigned int threads = std::thread::hardware_concurrency();
+    return threads > 0 ? threads : 1;
+}
+
+WorkStealingPool::WorkStealingPool(const unsigned int threadCount, const bool pinned)
+: m_threadCount(threadCount > 0 ? threadCount : hardwareThreads())
+, m_pinned(pinned)
+, m_task(nullptr)
+, m_pending(0)
+, m_generation(0)
+, m_quit(false)
+{
+    start();
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    stop();
+}
+
+unsigned int WorkStealingPool::threadCount() const
+{
+    return m_threadCount;
+}
+
+void WorkStealingPool::setThreadCount(unsigned int threadCount)
+{
+    threadCount = threadCount > 0 ? threadCount : hardwareThreads();
+
+    if (threadCount == m_threadCount)
+        return;
+
+    stop();
+    m_threadCount = threadCount;
+    start();
+}
+
+bool WorkStealingPool::pinned() const
+{
+    return m_pinned;
+}
+
+void WorkStealingPool::setPinned(const bool pinned)
+{
+    if (pinned == m_pinned)
+        return;
+
+    stop();
+    m_pinned = pinned;
+    start();
+}
+
+void WorkStealingPool::start()
+{
+    m_quit = false;
+
+    m_queues.clear();
+    for (unsigned int i = 0; i < m_threadCount; ++i)
+        m_queues.emplace_back(new Queue);
+
+    // queue 0 belongs to the thread calling parallelFor
+    for (unsigned int i = 1; i < m_threadCount; ++i)
+    {
+        m_workers.emplace_back(&WorkStealingPool::workerLoop, this, i);
+
+        if (m_pinned)
+            pin(m_workers.back(), i);
+    }
+}
+
+void WorkStealingPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_wakeCondition.notify_all();
+
+    for (auto & worker : m_workers)
+        worker.join();
+
+    m_workers.clear();
+}
+
+void WorkStealingPool::parallelFor(const std::size_t count, std::size_t grain, const Task & task)
+{
+    if (count == 0)
+        return;
+
+    grain = std::max<std::size_t>(grain, 1);
+    const std::size_t numChunks = (count + grain - 1) / grain;
+
+    // callers rely on chunks never crossing a multiple of grain, also when running serially
+    if (m_threadCount == 1 || numChunks == 1)
+    {
+        for (std::size_t c = 0; c < numChunks; ++c)
+            task(c * grain, std::min(count, (c + 1) * grain));
+        return;
+    }
+
+    m_task = &task;
+    m_pending.store(numChunks);
+
+    // deal out contiguous blocks of chunks, so that each thread walks through memory linearly until it starts stealing
+    const std::size_t chunksPerThread = (numChunks + m_threadCount - 1) / m_threadCount;
+
+    for (unsigned int i = 0; i < m_threadCount; ++i)
+    {
+        Queue & queue = *m_queues[i];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+
+        const std::size_t last = std::min(numChunks, (i + 1) * chunksPerThread);
+        for (std::size_t c = i * chunksPerThread; c < last; ++c)
+            queue.chunks.push_back(Chunk{ c * grain, std::min(count, (c + 1) * grain) });
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_generation;
+    }
+    m_wakeCondition.notify_all();
+
+    runChunks(0);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_doneCondition.wait(lock, [this] { return m_pending.load() == 0; });
+
+    m_task = nullptr;
+}
+
+void WorkStealingPool::workerLoop(const unsigned int index)
+{
+    unsigned long long generation;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        generation = m_generation;
+    }
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wakeCondition.wait(lock, [this, generation] { return m_quit || m_generation != generation; });
+
+            if (m_quit)
+                return;
+
+            generation = m_generation;
+        }
+
+        runChunks(index);
+    }
+}
+
+void WorkStealingPool::runChunks(const unsigned int index)
+{
+    Chunk chunk;
+    while (pop(index, chunk) || steal(index, chunk))
+    {
+        // m_task is published before the chunks are queued, the queue mutex orders both
+        (*m_task)(chunk.begin, chunk.end);
+
+        if (m_pending.fetch_sub(1) == 1)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_doneCondition.notify_all();
+        }
+    }
+}
+
+bool WorkStealingPool::pop(const unsigned int index, Chunk & chunk)
+{
+    Queue & queue = *m_queues[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+
+    if (queue.chunks.empty())
+        return false;
+
+    chunk = queue.chunks.front();
+    queue.chunks.pop_front();
+
+    return true;
+}
+
+bool WorkStealingPool::steal(const unsigned int thief, Chunk & chunk)
+{
+    for (unsigned int i = 1; i < m_threadCount; ++i)
+    {
+        Queue & queue = *m_queues[(thief + i) % m_threadCount];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+
+        if (queue.chunks.empty())
+            continue;
+
+        // steal from the far end of the victim's block to not interfere with its linear walk
+        chunk = queue.chunks.back();
+        queue.chunks.pop_back();
+
+        return true;
+    }
+
+    return false;
+}
+
+void WorkStealingPool::pin(std::thread & thread, const unsigned int core)
+{
+#if defined(_WIN32)
+    SetThreadAffinityMask(thread.native_handle(), static_cast<DWORD_PTR>(1) << (core % hardwareThreads() % 64));
+#elif defined(__linux__)
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core % hardwareThreads(), &cpus);
+
+    pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &cpus);
+#else
+    (void)thread;
+    (void)core;
+#endif
+}
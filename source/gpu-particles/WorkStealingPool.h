@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Thread pool for data parallel loops on the CPU. Each parallelFor splits its range into chunks
+// that are dealt out to per-thread queues in contiguous blocks; idle threads steal chunks from the
+// back of other queues. The calling thread takes part in the work and parallelFor returns only
+// after all chunks are done, i.e., every call acts as a barrier.
+class WorkStealingPool
+{
+public:
+    using Task = std::function<void(std::size_t begin, std::size_t end)>;
+
+public:
+    static unsigned int hardwareThreads();
+
+public:
+    explicit WorkStealingPool(unsigned int threadCount = 0, bool pinned = false);
+    ~WorkStealingPool();
+
+    // number of threads working on a parallelFor, including the calling thread
+    unsigned int threadCount() const;
+    void setThreadCount(unsigned int threadCount);
+
+    // binds worker threads to distinct cores (no effect on platforms without affinity support)
+    bool pinned() const;
+    void setPinned(bool pinned);
+
+    // calls task for [0, count) in chunks of grain, each chunk begins at a multiple of grain
+    void parallelFor(std::size_t count, std::size_t grain, const Task & task);
+
+protected:
+    struct Chunk
+    {
+        std::size_t begin;
+        std::size_t end;
+    };
+
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Chunk> chunks;
+    };
+
+    void start();
+    void stop();
+
+    void workerLoop(unsigned int index);
+    void runChunks(unsigned int index);
+
+    bool pop(unsigned int index, Chunk & chunk);
+    bool steal(unsigned int thief, Chunk & chunk);
+
+    void pin(std::thread & thread, unsigned int core);
+
+protected:
+    unsigned int m_threadCount;
+    bool m_pinned;
+
+    std::vector<std::thread> m_workers;
+    std::vector<std::unique_ptr<Queue>> m_queues;
+
+    const Task * m_task;
+    std::atomic<std::size_t> m_pending;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wakeCondition;
+    std::condition_variable m_doneCondition;
+    unsigned long long m_generation;
+    bool m_quit;
+};
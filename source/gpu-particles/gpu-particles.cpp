@@ -1,8 +1,11 @@
 #include "gpu-particles.h"
 
+#include <algorithm>
+#include <cmath>
+#include <functional>
+
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
-#include <glm/gtc/random.hpp>
 
 #include <glbinding/gl/functions.h>
 #include <glbinding/gl/extension.h>
@@ -27,10 +30,18 @@
 #include "GpuParticlesInputCapability.h"
 
 #include "AbstractParticleTechnique.h"
+#include "Checkpoint.h"
 
 #include "ComputeShaderParticles.h"
 #include "FragmentShaderParticles.h"
 #include "TransformFeedbackParticles.h"
+#include "CpuSimdParticles.h"
+#include "CounterRandom.h"
+#include "FramePipeline.h"
+#include "ParticleStatistics.h"
+#include "PhaseTimers.h"
+#include "TrajectoryRecorder.h"
+#include "WorkStealingPool.h"
 
 
 using namespace gl;
@@ -39,17 +50,76 @@ using namespace globjects;
 using namespace gloperate;
 
 
+namespace
+{
+
+// independent random streams of the counter-based generator, the force field uses streams 1 to 3
+const std::uint32_t positionStream = 0;
+
+}
+
+
 GpuParticles::GpuParticles(ResourceManager & resourceManager, const cpplocate::ModuleInfo & moduleInfo)
 :   Painter("gpu-particles", resourceManager, moduleInfo)
 ,   m_targetFramebufferCapability(addCapability(new TargetFramebufferCapability()))
 ,   m_viewportCapability(addCapability(new ViewportCapability()))
 ,   m_projectionCapability(addCapability(new PerspectiveProjectionCapability(m_viewportCapability)))
 ,   m_cameraCapability(addCapability(new CameraCapability(vec3(0.f, 1.f,-3.f))))
+,   m_timeCapability(addCapability(new VirtualTimeCapability()))
 ,   m_inputCapability(addCapability(new GpuParticlesInputCapability()))
 ,   m_technique(ParticleTechnique::FragmentShaderTechnique)
+,   m_evictInactive(false)
+,   m_frustumCulling(true)
+,   m_renderPath(RenderPath::GeometryShader)
+,   m_trailFormat(TrailFormat::Float32)
+,   m_trailScale(1.f)
+,   m_freezePausedTrails(false)
 ,   m_numParticles(262144)
+,   m_numParticlesChanged(false)
+,   m_format(ParticleFormat::Float4)
+,   m_formatChanged(false)
+,   m_seed(0)
+,   m_seedChanged(false)
+,   m_ensembleSize(1)
+,   m_ensembleChanged(false)
+,   m_statisticsOnly(false)
+,   m_statisticsInterval(0)
+,   m_framesSinceStatistics(0)
+,   m_statistics(new ParticleStatistics())
 ,   m_steps(1)
+,   m_simulationRate(0.f)
+,   m_maxCatchUpSteps(8)
+,   m_frameSteps(0)
+,   m_accumulator(0.f)
+,   m_interpolation(0.f)
+,   m_sortInterval(0)
+,   m_stepsSinceSort(0)
+,   m_interaction{ InteractionMode::None, 0.05f, 1.f }
+,   m_gravity{ GravityMode::Central, 0.5f, 1.f }
+,   m_emission{ EmitterMode::Off, 1, 10000.f, 1.f, 5.f, 0 }
+,   m_poolChanged(false)
+,   m_threadPool(new WorkStealingPool())
+,   m_threadCount(m_threadPool->threadCount())
+,   m_pinThreads(false)
+,   m_framePipeline(new FramePipeline(2))
+,   m_timers(new PhaseTimers())
+,   m_forceField(new ForceField(*m_threadPool))
+,   m_simulationTime(0.0)
+,   m_checkpointFile("gpu-particles.checkpoint")
+,   m_checkpointInterval(0.f)
+,   m_checkpointAge(0.f)
+,   m_savePending(false)
+,   m_restorePending(false)
+,   m_checkpointWriter(new CheckpointWriter())
+,   m_recording(false)
+,   m_recordFile("gpu-particles.trajectory")
+,   m_recordInterval(1)
+,   m_recordDelta(true)
+,   m_recordCompression(false)
+,   m_recorder(new TrajectoryRecorder())
 {
+    m_statistics->setFile("gpu-particles.statistics.csv");
+
     setupPropertyGroup();
     m_timer.setAutoUpdating(false);
     m_timer.start();
@@ -63,7 +133,282 @@ void GpuParticles::setupPropertyGroup()
         &GpuParticles::particleTechnique, &GpuParticles::setParticleTechnique)->setStrings({
         { ParticleTechnique::ComputeShaderTechnique, "Compute Shader Technique" },
         { ParticleTechnique::TransformFeedbackTechnique, "Transform Feedback Technique" },
-        { ParticleTechnique::FragmentShaderTechnique, "Fragment Shader Technique" }});
+        { ParticleTechnique::FragmentShaderTechnique, "Fragment Shader Technique" },
+        { ParticleTechnique::CpuSimdTechnique, "CPU SIMD Technique" }});
+
+    addProperty<int>("num_particles", this,
+        &GpuParticles::numParticles, &GpuParticles::setNumParticles)->setOptions({
+        { "minimum", 1 },
+        { "maximum", 1 << 25 }});
+
+    // Fixed Point 16 uses the fixed ranges of ParticleFormat.h rather than the state's bounds:
+    // positions beyond +-4 and velocities beyond +-8 are clamped
+    addProperty<ParticleFormat>("format", this,
+        &GpuParticles::format, &GpuParticles::setFormat)->setStrings({
+        { ParticleFormat::Float4, "Float4" },
+        { ParticleFormat::Float3, "Packed Float3" },
+        { ParticleFormat::Half, "Half Float" },
+        { ParticleFormat::Fixed16, "Fixed Point 16" }});
+
+    addProperty<unsigned int>("seed", this,
+        &GpuParticles::seed, &GpuParticles::setSeed);
+
+    // parameter sweeps: independent systems of consecutive seeds, stepped together; they run
+    // without sorting, emitters, interactions and tree gravity, which would mix them
+    addProperty<unsigned int>("ensemble_size", this,
+        &GpuParticles::ensembleSize, &GpuParticles::setEnsembleSize)->setOptions({
+        { "minimum", 1u },
+        { "maximum", maxEnsembleSize }});
+
+    // writes the statistics of each system to statistics_file every frame, the gpu techniques require compute shaders
+    addProperty<bool>("statistics_only", this,
+        &GpuParticles::statisticsOnly, &GpuParticles::setStatisticsOnly);
+
+    // evaluates the statistics asynchronously every n frames, see the statistics group
+    addProperty<int>("statistics_interval", this,
+        &GpuParticles::statisticsInterval, &GpuParticles::setStatisticsInterval)->setOptions({
+        { "minimum", 0 },
+        { "maximum", 1000 }});
+
+    addProperty<iozeug::FilePath>("statistics_file", this,
+        &GpuParticles::statisticsFile, &GpuParticles::setStatisticsFile);
+
+    addProperty<ForceFieldType>("force_field", this,
+        &GpuParticles::forceFieldType, &GpuParticles::setForceFieldType)->setStrings({
+        { ForceFieldType::Random, "Random 5x5x5" },
+        { ForceFieldType::CurlNoise, "Curl Noise" },
+        { ForceFieldType::Vortices, "Vortices" },
+        { ForceFieldType::Stream, "Stream From File" }});
+
+    addProperty<iozeug::FilePath>("force_field_file", this,
+        &GpuParticles::forceFieldFile, &GpuParticles::setForceFieldFile);
+
+    addProperty<int>("force_field_resolution", this,
+        &GpuParticles::forceFieldResolution, &GpuParticles::setForceFieldResolution)->setOptions({
+        { "minimum", ForceField::s_minResolution },
+        { "maximum", ForceField::s_maxResolution }});
+
+    addProperty<float>("force_field_speed", this,
+        &GpuParticles::forceFieldSpeed, &GpuParticles::setForceFieldSpeed)->setOptions({
+        { "minimum", 0.f },
+        { "maximum", 4.f }});
+
+    addProperty<int>("force_field_bricks_per_frame", this,
+        &GpuParticles::forceFieldBricksPerFrame, &GpuParticles::setForceFieldBricksPerFrame)->setOptions({
+        { "minimum", 1 },
+        { "maximum", 4096 }});
+
+    addProperty<bool>("evict_inactive", this,
+        &GpuParticles::evictInactive, &GpuParticles::setEvictInactive);
+
+    // draws only the particles inside the view frustum, culled by a compute pass or on the cpu
+    addProperty<bool>("frustum_culling", this,
+        &GpuParticles::frustumCulling, &GpuParticles::setFrustumCulling);
+
+    // compare them by the read-only timings of the particles phase, e.g., timings/particles_gpu_avg_ms
+    addProperty<RenderPath>("render_path", this,
+        &GpuParticles::renderPath, &GpuParticles::setRenderPath)->setStrings({
+        { RenderPath::GeometryShader, "Geometry Shader Quads" },
+        { RenderPath::InstancedQuads, "Instanced Quads" },
+        { RenderPath::PointSprites, "Point Sprites" }});
+
+    // the trail buffer is read and written by the decay of every frame and read again when presented
+    addProperty<TrailFormat>("trail_format", this,
+        &GpuParticles::trailFormat, &GpuParticles::setTrailFormat)->setStrings({
+        { TrailFormat::Float32, "RGBA32F" },
+        { TrailFormat::Float16, "RGBA16F" },
+        { TrailFormat::R11G11B10F, "R11G11B10F" }});
+
+    // of the viewport resolution, upscaled bilinearly
+    addProperty<float>("trail_scale", this,
+        &GpuParticles::trailScale, &GpuParticles::setTrailScale)->setOptions({
+        { "minimum", 0.25f },
+        { "maximum", 1.f }});
+
+    // keeps the trails of a paused simulation until the view changes, instead of letting them decay
+    addProperty<bool>("freeze_paused_trails", this,
+        &GpuParticles::freezePausedTrails, &GpuParticles::setFreezePausedTrails);
+
+    addProperty<unsigned int>("threads", this,
+        &GpuParticles::threadCount, &GpuParticles::setThreadCount)->setOptions({
+        { "minimum", 1u },
+        { "maximum", 4u * WorkStealingPool::hardwareThreads() }});
+
+    addProperty<bool>("pin_threads", this,
+        &GpuParticles::pinThreads, &GpuParticles::setPinThreads);
+
+    addProperty<int>("steps", this,
+        &GpuParticles::steps, &GpuParticles::setSteps)->setOptions({
+        { "minimum", 1 },
+        { "maximum", 64 }});
+
+    addProperty<float>("simulation_hz", this,
+        &GpuParticles::simulationRate, &GpuParticles::setSimulationRate)->setOptions({
+        { "minimum", 0.f },
+        { "maximum", 1000.f }});
+
+    addProperty<int>("max_catch_up_steps", this,
+        &GpuParticles::maxCatchUpSteps, &GpuParticles::setMaxCatchUpSteps)->setOptions({
+        { "minimum", 1 },
+        { "maximum", 64 }});
+
+    // read-only, e.g., for glexamples-bench to report the steps actually run
+    addProperty<int>("frame_steps", this, &GpuParticles::frameSteps);
+
+    addProperty<int>("sort_interval", this,
+        &GpuParticles::sortInterval, &GpuParticles::setSortInterval)->setOptions({
+        { "minimum", 0 },
+        { "maximum", 1000 }});
+
+    addProperty<InteractionMode>("interaction", this,
+        &GpuParticles::interactionMode, &GpuParticles::setInteractionMode)->setStrings({
+        { InteractionMode::None, "None" },
+        { InteractionMode::Repulsion, "Repulsion" },
+        { InteractionMode::Cohesion, "Cohesion" }});
+
+    // the cost grows with the cube of the radius, as does the number of neighbours
+    addProperty<float>("interaction_radius", this,
+        &GpuParticles::interactionRadius, &GpuParticles::setInteractionRadius)->setOptions({
+        { "minimum", 0.005f },
+        { "maximum", 0.25f }});
+
+    addProperty<float>("interaction_strength", this,
+        &GpuParticles::interactionStrength, &GpuParticles::setInteractionStrength)->setOptions({
+        { "minimum", 0.f },
+        { "maximum", 100.f }});
+
+    addProperty<GravityMode>("gravity", this,
+        &GpuParticles::gravityMode, &GpuParticles::setGravityMode)->setStrings({
+        { GravityMode::Central, "Central Pull" },
+        { GravityMode::BarnesHut, "Barnes-Hut N-Body" }});
+
+    // smaller angles are more accurate and slower, 0 sums all pairs directly
+    addProperty<float>("gravity_theta", this,
+        &GpuParticles::gravityTheta, &GpuParticles::setGravityTheta)->setOptions({
+        { "minimum", 0.f },
+        { "maximum", 1.5f }});
+
+    addProperty<float>("gravity_strength", this,
+        &GpuParticles::gravityStrength, &GpuParticles::setGravityStrength)->setOptions({
+        { "minimum", 0.f },
+        { "maximum", 100.f }});
+
+    // emitted particles reuse the slots of dead ones, num_particles bounds the live particles
+    addProperty<EmitterMode>("emitter", this,
+        &GpuParticles::emitterMode, &GpuParticles::setEmitterMode)->setStrings({
+        { EmitterMode::Off, "Off" },
+        { EmitterMode::Continuous, "Continuous" },
+        { EmitterMode::Bursts, "Bursts" }});
+
+    addProperty<unsigned int>("emitters", this,
+        &GpuParticles::emitterCount, &GpuParticles::setEmitterCount)->setOptions({
+        { "minimum", 1u },
+        { "maximum", 16u }});
+
+    // particles per second, bursts release the particles of their whole interval at once
+    addProperty<float>("emission_rate", this,
+        &GpuParticles::emissionRate, &GpuParticles::setEmissionRate)->setOptions({
+        { "minimum", 0.f },
+        { "maximum", 16777216.f }});
+
+    addProperty<float>("particle_lifetime", this,
+        &GpuParticles::particleLifetime, &GpuParticles::setParticleLifetime)->setOptions({
+        { "minimum", 0.1f },
+        { "maximum", 60.f }});
+
+    addProperty<float>("burst_interval", this,
+        &GpuParticles::burstInterval, &GpuParticles::setBurstInterval)->setOptions({
+        { "minimum", 0.05f },
+        { "maximum", 10.f }});
+
+    addProperty<unsigned int>("max_frames_in_flight", this,
+        &GpuParticles::maxFramesInFlight, &GpuParticles::setMaxFramesInFlight)->setOptions({
+        { "minimum", 1u },
+        { "maximum", 4u }});
+
+    // read-only statistics of the frame pipeline
+    addProperty<float>("cpu_gpu_overlap", this, &GpuParticles::cpuGpuOverlap);
+    addProperty<float>("gpu_wait_ms", this, &GpuParticles::gpuWaitTime);
+
+    // read-only rolling statistics per phase in milliseconds, e.g., timings/step_gpu_p99_ms
+    auto timings = addGroup("timings");
+    for (const auto phase : { TimedPhase::Step, TimedPhase::Draw, TimedPhase::Clear, TimedPhase::Particles, TimedPhase::Blit })
+    {
+        const PhaseTimers * timers = m_timers.get();
+
+        const std::function<PhaseTimers::Statistics ()> clocks[] = {
+            [timers, phase]() { return timers->cpu(phase); },
+            [timers, phase]() { return timers->gpu(phase); } };
+        const char * clockNames[] = { "_cpu", "_gpu" };
+
+        for (int i = 0; i < 2; ++i)
+        {
+            const std::string name = PhaseTimers::name(phase) + std::string(clockNames[i]);
+            const auto statistics = clocks[i];
+
+            timings->addProperty<float>(name + "_min_ms", std::function<float ()>([statistics]() { return statistics().min; }));
+            timings->addProperty<float>(name + "_avg_ms", std::function<float ()>([statistics]() { return statistics().average; }));
+            timings->addProperty<float>(name + "_p99_ms", std::function<float ()>([statistics]() { return statistics().p99; }));
+        }
+    }
+
+    // checkpoints hold no lifetimes or emission state, they are neither saved nor restored while emitters are active
+    addProperty<iozeug::FilePath>("checkpoint_file", this,
+        &GpuParticles::checkpointFile, &GpuParticles::setCheckpointFile);
+
+    addProperty<float>("checkpoint_interval", this,
+        &GpuParticles::checkpointInterval, &GpuParticles::setCheckpointInterval)->setOptions({
+        { "minimum", 0.f },
+        { "maximum", 3600.f }});
+
+    addProperty<double>("simulation_time", this, &GpuParticles::simulationTime);
+
+    addProperty<bool>("recording", this,
+        &GpuParticles::recording, &GpuParticles::setRecording);
+
+    addProperty<iozeug::FilePath>("record_file", this,
+        &GpuParticles::recordFile, &GpuParticles::setRecordFile);
+
+    addProperty<int>("record_interval", this,
+        &GpuParticles::recordInterval, &GpuParticles::setRecordInterval)->setOptions({
+        { "minimum", 1 },
+        { "maximum", 1000 }});
+
+    addProperty<bool>("record_delta", this,
+        &GpuParticles::recordDelta, &GpuParticles::setRecordDelta);
+
+    addProperty<bool>("record_compression", this,
+        &GpuParticles::recordCompression, &GpuParticles::setRecordCompression);
+
+    // read-only statistics of the recorder
+    addProperty<unsigned int>("record_dropped_chunks", this, &GpuParticles::recordDroppedChunks);
+    addProperty<float>("record_bandwidth_mb", this, &GpuParticles::recordBandwidth);
+
+    // read-only statistics of all particles as of the latest collected evaluation, e.g., statistics/max_speed
+    auto statistics = addGroup("statistics");
+    const ParticleStatistics * evaluation = m_statistics.get();
+
+    statistics->addProperty<double>("time", std::function<double ()>([evaluation]() { return evaluation->time(); }));
+    statistics->addProperty<unsigned int>("particles", std::function<unsigned int ()>([evaluation]() { return evaluation->total().particles; }));
+    statistics->addProperty<float>("kinetic_energy", std::function<float ()>([evaluation]() { return evaluation->total().kineticEnergy; }));
+    statistics->addProperty<float>("mean_speed", std::function<float ()>([evaluation]() { return evaluation->total().meanSpeed; }));
+    statistics->addProperty<float>("max_speed", std::function<float ()>([evaluation]() { return evaluation->total().maxSpeed; }));
+    statistics->addProperty<float>("spread", std::function<float ()>([evaluation]() { return evaluation->total().spread; }));
+
+    const char * axes[] = { "_x", "_y", "_z" };
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        statistics->addProperty<float>(std::string("centroid") + axes[axis], std::function<float ()>([evaluation, axis]() { return evaluation->total().centroid[axis]; }));
+        statistics->addProperty<float>(std::string("bounds_min") + axes[axis], std::function<float ()>([evaluation, axis]() { return evaluation->total().minimum[axis]; }));
+        statistics->addProperty<float>(std::string("bounds_max") + axes[axis], std::function<float ()>([evaluation, axis]() { return evaluation->total().maximum[axis]; }));
+    }
+
+    // particles per speed bin, bin i covers speeds from i to i + 1 times fixedVelocityRange / bins
+    for (unsigned int bin = 0; bin < ParticleStatistics::s_histogramBins; ++bin)
+    {
+        const std::string name = std::string(bin < 10 ? "speed_histogram_0" : "speed_histogram_") + std::to_string(bin);
+        statistics->addProperty<unsigned int>(name, std::function<unsigned int ()>([evaluation, bin]() { return evaluation->total().speedHistogram[bin]; }));
+    }
 }
 
 void GpuParticles::setupProjection()
@@ -82,156 +427,1062 @@ GpuParticles::ParticleTechnique GpuParticles::particleTechnique() const
 
 void GpuParticles::setParticleTechnique(ParticleTechnique technique)
 {
-    if (m_techniques.count(technique) > 0)
+    // before initialization the selection is validated in onInitialize
+    if (m_techniques.empty() || m_techniques.count(technique) > 0)
     {
         m_technique = technique;
         debug() << "Switched to " << property<ParticleTechnique>("technique")->toString();
     }
 }
 
-void GpuParticles::onInitialize()
+int GpuParticles::numParticles() const
 {
-    // create program
-    globjects::init();
+    return m_numParticles;
+}
 
-#ifdef __APPLE__
-    Shader::clearGlobalReplacements();
-    Shader::globalReplace("#version 140", "#version 150");
+void GpuParticles::setNumParticles(const int numParticles)
+{
+    if (numParticles == m_numParticles)
+        return;
 
-    debug() << "Using global OS X shader replacement '#version 140' -> '#version 150'" << std::endl;
-#endif
+    // resized in onPaint, where the context is current
+    m_numParticles = std::max(numParticles, 1);
+    m_numParticlesChanged = true;
+}
 
-    glClearColor(1.f, 1.f, 1.f, 0.f);
+ParticleFormat GpuParticles::format() const
+{
+    return m_format;
+}
 
-    setupProjection();
+void GpuParticles::setFormat(const ParticleFormat format)
+{
+    if (format == m_format)
+        return;
 
+    if (format == ParticleFormat::Fixed16)
+        warning() << "Fixed point particles are clamped to positions within +-" << fixedPositionRange
+            << " and velocities within +-" << fixedVelocityRange << ".";
 
-    // Initialize Particle Positions and Attributes
+    // techniques are recreated in onPaint, where the context is current
+    m_format = format;
+    m_formatChanged = true;
+}
 
-    m_positions.resize(m_numParticles);
-    for (int i = 0; i < m_numParticles; ++i)
-        m_positions[i] = vec4(sphericalRand<float>(1.f), 1.f);
+unsigned int GpuParticles::seed() const
+{
+    return m_seed;
+}
 
-    m_velocities.resize(m_numParticles);
-    for (int i = 0; i < m_numParticles; ++i)
-        m_velocities[i] = vec4(0.f);
+void GpuParticles::setSeed(const unsigned int seed)
+{
+    if (seed == m_seed)
+        return;
 
+    // regenerated in onPaint, where the context is current
+    m_seed = seed;
+    m_seedChanged = true;
+}
 
-    m_forces = Texture::createDefault(GL_TEXTURE_3D);
-    
-    NamedString::create("/particle-step.inc", new File("data/gpu-particles/particle-step.inc"));
+unsigned int GpuParticles::ensembleSize() const
+{
+    return m_ensembleSize;
+}
 
+void GpuParticles::setEnsembleSize(const unsigned int ensembleSize)
+{
+    const unsigned int clamped = std::min(std::max(ensembleSize, 1u), maxEnsembleSize);
+    if (clamped == m_ensembleSize)
+        return;
 
-    // initialize techniques
+    // ensembles run without emitters, which changes the techniques' buffers, see emission
+    if ((clamped > 1) != (m_ensembleSize > 1) && m_emission.mode != EmitterMode::Off)
+        m_poolChanged = true;
 
-    if (hasExtension(GLextension::GL_ARB_compute_shader))
-        m_techniques[ParticleTechnique::ComputeShaderTechnique] = new ComputeShaderParticles(
-            m_positions, m_velocities, *m_forces, *m_cameraCapability, ivec2(m_viewportCapability->width(), m_viewportCapability->height()));
-    else
-        warning() << "Compute shader based implementation not supported.";
+    // regenerated in onPaint, where the context is current
+    m_ensembleSize = clamped;
+    m_ensembleChanged = true;
+}
 
-    if (hasExtension(GLextension::GL_ARB_transform_feedback3)) 
-        m_techniques[ParticleTechnique::TransformFeedbackTechnique] = new TransformFeedbackParticles(
-            m_positions, m_velocities, *m_forces, *m_cameraCapability, ivec2(m_viewportCapability->width(), m_viewportCapability->height()));
-    else
-        warning() << "Transform feedback based implementation not supported.";
+bool GpuParticles::statisticsOnly() const
+{
+    return m_statisticsOnly;
+}
 
-    m_techniques[ParticleTechnique::FragmentShaderTechnique] = new FragmentShaderParticles(
-        m_positions, m_velocities, *m_forces, *m_cameraCapability, ivec2(m_viewportCapability->width(), m_viewportCapability->height()));
+void GpuParticles::setStatisticsOnly(const bool statisticsOnly)
+{
+    m_statisticsOnly = statisticsOnly;
+}
 
-    for (auto technique : m_techniques)
-        if (technique.second)
-            technique.second->initialize();
+int GpuParticles::statisticsInterval() const
+{
+    return m_statisticsInterval;
+}
 
-    reset();
-    
+void GpuParticles::setStatisticsInterval(const int statisticsInterval)
+{
+    m_statisticsInterval = std::max(statisticsInterval, 0);
+}
 
-    m_cameraCapability->setEye(vec3(0.f, 1.f,-3.f));
-    cameraChanged();
+iozeug::FilePath GpuParticles::statisticsFile() const
+{
+    return m_statistics->file();
+}
 
-    glDepthMask(GL_TRUE);
+void GpuParticles::setStatisticsFile(const iozeug::FilePath & file)
+{
+    m_statistics->setFile(file.path());
 }
 
-void GpuParticles::cameraChanged()
+ForceFieldType GpuParticles::forceFieldType() const
 {
-    
+    return m_forceField->type();
 }
 
-void GpuParticles::onPaint()
+void GpuParticles::setForceFieldType(const ForceFieldType type)
 {
-    if (m_viewportCapability->hasChanged())
-    {
-        glViewport(
-            m_viewportCapability->x(),
-            m_viewportCapability->y(),
-            m_viewportCapability->width(),
-            m_viewportCapability->height());
+    m_forceField->setType(type);
+}
 
-        for (auto technique : m_techniques)
-            if (technique.second)
-            {
-                technique.second->setViewport(ivec2(m_viewportCapability->width(), m_viewportCapability->height()));
-                technique.second->resize();
-            }
+int GpuParticles::forceFieldResolution() const
+{
+    return m_forceField->resolution();
+}
 
-        m_viewportCapability->setChanged(false);
-    }
+void GpuParticles::setForceFieldResolution(const int resolution)
+{
+    m_forceField->setResolution(resolution);
+}
 
-    const long double elapsed = static_cast<long double>(m_timer.elapsed().count());
-    m_timer.update();
+iozeug::FilePath GpuParticles::forceFieldFile() const
+{
+    return m_forceField->file();
+}
 
-    const float delta = static_cast<float>((m_timer.elapsed().count() - elapsed) * 1.0e-9L);
+void GpuParticles::setForceFieldFile(const iozeug::FilePath & file)
+{
+    m_forceField->setFile(file.path());
+}
 
-    glEnable(GL_DEPTH_TEST);
+float GpuParticles::forceFieldSpeed() const
+{
+    return m_forceField->speed();
+}
 
-    step(delta); // requires context to be current
-    m_techniques[m_technique]->draw(delta, m_projectionCapability->projection());
+void GpuParticles::setForceFieldSpeed(const float speed)
+{
+    m_forceField->setSpeed(speed);
+}
 
-    glDisable(GL_DEPTH_TEST);
+int GpuParticles::forceFieldBricksPerFrame() const
+{
+    return m_forceField->bricksPerFrame();
+}
 
-    cameraChanged();
+void GpuParticles::setForceFieldBricksPerFrame(const int bricksPerFrame)
+{
+    m_forceField->setBricksPerFrame(bricksPerFrame);
 }
 
-void GpuParticles::step(const float delta)
+bool GpuParticles::evictInactive() const
 {
-    if (m_inputCapability->paused())
-        return;
+    return m_evictInactive;
+}
 
-    const float delta_stepped = delta / static_cast<float>(m_steps);
+void GpuParticles::setEvictInactive(const bool evictInactive)
+{
+    m_evictInactive = evictInactive;
+}
 
-    for (int i = 0; i < m_steps; ++i)
-        m_techniques[m_technique]->step(delta_stepped);
+bool GpuParticles::frustumCulling() const
+{
+    return m_frustumCulling;
 }
 
-void GpuParticles::reset(const bool particles)
+void GpuParticles::setFrustumCulling(const bool frustumCulling)
 {
-    // initialize 3D Force Field (3D Texture)
+    m_frustumCulling = frustumCulling;
+}
 
-    static const ivec3 fdim(5, 5, 5); // this has center axises and allows for random rings etc..
+RenderPath GpuParticles::renderPath() const
+{
+    return m_renderPath;
+}
 
-    std::vector<vec3> forces;
-    forces.resize(fdim.x * fdim.y * fdim.z);
+void GpuParticles::setRenderPath(const RenderPath renderPath)
+{
+    m_renderPath = renderPath;
+}
 
-    srand(static_cast<unsigned int>(time(0)));
+TrailFormat GpuParticles::trailFormat() const
+{
+    return m_trailFormat;
+}
 
-    for (int z = 0; z < fdim.z; ++z)
-    for (int y = 0; y < fdim.y; ++y)
-    for (int x = 0; x < fdim.x; ++x)
-    {
-        const int i = z *  fdim.x * fdim.y + y * fdim.x + x;
-        const vec3 f(sphericalRand<float>(1.0));
+void GpuParticles::setTrailFormat(const TrailFormat format)
+{
+    m_trailFormat = format;
+}
 
-        forces[i] = f * (1.f - length(vec3(x, y, z)) / std::sqrt(3.f));
-    }
+float GpuParticles::trailScale() const
+{
+    return m_trailScale;
+}
 
-    m_forces->image3D(0, GL_RGB32F, fdim.x, fdim.y, fdim.z, 0, GL_RGB, GL_FLOAT, forces.data());
+void GpuParticles::setTrailScale(const float scale)
+{
+    m_trailScale = std::min(std::max(scale, 0.25f), 1.f);
+}
 
-    if (!particles)
-        return;
+bool GpuParticles::freezePausedTrails() const
+{
+    return m_freezePausedTrails;
+}
 
-    m_timer.reset();
-    m_timer.update();
+void GpuParticles::setFreezePausedTrails(const bool freeze)
+{
+    m_freezePausedTrails = freeze;
+}
 
-    for (auto technique : m_techniques)
-        technique.second->reset();
+unsigned int GpuParticles::threadCount() const
+{
+    return m_threadCount;
+}
+
+void GpuParticles::setThreadCount(const unsigned int threadCount)
+{
+    m_threadCount = threadCount;
+}
+
+bool GpuParticles::pinThreads() const
+{
+    return m_pinThreads;
+}
+
+void GpuParticles::setPinThreads(const bool pinThreads)
+{
+    m_pinThreads = pinThreads;
+}
+
+int GpuParticles::steps() const
+{
+    return m_steps;
+}
+
+void GpuParticles::setSteps(const int steps)
+{
+    m_steps = std::max(steps, 1);
+}
+
+float GpuParticles::simulationRate() const
+{
+    return m_simulationRate;
+}
+
+void GpuParticles::setSimulationRate(const float simulationRate)
+{
+    m_simulationRate = std::max(simulationRate, 0.f);
+    m_accumulator = 0.f;
+}
+
+int GpuParticles::maxCatchUpSteps() const
+{
+    return m_maxCatchUpSteps;
+}
+
+void GpuParticles::setMaxCatchUpSteps(const int maxCatchUpSteps)
+{
+    m_maxCatchUpSteps = std::max(maxCatchUpSteps, 1);
+}
+
+int GpuParticles::frameSteps() const
+{
+    return m_frameSteps;
+}
+
+int GpuParticles::sortInterval() const
+{
+    return m_sortInterval;
+}
+
+void GpuParticles::setSortInterval(const int sortInterval)
+{
+    m_sortInterval = std::max(sortInterval, 0);
+}
+
+InteractionMode GpuParticles::interactionMode() const
+{
+    return m_interaction.mode;
+}
+
+void GpuParticles::setInteractionMode(const InteractionMode mode)
+{
+    m_interaction.mode = mode;
+}
+
+float GpuParticles::interactionRadius() const
+{
+    return m_interaction.radius;
+}
+
+void GpuParticles::setInteractionRadius(const float radius)
+{
+    m_interaction.radius = std::max(radius, 0.005f);
+}
+
+float GpuParticles::interactionStrength() const
+{
+    return m_interaction.strength;
+}
+
+void GpuParticles::setInteractionStrength(const float strength)
+{
+    m_interaction.strength = std::max(strength, 0.f);
+}
+
+GravityMode GpuParticles::gravityMode() const
+{
+    return m_gravity.mode;
+}
+
+void GpuParticles::setGravityMode(const GravityMode mode)
+{
+    m_gravity.mode = mode;
+}
+
+float GpuParticles::gravityTheta() const
+{
+    return m_gravity.theta;
+}
+
+void GpuParticles::setGravityTheta(const float theta)
+{
+    m_gravity.theta = std::max(theta, 0.f);
+}
+
+float GpuParticles::gravityStrength() const
+{
+    return m_gravity.strength;
+}
+
+void GpuParticles::setGravityStrength(const float strength)
+{
+    m_gravity.strength = std::max(strength, 0.f);
+}
+
+EmitterMode GpuParticles::emitterMode() const
+{
+    return m_emission.mode;
+}
+
+void GpuParticles::setEmitterMode(const EmitterMode mode)
+{
+    if ((mode == EmitterMode::Off) != (m_emission.mode == EmitterMode::Off))
+        m_poolChanged = true;
+
+    m_emission.mode = mode;
+}
+
+unsigned int GpuParticles::emitterCount() const
+{
+    return m_emission.emitters;
+}
+
+void GpuParticles::setEmitterCount(const unsigned int emitters)
+{
+    m_emission.emitters = std::max(emitters, 1u);
+}
+
+float GpuParticles::emissionRate() const
+{
+    return m_emission.rate;
+}
+
+void GpuParticles::setEmissionRate(const float rate)
+{
+    m_emission.rate = std::max(rate, 0.f);
+}
+
+float GpuParticles::particleLifetime() const
+{
+    return m_emission.lifetime;
+}
+
+void GpuParticles::setParticleLifetime(const float lifetime)
+{
+    m_emission.lifetime = std::max(lifetime, 0.1f);
+}
+
+float GpuParticles::burstInterval() const
+{
+    return m_emission.burstInterval;
+}
+
+void GpuParticles::setBurstInterval(const float interval)
+{
+    m_emission.burstInterval = std::max(interval, 0.05f);
+}
+
+unsigned int GpuParticles::maxFramesInFlight() const
+{
+    return m_framePipeline->maxFramesInFlight();
+}
+
+void GpuParticles::setMaxFramesInFlight(const unsigned int maxFramesInFlight)
+{
+    m_framePipeline->setMaxFramesInFlight(maxFramesInFlight);
+}
+
+float GpuParticles::cpuGpuOverlap() const
+{
+    return m_framePipeline->overlap();
+}
+
+float GpuParticles::gpuWaitTime() const
+{
+    return m_framePipeline->waitTime();
+}
+
+iozeug::FilePath GpuParticles::checkpointFile() const
+{
+    return m_checkpointFile;
+}
+
+void GpuParticles::setCheckpointFile(const iozeug::FilePath & file)
+{
+    m_checkpointFile = file.path();
+}
+
+float GpuParticles::checkpointInterval() const
+{
+    return m_checkpointInterval;
+}
+
+void GpuParticles::setCheckpointInterval(const float checkpointInterval)
+{
+    m_checkpointInterval = std::max(checkpointInterval, 0.f);
+    m_checkpointAge = 0.f;
+}
+
+double GpuParticles::simulationTime() const
+{
+    return m_simulationTime;
+}
+
+void GpuParticles::saveCheckpoint()
+{
+    m_savePending = true;
+}
+
+void GpuParticles::restoreCheckpoint()
+{
+    m_restorePending = true;
+}
+
+bool GpuParticles::recording() const
+{
+    return m_recording;
+}
+
+void GpuParticles::setRecording(const bool recording)
+{
+    m_recording = recording;
+}
+
+iozeug::FilePath GpuParticles::recordFile() const
+{
+    return m_recordFile;
+}
+
+void GpuParticles::setRecordFile(const iozeug::FilePath & file)
+{
+    m_recordFile = file.path();
+}
+
+int GpuParticles::recordInterval() const
+{
+    return m_recordInterval;
+}
+
+void GpuParticles::setRecordInterval(const int recordInterval)
+{
+    m_recordInterval = std::max(recordInterval, 1);
+}
+
+bool GpuParticles::recordDelta() const
+{
+    return m_recordDelta;
+}
+
+void GpuParticles::setRecordDelta(const bool recordDelta)
+{
+    m_recordDelta = recordDelta;
+}
+
+bool GpuParticles::recordCompression() const
+{
+    return m_recordCompression;
+}
+
+void GpuParticles::setRecordCompression(const bool recordCompression)
+{
+    m_recordCompression = recordCompression;
+}
+
+unsigned int GpuParticles::recordDroppedChunks() const
+{
+    return m_recorder->droppedChunks();
+}
+
+float GpuParticles::recordBandwidth() const
+{
+    return m_recorder->bandwidth();
+}
+
+void GpuParticles::onInitialize()
+{
+    // create program
+    globjects::init();
+
+#ifdef __APPLE__
+    Shader::clearGlobalReplacements();
+    Shader::globalReplace("#version 140", "#version 150");
+
+    debug() << "Using global OS X shader replacement '#version 140' -> '#version 150'" << std::endl;
+#endif
+
+    glClearColor(1.f, 1.f, 1.f, 0.f);
+
+    setupProjection();
+
+
+    // Initialize Particle Positions and Attributes
+
+    createInitialState(false);
+    m_seedChanged = false;
+    m_numParticlesChanged = false;
+
+
+    // creates the texture and generates the first bricks, the techniques keep referencing it
+    m_forceField->setSeed(m_seed);
+    m_forceField->setLayers(static_cast<int>(ensemble().systems));
+    m_forceField->update(0.f);
+    
+    NamedString::create("/particle-step.inc", new File("data/gpu-particles/particle-step.inc"));
+    NamedString::create("/particle-format.inc", new File("data/gpu-particles/particle-format.inc"));
+    NamedString::create("/particle-pool.inc", new File("data/gpu-particles/particle-pool.inc"));
+
+
+    // create techniques, only the selected one allocates GPU resources (see prepareTechnique)
+
+    if (hasExtension(GLextension::GL_ARB_compute_shader))
+        m_techniques[ParticleTechnique::ComputeShaderTechnique] = new ComputeShaderParticles(
+            m_initialState, m_forceField->texture(), *m_cameraCapability, ivec2(m_viewportCapability->width(), m_viewportCapability->height()));
+    else
+        warning() << "Compute shader based implementation not supported.";
+
+    if (hasExtension(GLextension::GL_ARB_transform_feedback3)) 
+        m_techniques[ParticleTechnique::TransformFeedbackTechnique] = new TransformFeedbackParticles(
+            m_initialState, m_forceField->texture(), *m_cameraCapability, ivec2(m_viewportCapability->width(), m_viewportCapability->height()));
+    else
+        warning() << "Transform feedback based implementation not supported.";
+
+    m_techniques[ParticleTechnique::FragmentShaderTechnique] = new FragmentShaderParticles(
+        m_initialState, m_forceField->texture(), *m_cameraCapability, ivec2(m_viewportCapability->width(), m_viewportCapability->height()));
+
+    m_techniques[ParticleTechnique::CpuSimdTechnique] = new CpuSimdParticles(*m_threadPool, *m_forceField,
+        m_initialState, *m_cameraCapability, ivec2(m_viewportCapability->width(), m_viewportCapability->height()));
+
+    if (m_techniques.count(m_technique) == 0)
+    {
+        warning() << "Selected technique not supported, falling back to fragment shader based implementation.";
+        m_technique = ParticleTechnique::FragmentShaderTechnique;
+    }
+
+    m_emission.seed = m_seed;
+
+    for (auto technique : m_techniques)
+    {
+        technique.second->setFormat(m_format);
+        technique.second->setEmission(emission());
+        technique.second->setTimers(m_timers.get());
+    }
+    m_formatChanged = false;
+    m_poolChanged = false;
+
+    reset();
+    
+
+    m_cameraCapability->setEye(vec3(0.f, 1.f,-3.f));
+    cameraChanged();
+
+    glDepthMask(GL_TRUE);
+}
+
+void GpuParticles::cameraChanged()
+{
+    
+}
+
+void GpuParticles::onPaint()
+{
+    if (m_viewportCapability->hasChanged())
+    {
+        glViewport(
+            m_viewportCapability->x(),
+            m_viewportCapability->y(),
+            m_viewportCapability->width(),
+            m_viewportCapability->height());
+
+        for (auto technique : m_techniques)
+        {
+            technique.second->setViewport(ivec2(m_viewportCapability->width(), m_viewportCapability->height()));
+
+            if (technique.second->isInitialized())
+                technique.second->resize();
+        }
+
+        m_viewportCapability->setChanged(false);
+    }
+
+    const long double elapsed = static_cast<long double>(m_timer.elapsed().count());
+    m_timer.update();
+
+    float delta = static_cast<float>((m_timer.elapsed().count() - elapsed) * 1.0e-9L);
+
+    // prefer the host's virtual time if it advanced it, e.g., for fixed time steps in benchmarks
+    if (m_timeCapability->hasChanged())
+    {
+        delta = m_timeCapability->delta();
+        m_timeCapability->setChanged(false);
+    }
+
+    // a restored state replaces any pending seed or count change
+    if (m_restorePending || m_inputCapability->restoreRequested())
+    {
+        readCheckpoint(m_checkpointFile);
+        m_restorePending = false;
+    }
+
+    if (m_seedChanged || m_numParticlesChanged || m_ensembleChanged)
+    {
+        // a new seed invalidates all particles, a new count only adds or drops some unless it
+        // moves the boundaries of the systems of an ensemble
+        const bool regenerate = m_seedChanged || m_ensembleChanged || ensemble().systems > 1;
+        createInitialState(!regenerate);
+
+        for (auto technique : m_techniques)
+            technique.second->setInitialState(m_initialState);
+
+        if (regenerate)
+            reset();
+
+        m_seedChanged = false;
+        m_numParticlesChanged = false;
+        m_ensembleChanged = false;
+    }
+
+    if (m_formatChanged || m_poolChanged)
+    {
+        // buffers and shaders depend on the format and the pool, so the techniques restart from the initial state
+        m_emission.seed = m_seed;
+
+        for (auto technique : m_techniques)
+        {
+            technique.second->setFormat(m_format);
+            technique.second->setEmission(emission());
+
+            if (technique.second->isInitialized())
+                technique.second->release();
+        }
+
+        m_formatChanged = false;
+        m_poolChanged = false;
+    }
+
+    prepareTechnique();
+
+    if (m_recording != m_recorder->isRecording())
+    {
+        if (m_recording)
+            m_recording = m_recorder->start(m_recordFile, static_cast<unsigned int>(m_recordInterval), m_recordDelta, m_recordCompression);
+        else
+            m_recorder->stop();
+    }
+
+    // regenerates dirty force field bricks within the per frame budget
+    m_forceField->setLayers(static_cast<int>(ensemble().systems));
+    m_forceField->update(m_inputCapability->paused() ? 0.f : delta);
+
+    // blocks only if the gpu lags more than max_frames_in_flight frames behind
+    m_framePipeline->beginFrame();
+    m_timers->beginFrame();
+
+    glEnable(GL_DEPTH_TEST);
+
+    step(delta); // requires context to be current
+
+    // paused frames leave the state unchanged, so they do not count towards the interval
+    if (!m_inputCapability->paused())
+        m_checkpointAge += delta;
+
+    if (m_checkpointInterval > 0.f && m_checkpointAge >= m_checkpointInterval)
+        m_savePending = true;
+
+    // the copies are enqueued right after the step, before the draw
+    if (m_savePending || m_inputCapability->saveRequested())
+        writeCheckpoint();
+
+    m_checkpointWriter->update();
+    m_recorder->update();
+
+    // a paused simulation would only repeat the statistics
+    const bool statisticsDue = m_statisticsOnly
+        || (m_statisticsInterval > 0 && ++m_framesSinceStatistics >= m_statisticsInterval);
+
+    if (statisticsDue && !m_inputCapability->paused())
+    {
+        m_framesSinceStatistics = 0;
+
+        if (!m_statistics->evaluate(*m_techniques[m_technique], ensemble(), m_simulationTime))
+        {
+            warning() << "Statistics of the gpu techniques require compute shaders, disabling them.";
+            m_statisticsOnly = false;
+            m_statisticsInterval = 0;
+        }
+    }
+
+    if (m_statisticsOnly)
+    {
+        // the statistics replace the image
+        glClear(GL_COLOR_BUFFER_BIT);
+    }
+    else
+    {
+        PhaseTimers::Scope scope(m_timers.get(), TimedPhase::Draw);
+        m_techniques[m_technique]->setCulling(m_frustumCulling);
+        m_techniques[m_technique]->setRenderPath(m_renderPath);
+        m_techniques[m_technique]->setTrailBuffer(m_trailFormat, m_trailScale);
+        m_techniques[m_technique]->setFreezeTrails(m_freezePausedTrails && m_inputCapability->paused());
+        m_techniques[m_technique]->draw(delta, m_projectionCapability->projection(), m_interpolation);
+    }
+
+    m_statistics->update();
+
+    glDisable(GL_DEPTH_TEST);
+
+    m_timers->endFrame();
+    m_framePipeline->endFrame();
+
+    cameraChanged();
+}
+
+void GpuParticles::createInitialState(const bool reuseChunks)
+{
+    // the only host copy of the initial state, all techniques share and upload from it
+
+    static const unsigned int chunkSize = ParticleState::chunkSize;
+
+    const auto initialState = std::make_shared<ParticleState>();
+
+    initialState->count = static_cast<unsigned int>(m_numParticles);
+    initialState->chunks.resize(ParticleState::chunksFor(initialState->count));
+
+    // chunks only depend on seed and index, a resize shares all chunks of the previous state it can
+    unsigned int reused = 0;
+    if (reuseChunks && m_initialState)
+        for (; reused < initialState->chunkCount() && reused < m_initialState->chunkCount(); ++reused)
+            initialState->chunks[reused] = m_initialState->chunks[reused];
+
+    std::vector<std::shared_ptr<ParticleState::Chunk>> chunks;
+    for (unsigned int i = reused; i < initialState->chunkCount(); ++i)
+    {
+        chunks.push_back(std::make_shared<ParticleState::Chunk>());
+        initialState->chunks[i] = chunks.back();
+    }
+
+    const ParticleEnsemble ensemble = this->ensemble();
+    const unsigned int seed = m_seed;
+
+    // one chunk per task, allocation included
+    m_threadPool->parallelFor(chunks.size() * chunkSize, chunkSize, [&chunks, &ensemble, seed, reused](std::size_t begin, std::size_t)
+    {
+        const std::size_t index = begin / chunkSize;
+        ParticleState::Chunk & chunk = *chunks[index];
+
+        chunk.positions.resize(chunkSize);
+        chunk.velocities.resize(chunkSize, vec4(0.f));
+
+        const std::size_t offset = (reused + index) * chunkSize;
+
+        // system s starts from seed + s, its particles are numbered from its first one
+        for (std::size_t i = 0; i < chunkSize; ++i)
+        {
+            const unsigned int system = ensembleSystem(ensemble, static_cast<unsigned int>(offset + i));
+            const Philox4x32 random(seed + system);
+
+            const std::size_t particle = offset + i - ensembleBegin(ensemble, system, 0);
+            chunk.positions[i] = vec4(random.sphericalRand(particle, positionStream, 1.f), 1.f);
+        }
+    });
+
+    m_initialState = initialState;
+}
+
+ParticleEnsemble GpuParticles::ensemble() const
+{
+    const unsigned int count = static_cast<unsigned int>(m_numParticles);
+    const unsigned int systems = std::min(m_ensembleSize, count);
+
+    if (systems <= 1)
+        return singleSystem(count);
+
+    return { systems, count / systems, static_cast<unsigned int>(m_forceField->layers()), m_forceField->layerGrid() };
+}
+
+ParticleEmission GpuParticles::emission() const
+{
+    ParticleEmission emission = m_emission;
+    if (m_ensembleSize > 1)
+        emission.mode = EmitterMode::Off;
+
+    return emission;
+}
+
+void GpuParticles::prepareTechnique()
+{
+    AbstractParticleTechnique * technique = m_techniques[m_technique];
+
+    if (!technique->isInitialized())
+    {
+        // the viewport is already up to date, only the trail buffer needs to be allocated
+        technique->initialize();
+        technique->resize();
+
+        debug() << "Initialized " << property<ParticleTechnique>("technique")->toString();
+    }
+
+    if (!m_evictInactive)
+        return;
+
+    for (auto other : m_techniques)
+        if (other.second != technique && other.second->isInitialized())
+            other.second->release();
+}
+
+void GpuParticles::step(const float delta)
+{
+    m_frameSteps = 0;
+
+    if (m_inputCapability->paused())
+        return;
+
+    m_threadPool->setThreadCount(m_threadCount);
+    m_threadPool->setPinned(m_pinThreads);
+
+    // the systems of an ensemble must not interact
+    const ParticleEnsemble ensemble = this->ensemble();
+
+    ParticleInteraction interaction = m_interaction;
+    ParticleGravity gravity = m_gravity;
+
+    if (ensemble.systems > 1)
+    {
+        interaction.mode = InteractionMode::None;
+        gravity.mode = GravityMode::Central;
+    }
+
+    m_techniques[m_technique]->setInteraction(interaction);
+    m_techniques[m_technique]->setGravity(gravity);
+    m_techniques[m_technique]->setEnsemble(ensemble);
+
+    m_emission.seed = m_seed;
+    m_techniques[m_technique]->setEmission(emission());
+
+    if (m_simulationRate <= 0.f)
+    {
+        m_interpolation = 0.f;
+        advance(delta);
+        return;
+    }
+
+    const float fixedDelta = 1.f / m_simulationRate;
+
+    m_accumulator += delta;
+    int count = static_cast<int>(m_accumulator / fixedDelta);
+
+    if (count > m_maxCatchUpSteps)
+    {
+        // after a hitch the simulation falls behind the wall clock instead of taking unbounded time
+        m_accumulator = std::fmod(m_accumulator, fixedDelta) + static_cast<float>(m_maxCatchUpSteps) * fixedDelta;
+        count = m_maxCatchUpSteps;
+    }
+
+    for (int i = 0; i < count; ++i)
+        advance(fixedDelta);
+
+    m_accumulator = std::max(m_accumulator - static_cast<float>(count) * fixedDelta, 0.f);
+
+    // the last state lies ahead of the rendered time by the part of a step not yet owed
+    m_interpolation = m_accumulator - fixedDelta;
+}
+
+void GpuParticles::advance(const float delta)
+{
+    const float delta_stepped = delta / static_cast<float>(m_steps);
+
+    for (int i = 0; i < m_steps; ++i)
+    {
+        {
+            PhaseTimers::Scope scope(m_timers.get(), TimedPhase::Step);
+            m_techniques[m_technique]->step(delta_stepped);
+            ++m_frameSteps;
+
+            // the order of the particles only matters for the speed of the following steps,
+            // except for ensembles, whose systems are ranges of particles
+            if (m_sortInterval > 0 && m_ensembleSize <= 1 && ++m_stepsSinceSort >= m_sortInterval)
+            {
+                m_techniques[m_technique]->sort();
+                m_stepsSinceSort = 0;
+            }
+        }
+
+        m_simulationTime += delta_stepped;
+
+        // only enqueues copies, the recorder never waits within a step
+        m_recorder->step(*m_techniques[m_technique], m_simulationTime);
+    }
+}
+
+void GpuParticles::reset(const bool particles)
+{
+    // regenerated brick by brick with the next updates, a reset with an unchanged seed keeps the field
+    m_forceField->setSeed(m_seed);
+
+    if (!particles)
+        return;
+
+    m_timer.reset();
+    m_timer.update();
+
+    m_accumulator = 0.f;
+    m_interpolation = 0.f;
+    m_simulationTime = 0.0;
+    m_stepsSinceSort = 0;
+
+    for (auto technique : m_techniques)
+        if (technique.second->isInitialized())
+            technique.second->reset();
+}
+
+void GpuParticles::writeCheckpoint()
+{
+    // a request while the previous checkpoint is still being written is kept for later
+    if (m_checkpointWriter->busy())
+        return;
+
+    m_savePending = false;
+    m_checkpointAge = 0.f;
+
+    if (m_checkpointFile.empty())
+    {
+        warning() << "No checkpoint file set.";
+        return;
+    }
+
+    // the pool's lifetimes, live counts and emission sequence are not part of a checkpoint
+    if (emission().mode != EmitterMode::Off)
+    {
+        warning() << "Checkpoints do not support emitters, not saving \"" << m_checkpointFile << "\".";
+        return;
+    }
+
+    CheckpointInfo info;
+    info.count = m_initialState->size();
+    info.seed = m_seed;
+    info.ensembleSize = m_ensembleSize;
+    info.simulationTime = m_simulationTime;
+    info.forceFieldType = m_forceField->type();
+    info.forceFieldResolution = m_forceField->resolution();
+    info.forceFieldSpeed = m_forceField->speed();
+    info.forceFieldTime = m_forceField->time();
+
+    m_checkpointWriter->save(m_checkpointFile, *m_techniques[m_technique], info, m_forceField->cpuField());
+}
+
+bool GpuParticles::readCheckpoint(const std::string & path)
+{
+    static const unsigned int chunkSize = ParticleState::chunkSize;
+
+    Checkpoint checkpoint;
+    if (!checkpoint.open(path))
+    {
+        warning() << "Could not restore checkpoint \"" << path << "\"";
+        return false;
+    }
+
+    const CheckpointInfo & info = checkpoint.info();
+
+    // restoring would revive every slot of the pool, dead or alive; ensembles run without emitters
+    if (m_emission.mode != EmitterMode::Off && info.ensembleSize <= 1)
+    {
+        warning() << "Checkpoints do not support emitters, not restoring \"" << path << "\".";
+        return false;
+    }
+
+    // replaces the initial state, so later resets return to the checkpoint instead of regenerating
+    const auto state = std::make_shared<ParticleState>();
+    state->count = info.count;
+    state->chunks.resize(ParticleState::chunksFor(info.count));
+
+    const vec4 * positions = checkpoint.positions();
+    const vec4 * velocities = checkpoint.velocities();
+
+    // one chunk per task, copied straight from the mapping
+    m_threadPool->parallelFor(state->chunkCount() * static_cast<std::size_t>(chunkSize), chunkSize,
+        [&state, positions, velocities](std::size_t begin, std::size_t)
+    {
+        const unsigned int index = static_cast<unsigned int>(begin / chunkSize);
+        const unsigned int count = state->chunkParticles(index);
+
+        const auto chunk = std::make_shared<ParticleState::Chunk>();
+        chunk->positions.assign(positions + begin, positions + begin + count);
+        chunk->velocities.assign(velocities + begin, velocities + begin + count);
+
+        // chunks are always completely filled
+        chunk->positions.resize(chunkSize, vec4(0.f, 0.f, 0.f, 1.f));
+        chunk->velocities.resize(chunkSize, vec4(0.f));
+
+        state->chunks[index] = chunk;
+    });
+
+    m_initialState = state;
+    m_numParticles = static_cast<int>(info.count);
+    m_numParticlesChanged = false;
+    m_seed = info.seed;
+    m_seedChanged = false;
+
+    // the systems split the particles and select the force field layers as when saved
+    if ((info.ensembleSize > 1) != (m_ensembleSize > 1) && m_emission.mode != EmitterMode::Off)
+        m_poolChanged = true;
+
+    m_ensembleSize = info.ensembleSize;
+    m_ensembleChanged = false;
+
+    m_forceField->setLayers(static_cast<int>(ensemble().systems));
+    m_forceField->setSeed(info.seed);
+    m_forceField->setType(info.forceFieldType);
+    m_forceField->setResolution(info.forceFieldResolution);
+    m_forceField->setSpeed(info.forceFieldSpeed);
+    m_forceField->restore(info.forceFieldTime, checkpoint.forces());
+
+    for (auto technique : m_techniques)
+        technique.second->setInitialState(m_initialState);
+
+    reset();
+    m_simulationTime = info.simulationTime;
+
+    debug() << "Restored " << info.count << " particles at " << info.simulationTime << "s from " << path;
+
+    return true;
 }
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <memory>
+#include <string>
+
+#include <iozeug/FilePath.h>
 
 #include <glbinding/gl/types.h>
 
@@ -9,11 +12,16 @@
 #include <gloperate/painter/Painter.h>
 #include <gloperate/base/ChronoTimer.h>
 
+#include "BarnesHutTree.h"
+#include "ForceField.h"
+#include "ParticleEmission.h"
+#include "ParticleEnsemble.h"
+#include "ParticleFormat.h"
+#include "ParticleInteraction.h"
+#include "ParticleRenderPath.h"
+#include "TrailFormat.h"
+#include "ParticleState.h"
 
-namespace globjects
-{
-    class Texture;
-}
 
 namespace gloperate
 {
@@ -21,16 +29,23 @@ namespace gloperate
     class AbstractViewportCapability;
     class AbstractPerspectiveProjectionCapability;
     class AbstractCameraCapability;
+    class AbstractVirtualTimeCapability;
 }
 
 class GpuParticlesInputCapability;
 class AbstractParticleTechnique;
+class CheckpointWriter;
+class FramePipeline;
+class ParticleStatistics;
+class PhaseTimers;
+class TrajectoryRecorder;
+class WorkStealingPool;
 
 
 class GpuParticles : public gloperate::Painter
 {
 protected:
-    enum class ParticleTechnique { ComputeShaderTechnique, FragmentShaderTechnique, TransformFeedbackTechnique };
+    enum class ParticleTechnique { ComputeShaderTechnique, FragmentShaderTechnique, TransformFeedbackTechnique, CpuSimdTechnique };
 
 public:
     GpuParticles(gloperate::ResourceManager & resourceManager, const cpplocate::ModuleInfo & moduleInfo);
@@ -42,35 +57,274 @@ public:
     ParticleTechnique particleTechnique() const;
     void setParticleTechnique(ParticleTechnique technique);
 
+    unsigned int threadCount() const;
+    void setThreadCount(unsigned int threadCount);
+
+    bool pinThreads() const;
+    void setPinThreads(bool pinThreads);
+
+    int steps() const;
+    void setSteps(int steps);
+
+    float simulationRate() const;
+    void setSimulationRate(float simulationRate);
+
+    int maxCatchUpSteps() const;
+    void setMaxCatchUpSteps(int maxCatchUpSteps);
+
+    // technique steps run by the last frame, substeps included
+    int frameSteps() const;
+
+    int sortInterval() const;
+    void setSortInterval(int sortInterval);
+
+    InteractionMode interactionMode() const;
+    void setInteractionMode(InteractionMode mode);
+
+    float interactionRadius() const;
+    void setInteractionRadius(float radius);
+
+    float interactionStrength() const;
+    void setInteractionStrength(float strength);
+
+    GravityMode gravityMode() const;
+    void setGravityMode(GravityMode mode);
+
+    float gravityTheta() const;
+    void setGravityTheta(float theta);
+
+    float gravityStrength() const;
+    void setGravityStrength(float strength);
+
+    EmitterMode emitterMode() const;
+    void setEmitterMode(EmitterMode mode);
+
+    unsigned int emitterCount() const;
+    void setEmitterCount(unsigned int emitters);
+
+    float emissionRate() const;
+    void setEmissionRate(float rate);
+
+    float particleLifetime() const;
+    void setParticleLifetime(float lifetime);
+
+    float burstInterval() const;
+    void setBurstInterval(float interval);
+
+    int numParticles() const;
+    void setNumParticles(int numParticles);
+
+    ParticleFormat format() const;
+    void setFormat(ParticleFormat format);
+
+    unsigned int seed() const;
+    void setSeed(unsigned int seed);
+
+    // independent systems of the particles, see ParticleEnsemble.h
+    unsigned int ensembleSize() const;
+    void setEnsembleSize(unsigned int ensembleSize);
+
+    // evaluates the statistics of each system every frame instead of drawing the particles
+    bool statisticsOnly() const;
+    void setStatisticsOnly(bool statisticsOnly);
+
+    // frames between evaluations of the statistics while drawing, 0 evaluates them in statistics_only mode only
+    int statisticsInterval() const;
+    void setStatisticsInterval(int statisticsInterval);
+
+    iozeug::FilePath statisticsFile() const;
+    void setStatisticsFile(const iozeug::FilePath & file);
+
+    ForceFieldType forceFieldType() const;
+    void setForceFieldType(ForceFieldType type);
+
+    int forceFieldResolution() const;
+    void setForceFieldResolution(int resolution);
+
+    iozeug::FilePath forceFieldFile() const;
+    void setForceFieldFile(const iozeug::FilePath & file);
+
+    float forceFieldSpeed() const;
+    void setForceFieldSpeed(float speed);
+
+    int forceFieldBricksPerFrame() const;
+    void setForceFieldBricksPerFrame(int bricksPerFrame);
+
+    bool evictInactive() const;
+    void setEvictInactive(bool evictInactive);
+
+    bool frustumCulling() const;
+    void setFrustumCulling(bool frustumCulling);
+
+    RenderPath renderPath() const;
+    void setRenderPath(RenderPath renderPath);
+
+    TrailFormat trailFormat() const;
+    void setTrailFormat(TrailFormat format);
+
+    float trailScale() const;
+    void setTrailScale(float scale);
+
+    bool freezePausedTrails() const;
+    void setFreezePausedTrails(bool freeze);
+
+    unsigned int maxFramesInFlight() const;
+    void setMaxFramesInFlight(unsigned int maxFramesInFlight);
+
+    float cpuGpuOverlap() const;
+    float gpuWaitTime() const;
+
+    iozeug::FilePath checkpointFile() const;
+    void setCheckpointFile(const iozeug::FilePath & file);
+
+    // unpaused seconds between automatic checkpoints, 0 saves on request only
+    float checkpointInterval() const;
+    void setCheckpointInterval(float checkpointInterval);
+
+    double simulationTime() const;
+
+    // both take effect in onPaint, saving completes asynchronously over the next frames; checkpoints
+    // hold no pool state, so both are refused while emitters are active
+    void saveCheckpoint();
+    void restoreCheckpoint();
+
+    bool recording() const;
+    void setRecording(bool recording);
+
+    // the recording settings take effect with the next start of a recording
+    iozeug::FilePath recordFile() const;
+    void setRecordFile(const iozeug::FilePath & file);
+
+    // simulation steps between two captures
+    int recordInterval() const;
+    void setRecordInterval(int recordInterval);
+
+    bool recordDelta() const;
+    void setRecordDelta(bool recordDelta);
+
+    bool recordCompression() const;
+    void setRecordCompression(bool recordCompression);
+
+    unsigned int recordDroppedChunks() const;
+    float recordBandwidth() const;
+
 protected:
     void setupPropertyGroup();
     virtual void onInitialize() override;
     virtual void onPaint() override;
 
+    void createInitialState(bool reuseChunks);
+    // the systems of the ensemble over the current particles, at most one per particle
+    ParticleEnsemble ensemble() const;
+    // the emission of the techniques, which ensembles run without
+    ParticleEmission emission() const;
+    void prepareTechnique();
     void step(const float delta);
+    void advance(const float delta);
     void reset(const bool particles = true);
 
+    void writeCheckpoint();
+    bool readCheckpoint(const std::string & path);
+
 protected:
     /* capabilities */
     gloperate::AbstractTargetFramebufferCapability * m_targetFramebufferCapability;
     gloperate::AbstractViewportCapability * m_viewportCapability;
     gloperate::AbstractPerspectiveProjectionCapability * m_projectionCapability;
     gloperate::AbstractCameraCapability * m_cameraCapability;
+    gloperate::AbstractVirtualTimeCapability * m_timeCapability;
     GpuParticlesInputCapability * m_inputCapability;
 
     /* members */
     ParticleTechnique m_technique;
-    std::map<ParticleTechnique, AbstractParticleTechnique *> m_techniques;
+    std::map<ParticleTechnique, AbstractParticleTechnique *> m_techniques; // initialized when first painted
+    bool m_evictInactive;
+    bool m_frustumCulling;
+    RenderPath m_renderPath;
+    TrailFormat m_trailFormat;
+    float m_trailScale;
+    bool m_freezePausedTrails;
 
     // globjects::ref_ptr<gloperate::ChronoTimer> m_timer;
     gloperate::ChronoTimer m_timer;
 
     int m_numParticles;
+    bool m_numParticlesChanged;
+
+    SharedParticleState m_initialState;
+
+    ParticleFormat m_format;
+    bool m_formatChanged;
 
-    std::vector<glm::vec4> m_positions;
-    std::vector<glm::vec4> m_velocities;
+    // initial state and force field are generated from the seed only, runs are reproducible
+    unsigned int m_seed;
+    bool m_seedChanged;
+
+    // system s of an ensemble starts from seed + s and samples the force field layer of seed + s
+    unsigned int m_ensembleSize;
+    bool m_ensembleChanged;
+
+    bool m_statisticsOnly;
+    int m_statisticsInterval;
+    int m_framesSinceStatistics;
+    std::unique_ptr<ParticleStatistics> m_statistics;
 
     int m_steps;
 
-    globjects::ref_ptr<globjects::Texture> m_forces;
+    // fixed timestep in Hz, 0 steps once per frame with the frame's delta
+    float m_simulationRate;
+    // bounds the steps per frame after a hitch, the remaining backlog is dropped
+    int m_maxCatchUpSteps;
+    int m_frameSteps;
+    // simulated time owed to the wall clock, less than one fixed step after stepping
+    float m_accumulator;
+    // offset in seconds from the last simulated state to the rendered time
+    float m_interpolation;
+
+    // steps between spatial sorts of the particles, 0 never sorts
+    int m_sortInterval;
+    int m_stepsSinceSort;
+
+    // particle-particle forces, supported by the compute shader and CPU techniques
+    ParticleInteraction m_interaction;
+    // gravity among the particles, only supported by the CPU technique
+    ParticleGravity m_gravity;
+
+    // emitters and lifetimes, supported by the compute shader and CPU techniques
+    ParticleEmission m_emission;
+    // switching the emitters on or off changes the techniques' buffers, see onPaint
+    bool m_poolChanged;
+
+    // used by the cpu technique, reconfigured in onPaint since the properties may change while it is busy
+    std::unique_ptr<WorkStealingPool> m_threadPool;
+    unsigned int m_threadCount;
+    bool m_pinThreads;
+
+    // replaces the former glFinish per frame, bounds how far the cpu may run ahead of the gpu
+    std::unique_ptr<FramePipeline> m_framePipeline;
+
+    // cpu and gpu times of step and draw, shared with the techniques for the passes of draw
+    std::unique_ptr<PhaseTimers> m_timers;
+
+    // generated in bricks on the thread pool, seeded with m_seed
+    std::unique_ptr<ForceField> m_forceField;
+
+    // seconds simulated since the last reset, stored in checkpoints
+    double m_simulationTime;
+
+    std::string m_checkpointFile;
+    float m_checkpointInterval;
+    // unpaused seconds since the last automatic checkpoint
+    float m_checkpointAge;
+    bool m_savePending;
+    bool m_restorePending;
+    std::unique_ptr<CheckpointWriter> m_checkpointWriter;
+
+    // started and stopped in onPaint, where the context is current
+    bool m_recording;
+    std::string m_recordFile;
+    int m_recordInterval;
+    bool m_recordDelta;
+    bool m_recordCompression;
+    std::unique_ptr<TrajectoryRecorder> m_recorder;
 };